@@ -0,0 +1,475 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "Base64.h"
+
+#include "Base64Decoder.h"
+#include "CpuFeatures.h"
+
+#include <Core/OrthancException.h>
+
+#include <stdint.h>
+#include <string.h>
+
+namespace PhotoTrack
+{
+  static const char ALPHABET[] = 
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  static const uint8_t INVALID = 0xff;
+
+  namespace
+  {
+    class DecodingTable
+    {
+    private:
+      uint8_t  values_[256];
+
+    public:
+      DecodingTable()
+      {
+        memset(values_, INVALID, sizeof(values_));
+
+        for (uint8_t i = 0; i < 64; i++)
+        {
+          values_[static_cast<uint8_t>(ALPHABET[i])] = i;
+        }
+      }
+
+      uint8_t operator[] (uint8_t c) const
+      {
+        return values_[c];
+      }
+    };
+
+    const DecodingTable table_;
+
+
+    // Encodes groups of 3 bytes into 4 characters
+    void EncodeScalar(char* target,
+                      const uint8_t* source,
+                      size_t groups)
+    {
+      for (size_t i = 0; i < groups; i++, source += 3, target += 4)
+      {
+        uint32_t v = (source[0] << 16) | (source[1] << 8) | source[2];
+        target[0] = ALPHABET[v >> 18];
+        target[1] = ALPHABET[(v >> 12) & 63];
+        target[2] = ALPHABET[(v >> 6) & 63];
+        target[3] = ALPHABET[v & 63];
+      }
+    }
+
+
+    size_t DecodeScalar(char* target,
+                        const uint8_t* source,
+                        size_t size)
+    {
+      size_t i = 0;
+
+      for (; i + 4 <= size; i += 4, target += 3)
+      {
+        uint8_t a = table_[source[i]];
+        uint8_t b = table_[source[i + 1]];
+        uint8_t c = table_[source[i + 2]];
+        uint8_t d = table_[source[i + 3]];
+
+        if ((a | b | c | d) >= 64)
+        {
+          break;
+        }
+
+        target[0] = static_cast<char>((a << 2) | (b >> 4));
+        target[1] = static_cast<char>((b << 4) | (c >> 2));
+        target[2] = static_cast<char>((c << 6) | d);
+      }
+
+      return i;
+    }
+
+
+#if PHOTO_TRACK_X86_SIMD == 1
+    /**
+     * The SIMD kernels follow the algorithms of Wojciech Mula and
+     * Daniel Lemire ("Faster Base64 Encoding and Decoding Using AVX2
+     * Instructions", 2018). "pshufb" maps the nibbles of the
+     * characters to their class, which both validates the input and
+     * gives the offset to add to the ASCII codes. The 6-bit values
+     * are then packed with "pmaddubsw" and "pmaddwd".
+     **/
+
+    PHOTO_TRACK_TARGET("ssse3")
+    inline __m128i EncodeReshuffle(__m128i in)
+    {
+      // Bytes "abc" of each group are spread as "bacb", so that each
+      // 16-bit word holds the bits of two output characters
+      in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+
+      const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+      const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+      const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+      const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+      return _mm_or_si128(t1, t3);
+    }
+
+
+    PHOTO_TRACK_TARGET("ssse3")
+    inline __m128i EncodeTranslate(__m128i in)
+    {
+      // Offset from the 6-bit values to ASCII, indexed by the range
+      const __m128i lut = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+
+      __m128i indices = _mm_subs_epu8(in, _mm_set1_epi8(51));
+      indices = _mm_sub_epi8(indices, _mm_cmpgt_epi8(in, _mm_set1_epi8(25)));
+      return _mm_add_epi8(in, _mm_shuffle_epi8(lut, indices));
+    }
+
+
+    // Returns the number of groups of 3 bytes that were encoded
+    PHOTO_TRACK_TARGET("ssse3")
+    size_t EncodeSsse3(char* target,
+                       const uint8_t* source,
+                       size_t groups)
+    {
+      // Each iteration reads 16 bytes, but only consumes 12 of them
+      size_t i = 0;
+      for (; i + 6 <= groups; i += 4)
+      {
+        __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 3 * i));
+        __m128i out = EncodeTranslate(EncodeReshuffle(in));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(target + 4 * i), out);
+      }
+
+      return i;
+    }
+
+
+    PHOTO_TRACK_TARGET("avx2")
+    inline __m256i EncodeReshuffle(__m256i in)
+    {
+      in = _mm256_shuffle_epi8(in, _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                                                   10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+
+      const __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+      const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+      const __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+      const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+      return _mm256_or_si256(t1, t3);
+    }
+
+
+    PHOTO_TRACK_TARGET("avx2")
+    inline __m256i EncodeTranslate(__m256i in)
+    {
+      const __m256i lut = _mm256_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+                                           65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+
+      __m256i indices = _mm256_subs_epu8(in, _mm256_set1_epi8(51));
+      indices = _mm256_sub_epi8(indices, _mm256_cmpgt_epi8(in, _mm256_set1_epi8(25)));
+      return _mm256_add_epi8(in, _mm256_shuffle_epi8(lut, indices));
+    }
+
+
+    PHOTO_TRACK_TARGET("avx2")
+    size_t EncodeAvx2(char* target,
+                      const uint8_t* source,
+                      size_t groups)
+    {
+      // Each lane of 128 bits encodes 12 bytes, loaded with 16 bytes
+      size_t i = 0;
+      for (; i + 10 <= groups; i += 8)
+      {
+        const uint8_t* p = source + 3 * i;
+        __m256i in = _mm256_inserti128_si256
+          (_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))),
+           _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 12)), 1);
+
+        __m256i out = EncodeTranslate(EncodeReshuffle(in));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(target + 4 * i), out);
+      }
+
+      return i;
+    }
+
+
+    PHOTO_TRACK_TARGET("ssse3")
+    inline __m128i DecodeReshuffle(__m128i in)
+    {
+      // Merge the 6-bit values into 12-bit, then 24-bit integers
+      const __m128i ab = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+      const __m128i abcd = _mm_madd_epi16(ab, _mm_set1_epi32(0x00011000));
+      return _mm_shuffle_epi8(abcd, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    }
+
+
+    // Returns the number of consumed characters
+    PHOTO_TRACK_TARGET("ssse3")
+    size_t DecodeSsse3(char* target,
+                       const uint8_t* source,
+                       size_t size)
+    {
+      const __m128i lutLo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                          0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+      const __m128i lutHi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                          0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+      const __m128i lutRoll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+      const __m128i nibble = _mm_set1_epi8(0x0f);
+      const __m128i slash = _mm_set1_epi8(0x2f);
+
+      size_t i = 0;
+      for (; i + 16 <= size; i += 16, target += 12)
+      {
+        __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+
+        const __m128i hiNibbles = _mm_and_si128(_mm_srli_epi32(in, 4), nibble);
+        const __m128i loNibbles = _mm_and_si128(in, nibble);
+        const __m128i lo = _mm_shuffle_epi8(lutLo, loNibbles);
+        const __m128i hi = _mm_shuffle_epi8(lutHi, hiNibbles);
+
+        // Invalid character (including padding) in this block
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xffff)
+        {
+          break;
+        }
+
+        const __m128i roll = _mm_shuffle_epi8(lutRoll, _mm_add_epi8(_mm_cmpeq_epi8(in, slash), hiNibbles));
+        const __m128i out = DecodeReshuffle(_mm_add_epi8(in, roll));
+
+        // Only the 12 first bytes are meaningful
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(target), out);
+        int32_t last = _mm_cvtsi128_si32(_mm_srli_si128(out, 8));
+        memcpy(target + 8, &last, 4);
+      }
+
+      return i;
+    }
+
+
+    PHOTO_TRACK_TARGET("avx2")
+    size_t DecodeAvx2(char* target,
+                      const uint8_t* source,
+                      size_t size)
+    {
+      const __m256i lutLo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                             0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+                                             0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                             0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+      const __m256i lutHi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                             0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                             0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                             0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+      const __m256i lutRoll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                               0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+      const __m256i nibble = _mm256_set1_epi8(0x0f);
+      const __m256i slash = _mm256_set1_epi8(0x2f);
+
+      size_t i = 0;
+      for (; i + 32 <= size; i += 32, target += 24)
+      {
+        __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i));
+
+        const __m256i hiNibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), nibble);
+        const __m256i loNibbles = _mm256_and_si256(in, nibble);
+        const __m256i lo = _mm256_shuffle_epi8(lutLo, loNibbles);
+        const __m256i hi = _mm256_shuffle_epi8(lutHi, hiNibbles);
+
+        if (!_mm256_testz_si256(lo, hi))
+        {
+          break;
+        }
+
+        const __m256i roll = _mm256_shuffle_epi8(lutRoll, _mm256_add_epi8(_mm256_cmpeq_epi8(in, slash), hiNibbles));
+        in = _mm256_add_epi8(in, roll);
+
+        const __m256i ab = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+        const __m256i abcd = _mm256_madd_epi16(ab, _mm256_set1_epi32(0x00011000));
+        __m256i out = _mm256_shuffle_epi8(abcd, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                                                 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+
+        // Gather the 12 meaningful bytes of each lane
+        out = _mm256_permutevar8x32_epi32(out, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(target), _mm256_castsi256_si128(out));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(target + 16), _mm256_extracti128_si256(out, 1));
+      }
+
+      return i;
+    }
+#endif
+
+
+    Base64Kernel DetectBestKernel()
+    {
+      if (CpuFeatures::IsSupported(CpuFeature_Avx2))
+      {
+        return Base64Kernel_Avx2;
+      }
+      else if (CpuFeatures::IsSupported(CpuFeature_Ssse3))
+      {
+        return Base64Kernel_Ssse3;
+      }
+      else
+      {
+        return Base64Kernel_Scalar;
+      }
+    }
+  }
+
+
+  Base64Kernel Base64::GetBestKernel()
+  {
+    static const Base64Kernel kernel = DetectBestKernel();
+    return kernel;
+  }
+
+
+  bool Base64::IsKernelSupported(Base64Kernel kernel)
+  {
+    return (kernel == Base64Kernel_Scalar ||
+            (kernel == Base64Kernel_Ssse3 && GetBestKernel() != Base64Kernel_Scalar) ||
+            (kernel == Base64Kernel_Avx2 && GetBestKernel() == Base64Kernel_Avx2));
+  }
+
+
+  const char* Base64::EnumerationToString(Base64Kernel kernel)
+  {
+    switch (kernel)
+    {
+      case Base64Kernel_Scalar:
+        return "Scalar";
+
+      case Base64Kernel_Ssse3:
+        return "SSSE3";
+
+      case Base64Kernel_Avx2:
+        return "AVX2";
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  void Base64::Encode(std::string& target,
+                      const void* data,
+                      size_t size,
+                      Base64Kernel kernel)
+  {
+    if (!IsKernelSupported(kernel))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    target.resize((size + 2) / 3 * 4);
+    if (size == 0)
+    {
+      return;
+    }
+
+    const uint8_t* source = reinterpret_cast<const uint8_t*>(data);
+    char* q = &target[0];
+    const size_t groups = size / 3;
+    size_t done = 0;
+
+    switch (kernel)
+    {
+#if PHOTO_TRACK_X86_SIMD == 1
+      case Base64Kernel_Avx2:
+        done = EncodeAvx2(q, source, groups);
+        done += EncodeSsse3(q + 4 * done, source + 3 * done, groups - done);
+        break;
+
+      case Base64Kernel_Ssse3:
+        done = EncodeSsse3(q, source, groups);
+        break;
+#endif
+
+      default:
+        break;
+    }
+
+    EncodeScalar(q + 4 * done, source + 3 * done, groups - done);
+
+    // Last, incomplete group
+    const size_t remaining = size - 3 * groups;
+    if (remaining > 0)
+    {
+      uint8_t last[3] = { 0, 0, 0 };
+      memcpy(last, source + 3 * groups, remaining);
+
+      char* p = q + 4 * groups;
+      EncodeScalar(p, last, 1);
+      p[3] = '=';
+      if (remaining == 1)
+      {
+        p[2] = '=';
+      }
+    }
+  }
+
+
+  size_t Base64::DecodeBlocks(char* target,
+                              const char* source,
+                              size_t size,
+                              Base64Kernel kernel)
+  {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(source);
+    size_t done = 0;
+
+    switch (kernel)
+    {
+#if PHOTO_TRACK_X86_SIMD == 1
+      case Base64Kernel_Avx2:
+        done = DecodeAvx2(target, p, size);
+        done += DecodeSsse3(target + done / 4 * 3, p + done, size - done);
+        break;
+
+      case Base64Kernel_Ssse3:
+        done = DecodeSsse3(target, p, size);
+        break;
+#endif
+
+      default:
+        break;
+    }
+
+    // The scalar code finishes the job, and stops at the first group
+    // that contains padding or an invalid character
+    return done + DecodeScalar(target + done / 4 * 3, p + done, size - done);
+  }
+
+
+  bool Base64::Decode(std::string& target,
+                      const void* data,
+                      size_t size,
+                      Base64Kernel kernel)
+  {
+    if (!IsKernelSupported(kernel))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    target.clear();
+
+    Base64Decoder decoder(kernel);
+    return (decoder.Decode(target, data, size) &&
+            decoder.Finish(target));
+  }
+}
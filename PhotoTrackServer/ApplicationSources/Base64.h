@@ -0,0 +1,85 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include <stddef.h>
+#include <string>
+
+namespace PhotoTrack
+{
+  enum Base64Kernel
+  {
+    Base64Kernel_Scalar,
+    Base64Kernel_Ssse3,
+    Base64Kernel_Avx2
+  };
+
+  /**
+   * Codec of base64 (RFC 4648, standard alphabet), with SIMD kernels
+   * that are selected at runtime. The SIMD kernels only process the
+   * blocks that contain neither padding nor invalid characters: The
+   * rest is handled by the scalar code, so that all the kernels give
+   * the same results. Use Base64Decoder to decode a payload that is
+   * split into several chunks.
+   **/
+  class Base64
+  {
+  public:
+    // The best kernel for this CPU, detected once at runtime
+    static Base64Kernel GetBestKernel();
+
+    static bool IsKernelSupported(Base64Kernel kernel);
+
+    static const char* EnumerationToString(Base64Kernel kernel);
+
+    static void Encode(std::string& target,
+                       const void* data,
+                       size_t size,
+                       Base64Kernel kernel);
+
+    static void Encode(std::string& target,
+                       const std::string& data)
+    {
+      Encode(target, data.empty() ? NULL : data.c_str(), data.size(), GetBestKernel());
+    }
+
+    // Returns "false" if the input is not valid base64. The padding
+    // is optional.
+    static bool Decode(std::string& target,
+                       const void* data,
+                       size_t size,
+                       Base64Kernel kernel);
+
+    static bool Decode(std::string& target,
+                       const std::string& data)
+    {
+      return Decode(target, data.empty() ? NULL : data.c_str(), data.size(), GetBestKernel());
+    }
+
+    // Decodes the groups of 4 characters from the beginning of
+    // "source", up to the first group that contains padding or an
+    // invalid character. Returns the number of characters that were
+    // consumed, and writes 3 bytes per group into "target".
+    static size_t DecodeBlocks(char* target,
+                               const char* source,
+                               size_t size,
+                               Base64Kernel kernel);
+  };
+}
@@ -0,0 +1,252 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "Base64Decoder.h"
+
+#include <Core/OrthancException.h>
+
+#include <string.h>
+
+namespace PhotoTrack
+{
+  static const uint8_t INVALID = 0xff;
+  static const uint8_t PADDING = 0xfe;
+
+  namespace
+  {
+    class DecodingTable
+    {
+    private:
+      uint8_t  values_[256];
+
+    public:
+      DecodingTable()
+      {
+        static const char ALPHABET[] = 
+          "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+        memset(values_, INVALID, sizeof(values_));
+
+        for (uint8_t i = 0; i < 64; i++)
+        {
+          values_[static_cast<uint8_t>(ALPHABET[i])] = i;
+        }
+
+        values_['='] = PADDING;
+      }
+
+      uint8_t operator[] (uint8_t c) const
+      {
+        return values_[c];
+      }
+    };
+  }
+
+  static const DecodingTable table_;
+
+
+  // Decodes a group of 4 characters. Returns the number of decoded
+  // bytes, or -1 if the group is invalid.
+  static int DecodeQuad(char* target,
+                        const uint8_t* source,
+                        bool& isPadded)
+  {
+    uint8_t a = table_[source[0]];
+    uint8_t b = table_[source[1]];
+    uint8_t c = table_[source[2]];
+    uint8_t d = table_[source[3]];
+
+    if ((a | b | c | d) < 64)
+    {
+      target[0] = static_cast<char>((a << 2) | (b >> 4));
+      target[1] = static_cast<char>((b << 4) | (c >> 2));
+      target[2] = static_cast<char>((c << 6) | d);
+      return 3;
+    }
+
+    // Only the last group may be padded, as "xx==" or "xxx="
+    if (a >= 64 || 
+        b >= 64 ||
+        c == INVALID ||
+        d != PADDING)
+    {
+      return -1;
+    }
+
+    isPadded = true;
+    target[0] = static_cast<char>((a << 2) | (b >> 4));
+
+    if (c == PADDING)
+    {
+      return 1;
+    }
+    else
+    {
+      target[1] = static_cast<char>((b << 4) | (c >> 2));
+      return 2;
+    }
+  }
+
+
+  Base64Decoder::Base64Decoder() :
+    pendingSize_(0),
+    isPadded_(false),
+    kernel_(Base64::GetBestKernel())
+  {
+  }
+
+
+  Base64Decoder::Base64Decoder(Base64Kernel kernel) :
+    pendingSize_(0),
+    isPadded_(false),
+    kernel_(kernel)
+  {
+    if (!Base64::IsKernelSupported(kernel))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  bool Base64Decoder::Decode(std::string& target,
+                             const void* data,
+                             size_t size)
+  {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    const uint8_t* end = p + size;
+
+    if (size == 0)
+    {
+      return true;
+    }
+
+    if (isPadded_)
+    {
+      return false;   // Data after the padding
+    }
+
+    const size_t offset = target.size();
+    target.resize(offset + (pendingSize_ + size) / 4 * 3);
+
+    char* q = target.empty() ? NULL : &target[offset];
+
+    // Complete the group that was started by the previous chunk
+    if (pendingSize_ > 0)
+    {
+      while (pendingSize_ < 4 && p < end)
+      {
+        pending_[pendingSize_++] = *p++;
+      }
+
+      if (pendingSize_ < 4)
+      {
+        return true;
+      }
+
+      int n = DecodeQuad(q, pending_, isPadded_);
+      if (n < 0)
+      {
+        target.resize(offset);
+        return false;
+      }
+
+      q += n;
+      pendingSize_ = 0;
+    }
+
+    while (end - p >= 4)
+    {
+      if (isPadded_)
+      {
+        target.resize(offset);
+        return false;
+      }
+
+      // Fast path for the groups without padding
+      size_t consumed = Base64::DecodeBlocks(q, reinterpret_cast<const char*>(p), end - p, kernel_);
+      q += consumed / 4 * 3;
+      p += consumed;
+
+      if (end - p < 4)
+      {
+        break;
+      }
+
+      // The group that stopped the fast path is either padded or invalid
+      int n = DecodeQuad(q, p, isPadded_);
+      if (n < 0)
+      {
+        target.resize(offset);
+        return false;
+      }
+
+      q += n;
+      p += 4;
+    }
+
+    if (p < end && isPadded_)
+    {
+      target.resize(offset);
+      return false;
+    }
+
+    while (p < end)
+    {
+      pending_[pendingSize_++] = *p++;
+    }
+
+    target.resize(q - (target.empty() ? NULL : &target[0]));
+    return true;
+  }
+
+
+  bool Base64Decoder::Finish(std::string& target)
+  {
+    switch (pendingSize_)
+    {
+      case 0:
+        return true;
+
+      case 1:
+        return false;
+
+      default:
+      {
+        // Unpadded input
+        pending_[3] = '=';
+        if (pendingSize_ == 2)
+        {
+          pending_[2] = '=';
+        }
+
+        char buffer[3];
+        int n = DecodeQuad(buffer, pending_, isPadded_);
+        if (n < 0)
+        {
+          return false;
+        }
+
+        target.append(buffer, n);
+        pendingSize_ = 0;
+        return true;
+      }
+    }
+  }
+}
@@ -0,0 +1,61 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include "Base64.h"
+
+#include <boost/noncopyable.hpp>
+#include <stdint.h>
+#include <string>
+
+namespace PhotoTrack
+{
+  /**
+   * Incremental decoder of base64 (RFC 4648, standard alphabet). The
+   * input can be split at any position, which allows to decode a
+   * payload that is not contiguous in memory (e.g. a JSON string
+   * that contains escaped characters) without copying it first.
+   * Contrarily to Orthanc::Toolbox::DecodeBase64(), the invalid
+   * characters are reported instead of being skipped. The bulk of
+   * the input is decoded by the SIMD kernels of the Base64 class.
+   **/
+  class Base64Decoder : public boost::noncopyable
+  {
+  private:
+    uint8_t       pending_[4];
+    size_t        pendingSize_;
+    bool          isPadded_;
+    Base64Kernel  kernel_;
+
+  public:
+    Base64Decoder();
+
+    explicit Base64Decoder(Base64Kernel kernel);
+
+    // Appends the decoded bytes to "target". Returns "false" if the
+    // input is not valid base64.
+    bool Decode(std::string& target,
+                const void* data,
+                size_t size);
+
+    // Flushes the last bytes, that may come without padding
+    bool Finish(std::string& target);
+  };
+}
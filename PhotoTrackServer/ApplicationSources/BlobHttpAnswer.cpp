@@ -0,0 +1,210 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "BlobHttpAnswer.h"
+
+#include "Toolbox.h"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <vector>
+
+namespace PhotoTrack
+{
+  static std::string GetHeader(const BlobHttpAnswer::HttpHeaders& headers,
+                               const std::string& name)
+  {
+    BlobHttpAnswer::HttpHeaders::const_iterator found = headers.find(name);
+    return (found == headers.end() ? "" : found->second);
+  }
+
+
+  static bool MatchesETag(const std::string& header,
+                          const std::string& etag)
+  {
+    std::vector<std::string> tags;
+    boost::split(tags, header, boost::is_any_of(","));
+
+    for (size_t i = 0; i < tags.size(); i++)
+    {
+      std::string tag = boost::trim_copy(tags[i]);
+
+      // "If-None-Match" uses the weak comparison
+      if (boost::starts_with(tag, "W/"))
+      {
+        tag = tag.substr(2);
+      }
+
+      if (tag == "*" ||
+          tag == etag)
+      {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+
+  BlobHttpAnswer::BlobHttpAnswer() :
+    contentType_("application/octet-stream")
+  {
+  }
+
+
+  void BlobHttpAnswer::SendBody(Orthanc::HttpOutput& output,
+                                IBlobReader& reader,
+                                uint64_t start,
+                                uint64_t length)
+  {
+    static const uint64_t CHUNK_SIZE = 64 * 1024;
+
+    std::vector<uint8_t> buffer(static_cast<size_t>(std::min(length, CHUNK_SIZE)));
+
+    for (uint64_t pos = 0; pos < length; pos += CHUNK_SIZE)
+    {
+      size_t n = static_cast<size_t>(std::min(length - pos, CHUNK_SIZE));
+      reader.Read(&buffer[0], n, start + pos);
+      output.Send(&buffer[0], n);
+    }
+  }
+
+
+  void BlobHttpAnswer::FormatHeaders(std::string& header) const
+  {
+    if (!etag_.empty())
+    {
+      header += "ETag: " + etag_ + "\r\n";
+    }
+
+    if (!cacheControl_.empty())
+    {
+      header += "Cache-Control: " + cacheControl_ + "\r\n";
+    }
+
+    if (!downloadFilename_.empty())
+    {
+      header += "Content-Disposition: attachment; filename=\"" + downloadFilename_ + "\"\r\n";
+    }
+  }
+
+
+  bool BlobHttpAnswer::AnswerNotModified(Orthanc::RestApiOutput& output,
+                                         const HttpHeaders& headers)
+  {
+    std::string ifNoneMatch = GetHeader(headers, "if-none-match");
+
+    if (etag_.empty() ||
+        ifNoneMatch.empty() ||
+        !MatchesETag(ifNoneMatch, etag_))
+    {
+      return false;
+    }
+
+    std::string header = "HTTP/1.1 304 Not Modified\r\n";
+    FormatHeaders(header);
+    header += "\r\n";
+
+    output.GetLowLevelOutput().SendString(header);
+    output.MarkLowLevelOutputDone();
+    return true;
+  }
+
+
+  void BlobHttpAnswer::Answer(Orthanc::RestApiOutput& output,
+                              IBlobReader& reader,
+                              const HttpHeaders& headers)
+  {
+    if (AnswerNotModified(output, headers))
+    {
+      return;
+    }
+
+    uint64_t size = reader.GetSize();
+    uint64_t start = 0;
+    uint64_t length = size;
+
+    std::string range = GetHeader(headers, "range");
+    std::string ifRange = GetHeader(headers, "if-range");
+
+    ByteRange status = ByteRange_None;
+
+    // "If-Range": Only honor the range if the client has the current
+    // version of the blob (otherwise, send the full new content)
+    if (!range.empty() &&
+        (ifRange.empty() || (!etag_.empty() && ifRange == etag_)))
+    {
+      status = Toolbox::ParseByteRange(start, length, range, size);
+    }
+
+    // The headers are written by hand, as "Orthanc::HttpFileSender"
+    // can only answer "200 OK"
+    std::string header;
+
+    switch (status)
+    {
+      case ByteRange_Unsatisfiable:
+        header = ("HTTP/1.1 416 Requested Range Not Satisfiable\r\n"
+                  "Content-Range: bytes */" + boost::lexical_cast<std::string>(size) + "\r\n"
+                  "Content-Length: 0\r\n\r\n");
+        output.GetLowLevelOutput().SendString(header);
+        output.MarkLowLevelOutputDone();
+        return;
+
+      case ByteRange_Valid:
+        header = ("HTTP/1.1 206 Partial Content\r\n"
+                  "Content-Range: bytes " + boost::lexical_cast<std::string>(start) + "-" + 
+                  boost::lexical_cast<std::string>(start + length - 1) + "/" + 
+                  boost::lexical_cast<std::string>(size) + "\r\n");
+        break;
+
+      default:
+        start = 0;
+        length = size;
+        header = "HTTP/1.1 200 OK\r\n";
+        break;
+    }
+
+    header += "Content-Type: " + contentType_ + "\r\n";
+    header += "Content-Length: " + boost::lexical_cast<std::string>(length) + "\r\n";
+    header += "Accept-Ranges: bytes\r\n";
+    FormatHeaders(header);
+    header += "\r\n";
+
+    output.GetLowLevelOutput().SendString(header);
+    SendBody(output.GetLowLevelOutput(), reader, start, length);
+    output.MarkLowLevelOutputDone();
+  }
+
+
+  void BlobHttpAnswer::AnswerOffloaded(Orthanc::RestApiOutput& output,
+                                       const std::string& redirection)
+  {
+    // The proxy takes care of "Content-Length" and of the ranges
+    std::string header = "HTTP/1.1 200 OK\r\n";
+    header += "Content-Type: " + contentType_ + "\r\n";
+    FormatHeaders(header);
+    header += redirection + "\r\n";
+    header += "Content-Length: 0\r\n\r\n";
+
+    output.GetLowLevelOutput().SendString(header);
+    output.MarkLowLevelOutputDone();
+  }
+}
@@ -0,0 +1,96 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include "IBlobReader.h"
+
+#include <Core/RestApi/RestApiOutput.h>
+#include <map>
+
+namespace PhotoTrack
+{
+  /**
+   * Streams a blob to the HTTP client by chunks, so that the memory
+   * used by a download does not depend on the size of the image:
+   * 
+   * - "If-None-Match" is answered with "304 Not Modified".
+   * - "Range" (and "If-Range") are answered with "206 Partial
+   *   Content", reading only the requested bytes from the storage.
+   **/
+  class BlobHttpAnswer : public boost::noncopyable
+  {
+  public:
+    // The HTTP headers of the request, with lower-case names
+    typedef std::map<std::string, std::string>  HttpHeaders;
+
+  private:
+    std::string  contentType_;
+    std::string  etag_;
+    std::string  cacheControl_;
+    std::string  downloadFilename_;
+
+    void SendBody(Orthanc::HttpOutput& output,
+                  IBlobReader& reader,
+                  uint64_t start,
+                  uint64_t length);
+
+    void FormatHeaders(std::string& header) const;
+
+  public:
+    BlobHttpAnswer();
+
+    void SetContentType(const std::string& contentType)
+    {
+      contentType_ = contentType;
+    }
+
+    // The entity tag must change whenever the content changes
+    void SetETag(const std::string& etag)
+    {
+      etag_ = etag;
+    }
+
+    void SetCacheControl(const std::string& cacheControl)
+    {
+      cacheControl_ = cacheControl;
+    }
+
+    void SetDownloadFilename(const std::string& filename)
+    {
+      downloadFilename_ = filename;
+    }
+
+    // Answers "304 Not Modified" if the client already has the
+    // current version of the blob. Returns "false" if the content
+    // must be sent, which avoids opening the blob otherwise.
+    bool AnswerNotModified(Orthanc::RestApiOutput& output,
+                           const HttpHeaders& headers);
+
+    void Answer(Orthanc::RestApiOutput& output,
+                IBlobReader& reader,
+                const HttpHeaders& headers);
+
+    // Answers with an empty body, and lets the front proxy send the
+    // content that is designated by the given redirection header
+    // (e.g. "X-Accel-Redirect: /internal/ab/cd/abcd...")
+    void AnswerOffloaded(Orthanc::RestApiOutput& output,
+                         const std::string& redirection);
+  };
+}
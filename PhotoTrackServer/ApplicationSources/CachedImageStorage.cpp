@@ -0,0 +1,113 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "CachedImageStorage.h"
+
+#include "MemoryBlobReader.h"
+
+#include <memory>
+
+namespace PhotoTrack
+{
+  CachedImageStorage::CachedImageStorage(IImageStorage& storage,
+                                         size_t budget,
+                                         size_t maxEntrySize) :
+    storage_(storage),
+    cache_(budget, maxEntrySize)
+  {
+  }
+
+
+  std::string CachedImageStorage::Create(const void* content,
+                                         size_t size)
+  {
+    // Don't cache the new blobs: Only the blobs that are read are hot
+    return storage_.Create(content, size);
+  }
+
+
+  void CachedImageStorage::Read(std::string& content,
+                                const std::string& uuid)
+  {
+    ImageCache::Content cached;
+    ImageCache::Generation generation;
+
+    if (cache_.Lookup(cached, generation, uuid))
+    {
+      content = *cached;
+    }
+    else
+    {
+      storage_.Read(content, uuid);
+
+      if (cache_.IsAdmissible(content.size()))
+      {
+        cache_.Store(uuid, ImageCache::Content(new std::string(content)), generation);
+      }
+    }
+  }
+
+
+  void CachedImageStorage::Remove(const std::string& uuid)
+  {
+    storage_.Remove(uuid);
+
+    // Invalidate once the blob is gone, so that a reader that missed
+    // the cache before the removal cannot insert it back
+    cache_.Invalidate(uuid);
+  }
+
+
+  bool CachedImageStorage::Exists(const std::string& uuid)
+  {
+    return storage_.Exists(uuid);
+  }
+
+
+  IBlobReader* CachedImageStorage::OpenBlob(const std::string& uuid)
+  {
+    ImageCache::Content cached;
+    ImageCache::Generation generation;
+
+    if (!cache_.Lookup(cached, generation, uuid))
+    {
+      std::auto_ptr<IBlobReader> reader(storage_.OpenBlob(uuid));
+
+      if (!cache_.IsAdmissible(static_cast<size_t>(reader->GetSize())))
+      {
+        // Large blobs are streamed from the storage area
+        return reader.release();
+      }
+
+      std::string* content = new std::string;
+      cached.reset(content);
+
+      content->resize(static_cast<size_t>(reader->GetSize()));
+      if (!content->empty())
+      {
+        reader->Read(&(*content)[0], content->size(), 0);
+      }
+
+      cache_.Store(uuid, cached, generation);
+    }
+
+    return new MemoryBlobReader(cached);
+  }
+}
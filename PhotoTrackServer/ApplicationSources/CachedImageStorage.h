@@ -0,0 +1,74 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include "IImageStorage.h"
+#include "ImageCache.h"
+
+namespace PhotoTrack
+{
+  /**
+   * Keeps the recently read blobs of another storage area in memory.
+   * As the content of a blob never changes once written, the cache
+   * only has to be invalidated when the blob is removed (which
+   * happens when an image is replaced, or when a photo is deleted).
+   **/
+  class CachedImageStorage : public IImageStorage
+  {
+  private:
+    IImageStorage&  storage_;
+    ImageCache      cache_;
+
+  public:
+    CachedImageStorage(IImageStorage& storage,
+                       size_t budget,
+                       size_t maxEntrySize);
+
+    using IImageStorage::Create;
+
+    virtual std::string Create(const void* content,
+                               size_t size);
+
+    virtual std::string CreateFromFile(const std::string& path)
+    {
+      return storage_.CreateFromFile(path);
+    }
+
+    virtual void Read(std::string& content,
+                      const std::string& uuid);
+
+    virtual void Remove(const std::string& uuid);
+
+    virtual bool Exists(const std::string& uuid);
+
+    virtual IBlobReader* OpenBlob(const std::string& uuid);
+
+    virtual bool LookupFile(std::string& relativePath,
+                            const std::string& uuid)
+    {
+      return storage_.LookupFile(relativePath, uuid);
+    }
+
+    ImageCache& GetCache()
+    {
+      return cache_;
+    }
+  };
+}
@@ -96,6 +96,29 @@ namespace PhotoTrack
     }
 
 
+    bool GetBoolean(const std::string& name, 
+                    bool defaultValue)
+    {
+      boost::mutex::scoped_lock lock(globalMutex);
+
+      if (globalConfiguration.isMember(name))
+      {
+        const Json::Value& v = globalConfiguration[name];
+
+        if (v.type() == Json::booleanValue)
+        {
+          return v.asBool();
+        }
+
+        return v.asString() == "true";
+      }
+      else
+      {
+        return defaultValue;
+      }
+    }
+
+
     std::string GetString(const std::string& name, 
                           const std::string& defaultValue)
     {
@@ -34,6 +34,9 @@ namespace PhotoTrack
     int GetInteger(const std::string& name, 
                    int defaultValue);
 
+    bool GetBoolean(const std::string& name, 
+                    bool defaultValue);
+
     std::string GetString(const std::string& name, 
                           const std::string& defaultValue);
 
@@ -0,0 +1,611 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "ContactSheetCache.h"
+
+#include "DerivedImageCache.h"
+#include "ImageResampler.h"
+#include "JpegReader.h"
+#include "JpegWriter.h"
+
+#include <Core/ImageFormats/ImageBuffer.h>
+#include <Core/ImageFormats/PngReader.h>
+#include <Core/OrthancException.h>
+#include <Core/Toolbox.h>
+#include <Core/Uuid.h>
+
+#include <glog/logging.h>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <algorithm>
+#include <string.h>
+#include <vector>
+
+namespace PhotoTrack
+{
+  namespace
+  {
+    class WorkerSlot : public boost::noncopyable
+    {
+    private:
+      Orthanc::Semaphore& workers_;
+
+    public:
+      WorkerSlot(Orthanc::Semaphore& workers) : workers_(workers)
+      {
+        workers_.Acquire();
+      }
+
+      ~WorkerSlot()
+      {
+        workers_.Release();
+      }
+    };
+  }
+
+
+  static const char MAGIC[8] = { 'P', 'T', 'S', 'H', 'E', 'E', 'T', '1' };
+
+  // Gray level of the empty cells
+  static const uint8_t BACKGROUND = 0x20;
+
+
+  // The sheet is stored as a single file, so that the image and its
+  // map are always replaced together: Magic, size of the serialized
+  // map (in the byte order of the host), map, then JPEG image
+  static bool ReadSheet(std::string& image,
+                        Json::Value& map,
+                        const std::string& path)
+  {
+    if (!boost::filesystem::is_regular_file(path))
+    {
+      return false;
+    }
+
+    std::string content;
+
+    try
+    {
+      Orthanc::Toolbox::ReadFile(content, path);
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      // The sheet was concurrently invalidated
+      return false;
+    }
+
+    uint32_t size;
+    if (content.size() < sizeof(MAGIC) + sizeof(size) ||
+        memcmp(content.c_str(), MAGIC, sizeof(MAGIC)) != 0)
+    {
+      return false;
+    }
+
+    memcpy(&size, content.c_str() + sizeof(MAGIC), sizeof(size));
+
+    const size_t offset = sizeof(MAGIC) + sizeof(size);
+    if (content.size() - offset < size)
+    {
+      return false;
+    }
+
+    Json::Reader reader;
+    if (!reader.parse(content.substr(offset, size), map) ||
+        map.type() != Json::objectValue)
+    {
+      return false;
+    }
+
+    image = content.substr(offset + size);
+    return true;
+  }
+
+
+  static void WriteSheet(const std::string& path,
+                         const std::string& image,
+                         const Json::Value& map)
+  {
+    Json::FastWriter writer;
+    std::string serialized = writer.write(map);
+    uint32_t size = static_cast<uint32_t>(serialized.size());
+
+    std::string content;
+    content.reserve(sizeof(MAGIC) + sizeof(size) + serialized.size() + image.size());
+    content.append(MAGIC, sizeof(MAGIC));
+    content.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    content.append(serialized);
+    content.append(image);
+
+    boost::filesystem::create_directories(boost::filesystem::path(path).parent_path());
+
+    // Write to a temporary file, then atomically move it into place
+    std::string tmp = path + "." + Orthanc::Toolbox::GenerateUuid() + ".tmp";
+    Orthanc::Toolbox::WriteFile(content, tmp);
+
+    boost::system::error_code error;
+    boost::filesystem::rename(tmp, path, error);
+    if (error)
+    {
+      boost::filesystem::remove(tmp, error);
+    }
+  }
+
+
+  // Draws "thumbnail" into the RGB24 image "sheet", with its top-left
+  // corner at (x, y). The transparent pixels are blended with the
+  // background.
+  static void DrawThumbnail(Orthanc::ImageAccessor& sheet,
+                            unsigned int x,
+                            unsigned int y,
+                            const Orthanc::ImageAccessor& thumbnail)
+  {
+    for (unsigned int i = 0; i < thumbnail.GetHeight(); i++)
+    {
+      const uint8_t* p = reinterpret_cast<const uint8_t*>(thumbnail.GetConstRow(i));
+      uint8_t* q = reinterpret_cast<uint8_t*>(sheet.GetRow(y + i)) + 3 * x;
+
+      switch (thumbnail.GetFormat())
+      {
+        case Orthanc::PixelFormat_Grayscale8:
+          for (unsigned int j = 0; j < thumbnail.GetWidth(); j++, p++, q += 3)
+          {
+            q[0] = q[1] = q[2] = p[0];
+          }
+          break;
+
+        case Orthanc::PixelFormat_RGB24:
+          memcpy(q, p, 3 * thumbnail.GetWidth());
+          break;
+
+        case Orthanc::PixelFormat_RGBA32:
+          for (unsigned int j = 0; j < thumbnail.GetWidth(); j++, p += 4, q += 3)
+          {
+            for (unsigned int c = 0; c < 3; c++)
+            {
+              q[c] = static_cast<uint8_t>((p[c] * p[3] + BACKGROUND * (255 - p[3]) + 127) / 255);
+            }
+          }
+          break;
+
+        default:
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented);
+      }
+    }
+  }
+
+
+  // Decodes the image of the photo, downscales it to fit in the cell
+  // at (x, y), and draws it centered in this cell. Returns "false" if
+  // the image cannot be decoded.
+  static bool DrawPhoto(Orthanc::ImageAccessor& sheet,
+                        Json::Value& entry,
+                        DatabaseWrapper& db,
+                        const Photo& photo,
+                        unsigned int x,
+                        unsigned int y,
+                        unsigned int size)
+  {
+    std::string image;
+    db.ReadImage(image, photo);
+
+    JpegReader jpeg;
+    Orthanc::PngReader png;
+    const Orthanc::ImageAccessor* source;
+
+    try
+    {
+      if (photo.GetImageMime() == "image/jpeg")
+      {
+        // Let libjpeg do most of the downscaling in the DCT domain
+        jpeg.ReadFromMemory(image, size, size);
+        source = &jpeg;
+      }
+      else
+      {
+        png.ReadFromMemory(image);
+        source = &png;
+      }
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(WARNING) << "Cannot decode image " << photo.GetImageUuid() << ": " << e.What();
+      return false;
+    }
+
+    image.clear();
+
+    if (source->GetFormat() != Orthanc::PixelFormat_Grayscale8 &&
+        source->GetFormat() != Orthanc::PixelFormat_RGB24 &&
+        source->GetFormat() != Orthanc::PixelFormat_RGBA32)
+    {
+      return false;   // E.g. 16-bit PNG images
+    }
+
+    unsigned int width, height;
+    ImageResampler::ComputeFittingSize(width, height, source->GetWidth(), source->GetHeight(), size, size);
+
+    if (width == 0 || height == 0)
+    {
+      return false;
+    }
+
+    Orthanc::ImageBuffer buffer;
+    Orthanc::ImageAccessor thumbnail;
+
+    if (width == source->GetWidth() &&
+        height == source->GetHeight())
+    {
+      thumbnail = *source;
+    }
+    else
+    {
+      buffer.SetFormat(source->GetFormat());
+      buffer.SetWidth(width);
+      buffer.SetHeight(height);
+      thumbnail = buffer.GetAccessor();
+      ImageResampler::Resample(thumbnail, *source, ResamplingFilter_Area);
+    }
+
+    x += (size - width) / 2;
+    y += (size - height) / 2;
+    DrawThumbnail(sheet, x, y, thumbnail);
+
+    entry["X"] = x;
+    entry["Y"] = y;
+    entry["Width"] = width;
+    entry["Height"] = height;
+
+    return true;
+  }
+
+
+  ContactSheetCache::ContactSheetCache(DatabaseWrapper& db,
+                                       const std::string& root,
+                                       unsigned int maxWorkers) :
+    db_(db),
+    root_(root),
+    quality_(85),
+    thumbnailSize_(128),
+    columns_(16),
+    workers_(maxWorkers == 0 ? 1 : maxWorkers)
+  {
+    boost::filesystem::create_directories(root_);
+  }
+
+
+  void ContactSheetCache::SetJpegQuality(uint8_t quality)
+  {
+    if (quality == 0 || 
+        quality > 100)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    quality_ = quality;
+  }
+
+
+  void ContactSheetCache::SetThumbnailSize(unsigned int size)
+  {
+    // The cells are aligned on the 16x16 blocks of the JPEG encoder,
+    // so that copying them from one sheet to the next one does not
+    // accumulate compression artifacts at their borders
+    if (size == 0 ||
+        size % 16 != 0 ||
+        size > 1024)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    thumbnailSize_ = size;
+  }
+
+
+  void ContactSheetCache::SetColumns(unsigned int columns)
+  {
+    if (columns == 0 ||
+        columns > 256)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    columns_ = columns;
+  }
+
+
+  std::string ContactSheetCache::GetPath(const std::string& siteUuid) const
+  {
+    if (!Orthanc::Toolbox::IsUuid(siteUuid))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    boost::filesystem::path path(root_);
+    path /= siteUuid.substr(0, 2);
+    path /= siteUuid.substr(2, 2);
+    path /= siteUuid + ".sheet";
+
+    return path.string();
+  }
+
+
+  std::string ContactSheetCache::ComputeVersion(const std::list<Photo>& photos) const
+  {
+    // The blobs are immutable: The UUIDs of the photos and of their
+    // images fully describe the content of the sheet
+    std::string s = (boost::lexical_cast<std::string>(thumbnailSize_) + "/" +
+                     boost::lexical_cast<std::string>(columns_) + "\n");
+
+    for (std::list<Photo>::const_iterator it = photos.begin(); it != photos.end(); ++it)
+    {
+      s += it->GetUuid() + "/" + it->GetImageUuid() + "\n";
+    }
+
+    std::string version;
+    Orthanc::Toolbox::ComputeMD5(version, s);
+    return version;
+  }
+
+
+  void ContactSheetCache::Build(std::string& image,
+                                Json::Value& map,
+                                const std::string& siteUuid,
+                                const std::string& version,
+                                const std::list<Photo>& photos)
+  {
+    const unsigned int size = thumbnailSize_;
+
+    // Load the previous sheet, if it has the same geometry
+    Json::Value previousMap;
+    JpegReader previous;
+    bool hasPrevious = false;
+
+    if (ReadSheet(image, previousMap, GetPath(siteUuid)) &&
+        previousMap["ThumbnailSize"].asUInt() == size &&
+        previousMap["Columns"].asUInt() == columns_ &&
+        previousMap["Photos"].type() == Json::objectValue)
+    {
+      try
+      {
+        previous.ReadFromMemory(image);
+        hasPrevious = (previous.GetFormat() == Orthanc::PixelFormat_RGB24);
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(WARNING) << "Corrupted contact sheet for site " << siteUuid << ": " << e.What();
+      }
+    }
+
+    image.clear();
+
+    // Keep the cells of the photos whose image has not changed
+    std::vector<const Photo*> items;
+    std::vector<int> cells;
+    std::vector<bool> reused;
+    std::set<unsigned int> used;
+    unsigned int countCells = 0;
+
+    for (std::list<Photo>::const_iterator it = photos.begin(); it != photos.end(); ++it)
+    {
+      int cell = -1;
+
+      if (hasPrevious &&
+          previousMap["Photos"].isMember(it->GetUuid()))
+      {
+        const Json::Value& entry = previousMap["Photos"][it->GetUuid()];
+        unsigned int x = entry["X"].asUInt() / size;
+        unsigned int y = entry["Y"].asUInt() / size;
+
+        if (entry["ImageUuid"].asString() == it->GetImageUuid() &&
+            x < columns_ &&
+            (x + 1) * size <= previous.GetWidth() &&
+            (y + 1) * size <= previous.GetHeight() &&
+            used.find(y * columns_ + x) == used.end())
+        {
+          cell = static_cast<int>(y * columns_ + x);
+          used.insert(cell);
+          countCells = std::max(countCells, static_cast<unsigned int>(cell) + 1);
+        }
+      }
+
+      items.push_back(&*it);
+      cells.push_back(cell);
+      reused.push_back(cell != -1);
+    }
+
+    if (countCells > 2 * items.size() + columns_)
+    {
+      // Too many photos were removed: Compact the sheet from scratch
+      used.clear();
+      countCells = 0;
+      std::fill(cells.begin(), cells.end(), -1);
+      std::fill(reused.begin(), reused.end(), false);
+    }
+
+    // The new photos fill the holes left by the removed photos
+    unsigned int next = 0;
+    for (size_t i = 0; i < items.size(); i++)
+    {
+      if (cells[i] == -1)
+      {
+        while (used.find(next) != used.end())
+        {
+          next++;
+        }
+
+        cells[i] = static_cast<int>(next);
+        used.insert(next);
+        countCells = std::max(countCells, next + 1);
+      }
+    }
+
+    // Compose the sheet
+    const unsigned int rows = (countCells + columns_ - 1) / columns_;
+
+    Orthanc::ImageBuffer buffer;
+    buffer.SetFormat(Orthanc::PixelFormat_RGB24);
+    buffer.SetWidth(std::min(countCells, columns_) * size);
+    buffer.SetHeight(rows * size);
+
+    Orthanc::ImageAccessor sheet = buffer.GetAccessor();
+    for (unsigned int y = 0; y < sheet.GetHeight(); y++)
+    {
+      memset(sheet.GetRow(y), BACKGROUND, 3 * sheet.GetWidth());
+    }
+
+    map = Json::objectValue;
+    map["Version"] = version;
+    map["ThumbnailSize"] = size;
+    map["Columns"] = columns_;
+    map["Width"] = sheet.GetWidth();
+    map["Height"] = sheet.GetHeight();
+    map["Photos"] = Json::objectValue;
+
+    unsigned int countDecoded = 0;
+
+    for (size_t i = 0; i < items.size(); i++)
+    {
+      const unsigned int x = (cells[i] % columns_) * size;
+      const unsigned int y = (cells[i] / columns_) * size;
+
+      Json::Value entry = Json::objectValue;
+
+      if (reused[i])
+      {
+        // Unchanged photo: Copy its cell from the previous sheet
+        for (unsigned int j = 0; j < size; j++)
+        {
+          memcpy(reinterpret_cast<uint8_t*>(sheet.GetRow(y + j)) + 3 * x,
+                 reinterpret_cast<const uint8_t*>(previous.GetConstRow(y + j)) + 3 * x, 3 * size);
+        }
+
+        entry = previousMap["Photos"][items[i]->GetUuid()];
+      }
+      else
+      {
+        countDecoded++;
+
+        if (!DrawPhoto(sheet, entry, db_, *items[i], x, y, size))
+        {
+          continue;
+        }
+
+        entry["ImageUuid"] = items[i]->GetImageUuid();
+      }
+
+      map["Photos"][items[i]->GetUuid()] = entry;
+    }
+
+    LOG(INFO) << "Contact sheet of site " << siteUuid << ": " << countDecoded 
+            << " image(s) decoded out of " << items.size();
+
+    JpegWriter writer;
+    writer.SetQuality(quality_);
+    writer.WriteToMemory(image, sheet);
+
+    WriteSheet(GetPath(siteUuid), image, map);
+  }
+
+
+  bool ContactSheetCache::GetContactSheet(std::string& image,
+                                          Json::Value& map,
+                                          const std::string& siteUuid)
+  {
+    std::list<Photo> photos;
+    db_.GetSitePhotosWithImage(photos, siteUuid);
+
+    for (std::list<Photo>::iterator it = photos.begin(); it != photos.end(); )
+    {
+      if (DerivedImageCache::IsSupportedImage(it->GetImageMime()))
+      {
+        ++it;
+      }
+      else
+      {
+        it = photos.erase(it);
+      }
+    }
+
+    if (photos.empty())
+    {
+      return false;
+    }
+
+    const std::string version = ComputeVersion(photos);
+    const std::string path = GetPath(siteUuid);
+
+    if (ReadSheet(image, map, path) &&
+        map["Version"].asString() == version)
+    {
+      return true;
+    }
+
+    {
+      // Wait for the concurrent rebuild of the same sheet, if any
+      boost::mutex::scoped_lock lock(mutex_);
+
+      while (pending_.find(siteUuid) != pending_.end())
+      {
+        generated_.wait(lock);
+      }
+
+      if (ReadSheet(image, map, path) &&
+          map["Version"].asString() == version)
+      {
+        return true;
+      }
+
+      pending_.insert(siteUuid);
+    }
+
+    try
+    {
+      WorkerSlot slot(workers_);
+      Build(image, map, siteUuid, version, photos);
+    }
+    catch (...)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      pending_.erase(siteUuid);
+      generated_.notify_all();
+      throw;
+    }
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      pending_.erase(siteUuid);
+      generated_.notify_all();
+    }
+
+    return true;
+  }
+
+
+  void ContactSheetCache::Invalidate(const std::string& siteUuid)
+  {
+    boost::system::error_code error;
+    boost::filesystem::remove(GetPath(siteUuid), error);
+
+    if (error)
+    {
+      LOG(ERROR) << "Cannot remove the contact sheet of site " << siteUuid << ": " << error.message();
+    }
+  }
+}
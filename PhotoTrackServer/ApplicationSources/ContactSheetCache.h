@@ -0,0 +1,102 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include "Database.h"
+
+#include <Core/MultiThreading/Semaphore.h>
+
+#include <boost/thread.hpp>
+#include <set>
+
+namespace PhotoTrack
+{
+  /**
+   * Persistent cache of the contact sheets of the sites, i.e. of one
+   * composite JPEG image that contains a fixed-size thumbnail of all
+   * the photos of the site, together with the map from the UUIDs of
+   * the photos to the coordinates of their thumbnail. This allows a
+   * client to display a whole site with only two HTTP requests.
+   *
+   * The sheets are keyed by a version that is a hash of the photos
+   * of the site and of their images: A sheet whose version differs
+   * from the current content of the site is rebuilt on the next
+   * request. The rebuild is incremental: The photos whose image is
+   * unchanged keep their cell, whose pixels are copied from the
+   * previous sheet, and only the new images are decoded.
+   **/
+  class ContactSheetCache : public boost::noncopyable
+  {
+  private:
+    DatabaseWrapper&           db_;
+    std::string                root_;
+    uint8_t                    quality_;
+    unsigned int               thumbnailSize_;
+    unsigned int               columns_;
+    Orthanc::Semaphore         workers_;
+
+    boost::mutex               mutex_;
+    boost::condition_variable  generated_;
+    std::set<std::string>      pending_;
+
+    std::string ComputeVersion(const std::list<Photo>& photos) const;
+
+    void Build(std::string& image,
+               Json::Value& map,
+               const std::string& siteUuid,
+               const std::string& version,
+               const std::list<Photo>& photos);
+
+  public:
+    ContactSheetCache(DatabaseWrapper& db,
+                      const std::string& root,
+                      unsigned int maxWorkers);
+
+    void SetJpegQuality(uint8_t quality);
+
+    // Size of the square cells of the sheet, in pixels (defaults to 128)
+    void SetThumbnailSize(unsigned int size);
+
+    unsigned int GetThumbnailSize() const
+    {
+      return thumbnailSize_;
+    }
+
+    // Number of cells in one row of the sheet (defaults to 16)
+    void SetColumns(unsigned int columns);
+
+    unsigned int GetColumns() const
+    {
+      return columns_;
+    }
+
+    std::string GetPath(const std::string& siteUuid) const;
+
+    // Gives the JPEG image of the up-to-date contact sheet of the
+    // site, and its map. The "Version" field of the map identifies
+    // the content of the image. Returns "false" if the site contains
+    // no photo with a JPEG or PNG image.
+    bool GetContactSheet(std::string& image,
+                         Json::Value& map,
+                         const std::string& siteUuid);
+
+    void Invalidate(const std::string& siteUuid);
+  };
+}
@@ -0,0 +1,85 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "CpuFeatures.h"
+
+namespace PhotoTrack
+{
+  namespace
+  {
+    struct Features
+    {
+      bool  sse2_;
+      bool  ssse3_;
+      bool  avx2_;
+
+      Features() : sse2_(false), ssse3_(false), avx2_(false)
+      {
+#if PHOTO_TRACK_X86_SIMD == 1 && defined(__GNUC__)
+        __builtin_cpu_init();
+        sse2_ = __builtin_cpu_supports("sse2");
+        ssse3_ = __builtin_cpu_supports("ssse3");
+        avx2_ = __builtin_cpu_supports("avx2");
+
+#elif PHOTO_TRACK_X86_SIMD == 1
+        int info[4];
+        __cpuid(info, 0);
+        const int maxLeaf = info[0];
+
+        __cpuid(info, 1);
+        sse2_ = (info[3] & (1 << 26)) != 0;
+        ssse3_ = (info[2] & (1 << 9)) != 0;
+
+        // AVX needs the support of the OS to save the YMM registers
+        const bool hasOsAvx = ((info[2] & (1 << 27)) != 0 &&
+                               (info[2] & (1 << 28)) != 0 &&
+                               (_xgetbv(0) & 6) == 6);
+
+        if (hasOsAvx && maxLeaf >= 7)
+        {
+          __cpuidex(info, 7, 0);
+          avx2_ = (info[1] & (1 << 5)) != 0;
+        }
+#endif
+      }
+    };
+  }
+
+
+  bool CpuFeatures::IsSupported(CpuFeature feature)
+  {
+    static const Features features;
+
+    switch (feature)
+    {
+      case CpuFeature_Sse2:
+        return features.sse2_;
+
+      case CpuFeature_Ssse3:
+        return features.ssse3_;
+
+      case CpuFeature_Avx2:
+        return features.avx2_;
+
+      default:
+        return false;
+    }
+  }
+}
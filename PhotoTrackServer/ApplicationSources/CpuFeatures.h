@@ -0,0 +1,55 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+/**
+ * The SIMD kernels are compiled for their instruction set with the
+ * "PHOTO_TRACK_TARGET" attribute, regardless of the flags of the
+ * compiler, and are only called if the CPU supports them.
+ **/
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define PHOTO_TRACK_X86_SIMD 1
+#  define PHOTO_TRACK_TARGET(isa) __attribute__((target(isa)))
+#  include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#  define PHOTO_TRACK_X86_SIMD 1
+#  define PHOTO_TRACK_TARGET(isa)
+#  include <intrin.h>
+#  include <immintrin.h>
+#else
+#  define PHOTO_TRACK_X86_SIMD 0
+#endif
+
+namespace PhotoTrack
+{
+  enum CpuFeature
+  {
+    CpuFeature_Sse2,
+    CpuFeature_Ssse3,
+    CpuFeature_Avx2
+  };
+
+  class CpuFeatures
+  {
+  public:
+    // The features are detected once, at the first call
+    static bool IsSupported(CpuFeature feature);
+  };
+}
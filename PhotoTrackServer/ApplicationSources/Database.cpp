@@ -21,28 +21,73 @@
 
 #include "Toolbox.h"
 #include "EmbeddedResources.h"
+#include "ImagePreview.h"
+#include "PerceptualHash.h"
 #include "Site.h"
 #include "User.h"
 #include "Photo.h"
 
+#include <Core/Compression/ZlibCompressor.h>
 #include <Core/Toolbox.h>
 #include <Core/Uuid.h>
 #include <Core/SQLite/Connection.h>
 #include <Core/SQLite/Statement.h>
+#include <Core/SQLite/Transaction.h>
 
 #include <glog/logging.h>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
 #include <boost/thread.hpp>
+#include <stdio.h>
 
 namespace
 {
+  static const int SCHEMA_VERSION = 3;
+
+
+  bool DoesColumnExist(Orthanc::SQLite::Connection& db,
+                       const std::string& table,
+                       const std::string& column)
+  {
+    Orthanc::SQLite::Statement s(db, "PRAGMA table_info(" + table + ")");
+
+    while (s.Step())
+    {
+      if (s.ColumnString(1) == column)
+      {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+
+  void AddColumn(Orthanc::SQLite::Connection& db,
+                 const std::string& table,
+                 const std::string& column,
+                 const std::string& type)
+  {
+    if (!DoesColumnExist(db, table, column))
+    {
+      db.Execute("ALTER TABLE " + table + " ADD COLUMN " + column + " " + type);
+    }
+  }
+
+
   class SignalImageDeleted : public Orthanc::SQLite::IScalarFunction
   {
   private:
-    Orthanc::FileStorage& fileStorage_;
+    typedef std::list<PhotoTrack::IImageListener*>  Listeners;
+
+    PhotoTrack::IImageStorage& storage_;
+    const Listeners& listeners_;
     
   public:
-    SignalImageDeleted(Orthanc::FileStorage& fileStorage) : 
-      fileStorage_(fileStorage)
+    SignalImageDeleted(PhotoTrack::IImageStorage& storage,
+                       const Listeners& listeners) : 
+      storage_(storage),
+      listeners_(listeners)
     {
     }
     
@@ -63,7 +108,12 @@ namespace
       if (!uuid.empty())
       {
         LOG(INFO) << "Remove stored image with UUID " << uuid;
-        fileStorage_.Remove(uuid);
+        storage_.Remove(uuid);
+
+        for (Listeners::const_iterator it = listeners_.begin(); it != listeners_.end(); ++it)
+        {
+          (*it)->SignalImageDeleted(uuid);
+        }
       }
     }
   };
@@ -71,8 +121,9 @@ namespace
 
 
 DatabaseWrapper::DatabaseWrapper(const std::string& path,
-                                 Orthanc::FileStorage& fileStorage) :
-  fileStorage_(fileStorage)
+                                 PhotoTrack::IImageStorage& storage) :
+  storage_(storage),
+  idempotencyKeyTtl_(24 * 3600)
 {
   LOG(WARNING) << "Using the following SQLite database: " << path;
 
@@ -97,10 +148,93 @@ DatabaseWrapper::DatabaseWrapper(const std::string& path,
     Orthanc::EmbeddedResources::GetFileResource(s, Orthanc::EmbeddedResources::PREPARE_DATABASE);
     db_.Execute(s);
   }
+  else
+  {
+    Upgrade();
+  }
+
+  db_.Register(new SignalImageDeleted(storage_, listeners_));
+
+  // The requests that were processed when the server stopped will
+  // never complete: Let their clients retry them
+  db_.Execute("DELETE FROM IdempotencyKeys WHERE answer IS NULL");
+}
+
+int DatabaseWrapper::GetSchemaVersion()
+{
+  using namespace Orthanc;
+
+  if (!db_.DoesTableExist("GlobalProperties"))
+  {
+    return 1;
+  }
+
+  SQLite::Statement s(db_, SQLITE_FROM_HERE, "SELECT value FROM GlobalProperties WHERE property='SchemaVersion'");
+  if (!s.Step())
+  {
+    return 1;
+  }
+
+  try
+  {
+    return boost::lexical_cast<int>(s.ColumnString(0));
+  }
+  catch (boost::bad_lexical_cast&)
+  {
+    throw OrthancException(ErrorCode_IncompatibleDatabaseVersion);
+  }
+}
+
+
+void DatabaseWrapper::Upgrade()
+{
+  using namespace Orthanc;
+
+  int version = GetSchemaVersion();
+
+  if (version > SCHEMA_VERSION)
+  {
+    LOG(ERROR) << "The database was created by a more recent version of PhotoTrack (schema "
+               << version << ")";
+    throw OrthancException(ErrorCode_IncompatibleDatabaseVersion);
+  }
+
+  if (version == 1)
+  {
+    LOG(WARNING) << "Upgrading the database from schema 1 to 2";
+
+    SQLite::Transaction transaction(db_);
+    transaction.Begin();
+
+    AddColumn(db_, "Photos", "imageCompression", "INTEGER");
+    AddColumn(db_, "Photos", "preview", "TEXT");
+    AddColumn(db_, "Photos", "imageHash", "TEXT");
+    AddColumn(db_, "Photos", "perceptualHash", "TEXT");
+
+    std::string s;
+    EmbeddedResources::GetFileResource(s, EmbeddedResources::UPGRADE_DATABASE_1_TO_2);
+    db_.Execute(s);
+
+    transaction.Commit();
+    version = 2;
+  }
+
+  if (version == 2)
+  {
+    LOG(WARNING) << "Upgrading the database from schema 2 to 3";
+
+    SQLite::Transaction transaction(db_);
+    transaction.Begin();
 
-  db_.Register(new SignalImageDeleted(fileStorage_));
+    std::string s;
+    EmbeddedResources::GetFileResource(s, EmbeddedResources::UPGRADE_DATABASE_2_TO_3);
+    db_.Execute(s);
+
+    transaction.Commit();
+  }
 }
 
+
 /*
   CREATE TABLE Sites(
   0 uuid TEXT PRIMARY KEY,
@@ -178,11 +312,16 @@ void DatabaseWrapper::CreateOrUpdateUser(const User& user)
   CREATE TABLE Photos(
   0 uuid TEXT PRIMARY KEY,
   1 imageUuid TEXT,
-  2 longitude REAL,
+  2 imageMime TEXT,
   3 latitude REAL,
-  4 secondsSinceEpoch INTEGER,
-  5 tag TEXT,
-  6 siteUuid TEXT REFERENCES Sites(uuid) ON DELETE CASCADE
+  4 longitude REAL,
+  5 secondsSinceEpoch INTEGER,
+  6 tag TEXT,
+  7 siteUuid TEXT REFERENCES Sites(uuid) ON DELETE CASCADE,
+  8 imageCompression INTEGER,
+  9 preview TEXT,
+  10 imageHash TEXT,
+  11 perceptualHash TEXT
   );
 */
 
@@ -197,7 +336,12 @@ void DatabaseWrapper::CreateOrUpdatePhoto(const Photo& photo)
   using namespace Orthanc;
   boost::unique_lock<boost::recursive_mutex> lock(mutex_);
 
-  SQLite::Statement s(db_, SQLITE_FROM_HERE, "INSERT OR REPLACE INTO Photos VALUES(?, ?, ?, ?, ?, ?, ?, ?)");
+  // The columns are named, as the upgraded databases may order them
+  // differently
+  SQLite::Statement s(db_, SQLITE_FROM_HERE, 
+                      "INSERT OR REPLACE INTO Photos(uuid, imageUuid, imageMime, latitude, longitude, "
+                      "secondsSinceEpoch, tag, siteUuid, imageCompression, preview, imageHash, "
+                      "perceptualHash) VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
   s.BindString(0, photo.GetUuid());
   s.BindString(1, photo.GetImageUuid());
   s.BindString(2, photo.GetImageMime());
@@ -216,6 +360,10 @@ void DatabaseWrapper::CreateOrUpdatePhoto(const Photo& photo)
   s.BindInt64(5, photo.GetSecondsSinceEpoch());
   s.BindString(6, photo.GetTag());
   s.BindString(7, photo.GetSiteUuid());
+  s.BindInt(8, photo.GetImageCompression());
+  s.BindString(9, photo.GetPreview());
+  s.BindString(10, photo.GetImageHash());
+  s.BindString(11, photo.GetPerceptualHash());
   s.Run();
 }
 
@@ -226,7 +374,9 @@ bool DatabaseWrapper::GetPhoto(Photo& photo,
   using namespace Orthanc;
   boost::unique_lock<boost::recursive_mutex> lock(mutex_);
 
-  SQLite::Statement s(db_, SQLITE_FROM_HERE, "SELECT * FROM Photos WHERE uuid=?");
+  SQLite::Statement s(db_, SQLITE_FROM_HERE, 
+                      "SELECT uuid, imageUuid, imageMime, latitude, longitude, secondsSinceEpoch, tag, "
+                      "siteUuid, imageCompression, preview, imageHash, perceptualHash FROM Photos WHERE uuid=?");
   s.BindString(0, uuid);
 
   if (!s.Step())
@@ -252,11 +402,38 @@ bool DatabaseWrapper::GetPhoto(Photo& photo,
     photo.SetSecondsSinceEpoch(s.ColumnInt64(5));
     photo.SetTag(s.ColumnString(6));
     photo.SetSiteUuid(s.ColumnString(7));
+
+    if (s.ColumnIsNull(8))
+    {
+      photo.SetImageCompression(Orthanc::CompressionType_None);
+    }
+    else
+    {
+      photo.SetImageCompression(static_cast<Orthanc::CompressionType>(s.ColumnInt(8)));
+    }
+
+    photo.SetPreview(s.ColumnIsNull(9) ? "" : s.ColumnString(9));
+    photo.SetImageHash(s.ColumnIsNull(10) ? "" : s.ColumnString(10));
+    photo.SetPerceptualHash(s.ColumnIsNull(11) ? "" : s.ColumnString(11));
       
     return true;
   }    
 }
 
+bool DatabaseWrapper::GetPhotoFromImage(Photo& photo,
+                                        const std::string& imageUuid)
+{
+  using namespace Orthanc;
+  boost::unique_lock<boost::recursive_mutex> lock(mutex_);
+
+  SQLite::Statement s(db_, SQLITE_FROM_HERE, "SELECT uuid FROM Photos WHERE imageUuid=?");
+  s.BindString(0, imageUuid);
+
+  return (!imageUuid.empty() &&
+          s.Step() &&
+          GetPhoto(photo, s.ColumnString(0)));
+}
+
 bool DatabaseWrapper::GetUser(User& user, const std::string& uuid)
 {
   using namespace Orthanc;
@@ -358,7 +535,24 @@ void DatabaseWrapper::GetUsers(Json::Value& users)
   }
 }
 
-void DatabaseWrapper::GetPhotos(Json::Value& photos)
+static void AppendPhoto(Json::Value& photos,
+                        const Photo& photo,
+                        bool previews)
+{
+  Json::Value jsonPhoto;
+  photo.ToJson(jsonPhoto);
+
+  if (previews &&
+      !photo.GetPreview().empty())
+  {
+    jsonPhoto["Preview"] = "data:image/png;base64," + photo.GetPreview();
+  }
+
+  photos.append(jsonPhoto);
+}
+
+void DatabaseWrapper::GetPhotos(Json::Value& photos,
+                                bool previews)
 {
   photos = Json::arrayValue;
 
@@ -371,13 +565,13 @@ void DatabaseWrapper::GetPhotos(Json::Value& photos)
   {
     Photo photo;
     GetPhoto(photo, s.ColumnString(0));
-    Json::Value jsonPhoto;
-    photo.ToJson(jsonPhoto);
-    photos.append(jsonPhoto);
+    AppendPhoto(photos, photo, previews);
   }
 }
 
-void DatabaseWrapper::GetPhotos(Json::Value& photos, const std::string& siteUuid)
+void DatabaseWrapper::GetPhotos(Json::Value& photos,
+                                const std::string& siteUuid,
+                                bool previews)
 {
   photos = Json::arrayValue;
 
@@ -391,9 +585,7 @@ void DatabaseWrapper::GetPhotos(Json::Value& photos, const std::string& siteUuid
   {
     Photo photo;
     GetPhoto(photo, s.ColumnString(0));
-    Json::Value jsonPhoto;
-    photo.ToJson(jsonPhoto);
-    photos.append(jsonPhoto);
+    AppendPhoto(photos, photo, previews);
   }
 }
 
@@ -436,39 +628,520 @@ void DatabaseWrapper::DeleteUser(const std::string& uuid)
 }
 
 
+bool DatabaseWrapper::StoreImage(const std::string& photoUuid,
+                                 const std::string& previousImageUuid,
+                                 const void* image,
+                                 size_t size,
+                                 const std::string& mimeType,
+                                 const Photo* newPhoto)
+{
+  // Only compress the payloads that are worth it (never the JPEG
+  // images, that are already compressed)
+  Orthanc::CompressionType compression = Orthanc::CompressionType_None;
+  std::string compressed;
+
+  if (PhotoTrack::Toolbox::IsCompressibleImage(mimeType, image, size))
+  {
+    Orthanc::ZlibCompressor compressor;
+    compressor.Compress(compressed, image, size);
+
+    if (compressed.size() < size)
+    {
+      compression = Orthanc::CompressionType_Zlib;
+    }
+  }
+
+  // The preview and the hashes are computed once for all, outside of
+  // the lock
+  std::string hash = PhotoTrack::Toolbox::ComputeSHA1(image, size);
+
+  std::string preview, perceptualHash;
+  if (!PhotoTrack::ImagePreview::Create(preview, perceptualHash, image, size, mimeType))
+  {
+    preview.clear();
+    perceptualHash.clear();
+  }
+
+  // The blob is written (and made durable) before locking the
+  // database, so that the concurrent uploads can be flushed together
+  std::string imageUuid = (compression == Orthanc::CompressionType_Zlib ?
+                           storage_.Create(compressed) : storage_.Create(image, size));
+
+  return CommitImage(photoUuid, previousImageUuid, imageUuid, mimeType, compression, preview, perceptualHash, hash, newPhoto);
+}
+
+
 void DatabaseWrapper::ReplaceImage(const std::string& photoUuid,
-                                   const std::string& image,
+                                   const void* image,
+                                   size_t size,
                                    const std::string& mimeType)
 {
+  StoreImage(photoUuid, "", image, size, mimeType, NULL);
+}
+
+
+void DatabaseWrapper::CreatePhotoWithImage(const Photo& photo,
+                                           const void* image,
+                                           size_t size,
+                                           const std::string& mimeType)
+{
+  StoreImage(photo.GetUuid(), "", image, size, mimeType, &photo);
+}
+
+
+bool DatabaseWrapper::CreatePhotoWithImage(const Photo& photo,
+                                           const std::string& imageHash)
+{
+  boost::unique_lock<boost::recursive_mutex> lock(mutex_);
+
+  Orthanc::SQLite::Transaction transaction(db_);
+  transaction.Begin();
+
+  CreateOrUpdatePhoto(photo);
+
+  if (!AttachImage(photo.GetUuid(), imageHash))
+  {
+    transaction.Rollback();
+    return false;
+  }
+
+  transaction.Commit();
+  return true;
+}
+
+
+bool DatabaseWrapper::SwapImage(const std::string& previousImageUuid,
+                                const std::string& image,
+                                const std::string& mimeType)
+{
+  if (previousImageUuid.empty())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+
+  return StoreImage("", previousImageUuid, image.empty() ? NULL : image.c_str(), image.size(), mimeType, NULL);
+}
+
+
+void DatabaseWrapper::ReplaceImageFromFile(const std::string& photoUuid,
+                                           const std::string& path,
+                                           const std::string& mimeType)
+{
+  static const size_t SAMPLE_SIZE = 64 * 1024;
+
+  std::string sample;
+
+  {
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (fp == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile);
+    }
+
+    sample.resize(SAMPLE_SIZE);
+    sample.resize(fread(&sample[0], 1, SAMPLE_SIZE, fp));
+    fclose(fp);
+  }
+
+  if (PhotoTrack::Toolbox::IsCompressibleImage(mimeType, sample))
+  {
+    // The compression needs the whole image in memory anyway
+    std::string image;
+    Orthanc::Toolbox::ReadFile(image, path);
+    ReplaceImage(photoUuid, image, mimeType);
+    boost::filesystem::remove(path);
+    return;
+  }
+
+  std::string hash = PhotoTrack::Toolbox::ComputeFileSHA1(path);
+
+  std::string preview, perceptualHash;
+  if (!PhotoTrack::ImagePreview::CreateFromFile(preview, perceptualHash, path, mimeType))
+  {
+    preview.clear();
+    perceptualHash.clear();
+  }
+
+  std::string imageUuid = storage_.CreateFromFile(path);
+
+  CommitImage(photoUuid, "", imageUuid, mimeType, Orthanc::CompressionType_None, preview, perceptualHash, hash, NULL);
+}
+
+
+bool DatabaseWrapper::CommitImage(const std::string& photoUuid,
+                                  const std::string& previousImageUuid,
+                                  const std::string& imageUuid,
+                                  const std::string& mimeType,
+                                  Orthanc::CompressionType compression,
+                                  const std::string& preview,
+                                  const std::string& perceptualHash,
+                                  const std::string& hash,
+                                  const Photo* newPhoto)
+{
+  using namespace Orthanc;
+  boost::unique_lock<boost::recursive_mutex> lock(mutex_);
+
+  std::string oldImage;
+  bool replaced = false;
+
+  try
+  {
+    SQLite::Transaction transaction(db_);
+    transaction.Begin();
+
+    if (newPhoto != NULL)
+    {
+      CreateOrUpdatePhoto(*newPhoto);
+    }
+
+    std::list<Photo> photos;
+
+    if (photoUuid.empty())
+    {
+      // Swap of the image shared by all the photos that refer to
+      // "previousImageUuid"
+      std::list<std::string> uuids;
+
+      {
+        SQLite::Statement s(db_, SQLITE_FROM_HERE, "SELECT uuid FROM Photos WHERE imageUuid=?");
+        s.BindString(0, previousImageUuid);
+        while (s.Step())
+        {
+          uuids.push_back(s.ColumnString(0));
+        }
+      }
+
+      for (std::list<std::string>::const_iterator
+             it = uuids.begin(); it != uuids.end(); ++it)
+      {
+        photos.push_back(Photo());
+        GetPhoto(photos.back(), *it);
+      }
+
+      // The image was replaced in the meantime
+      replaced = photos.empty();
+      oldImage = previousImageUuid;
+    }
+    else
+    {
+      photos.push_back(Photo());
+      if (!GetPhoto(photos.back(), photoUuid))
+      {
+        throw OrthancException(ErrorCode_InexistentItem);
+      }
+
+      oldImage = photos.back().GetImageUuid();
+
+      // The image was replaced in the meantime
+      replaced = (!previousImageUuid.empty() &&
+                  oldImage != previousImageUuid);
+    }
+
+    if (!replaced)
+    {
+      std::string oldHash = photos.front().GetImageHash();
+
+      for (std::list<Photo>::iterator it = photos.begin(); it != photos.end(); ++it)
+      {
+        it->SetImageUuid(imageUuid);
+        it->SetImageMime(mimeType);
+        it->SetImageCompression(compression);
+        it->SetPreview(preview);
+        it->SetPerceptualHash(perceptualHash);
+        it->SetImageHash(hash);
+        CreateOrUpdatePhoto(*it);
+
+        SQLite::Statement s(db_, SQLITE_FROM_HERE, "INSERT INTO Changes VALUES(NULL, ?, ?, ?)");
+        s.BindInt(0, ChangeType_NewImage);
+        s.BindString(1, it->GetUuid());
+        s.BindString(2, PhotoTrack::Toolbox::TimestampToIso8601(PhotoTrack::Toolbox::GetSecondsSinceEpoch()));
+        s.Run();
+      }
+
+      if (!previousImageUuid.empty() &&
+          !oldHash.empty() &&
+          oldHash != hash)
+      {
+        // The same image in another form (e.g. recompressed): The
+        // clients must still find it by its original SHA-1
+        {
+          SQLite::Statement s(db_, SQLITE_FROM_HERE, "UPDATE ImageHashAliases SET imageHash=? WHERE imageHash=?");
+          s.BindString(0, hash);
+          s.BindString(1, oldHash);
+          s.Run();
+        }
+
+        SQLite::Statement s(db_, SQLITE_FROM_HERE, "INSERT OR REPLACE INTO ImageHashAliases VALUES(?, ?)");
+        s.BindString(0, oldHash);
+        s.BindString(1, hash);
+        s.Run();
+      }
+
+      transaction.Commit();
+    }
+  }
+  catch (OrthancException&)
+  {
+    // The transaction is rolled back: Nobody refers to the new blob
+    storage_.Remove(imageUuid);
+    throw;
+  }
+
+  if (replaced)
+  {
+    storage_.Remove(imageUuid);
+    return false;
+  }
+
+  // The previous blob is only removed once the new one is committed
+  ReleaseImage(oldImage);
+
+  for (std::list<PhotoTrack::IImageListener*>::const_iterator
+         it = listeners_.begin(); it != listeners_.end(); ++it)
+  {
+    (*it)->SignalNewImage(imageUuid);
+  }
+
+  return true;
+}
+
+bool DatabaseWrapper::IsImageReferenced(const std::string& imageUuid)
+{
+  using namespace Orthanc;
+  boost::unique_lock<boost::recursive_mutex> lock(mutex_);
+
+  SQLite::Statement s(db_, SQLITE_FROM_HERE, "SELECT 1 FROM Photos WHERE imageUuid=? LIMIT 1");
+  s.BindString(0, imageUuid);
+  return s.Step();
+}
+
+
+void DatabaseWrapper::ReleaseImage(const std::string& imageUuid)
+{
+  boost::unique_lock<boost::recursive_mutex> lock(mutex_);
+
+  if (!imageUuid.empty() &&
+      !IsImageReferenced(imageUuid))
+  {
+    storage_.Remove(imageUuid);
+
+    for (std::list<PhotoTrack::IImageListener*>::const_iterator
+           it = listeners_.begin(); it != listeners_.end(); ++it)
+    {
+      (*it)->SignalImageDeleted(imageUuid);
+    }
+  }
+}
+
+
+bool DatabaseWrapper::AttachImage(const std::string& photoUuid,
+                                  const std::string& imageHash)
+{
+  using namespace Orthanc;
   boost::unique_lock<boost::recursive_mutex> lock(mutex_);
 
   Photo photo;
-  if (GetPhoto(photo, photoUuid))
+  if (!GetPhoto(photo, photoUuid))
+  {
+    throw OrthancException(ErrorCode_InexistentItem);
+  }
+
+  Photo source;
+
+  {
+    SQLite::Statement s(db_, SQLITE_FROM_HERE, "SELECT uuid FROM Photos WHERE imageHash IN "
+                        "(?, (SELECT imageHash FROM ImageHashAliases WHERE alias=?)) AND imageUuid<>'' LIMIT 1");
+    s.BindString(0, imageHash);
+    s.BindString(1, imageHash);
+
+    if (imageHash.empty() ||
+        !s.Step() ||
+        !GetPhoto(source, s.ColumnString(0)))
+    {
+      return false;
+    }
+  }
+
+  std::string oldImage = photo.GetImageUuid();
+  if (oldImage == source.GetImageUuid())
+  {
+    return true;
+  }
+
+  photo.SetImageUuid(source.GetImageUuid());
+  photo.SetImageMime(source.GetImageMime());
+  photo.SetImageCompression(source.GetImageCompression());
+  photo.SetPreview(source.GetPreview());
+  photo.SetPerceptualHash(source.GetPerceptualHash());
+  photo.SetImageHash(source.GetImageHash());
+  CreateOrUpdatePhoto(photo);
+
+  SQLite::Statement s(db_, SQLITE_FROM_HERE, "INSERT INTO Changes VALUES(NULL, ?, ?, ?)");
+  s.BindInt(0, ChangeType_NewImage);
+  s.BindString(1, photo.GetUuid());
+  s.BindString(2, PhotoTrack::Toolbox::TimestampToIso8601(PhotoTrack::Toolbox::GetSecondsSinceEpoch()));
+  s.Run();
+
+  ReleaseImage(oldImage);
+
+  return true;
+}
+
+
+void DatabaseWrapper::LookupImageHashes(std::set<std::string>& found,
+                                        const std::list<std::string>& hashes)
+{
+  found.clear();
+
+  using namespace Orthanc;
+  boost::unique_lock<boost::recursive_mutex> lock(mutex_);
+
+  for (std::list<std::string>::const_iterator
+         it = hashes.begin(); it != hashes.end(); ++it)
   {
-    std::string imageUuid = fileStorage_.Create(image);
+    SQLite::Statement s(db_, SQLITE_FROM_HERE, "SELECT 1 FROM Photos WHERE imageHash IN "
+                        "(?, (SELECT imageHash FROM ImageHashAliases WHERE alias=?)) AND imageUuid<>'' LIMIT 1");
+    s.BindString(0, *it);
+    s.BindString(1, *it);
 
-    if (!photo.GetImageUuid().empty())
+    if (s.Step())
     {
-      fileStorage_.Remove(photo.GetImageUuid());
+      found.insert(*it);
     }
+  }
+}
+
+
+void DatabaseWrapper::ReadImage(std::string& image,
+                                const Photo& photo)
+{
+  switch (photo.GetImageCompression())
+  {
+    case Orthanc::CompressionType_None:
+      storage_.Read(image, photo.GetImageUuid());
+      break;
+
+    case Orthanc::CompressionType_Zlib:
+    {
+      std::string compressed;
+      storage_.Read(compressed, photo.GetImageUuid());
+
+      Orthanc::ZlibCompressor compressor;
+      compressor.Uncompress(image, compressed);
+      break;
+    }
+
+    default:
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented);
+  }
+}
 
-    photo.SetImageUuid(imageUuid);
-    photo.SetImageMime(mimeType);
-    CreateOrUpdatePhoto(photo);
 
+void DatabaseWrapper::GetInactiveClosedSites(std::list<std::string>& sites,
+                                             int64_t since)
+{
+  sites.clear();
+
+  using namespace Orthanc;
+  boost::unique_lock<boost::recursive_mutex> lock(mutex_);
+
+  SQLite::Statement s(db_, SQLITE_FROM_HERE, 
+                      "SELECT uuid FROM Sites WHERE status=? AND secondsSinceEpoch<? AND NOT EXISTS "
+                      "(SELECT 1 FROM Photos WHERE Photos.siteUuid=Sites.uuid AND Photos.secondsSinceEpoch>=?)");
+  s.BindInt(0, SiteStatus_Closed);
+  s.BindInt64(1, since);
+  s.BindInt64(2, since);
+
+  while (s.Step())
+  {
+    sites.push_back(s.ColumnString(0));
+  }
+}
+
+
+void DatabaseWrapper::GetSiteImages(std::list<std::string>& images,
+                                    const std::string& siteUuid)
+{
+  images.clear();
+
+  using namespace Orthanc;
+  boost::unique_lock<boost::recursive_mutex> lock(mutex_);
+
+  SQLite::Statement s(db_, SQLITE_FROM_HERE, "SELECT DISTINCT imageUuid FROM Photos WHERE siteUuid=? AND imageUuid<>''");
+  s.BindString(0, siteUuid);
+
+  while (s.Step())
+  {
+    images.push_back(s.ColumnString(0));
+  }
+}
+
+
+void DatabaseWrapper::GetSitePhotosWithImage(std::list<Photo>& photos,
+                                             const std::string& siteUuid)
+{
+  photos.clear();
+
+  using namespace Orthanc;
+  boost::unique_lock<boost::recursive_mutex> lock(mutex_);
+
+  SQLite::Statement s(db_, SQLITE_FROM_HERE, "SELECT uuid FROM Photos WHERE siteUuid=? AND imageUuid<>'' "
+                      "ORDER BY secondsSinceEpoch, uuid");
+  s.BindString(0, siteUuid);
+
+  while (s.Step())
+  {
+    photos.push_back(Photo());
+    GetPhoto(photos.back(), s.ColumnString(0));
+  }
+}
+
+
+void DatabaseWrapper::GetSiteNearDuplicates(std::list< std::list<std::string> >& groups,
+                                            const std::string& siteUuid,
+                                            unsigned int maxDistance)
+{
+  groups.clear();
+
+  std::vector<std::string> photos;
+  std::vector<uint64_t> hashes;
+
+  {
     using namespace Orthanc;
-    SQLite::Statement s(db_, SQLITE_FROM_HERE, "INSERT INTO Changes VALUES(NULL, ?, ?, ?)");
-    s.BindInt(0, ChangeType_NewImage);
-    s.BindString(1, photo.GetUuid());
-    s.BindString(2, PhotoTrack::Toolbox::TimestampToIso8601(PhotoTrack::Toolbox::GetSecondsSinceEpoch()));
-    s.Run();      
+    boost::unique_lock<boost::recursive_mutex> lock(mutex_);
+
+    SQLite::Statement s(db_, SQLITE_FROM_HERE, "SELECT uuid, perceptualHash FROM Photos WHERE siteUuid=? "
+                        "AND imageUuid<>'' AND perceptualHash<>'' ORDER BY secondsSinceEpoch, uuid");
+    s.BindString(0, siteUuid);
+
+    while (s.Step())
+    {
+      uint64_t hash;
+      if (PhotoTrack::PerceptualHash::Parse(hash, s.ColumnString(1)))
+      {
+        photos.push_back(s.ColumnString(0));
+        hashes.push_back(hash);
+      }
+    }
   }
-  else
+
+  // The comparisons are done outside of the lock
+  std::list< std::vector<size_t> > clusters;
+  PhotoTrack::PerceptualHash::Cluster(clusters, hashes, maxDistance);
+
+  for (std::list< std::vector<size_t> >::const_iterator
+         it = clusters.begin(); it != clusters.end(); ++it)
   {
-    throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentItem);
+    groups.push_back(std::list<std::string>());
+
+    for (size_t i = 0; i < it->size(); i++)
+    {
+      groups.back().push_back(photos[(*it)[i]]);
+    }
   }
 }
 
+
 static const char* EnumerationToString(ChangeType change)
 {
   switch (change)
@@ -481,6 +1154,77 @@ static const char* EnumerationToString(ChangeType change)
   }
 }
 
+IdempotencyKeyStatus DatabaseWrapper::ReserveIdempotencyKey(std::string& answer,
+                                                           const std::string& key,
+                                                           const std::string& fingerprint)
+{
+  using namespace Orthanc;
+  boost::unique_lock<boost::recursive_mutex> lock(mutex_);
+
+  int64_t now = PhotoTrack::Toolbox::GetSecondsSinceEpoch();
+
+  {
+    SQLite::Statement s(db_, SQLITE_FROM_HERE, "DELETE FROM IdempotencyKeys WHERE secondsSinceEpoch<=?");
+    s.BindInt64(0, now - idempotencyKeyTtl_);
+    s.Run();
+  }
+
+  {
+    SQLite::Statement s(db_, SQLITE_FROM_HERE, "SELECT fingerprint, answer FROM IdempotencyKeys WHERE idempotencyKey=?");
+    s.BindString(0, key);
+
+    if (s.Step())
+    {
+      if (s.ColumnString(0) != fingerprint)
+      {
+        return IdempotencyKeyStatus_Mismatch;
+      }
+      else if (s.ColumnIsNull(1))
+      {
+        return IdempotencyKeyStatus_Pending;
+      }
+      else
+      {
+        answer = s.ColumnString(1);
+        return IdempotencyKeyStatus_Completed;
+      }
+    }
+  }
+
+  SQLite::Statement s(db_, SQLITE_FROM_HERE, "INSERT INTO IdempotencyKeys VALUES(?, ?, NULL, ?)");
+  s.BindString(0, key);
+  s.BindString(1, fingerprint);
+  s.BindInt64(2, now);
+  s.Run();
+
+  return IdempotencyKeyStatus_New;
+}
+
+
+void DatabaseWrapper::CompleteIdempotencyKey(const std::string& key,
+                                             const std::string& answer)
+{
+  using namespace Orthanc;
+  boost::unique_lock<boost::recursive_mutex> lock(mutex_);
+
+  SQLite::Statement s(db_, SQLITE_FROM_HERE, "UPDATE IdempotencyKeys SET answer=? WHERE idempotencyKey=?");
+  s.BindString(0, answer);
+  s.BindString(1, key);
+  s.Run();
+}
+
+
+void DatabaseWrapper::ReleaseIdempotencyKey(const std::string& key)
+{
+  using namespace Orthanc;
+  boost::unique_lock<boost::recursive_mutex> lock(mutex_);
+
+  SQLite::Statement s(db_, SQLITE_FROM_HERE, "DELETE FROM IdempotencyKeys WHERE idempotencyKey=? AND answer IS NULL");
+  s.BindString(0, key);
+  s.Run();
+}
+
+
 void DatabaseWrapper::GetChangesInternal(Json::Value& target,
                                          Orthanc::SQLite::Statement& s,
                                          int64_t since,
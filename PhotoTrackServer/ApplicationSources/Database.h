@@ -22,22 +22,68 @@
 #include "Site.h"
 #include "User.h"
 #include "Photo.h"
+#include "IImageListener.h"
+#include "IImageStorage.h"
 
 #include <Core/SQLite/Connection.h>
-#include <Core/FileStorage/FileStorage.h>
 #include <boost/thread.hpp>
+#include <list>
+#include <set>
 
 enum ChangeType
 {
   ChangeType_NewImage
 };
 
+enum IdempotencyKeyStatus
+{
+  IdempotencyKeyStatus_New,         // The request must be processed
+  IdempotencyKeyStatus_Completed,   // The answer must be replayed
+  IdempotencyKeyStatus_Pending,     // The first request is still processed
+  IdempotencyKeyStatus_Mismatch     // The key was used for another request
+};
+
 class DatabaseWrapper : public boost::noncopyable
 {
 private:
   boost::recursive_mutex mutex_;
   Orthanc::SQLite::Connection db_;
-  Orthanc::FileStorage& fileStorage_;
+  PhotoTrack::IImageStorage& storage_;
+  std::list<PhotoTrack::IImageListener*> listeners_;
+  int64_t idempotencyKeyTtl_;
+
+  int GetSchemaVersion();
+
+  // Brings the existing databases to the current schema
+  void Upgrade();
+
+  bool IsImageReferenced(const std::string& imageUuid);
+
+  // Removes the blob if no photo refers to it anymore
+  void ReleaseImage(const std::string& imageUuid);
+
+  // Attaches a blob that has just been stored to the photo. The blob
+  // is removed if the photo does not exist, or if its image is not
+  // "previousImageUuid" anymore (if not empty). If "photoUuid" is
+  // empty, the blob is attached to all the photos whose image is
+  // "previousImageUuid". If "newPhoto" is given, it is created in the
+  // same transaction.
+  bool CommitImage(const std::string& photoUuid,
+                   const std::string& previousImageUuid,
+                   const std::string& imageUuid,
+                   const std::string& mimeType,
+                   Orthanc::CompressionType compression,
+                   const std::string& preview,
+                   const std::string& perceptualHash,
+                   const std::string& hash,
+                   const Photo* newPhoto);
+
+  bool StoreImage(const std::string& photoUuid,
+                  const std::string& previousImageUuid,
+                  const void* image,
+                  size_t size,
+                  const std::string& mimeType,
+                  const Photo* newPhoto);
 
   void GetChangesInternal(Json::Value& target,
                           Orthanc::SQLite::Statement& s,
@@ -46,11 +92,23 @@ private:
 
 public:
   DatabaseWrapper(const std::string& path,
-                  Orthanc::FileStorage& fileStorage);
+                  PhotoTrack::IImageStorage& storage);
 
-  Orthanc::FileStorage& GetFileStorage() const
+  PhotoTrack::IImageStorage& GetImageStorage() const
   {
-    return fileStorage_;
+    return storage_;
+  }
+
+  // The listener must be registered before the database is used
+  void Register(PhotoTrack::IImageListener& listener)
+  {
+    listeners_.push_back(&listener);
+  }
+
+  // In seconds, 24 hours by default
+  void SetIdempotencyKeyTtl(unsigned int ttl)
+  {
+    idempotencyKeyTtl_ = ttl;
   }
 
   void CreateOrUpdateSite(const Site& site);
@@ -59,14 +117,20 @@ public:
 
   bool GetPhoto(Photo& photo,
                 const std::string& uuid);
+  bool GetPhotoFromImage(Photo& photo,
+                         const std::string& imageUuid);
   bool GetUser(User& user, const std::string& uuid);
   bool GetSite(Site& site, const std::string& uuid);
 
   void GetSites(Json::Value& sites);
   void GetUsers(Json::Value& users);
-  void GetPhotos(Json::Value& photos);
+  // If "previews" is set, the listed photos embed the data URI of
+  // their preview, if any
+  void GetPhotos(Json::Value& photos,
+                 bool previews = false);
   void GetPhotos(Json::Value& photos,
-                 const std::string& siteUuid);
+                 const std::string& siteUuid,
+                 bool previews = false);
   void GetPhotos(Json::Value& photos,
                  const Site& site);
 
@@ -75,9 +139,95 @@ public:
   void DeleteUser(const std::string& uuid);
 
   void ReplaceImage(const std::string& photoUuid,
-                    const std::string& image,
+                    const void* image,
+                    size_t size,
                     const std::string& mimeType);
 
+  // Creates the photo together with its image, in one transaction:
+  // The photo is never visible without its image
+  void CreatePhotoWithImage(const Photo& photo,
+                            const void* image,
+                            size_t size,
+                            const std::string& mimeType);
+
+  // Same as above, attaching the already stored image with the given
+  // SHA-1 as "AttachImage()". If no such image is stored, the photo
+  // is not created and "false" is returned.
+  bool CreatePhotoWithImage(const Photo& photo,
+                            const std::string& imageHash);
+
+  void ReplaceImage(const std::string& photoUuid,
+                    const std::string& image,
+                    const std::string& mimeType)
+  {
+    ReplaceImage(photoUuid, image.empty() ? NULL : image.c_str(), image.size(), mimeType);
+  }
+
+  // Replaces the given image in all the photos that share it (e.g.
+  // after a background processing of this image). Its SHA-1 is kept
+  // as an alias of the new image for "AttachImage()" and
+  // "LookupImageHashes()". Returns "false" if no photo refers to this
+  // image anymore.
+  bool SwapImage(const std::string& previousImageUuid,
+                 const std::string& image,
+                 const std::string& mimeType);
+
+  // Same as above, taking over the file that contains the image
+  // (e.g. a request body that was spilled to the disk). If possible,
+  // the file is moved into the storage area, without reading it in
+  // memory.
+  void ReplaceImageFromFile(const std::string& photoUuid,
+                            const std::string& path,
+                            const std::string& mimeType);
+
+  // Attaches the already stored image with the given SHA-1 to the
+  // photo, so that the clients need not upload it again. The blob is
+  // shared between the photos. Returns "false" if no such image is
+  // stored.
+  bool AttachImage(const std::string& photoUuid,
+                   const std::string& imageHash);
+
+  // Gives the SHA-1 hashes from the list that are stored
+  void LookupImageHashes(std::set<std::string>& found,
+                         const std::list<std::string>& hashes);
+
+  // Reads the image of the photo, uncompressing it if needed
+  void ReadImage(std::string& image,
+                 const Photo& photo);
+
+  // Lists the closed sites that contain no photo taken after the
+  // given time (in seconds since the epoch)
+  void GetInactiveClosedSites(std::list<std::string>& sites,
+                              int64_t since);
+
+  void GetSiteImages(std::list<std::string>& images,
+                     const std::string& siteUuid);
+
+  // Lists the photos of the site to which an image is attached, in
+  // chronological order
+  void GetSitePhotosWithImage(std::list<Photo>& photos,
+                              const std::string& siteUuid);
+
+  // Groups the photos of the site whose images are near-duplicates,
+  // i.e. whose perceptual hashes differ by at most "maxDistance"
+  // bits. The photos of each group are in chronological order.
+  void GetSiteNearDuplicates(std::list< std::list<std::string> >& groups,
+                             const std::string& siteUuid,
+                             unsigned int maxDistance);
+
+  // Reserves a key for a request, identified by its fingerprint. If
+  // the request was already completed, gives back its answer. The
+  // expired keys are removed on the way.
+  IdempotencyKeyStatus ReserveIdempotencyKey(std::string& answer,
+                                             const std::string& key,
+                                             const std::string& fingerprint);
+
+  void CompleteIdempotencyKey(const std::string& key,
+                              const std::string& answer);
+
+  // Removes the reservation of a request that has failed
+  void ReleaseIdempotencyKey(const std::string& key);
+
   void GetChanges(Json::Value& target,
                   int64_t since,
                   unsigned int maxResults);
@@ -0,0 +1,333 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "DerivedImageCache.h"
+
+#include "ImageResampler.h"
+#include "JpegReader.h"
+#include "JpegWriter.h"
+
+#include <Core/ImageFormats/ImageBuffer.h>
+#include <Core/ImageFormats/PngReader.h>
+#include <Core/ImageFormats/PngWriter.h>
+#include <Core/OrthancException.h>
+#include <Core/Toolbox.h>
+#include <Core/Uuid.h>
+
+#include <glog/logging.h>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+
+namespace PhotoTrack
+{
+  namespace
+  {
+    class WorkerSlot : public boost::noncopyable
+    {
+    private:
+      Orthanc::Semaphore& workers_;
+
+    public:
+      WorkerSlot(Orthanc::Semaphore& workers) : workers_(workers)
+      {
+        workers_.Acquire();
+      }
+
+      ~WorkerSlot()
+      {
+        workers_.Release();
+      }
+    };
+  }
+
+
+  static bool ReadCachedFile(std::string& content,
+                             const std::string& path)
+  {
+    if (!boost::filesystem::is_regular_file(path))
+    {
+      return false;
+    }
+
+    try
+    {
+      Orthanc::Toolbox::ReadFile(content, path);
+      return true;
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      // The entry was concurrently invalidated
+      return false;
+    }
+  }
+
+
+  DerivedImageCache::DerivedImageCache(const std::string& root,
+                                       unsigned int maxWorkers) :
+    root_(root),
+    quality_(85),
+    workers_(maxWorkers == 0 ? 1 : maxWorkers)
+  {
+    boost::filesystem::create_directories(root_);
+  }
+
+
+  void DerivedImageCache::SetJpegQuality(uint8_t quality)
+  {
+    if (quality == 0 || 
+        quality > 100)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    quality_ = quality;
+  }
+
+
+  bool DerivedImageCache::IsSupportedImage(const std::string& mimeType)
+  {
+    return (mimeType == "image/jpeg" ||
+            mimeType == "image/png");
+  }
+
+
+  unsigned int DerivedImageCache::SnapSize(unsigned int size)
+  {
+    static const unsigned int SIZES[] = {
+      64, 128, 160, 256, 320, 480, 640, 800, 1024, 1280, 1600, 2048, 3072, 4096
+    };
+
+    if (size == 0)
+    {
+      return 0;
+    }
+
+    for (size_t i = 0; i < sizeof(SIZES) / sizeof(SIZES[0]); i++)
+    {
+      if (size <= SIZES[i])
+      {
+        return SIZES[i];
+      }
+    }
+
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+
+
+  std::string DerivedImageCache::GetDirectory(const std::string& imageUuid) const
+  {
+    if (!Orthanc::Toolbox::IsUuid(imageUuid))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    boost::filesystem::path path(root_);
+    path /= imageUuid.substr(0, 2);
+    path /= imageUuid.substr(2, 2);
+    path /= imageUuid;
+
+    return path.string();
+  }
+
+
+  std::string DerivedImageCache::GetPath(const std::string& imageUuid,
+                                         unsigned int maxWidth,
+                                         unsigned int maxHeight) const
+  {
+    return (boost::filesystem::path(GetDirectory(imageUuid)) / 
+            (boost::lexical_cast<std::string>(SnapSize(maxWidth)) + "x" + 
+             boost::lexical_cast<std::string>(SnapSize(maxHeight)))).string();
+  }
+
+
+  void DerivedImageCache::Generate(std::string& target,
+                                   DatabaseWrapper& db,
+                                   const Photo& photo,
+                                   unsigned int maxWidth,
+                                   unsigned int maxHeight)
+  {
+    // An empty entry means that the original image must be used
+    target.clear();
+
+    std::string image;
+    db.ReadImage(image, photo);
+
+    JpegReader jpeg;
+    Orthanc::PngReader png;
+    const Orthanc::ImageAccessor* source;
+    bool isScaled = false;
+
+    try
+    {
+      if (photo.GetImageMime() == "image/jpeg")
+      {
+        jpeg.ReadFromMemory(image, maxWidth, maxHeight);
+        isScaled = (jpeg.GetWidth() != jpeg.GetOriginalWidth() ||
+                    jpeg.GetHeight() != jpeg.GetOriginalHeight());
+        source = &jpeg;
+      }
+      else if (photo.GetImageMime() == "image/png")
+      {
+        png.ReadFromMemory(image);
+        source = &png;
+      }
+      else
+      {
+        return;
+      }
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(WARNING) << "Cannot decode image " << photo.GetImageUuid() << ": " << e.What();
+      return;
+    }
+
+    image.clear();
+
+    unsigned int width, height;
+    ImageResampler::ComputeFittingSize(width, height, source->GetWidth(), source->GetHeight(),
+                                       maxWidth, maxHeight);
+
+    Orthanc::ImageBuffer buffer;
+    Orthanc::ImageAccessor resized;
+
+    if (width == source->GetWidth() &&
+        height == source->GetHeight())
+    {
+      if (!isScaled)
+      {
+        return;  // Not larger than the bounding box
+      }
+
+      // The DCT scaling of libjpeg has directly produced the target size
+      resized = *source;
+    }
+    else
+    {
+      if (source->GetFormat() != Orthanc::PixelFormat_Grayscale8 &&
+          source->GetFormat() != Orthanc::PixelFormat_RGB24 &&
+          source->GetFormat() != Orthanc::PixelFormat_RGBA32)
+      {
+        return;   // E.g. 16-bit PNG images
+      }
+
+      buffer.SetFormat(source->GetFormat());
+      buffer.SetWidth(width);
+      buffer.SetHeight(height);
+      resized = buffer.GetAccessor();
+      ImageResampler::Resample(resized, *source, ResamplingFilter_Lanczos3);
+    }
+
+    if (photo.GetImageMime() == "image/jpeg")
+    {
+      JpegWriter writer;
+      writer.SetQuality(quality_);
+      writer.WriteToMemory(target, resized);
+    }
+    else
+    {
+      Orthanc::PngWriter writer;
+      writer.WriteToMemory(target, resized);
+    }
+  }
+
+
+  bool DerivedImageCache::GetResizedImage(std::string& target,
+                                          DatabaseWrapper& db,
+                                          const Photo& photo,
+                                          unsigned int maxWidth,
+                                          unsigned int maxHeight)
+  {
+    maxWidth = SnapSize(maxWidth);
+    maxHeight = SnapSize(maxHeight);
+
+    const std::string path = GetPath(photo.GetImageUuid(), maxWidth, maxHeight);
+
+    if (ReadCachedFile(target, path))
+    {
+      return !target.empty();
+    }
+
+    {
+      // Wait for the concurrent generation of the same entry, if any
+      boost::mutex::scoped_lock lock(mutex_);
+
+      while (pending_.find(path) != pending_.end())
+      {
+        generated_.wait(lock);
+      }
+
+      if (ReadCachedFile(target, path))
+      {
+        return !target.empty();
+      }
+
+      pending_.insert(path);
+    }
+
+    try
+    {
+      {
+        WorkerSlot slot(workers_);
+        Generate(target, db, photo, maxWidth, maxHeight);
+      }
+
+      // Write to a temporary file, then atomically move it into place
+      boost::filesystem::create_directories(boost::filesystem::path(path).parent_path());
+
+      std::string tmp = path + "." + Orthanc::Toolbox::GenerateUuid() + ".tmp";
+      Orthanc::Toolbox::WriteFile(target, tmp);
+
+      boost::system::error_code error;
+      boost::filesystem::rename(tmp, path, error);
+      if (error)
+      {
+        boost::filesystem::remove(tmp, error);
+      }
+    }
+    catch (...)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      pending_.erase(path);
+      generated_.notify_all();
+      throw;
+    }
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      pending_.erase(path);
+      generated_.notify_all();
+    }
+
+    return !target.empty();
+  }
+
+
+  void DerivedImageCache::Invalidate(const std::string& imageUuid)
+  {
+    boost::system::error_code error;
+    boost::filesystem::remove_all(GetDirectory(imageUuid), error);
+
+    if (error)
+    {
+      LOG(ERROR) << "Cannot remove the derived images of " << imageUuid << ": " << error.message();
+    }
+  }
+}
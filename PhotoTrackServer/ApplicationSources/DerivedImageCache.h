@@ -0,0 +1,106 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include "Database.h"
+#include "IImageListener.h"
+
+#include <Core/MultiThreading/Semaphore.h>
+
+#include <boost/thread.hpp>
+#include <set>
+
+namespace PhotoTrack
+{
+  /**
+   * Persistent cache of the downscaled versions of the images, that
+   * are generated on demand. The entries are stored in the
+   * filesystem, keyed by the UUID of the original blob and by the
+   * requested bounding box. As the blobs are immutable, the entries
+   * never become stale: They are removed when the database detaches
+   * the blob from its photo. At most "maxWorkers" images are decoded
+   * and resampled at once, and concurrent requests for the same
+   * entry are served by a single generation. The requested sizes are
+   * rounded up to a fixed set of bounding boxes, which bounds the
+   * number of entries per image whatever the clients ask for.
+   **/
+  class DerivedImageCache : public IImageListener
+  {
+  private:
+    std::string                root_;
+    uint8_t                    quality_;
+    Orthanc::Semaphore         workers_;
+
+    boost::mutex               mutex_;
+    boost::condition_variable  generated_;
+    std::set<std::string>      pending_;
+
+    std::string GetDirectory(const std::string& imageUuid) const;
+
+    void Generate(std::string& target,
+                  DatabaseWrapper& db,
+                  const Photo& photo,
+                  unsigned int maxWidth,
+                  unsigned int maxHeight);
+
+  public:
+    DerivedImageCache(const std::string& root,
+                      unsigned int maxWorkers);
+
+    void SetJpegQuality(uint8_t quality);
+
+    const std::string& GetRoot() const
+    {
+      return root_;
+    }
+
+    static bool IsSupportedImage(const std::string& mimeType);
+
+    // Rounds a requested width or height up to the nearest size that
+    // is cached (0 means unbounded, and is left as such)
+    static unsigned int SnapSize(unsigned int size);
+
+    std::string GetPath(const std::string& imageUuid,
+                        unsigned int maxWidth,
+                        unsigned int maxHeight) const;
+
+    // The bounding box is snapped with "SnapSize()". Returns "false"
+    // if the image already fits within the snapped bounding box (or
+    // cannot be decoded): The original image must
+    // be sent in this case. Otherwise, the downscaled image has the
+    // same MIME type as the original.
+    bool GetResizedImage(std::string& target,
+                         DatabaseWrapper& db,
+                         const Photo& photo,
+                         unsigned int maxWidth,
+                         unsigned int maxHeight);
+
+    void Invalidate(const std::string& imageUuid);
+
+    virtual void SignalNewImage(const std::string& imageUuid)
+    {
+    }
+
+    virtual void SignalImageDeleted(const std::string& imageUuid)
+    {
+      Invalidate(imageUuid);
+    }
+  };
+}
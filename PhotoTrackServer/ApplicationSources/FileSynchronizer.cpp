@@ -0,0 +1,275 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "FileSynchronizer.h"
+
+#include <Core/OrthancException.h>
+
+#include <glog/logging.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace PhotoTrack
+{
+  struct FileSynchronizer::Group
+  {
+    std::vector<int>       files_;
+    std::set<std::string>  directories_;
+    bool                   done_;
+    bool                   success_;
+
+    Group() : done_(false), success_(false)
+    {
+    }
+  };
+
+
+  bool FileSynchronizer::SyncFile(int fd)
+  {
+    for (;;)
+    {
+#if defined(_WIN32)
+      int error = _commit(fd);
+#elif defined(__linux__)
+      int error = fdatasync(fd);
+#else
+      int error = fsync(fd);
+#endif
+
+      if (error == 0)
+      {
+        return true;
+      }
+      else if (errno != EINTR)
+      {
+        return false;
+      }
+    }
+  }
+
+
+  bool FileSynchronizer::SyncDirectory(const std::string& directory)
+  {
+#if defined(_WIN32)
+    // The directory entries cannot be flushed explicitly on Windows
+    return true;
+#else
+    int fd = open(directory.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+      return false;
+    }
+
+    bool success = SyncFile(fd);
+    close(fd);
+    return success;
+#endif
+  }
+
+
+  static bool SyncAndClose(int fd)
+  {
+    bool success = FileSynchronizer::SyncFile(fd);
+    close(fd);
+    return success;
+  }
+
+
+  DurabilityPolicy StringToDurabilityPolicy(const std::string& policy)
+  {
+    if (policy == "PerWrite")
+    {
+      return DurabilityPolicy_PerWrite;
+    }
+    else if (policy == "Grouped")
+    {
+      return DurabilityPolicy_Grouped;
+    }
+    else if (policy == "OsBuffered")
+    {
+      return DurabilityPolicy_OsBuffered;
+    }
+    else
+    {
+      LOG(ERROR) << "Unknown durability policy: " << policy;
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+#if defined(__linux__)
+  // Flushes each filesystem that contains one of the directories
+  // once, which writes back the data and the metadata of all the
+  // files of the group in a single pass
+  static bool SyncFilesystems(const std::set<std::string>& directories)
+  {
+    bool success = true;
+    std::set<dev_t> done;
+
+    for (std::set<std::string>::const_iterator
+           it = directories.begin(); it != directories.end(); ++it)
+    {
+      struct stat info;
+      if (stat(it->c_str(), &info) != 0)
+      {
+        success = false;
+      }
+      else if (done.find(info.st_dev) == done.end())
+      {
+        int fd = open(it->c_str(), O_RDONLY);
+        if (fd < 0 ||
+            syncfs(fd) != 0)
+        {
+          success = false;
+        }
+
+        if (fd >= 0)
+        {
+          close(fd);
+        }
+
+        done.insert(info.st_dev);
+      }
+    }
+
+    return success;
+  }
+#endif
+
+
+  void FileSynchronizer::Flush(Group& group)
+  {
+    bool success = true;
+
+#if defined(__linux__)
+    // A single "syncfs()" per filesystem replaces one "fdatasync()"
+    // per file, which was issued sequentially by the leader
+    success = SyncFilesystems(group.directories_);
+
+    for (size_t i = 0; i < group.files_.size(); i++)
+    {
+      close(group.files_[i]);
+    }
+
+#else
+    // Elsewhere, there is no way to flush a filesystem at once: Each
+    // file is synced on its own, then each distinct directory
+    for (size_t i = 0; i < group.files_.size(); i++)
+    {
+      if (!SyncAndClose(group.files_[i]))
+      {
+        success = false;
+      }
+    }
+
+    for (std::set<std::string>::const_iterator
+           it = group.directories_.begin(); it != group.directories_.end(); ++it)
+    {
+      if (!SyncDirectory(*it))
+      {
+        success = false;
+      }
+    }
+#endif
+
+    group.success_ = success;
+  }
+
+
+  FileSynchronizer::FileSynchronizer(DurabilityPolicy policy) :
+    policy_(policy),
+    flushing_(false)
+  {
+  }
+
+
+  void FileSynchronizer::Commit(int fd,
+                                const std::string& directory)
+  {
+    switch (policy_)
+    {
+      case DurabilityPolicy_OsBuffered:
+        close(fd);
+        return;
+
+      case DurabilityPolicy_PerWrite:
+        if (!SyncAndClose(fd) ||
+            !SyncDirectory(directory))
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+        }
+        return;
+
+      case DurabilityPolicy_Grouped:
+        break;
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (current_.get() == NULL)
+    {
+      current_.reset(new Group);
+    }
+
+    boost::shared_ptr<Group> group = current_;
+    group->files_.push_back(fd);
+    group->directories_.insert(directory);
+
+    while (!group->done_)
+    {
+      if (flushing_)
+      {
+        // Another thread is flushing an older group: Wait for it to
+        // complete, then our group will be flushed at once
+        flushed_.wait(lock);
+      }
+      else
+      {
+        // Become the leader of the current group
+        boost::shared_ptr<Group> toFlush = current_;
+        current_.reset();
+        flushing_ = true;
+
+        lock.unlock();
+        Flush(*toFlush);
+        lock.lock();
+
+        toFlush->done_ = true;
+        flushing_ = false;
+        flushed_.notify_all();
+      }
+    }
+
+    if (!group->success_)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+    }
+  }
+}
@@ -0,0 +1,88 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace PhotoTrack
+{
+  enum DurabilityPolicy
+  {
+    // Each blob is flushed to the disk on its own
+    DurabilityPolicy_PerWrite,
+
+    // The blobs that are written concurrently are flushed together.
+    // On Linux, a group is flushed by one "syncfs()" per filesystem;
+    // elsewhere, each file of the group is still synced on its own.
+    DurabilityPolicy_Grouped,
+
+    // The flushing is left to the operating system (the default, as
+    // with the former Orthanc::FileStorage)
+    DurabilityPolicy_OsBuffered
+  };
+
+  DurabilityPolicy StringToDurabilityPolicy(const std::string& policy);
+
+
+  /**
+   * Makes the newly written files durable before the corresponding
+   * metadata is committed to the database. In the grouped mode, the
+   * threads that commit a file while another thread is flushing to
+   * the disk are gathered, then flushed at once by the first of them.
+   **/
+  class FileSynchronizer : public boost::noncopyable
+  {
+  private:
+    struct Group;
+
+    DurabilityPolicy          policy_;
+    boost::mutex              mutex_;
+    boost::condition_variable flushed_;
+    bool                      flushing_;
+    boost::shared_ptr<Group>  current_;
+
+    static void Flush(Group& group);
+
+  public:
+    FileSynchronizer(DurabilityPolicy policy);
+
+    DurabilityPolicy GetPolicy() const
+    {
+      return policy_;
+    }
+
+    // Flushes one file, or the entries of one directory, to the disk
+    // whatever the policy. Returns "false" on error.
+    static bool SyncFile(int fd);
+
+    static bool SyncDirectory(const std::string& directory);
+
+    // Takes the ownership of the file descriptor "fd", that has just
+    // been written, and returns once the file and its parent
+    // "directory" are durable (depending on the policy)
+    void Commit(int fd,
+                const std::string& directory);
+  };
+}
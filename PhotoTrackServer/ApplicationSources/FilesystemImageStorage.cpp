@@ -0,0 +1,286 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "FilesystemImageStorage.h"
+
+#include <Core/OrthancException.h>
+#include <Core/Toolbox.h>
+#include <Core/Uuid.h>
+
+#include <boost/filesystem.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#if !defined(O_BINARY)
+#define O_BINARY 0
+#endif
+
+namespace
+{
+  // Streams a blob from its file, using "pread()" so that the reads
+  // need no seeking
+  class FileBlobReader : public PhotoTrack::IBlobReader
+  {
+  private:
+    int       fd_;
+    uint64_t  size_;
+
+  public:
+    FileBlobReader(const std::string& path)
+    {
+      fd_ = open(path.c_str(), O_RDONLY | O_BINARY);
+      if (fd_ < 0)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile);
+      }
+
+      struct stat info;
+      if (fstat(fd_, &info) != 0)
+      {
+        close(fd_);
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile);
+      }
+
+      size_ = static_cast<uint64_t>(info.st_size);
+    }
+
+    virtual ~FileBlobReader()
+    {
+      close(fd_);
+    }
+
+    virtual uint64_t GetSize()
+    {
+      return size_;
+    }
+
+    virtual void Read(void* target,
+                      size_t size,
+                      uint64_t offset)
+    {
+      if (offset > size_ ||
+          size > size_ - offset)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+
+#if defined(_WIN32)
+      if (_lseeki64(fd_, offset, SEEK_SET) < 0)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+      }
+#endif
+
+      uint8_t* p = reinterpret_cast<uint8_t*>(target);
+      while (size > 0)
+      {
+#if defined(_WIN32)
+        int n = _read(fd_, p, static_cast<unsigned int>(size));
+#else
+        ssize_t n = pread(fd_, p, size, offset);
+#endif
+
+        if (n <= 0)
+        {
+          if (n < 0 && errno == EINTR)
+          {
+            continue;
+          }
+
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+        }
+
+        p += n;
+        offset += n;
+        size -= n;
+      }
+    }
+  };
+}
+
+
+namespace PhotoTrack
+{
+  FilesystemImageStorage::FilesystemImageStorage(const std::string& root,
+                                                 DurabilityPolicy policy) : 
+    root_(root),
+    storage_(root),
+    synchronizer_(policy)
+  {
+  }
+
+
+  std::string FilesystemImageStorage::Create(const void* content,
+                                             size_t size)
+  {
+    // The file is written by hand instead of through
+    // "Orthanc::FileStorage", so as to control its flushing
+    std::string uuid = Orthanc::Toolbox::GenerateUuid();
+    std::string path = GetPath(uuid);
+    std::string directory = boost::filesystem::path(path).parent_path().string();
+
+    boost::filesystem::create_directories(directory);
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+    }
+
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(content);
+    while (size > 0)
+    {
+#if defined(_WIN32)
+      int n = _write(fd, p, static_cast<unsigned int>(size));
+#else
+      ssize_t n = write(fd, p, size);
+#endif
+
+      if (n <= 0)
+      {
+        if (n < 0 && errno == EINTR)
+        {
+          continue;
+        }
+
+        close(fd);
+        boost::filesystem::remove(path);
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+      }
+
+      p += n;
+      size -= n;
+    }
+
+    try
+    {
+      synchronizer_.Commit(fd, directory);
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      boost::filesystem::remove(path);
+      throw;
+    }
+
+    return uuid;
+  }
+
+
+  std::string FilesystemImageStorage::CreateFromFile(const std::string& source)
+  {
+    std::string uuid = Orthanc::Toolbox::GenerateUuid();
+    std::string path = GetPath(uuid);
+    std::string directory = boost::filesystem::path(path).parent_path().string();
+
+    boost::filesystem::create_directories(directory);
+
+    boost::system::error_code error;
+    boost::filesystem::rename(source, path, error);
+    if (error)
+    {
+      // Typically, the file is on another filesystem
+      return IImageStorage::CreateFromFile(source);
+    }
+
+    // The file itself might not be flushed yet
+    int fd = open(path.c_str(), O_RDWR | O_BINARY);
+    if (fd < 0)
+    {
+      boost::filesystem::remove(path, error);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+    }
+
+    try
+    {
+      synchronizer_.Commit(fd, directory);
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      boost::filesystem::remove(path, error);
+      throw;
+    }
+
+    return uuid;
+  }
+
+
+  void FilesystemImageStorage::Read(std::string& content,
+                                    const std::string& uuid)
+  {
+    storage_.ReadFile(content, uuid);
+  }
+
+
+  void FilesystemImageStorage::Remove(const std::string& uuid)
+  {
+    storage_.Remove(uuid);
+  }
+
+
+  bool FilesystemImageStorage::Exists(const std::string& uuid)
+  {
+    return (Orthanc::Toolbox::IsUuid(uuid) &&
+            Orthanc::Toolbox::IsExistingFile(GetPath(uuid)));
+  }
+
+
+  IBlobReader* FilesystemImageStorage::OpenBlob(const std::string& uuid)
+  {
+    return new FileBlobReader(GetPath(uuid));
+  }
+
+
+  bool FilesystemImageStorage::LookupFile(std::string& relativePath,
+                                          const std::string& uuid)
+  {
+    if (Exists(uuid))
+    {
+      relativePath = uuid.substr(0, 2) + "/" + uuid.substr(2, 2) + "/" + uuid;
+      return true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+
+  std::string FilesystemImageStorage::GetPath(const std::string& uuid) const
+  {
+    if (!Orthanc::Toolbox::IsUuid(uuid))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    boost::filesystem::path path(root_);
+    path /= uuid.substr(0, 2);
+    path /= uuid.substr(2, 2);
+    path /= uuid;
+
+    return path.string();
+  }
+}
@@ -0,0 +1,80 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include "FileSynchronizer.h"
+#include "IImageStorage.h"
+
+#include <Core/FileStorage/FileStorage.h>
+
+namespace PhotoTrack
+{
+  /**
+   * Storage area that writes one file per blob, using the hashed
+   * directory tree of Orthanc. The durability policy controls how
+   * the new files are flushed to the disk.
+   **/
+  class FilesystemImageStorage : public IImageStorage
+  {
+  private:
+    std::string           root_;
+    Orthanc::FileStorage  storage_;
+    FileSynchronizer      synchronizer_;
+
+  public:
+    FilesystemImageStorage(const std::string& root,
+                           DurabilityPolicy policy = DurabilityPolicy_OsBuffered);
+
+    using IImageStorage::Create;
+
+    virtual std::string Create(const void* content,
+                               size_t size);
+
+    // The file is moved into the storage area if it lies on the same
+    // filesystem, which avoids copying it
+    virtual std::string CreateFromFile(const std::string& path);
+
+    virtual void Read(std::string& content,
+                      const std::string& uuid);
+
+    virtual void Remove(const std::string& uuid);
+
+    virtual bool Exists(const std::string& uuid);
+
+    virtual IBlobReader* OpenBlob(const std::string& uuid);
+
+    virtual bool LookupFile(std::string& relativePath,
+                            const std::string& uuid);
+
+    DurabilityPolicy GetDurabilityPolicy() const
+    {
+      return synchronizer_.GetPolicy();
+    }
+
+    const std::string& GetRoot() const
+    {
+      return root_;
+    }
+
+    // Path to the file containing the given blob, following the
+    // layout of "Orthanc::FileStorage"
+    std::string GetPath(const std::string& uuid) const;
+  };
+}
@@ -0,0 +1,110 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include "IImageStorage.h"
+
+#include <boost/filesystem.hpp>
+
+namespace PhotoTrack
+{
+  /**
+   * Dispatches the blobs between two storage areas depending on
+   * their size: Small blobs (e.g. thumbnails or text notes) go to a
+   * storage area that is optimized for them (typically packfiles),
+   * whereas large images keep the one-file-per-blob layout.
+   **/
+  class HybridImageStorage : public IImageStorage
+  {
+  private:
+    IImageStorage&  small_;
+    IImageStorage&  large_;
+    size_t          threshold_;
+
+    IImageStorage& Locate(const std::string& uuid)
+    {
+      return small_.Exists(uuid) ? small_ : large_;
+    }
+
+  public:
+    HybridImageStorage(IImageStorage& small,
+                       IImageStorage& large,
+                       size_t threshold) :
+      small_(small),
+      large_(large),
+      threshold_(threshold)
+    {
+    }
+
+    using IImageStorage::Create;
+
+    virtual std::string Create(const void* content,
+                               size_t size)
+    {
+      if (size <= threshold_)
+      {
+        return small_.Create(content, size);
+      }
+      else
+      {
+        return large_.Create(content, size);
+      }
+    }
+
+    virtual std::string CreateFromFile(const std::string& path)
+    {
+      if (boost::filesystem::file_size(path) <= threshold_)
+      {
+        return small_.CreateFromFile(path);
+      }
+      else
+      {
+        return large_.CreateFromFile(path);
+      }
+    }
+
+    virtual void Read(std::string& content,
+                      const std::string& uuid)
+    {
+      Locate(uuid).Read(content, uuid);
+    }
+
+    virtual void Remove(const std::string& uuid)
+    {
+      Locate(uuid).Remove(uuid);
+    }
+
+    virtual bool Exists(const std::string& uuid)
+    {
+      return small_.Exists(uuid) || large_.Exists(uuid);
+    }
+
+    virtual IBlobReader* OpenBlob(const std::string& uuid)
+    {
+      return Locate(uuid).OpenBlob(uuid);
+    }
+
+    virtual bool LookupFile(std::string& relativePath,
+                            const std::string& uuid)
+    {
+      return Locate(uuid).LookupFile(relativePath, uuid);
+    }
+  };
+}
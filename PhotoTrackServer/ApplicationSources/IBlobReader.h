@@ -0,0 +1,48 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <stdint.h>
+#include <string>
+
+namespace PhotoTrack
+{
+  /**
+   * Random access to the content of one blob of an image storage,
+   * without loading it entirely in memory. The readers must remain
+   * usable even if the blob is removed from the storage area in the
+   * meantime.
+   **/
+  class IBlobReader : public boost::noncopyable
+  {
+  public:
+    virtual ~IBlobReader()
+    {
+    }
+
+    virtual uint64_t GetSize() = 0;
+
+    // Reads "size" bytes starting at "offset" within the blob
+    virtual void Read(void* target,
+                      size_t size,
+                      uint64_t offset) = 0;
+  };
+}
@@ -0,0 +1,45 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <string>
+
+namespace PhotoTrack
+{
+  /**
+   * Observer of the blobs that are attached to, or detached from the
+   * photos by the database. The callbacks are invoked while the
+   * database is locked, so they must return quickly. A blob that is
+   * shared by several photos is only signaled when it is stored, and
+   * once its last photo is gone.
+   **/
+  class IImageListener : public boost::noncopyable
+  {
+  public:
+    virtual ~IImageListener()
+    {
+    }
+
+    virtual void SignalNewImage(const std::string& imageUuid) = 0;
+
+    virtual void SignalImageDeleted(const std::string& imageUuid) = 0;
+  };
+}
@@ -0,0 +1,47 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "IImageStorage.h"
+
+#include "MemoryBlobReader.h"
+
+#include <Core/Toolbox.h>
+#include <boost/filesystem.hpp>
+
+namespace PhotoTrack
+{
+  IBlobReader* IImageStorage::OpenBlob(const std::string& uuid)
+  {
+    std::string content;
+    Read(content, uuid);
+    return new MemoryBlobReader(content);
+  }
+
+
+  std::string IImageStorage::CreateFromFile(const std::string& path)
+  {
+    std::string content;
+    Orthanc::Toolbox::ReadFile(content, path);
+
+    std::string uuid = Create(content);
+    boost::filesystem::remove(path);
+    return uuid;
+  }
+}
@@ -0,0 +1,75 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include "IBlobReader.h"
+
+#include <boost/noncopyable.hpp>
+#include <string>
+
+namespace PhotoTrack
+{
+  /**
+   * Interface to the area where the binary content of the images
+   * (the "blobs") is stored. Each blob is identified by an UUID that
+   * is generated by the storage area. The implementations must be
+   * thread-safe.
+   **/
+  class IImageStorage : public boost::noncopyable
+  {
+  public:
+    virtual ~IImageStorage()
+    {
+    }
+
+    virtual std::string Create(const void* content,
+                               size_t size) = 0;
+
+    virtual void Read(std::string& content,
+                      const std::string& uuid) = 0;
+
+    virtual void Remove(const std::string& uuid) = 0;
+
+    virtual bool Exists(const std::string& uuid) = 0;
+
+    // Opens the blob for streaming. By default, the blob is read into
+    // memory: The storage areas that can do better override this.
+    virtual IBlobReader* OpenBlob(const std::string& uuid);
+
+    // Stores the content of a file, which is taken over by the
+    // storage area. By default, the file is read into memory, then
+    // removed: The storage areas that can do better override this.
+    virtual std::string CreateFromFile(const std::string& path);
+
+    // If the blob is stored as a plain file of the filesystem storage
+    // area, gives the path to this file relative to the root of this
+    // area. This is used to offload the transfers to a front proxy.
+    virtual bool LookupFile(std::string& relativePath,
+                            const std::string& uuid)
+    {
+      return false;
+    }
+
+    std::string Create(const std::string& content)
+    {
+      return Create(content.empty() ? NULL : content.c_str(), content.size());
+    }
+  };
+}
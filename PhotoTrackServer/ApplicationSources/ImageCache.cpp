@@ -0,0 +1,265 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "ImageCache.h"
+
+#include <Core/OrthancException.h>
+#include <boost/functional/hash.hpp>
+
+namespace PhotoTrack
+{
+  class ImageCache::Shard : public boost::noncopyable
+  {
+  private:
+    typedef std::list<std::string>  Recency;   // Most recently used first
+
+    struct Entry
+    {
+      Content            content_;
+      Recency::iterator  recency_;
+    };
+
+    typedef std::map<std::string, Entry>  Entries;
+
+    boost::mutex  mutex_;
+    Entries       entries_;
+    Recency       recency_;
+    size_t        size_;
+    size_t        budget_;
+    uint64_t      generation_;   // Incremented by each invalidation
+    uint64_t      hits_;
+    uint64_t      misses_;
+
+    void RemoveInternal(Entries::iterator it)
+    {
+      size_ -= it->second.content_->size();
+      recency_.erase(it->second.recency_);
+      entries_.erase(it);
+    }
+
+  public:
+    Shard(size_t budget) :
+      size_(0),
+      budget_(budget),
+      generation_(0),
+      hits_(0),
+      misses_(0)
+    {
+    }
+
+    size_t GetBudget() const
+    {
+      return budget_;
+    }
+
+    uint64_t GetGeneration()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return generation_;
+    }
+
+    bool Lookup(Content& content,
+                uint64_t& generation,
+                const std::string& key)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Entries::iterator it = entries_.find(key);
+      if (it == entries_.end())
+      {
+        misses_++;
+        generation = generation_;
+        return false;
+      }
+
+      // Move the entry to the front of the LRU list
+      recency_.splice(recency_.begin(), recency_, it->second.recency_);
+
+      hits_++;
+      content = it->second.content_;
+      return true;
+    }
+
+    void Store(const std::string& key,
+               const Content& content,
+               uint64_t generation)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (generation != generation_)
+      {
+        // An entry of this shard was invalidated since the miss: The
+        // content might come from a blob that is removed by now
+        return;
+      }
+
+      Entries::iterator it = entries_.find(key);
+      if (it != entries_.end())
+      {
+        RemoveInternal(it);
+      }
+
+      // Evict the least recently used entries
+      while (!recency_.empty() &&
+             size_ + content->size() > budget_)
+      {
+        RemoveInternal(entries_.find(recency_.back()));
+      }
+
+      recency_.push_front(key);
+
+      Entry& entry = entries_[key];
+      entry.content_ = content;
+      entry.recency_ = recency_.begin();
+      size_ += content->size();
+    }
+
+    void Invalidate(const std::string& key)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      generation_++;
+
+      Entries::iterator it = entries_.find(key);
+      if (it != entries_.end())
+      {
+        RemoveInternal(it);
+      }
+    }
+
+    void AddStatistics(uint64_t& hits,
+                       uint64_t& misses,
+                       uint64_t& size,
+                       uint64_t& count)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      hits += hits_;
+      misses += misses_;
+      size += size_;
+      count += entries_.size();
+    }
+  };
+
+
+  ImageCache::Shard& ImageCache::GetShard(const std::string& key)
+  {
+    boost::hash<std::string> hasher;
+    return *shards_[hasher(key) % shards_.size()];
+  }
+
+
+  ImageCache::ImageCache(size_t budget,
+                         size_t maxEntrySize,
+                         unsigned int shardsCount) :
+    maxEntrySize_(maxEntrySize)
+  {
+    if (shardsCount == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    shards_.resize(shardsCount);
+    for (unsigned int i = 0; i < shardsCount; i++)
+    {
+      shards_[i] = new Shard(budget / shardsCount);
+    }
+  }
+
+
+  ImageCache::~ImageCache()
+  {
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+      delete shards_[i];
+    }
+  }
+
+
+  bool ImageCache::IsAdmissible(size_t size) const
+  {
+    // An entry must also fit in its shard
+    return (size <= maxEntrySize_ &&
+            size <= shards_[0]->GetBudget());
+  }
+
+
+  bool ImageCache::Lookup(Content& content,
+                          Generation& generation,
+                          const std::string& key)
+  {
+    return GetShard(key).Lookup(content, generation, key);
+  }
+
+
+  bool ImageCache::Lookup(Content& content,
+                          const std::string& key)
+  {
+    Generation generation;
+    return Lookup(content, generation, key);
+  }
+
+
+  void ImageCache::Store(const std::string& key,
+                         const Content& content,
+                         Generation generation)
+  {
+    if (content.get() == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    if (IsAdmissible(content->size()))
+    {
+      GetShard(key).Store(key, content, generation);
+    }
+  }
+
+
+  void ImageCache::Store(const std::string& key,
+                         const Content& content)
+  {
+    Shard& shard = GetShard(key);
+    Store(key, content, shard.GetGeneration());
+  }
+
+
+  void ImageCache::Invalidate(const std::string& key)
+  {
+    GetShard(key).Invalidate(key);
+  }
+
+
+  void ImageCache::GetStatistics(Json::Value& target)
+  {
+    uint64_t hits = 0, misses = 0, size = 0, count = 0;
+
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+      shards_[i]->AddStatistics(hits, misses, size, count);
+    }
+
+    target = Json::objectValue;
+    target["Hits"] = static_cast<Json::UInt64>(hits);
+    target["Misses"] = static_cast<Json::UInt64>(misses);
+    target["Size"] = static_cast<Json::UInt64>(size);
+    target["MaxSize"] = static_cast<Json::UInt64>(shards_[0]->GetBudget() * shards_.size());
+    target["Count"] = static_cast<Json::UInt64>(count);
+  }
+}
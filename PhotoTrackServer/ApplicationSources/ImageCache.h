@@ -0,0 +1,95 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <json/value.h>
+#include <list>
+#include <map>
+#include <stdint.h>
+#include <vector>
+
+namespace PhotoTrack
+{
+  /**
+   * Memory cache of blobs, with a bounded budget in bytes. The
+   * entries are spread over several shards, each with its own mutex
+   * and its own LRU eviction, so that the concurrent requests do not
+   * contend on a single lock. The blobs above a given size are not
+   * admitted in the cache, so that a few large images cannot evict
+   * all the hot ones.
+   **/
+  class ImageCache : public boost::noncopyable
+  {
+  public:
+    typedef boost::shared_ptr<const std::string>  Content;
+    typedef uint64_t                              Generation;
+
+  private:
+    class Shard;
+
+    std::vector<Shard*>  shards_;
+    size_t               maxEntrySize_;
+
+    Shard& GetShard(const std::string& key);
+
+  public:
+    ImageCache(size_t budget,
+               size_t maxEntrySize,
+               unsigned int shardsCount = 16);
+
+    ~ImageCache();
+
+    size_t GetMaxEntrySize() const
+    {
+      return maxEntrySize_;
+    }
+
+    bool IsAdmissible(size_t size) const;
+
+    // Returns "false" on cache misses
+    bool Lookup(Content& content,
+                const std::string& key);
+
+    // On a miss, "generation" receives a token to be given back to
+    // "Store()": The content is then only cached if the key was not
+    // invalidated in the meantime (the invalidations are tracked per
+    // shard), which prevents a concurrent removal of the blob from
+    // leaving a stale entry behind.
+    bool Lookup(Content& content,
+                Generation& generation,
+                const std::string& key);
+
+    void Store(const std::string& key,
+               const Content& content);
+
+    void Store(const std::string& key,
+               const Content& content,
+               Generation generation);
+
+    void Invalidate(const std::string& key);
+
+    // Total number of hits and misses, used and maximum size in
+    // bytes, number of entries
+    void GetStatistics(Json::Value& target);
+  };
+}
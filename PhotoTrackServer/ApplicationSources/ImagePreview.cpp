@@ -0,0 +1,156 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "ImagePreview.h"
+
+#include "Base64.h"
+#include "ImageResampler.h"
+#include "JpegReader.h"
+#include "PerceptualHash.h"
+
+#include <Core/ImageFormats/ImageBuffer.h>
+#include <Core/ImageFormats/PngReader.h>
+#include <Core/ImageFormats/PngWriter.h>
+#include <Core/OrthancException.h>
+
+#include <glog/logging.h>
+
+namespace PhotoTrack
+{
+  const unsigned int ImagePreview::PREVIEW_SIZE;
+
+  static bool Encode(std::string& preview,
+                     std::string& perceptualHash,
+                     const Orthanc::ImageAccessor& source)
+  {
+    if (source.GetFormat() != Orthanc::PixelFormat_Grayscale8 &&
+        source.GetFormat() != Orthanc::PixelFormat_RGB24 &&
+        source.GetFormat() != Orthanc::PixelFormat_RGBA32)
+    {
+      return false;   // E.g. 16-bit PNG images
+    }
+
+    unsigned int width, height;
+    ImageResampler::ComputeFittingSize(width, height, source.GetWidth(), source.GetHeight(),
+                                       ImagePreview::PREVIEW_SIZE, ImagePreview::PREVIEW_SIZE);
+
+    if (width == 0 || height == 0)
+    {
+      return false;
+    }
+
+    // The box filter averages the whole source, which is the blur
+    Orthanc::ImageBuffer buffer;
+    buffer.SetFormat(source.GetFormat());
+    buffer.SetWidth(width);
+    buffer.SetHeight(height);
+
+    Orthanc::ImageAccessor resized = buffer.GetAccessor();
+    ImageResampler::Resample(resized, source, ResamplingFilter_Area);
+
+    std::string encoded;
+    Orthanc::PngWriter writer;
+    writer.WriteToMemory(encoded, resized);
+
+    Base64::Encode(preview, encoded);
+
+    // The DCT scaling of the JPEG images keeps enough details for the
+    // 9x8 thumbnail of the hash
+    uint64_t hash;
+    if (PerceptualHash::Compute(hash, source))
+    {
+      perceptualHash = PerceptualHash::Format(hash);
+    }
+    else
+    {
+      perceptualHash.clear();
+    }
+
+    return true;
+  }
+
+
+  bool ImagePreview::Create(std::string& preview,
+                            std::string& perceptualHash,
+                            const void* image,
+                            size_t size,
+                            const std::string& mimeType)
+  {
+    JpegReader jpeg;
+    Orthanc::PngReader png;
+
+    try
+    {
+      if (mimeType == "image/jpeg")
+      {
+        // The DCT scaling divides the cost of the decoding by up to 64
+        jpeg.ReadFromMemory(image, size, PREVIEW_SIZE, PREVIEW_SIZE);
+        return Encode(preview, perceptualHash, jpeg);
+      }
+      else if (mimeType == "image/png")
+      {
+        png.ReadFromMemory(image, size);
+        return Encode(preview, perceptualHash, png);
+      }
+      else
+      {
+        return false;
+      }
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(WARNING) << "Cannot compute the preview of an image: " << e.What();
+      return false;
+    }
+  }
+
+
+  bool ImagePreview::CreateFromFile(std::string& preview,
+                                    std::string& perceptualHash,
+                                    const std::string& path,
+                                    const std::string& mimeType)
+  {
+    JpegReader jpeg;
+    Orthanc::PngReader png;
+
+    try
+    {
+      if (mimeType == "image/jpeg")
+      {
+        jpeg.ReadFromFile(path, PREVIEW_SIZE, PREVIEW_SIZE);
+        return Encode(preview, perceptualHash, jpeg);
+      }
+      else if (mimeType == "image/png")
+      {
+        png.ReadFromFile(path.c_str());
+        return Encode(preview, perceptualHash, png);
+      }
+      else
+      {
+        return false;
+      }
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(WARNING) << "Cannot compute the preview of an image: " << e.What();
+      return false;
+    }
+  }
+}
@@ -0,0 +1,64 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include <stddef.h>
+#include <string>
+
+namespace PhotoTrack
+{
+  /**
+   * Tiny previews of the images, that are embedded in the listings of
+   * the photos so that the clients can paint the page before the
+   * thumbnails are loaded. A preview is a PNG image whose longest
+   * side is PREVIEW_SIZE pixels: Once stretched by the browser, it
+   * gives a blurred version of the photo for a few hundred bytes.
+   * The perceptual hash of the image (cf. PerceptualHash) is computed
+   * from the same decoding, as 16 hexadecimal digits.
+   **/
+  class ImagePreview
+  {
+  public:
+    static const unsigned int PREVIEW_SIZE = 16;
+
+    // Computes the preview of a JPEG or PNG image, encoded in base64,
+    // together with its perceptual hash. Returns "false" if the image
+    // cannot be decoded.
+    static bool Create(std::string& preview,
+                       std::string& perceptualHash,
+                       const void* image,
+                       size_t size,
+                       const std::string& mimeType);
+
+    static bool Create(std::string& preview,
+                       std::string& perceptualHash,
+                       const std::string& image,
+                       const std::string& mimeType)
+    {
+      return Create(preview, perceptualHash, image.empty() ? NULL : image.c_str(), image.size(), mimeType);
+    }
+
+    // Same as above, decoding the image directly from a file
+    static bool CreateFromFile(std::string& preview,
+                               std::string& perceptualHash,
+                               const std::string& path,
+                               const std::string& mimeType);
+  };
+}
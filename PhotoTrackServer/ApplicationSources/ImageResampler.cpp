@@ -0,0 +1,652 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "ImageResampler.h"
+
+#include "CpuFeatures.h"
+
+#include <Core/OrthancException.h>
+
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+namespace PhotoTrack
+{
+  namespace
+  {
+    // The weights of the filters are fixed-point numbers, whose sum
+    // is exactly (1 << WEIGHT_BITS)
+    static const int WEIGHT_BITS = 14;
+
+    // Padding at the end of the intermediate rows, as the SIMD
+    // horizontal kernel reads 4 bytes per pixel
+    static const unsigned int ROW_PADDING = 16;
+
+    static const double PI = 3.14159265358979323846;
+
+
+    double Sinc(double x)
+    {
+      if (std::fabs(x) < 1e-9)
+      {
+        return 1.0;
+      }
+      else
+      {
+        x *= PI;
+        return std::sin(x) / x;
+      }
+    }
+
+
+    double Lanczos3(double x)
+    {
+      if (x <= -3.0 || x >= 3.0)
+      {
+        return 0.0;
+      }
+      else
+      {
+        return Sinc(x) * Sinc(x / 3.0);
+      }
+    }
+
+
+    /**
+     * For each pixel of the target, the window of source pixels that
+     * contribute to it. All the windows have the same length, which
+     * eases the vectorization of the inner loops: The unused weights
+     * are set to zero.
+     **/
+    class Contributions
+    {
+    private:
+      unsigned int          windowSize_;
+      std::vector<unsigned int>  start_;
+      std::vector<int16_t>  weights_;
+
+      static void ComputeArea(unsigned int& first,
+                              std::vector<double>& weights,
+                              unsigned int i,
+                              unsigned int sourceSize,
+                              double scale)
+      {
+        // The target pixel covers [a, b) in the source coordinates
+        double a = static_cast<double>(i) * scale;
+        double b = std::min(static_cast<double>(i + 1) * scale, static_cast<double>(sourceSize));
+
+        first = static_cast<unsigned int>(std::floor(a));
+        unsigned int last = std::min(static_cast<unsigned int>(std::ceil(b)), sourceSize);
+        if (last <= first)
+        {
+          last = first + 1;
+        }
+
+        weights.resize(last - first);
+        for (unsigned int j = 0; j < weights.size(); j++)
+        {
+          double x = static_cast<double>(first + j);
+          double overlap = std::min(b, x + 1.0) - std::max(a, x);
+          weights[j] = std::max(0.0, overlap) / (b - a);
+        }
+      }
+
+      static void ComputeLanczos(unsigned int& first,
+                                 std::vector<double>& weights,
+                                 unsigned int i,
+                                 unsigned int sourceSize,
+                                 double scale)
+      {
+        // When downscaling, the kernel is stretched to filter out the
+        // frequencies that cannot be represented in the target
+        const double filterScale = std::max(scale, 1.0);
+        const double support = 3.0 * filterScale;
+        const double center = (static_cast<double>(i) + 0.5) * scale;
+
+        int lo = static_cast<int>(std::floor(center - support));
+        int hi = static_cast<int>(std::ceil(center + support));
+        lo = std::max(0, lo);
+        hi = std::min(static_cast<int>(sourceSize), hi);
+        if (hi <= lo)
+        {
+          lo = std::min(lo, static_cast<int>(sourceSize) - 1);
+          hi = lo + 1;
+        }
+
+        first = static_cast<unsigned int>(lo);
+        weights.resize(hi - lo);
+
+        double total = 0;
+        for (unsigned int j = 0; j < weights.size(); j++)
+        {
+          weights[j] = Lanczos3((static_cast<double>(first + j) + 0.5 - center) / filterScale);
+          total += weights[j];
+        }
+
+        for (unsigned int j = 0; j < weights.size(); j++)
+        {
+          weights[j] = (total == 0.0 ? 1.0 / static_cast<double>(weights.size()) : weights[j] / total);
+        }
+      }
+
+    public:
+      Contributions(unsigned int targetSize,
+                    unsigned int sourceSize,
+                    ResamplingFilter filter)
+      {
+        const double scale = static_cast<double>(sourceSize) / static_cast<double>(targetSize);
+
+        std::vector<unsigned int> first(targetSize);
+        std::vector< std::vector<double> > weights(targetSize);
+
+        windowSize_ = 1;
+
+        for (unsigned int i = 0; i < targetSize; i++)
+        {
+          switch (filter)
+          {
+            case ResamplingFilter_Area:
+              ComputeArea(first[i], weights[i], i, sourceSize, scale);
+              break;
+
+            case ResamplingFilter_Lanczos3:
+              ComputeLanczos(first[i], weights[i], i, sourceSize, scale);
+              break;
+
+            default:
+              throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+          }
+
+          windowSize_ = std::max(windowSize_, static_cast<unsigned int>(weights[i].size()));
+        }
+
+        windowSize_ = std::min(windowSize_, sourceSize);
+        start_.resize(targetSize);
+        weights_.resize(targetSize * windowSize_, 0);
+
+        for (unsigned int i = 0; i < targetSize; i++)
+        {
+          // Shift the windows that would overflow the source
+          start_[i] = std::min(first[i], sourceSize - windowSize_);
+          unsigned int offset = first[i] - start_[i];
+
+          int16_t* w = &weights_[i * windowSize_];
+          int sum = 0;
+          unsigned int largest = offset;
+
+          for (unsigned int j = 0; j < weights[i].size(); j++)
+          {
+            w[offset + j] = static_cast<int16_t>(std::floor(weights[i][j] * static_cast<double>(1 << WEIGHT_BITS) + 0.5));
+            sum += w[offset + j];
+
+            if (w[offset + j] > w[largest])
+            {
+              largest = offset + j;
+            }
+          }
+
+          // Compensate for the rounding errors
+          w[largest] += static_cast<int16_t>((1 << WEIGHT_BITS) - sum);
+        }
+      }
+
+      unsigned int GetWindowSize() const
+      {
+        return windowSize_;
+      }
+
+      unsigned int GetStart(unsigned int i) const
+      {
+        return start_[i];
+      }
+
+      const int16_t* GetWeights(unsigned int i) const
+      {
+        return &weights_[i * windowSize_];
+      }
+    };
+
+
+    inline uint8_t Normalize(int32_t value)
+    {
+      value = (value + (1 << (WEIGHT_BITS - 1))) >> WEIGHT_BITS;
+      return static_cast<uint8_t>(value < 0 ? 0 : (value > 255 ? 255 : value));
+    }
+
+
+    // Combines the "i"-th row of the window into each byte of "target"
+    void VerticalScalar(uint8_t* target,
+                        const uint8_t* source,
+                        size_t sourcePitch,
+                        unsigned int rowSize,
+                        const int16_t* weights,
+                        unsigned int windowSize)
+    {
+      for (unsigned int i = 0; i < rowSize; i++)
+      {
+        int32_t sum = 0;
+        for (unsigned int k = 0; k < windowSize; k++)
+        {
+          sum += static_cast<int32_t>(weights[k]) * static_cast<int32_t>(source[k * sourcePitch + i]);
+        }
+
+        target[i] = Normalize(sum);
+      }
+    }
+
+
+    void HorizontalScalar(uint8_t* target,
+                          const uint8_t* source,
+                          unsigned int targetWidth,
+                          unsigned int channels,
+                          const Contributions& contributions)
+    {
+      const unsigned int windowSize = contributions.GetWindowSize();
+
+      for (unsigned int x = 0; x < targetWidth; x++)
+      {
+        const uint8_t* p = source + contributions.GetStart(x) * channels;
+        const int16_t* w = contributions.GetWeights(x);
+
+        for (unsigned int c = 0; c < channels; c++)
+        {
+          int32_t sum = 0;
+          for (unsigned int k = 0; k < windowSize; k++)
+          {
+            sum += static_cast<int32_t>(w[k]) * static_cast<int32_t>(p[k * channels + c]);
+          }
+
+          target[x * channels + c] = Normalize(sum);
+        }
+      }
+    }
+
+
+#if PHOTO_TRACK_X86_SIMD == 1
+    /**
+     * The SIMD kernels interleave the bytes of two consecutive taps
+     * as 16-bit integers, then "pmaddwd" multiplies them by the pair
+     * of weights and sums them into 32-bit accumulators. This is
+     * exact integer arithmetic, hence the same result as the scalar
+     * kernels. The final saturating packs implement the clamping.
+     **/
+    inline int32_t PackWeights(int16_t a,
+                               int16_t b)
+    {
+      return static_cast<int32_t>((static_cast<uint32_t>(static_cast<uint16_t>(b)) << 16) | 
+                                  static_cast<uint32_t>(static_cast<uint16_t>(a)));
+    }
+
+
+    PHOTO_TRACK_TARGET("sse2")
+    void VerticalSse2(uint8_t* target,
+                      const uint8_t* source,
+                      size_t sourcePitch,
+                      unsigned int rowSize,
+                      const int16_t* weights,
+                      unsigned int windowSize)
+    {
+      const __m128i zero = _mm_setzero_si128();
+      const __m128i rounding = _mm_set1_epi32(1 << (WEIGHT_BITS - 1));
+
+      unsigned int i = 0;
+      for (; i + 16 <= rowSize; i += 16)
+      {
+        __m128i acc0 = rounding;
+        __m128i acc1 = rounding;
+        __m128i acc2 = rounding;
+        __m128i acc3 = rounding;
+
+        for (unsigned int k = 0; k < windowSize; k += 2)
+        {
+          __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + k * sourcePitch + i));
+          __m128i b, w;
+
+          if (k + 1 < windowSize)
+          {
+            b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + (k + 1) * sourcePitch + i));
+            w = _mm_set1_epi32(PackWeights(weights[k], weights[k + 1]));
+          }
+          else
+          {
+            b = zero;
+            w = _mm_set1_epi32(PackWeights(weights[k], 0));
+          }
+
+          __m128i aLow = _mm_unpacklo_epi8(a, zero);
+          __m128i aHigh = _mm_unpackhi_epi8(a, zero);
+          __m128i bLow = _mm_unpacklo_epi8(b, zero);
+          __m128i bHigh = _mm_unpackhi_epi8(b, zero);
+
+          acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(aLow, bLow), w));
+          acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(aLow, bLow), w));
+          acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi16(aHigh, bHigh), w));
+          acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi16(aHigh, bHigh), w));
+        }
+
+        acc0 = _mm_srai_epi32(acc0, WEIGHT_BITS);
+        acc1 = _mm_srai_epi32(acc1, WEIGHT_BITS);
+        acc2 = _mm_srai_epi32(acc2, WEIGHT_BITS);
+        acc3 = _mm_srai_epi32(acc3, WEIGHT_BITS);
+
+        __m128i result = _mm_packus_epi16(_mm_packs_epi32(acc0, acc1), _mm_packs_epi32(acc2, acc3));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(target + i), result);
+      }
+
+      VerticalScalar(target + i, source + i, sourcePitch, rowSize - i, weights, windowSize);
+    }
+
+
+    PHOTO_TRACK_TARGET("avx2")
+    void VerticalAvx2(uint8_t* target,
+                      const uint8_t* source,
+                      size_t sourcePitch,
+                      unsigned int rowSize,
+                      const int16_t* weights,
+                      unsigned int windowSize)
+    {
+      // The unpack and pack instructions of AVX2 work within 128-bit
+      // lanes: They cancel out, so the bytes stay in order
+      const __m256i zero = _mm256_setzero_si256();
+      const __m256i rounding = _mm256_set1_epi32(1 << (WEIGHT_BITS - 1));
+
+      unsigned int i = 0;
+      for (; i + 32 <= rowSize; i += 32)
+      {
+        __m256i acc0 = rounding;
+        __m256i acc1 = rounding;
+        __m256i acc2 = rounding;
+        __m256i acc3 = rounding;
+
+        for (unsigned int k = 0; k < windowSize; k += 2)
+        {
+          __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + k * sourcePitch + i));
+          __m256i b, w;
+
+          if (k + 1 < windowSize)
+          {
+            b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + (k + 1) * sourcePitch + i));
+            w = _mm256_set1_epi32(PackWeights(weights[k], weights[k + 1]));
+          }
+          else
+          {
+            b = zero;
+            w = _mm256_set1_epi32(PackWeights(weights[k], 0));
+          }
+
+          __m256i aLow = _mm256_unpacklo_epi8(a, zero);
+          __m256i aHigh = _mm256_unpackhi_epi8(a, zero);
+          __m256i bLow = _mm256_unpacklo_epi8(b, zero);
+          __m256i bHigh = _mm256_unpackhi_epi8(b, zero);
+
+          acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(aLow, bLow), w));
+          acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(aLow, bLow), w));
+          acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi16(aHigh, bHigh), w));
+          acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi16(aHigh, bHigh), w));
+        }
+
+        acc0 = _mm256_srai_epi32(acc0, WEIGHT_BITS);
+        acc1 = _mm256_srai_epi32(acc1, WEIGHT_BITS);
+        acc2 = _mm256_srai_epi32(acc2, WEIGHT_BITS);
+        acc3 = _mm256_srai_epi32(acc3, WEIGHT_BITS);
+
+        __m256i result = _mm256_packus_epi16(_mm256_packs_epi32(acc0, acc1), _mm256_packs_epi32(acc2, acc3));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(target + i), result);
+      }
+
+      VerticalSse2(target + i, source + i, sourcePitch, rowSize - i, weights, windowSize);
+    }
+
+
+    PHOTO_TRACK_TARGET("sse2")
+    inline __m128i LoadPixel(const uint8_t* p)
+    {
+      int32_t value;
+      memcpy(&value, p, sizeof(value));
+      return _mm_unpacklo_epi8(_mm_cvtsi32_si128(value), _mm_setzero_si128());
+    }
+
+
+    // Processes all the channels of one pixel at once, in 32-bit
+    // lanes. Reads up to 3 bytes after the last pixel of the row.
+    PHOTO_TRACK_TARGET("sse2")
+    void HorizontalSse2(uint8_t* target,
+                        const uint8_t* source,
+                        unsigned int targetWidth,
+                        unsigned int channels,
+                        const Contributions& contributions)
+    {
+      const unsigned int windowSize = contributions.GetWindowSize();
+      const __m128i rounding = _mm_set1_epi32(1 << (WEIGHT_BITS - 1));
+
+      for (unsigned int x = 0; x < targetWidth; x++)
+      {
+        const uint8_t* p = source + contributions.GetStart(x) * channels;
+        const int16_t* w = contributions.GetWeights(x);
+
+        __m128i acc = rounding;
+
+        for (unsigned int k = 0; k < windowSize; k += 2)
+        {
+          __m128i a = LoadPixel(p + k * channels);
+
+          if (k + 1 < windowSize)
+          {
+            __m128i b = LoadPixel(p + (k + 1) * channels);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), 
+                                                    _mm_set1_epi32(PackWeights(w[k], w[k + 1]))));
+          }
+          else
+          {
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi16(a, _mm_setzero_si128()),
+                                                    _mm_set1_epi32(PackWeights(w[k], 0))));
+          }
+        }
+
+        acc = _mm_srai_epi32(acc, WEIGHT_BITS);
+        acc = _mm_packs_epi32(acc, acc);
+
+        int32_t pixel = _mm_cvtsi128_si32(_mm_packus_epi16(acc, acc));
+        memcpy(target + x * channels, &pixel, channels);
+      }
+    }
+#endif
+
+
+    ResamplingKernel DetectBestKernel()
+    {
+      if (CpuFeatures::IsSupported(CpuFeature_Avx2))
+      {
+        return ResamplingKernel_Avx2;
+      }
+      else if (CpuFeatures::IsSupported(CpuFeature_Sse2))
+      {
+        return ResamplingKernel_Sse2;
+      }
+      else
+      {
+        return ResamplingKernel_Scalar;
+      }
+    }
+  }
+
+
+  ResamplingKernel ImageResampler::GetBestKernel()
+  {
+    static const ResamplingKernel kernel = DetectBestKernel();
+    return kernel;
+  }
+
+
+  bool ImageResampler::IsKernelSupported(ResamplingKernel kernel)
+  {
+    return (kernel == ResamplingKernel_Scalar ||
+            (kernel == ResamplingKernel_Sse2 && GetBestKernel() != ResamplingKernel_Scalar) ||
+            (kernel == ResamplingKernel_Avx2 && GetBestKernel() == ResamplingKernel_Avx2));
+  }
+
+
+  const char* ImageResampler::EnumerationToString(ResamplingKernel kernel)
+  {
+    switch (kernel)
+    {
+      case ResamplingKernel_Scalar:
+        return "Scalar";
+
+      case ResamplingKernel_Sse2:
+        return "SSE2";
+
+      case ResamplingKernel_Avx2:
+        return "AVX2";
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  void ImageResampler::ComputeFittingSize(unsigned int& width,
+                                          unsigned int& height,
+                                          unsigned int sourceWidth,
+                                          unsigned int sourceHeight,
+                                          unsigned int maxWidth,
+                                          unsigned int maxHeight)
+  {
+    width = sourceWidth;
+    height = sourceHeight;
+
+    if (sourceWidth == 0 ||
+        sourceHeight == 0)
+    {
+      return;
+    }
+
+    if (maxWidth != 0 && 
+        width > maxWidth)
+    {
+      height = static_cast<unsigned int>(static_cast<uint64_t>(height) * maxWidth / sourceWidth);
+      width = maxWidth;
+    }
+
+    if (maxHeight != 0 && 
+        height > maxHeight)
+    {
+      width = static_cast<unsigned int>(static_cast<uint64_t>(sourceWidth) * maxHeight / sourceHeight);
+      height = maxHeight;
+    }
+
+    width = std::max(1u, width);
+    height = std::max(1u, height);
+  }
+
+
+  void ImageResampler::Resample(Orthanc::ImageAccessor& target,
+                                const Orthanc::ImageAccessor& source,
+                                ResamplingFilter filter,
+                                ResamplingKernel kernel)
+  {
+    if (target.GetFormat() != source.GetFormat())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_IncompatibleImageFormat);
+    }
+
+    if (!IsKernelSupported(kernel))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    unsigned int channels;
+    switch (source.GetFormat())
+    {
+      case Orthanc::PixelFormat_Grayscale8:
+        channels = 1;
+        break;
+
+      case Orthanc::PixelFormat_RGB24:
+        channels = 3;
+        break;
+
+      case Orthanc::PixelFormat_RGBA32:
+        channels = 4;
+        break;
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented);
+    }
+
+    if (source.GetWidth() == 0 ||
+        source.GetHeight() == 0 ||
+        target.GetWidth() == 0 ||
+        target.GetHeight() == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_IncompatibleImageSize);
+    }
+
+    // First pass: Vertical resampling, that combines whole rows of
+    // the source into the rows of the intermediate image
+    const unsigned int rowSize = source.GetWidth() * channels;
+    const unsigned int pitch = rowSize + ROW_PADDING;
+    std::vector<uint8_t> intermediate(pitch * target.GetHeight());
+
+    Contributions vertical(target.GetHeight(), source.GetHeight(), filter);
+    for (unsigned int y = 0; y < target.GetHeight(); y++)
+    {
+      uint8_t* row = &intermediate[y * pitch];
+      const uint8_t* window = reinterpret_cast<const uint8_t*>(source.GetConstRow(vertical.GetStart(y)));
+
+      switch (kernel)
+      {
+#if PHOTO_TRACK_X86_SIMD == 1
+        case ResamplingKernel_Avx2:
+          VerticalAvx2(row, window, source.GetPitch(), rowSize, vertical.GetWeights(y), vertical.GetWindowSize());
+          break;
+
+        case ResamplingKernel_Sse2:
+          VerticalSse2(row, window, source.GetPitch(), rowSize, vertical.GetWeights(y), vertical.GetWindowSize());
+          break;
+#endif
+
+        default:
+          VerticalScalar(row, window, source.GetPitch(), rowSize, vertical.GetWeights(y), vertical.GetWindowSize());
+          break;
+      }
+    }
+
+    // Second pass: Horizontal resampling of the intermediate rows
+    Contributions horizontal(target.GetWidth(), source.GetWidth(), filter);
+    for (unsigned int y = 0; y < target.GetHeight(); y++)
+    {
+      uint8_t* row = reinterpret_cast<uint8_t*>(target.GetRow(y));
+
+#if PHOTO_TRACK_X86_SIMD == 1
+      if (kernel != ResamplingKernel_Scalar)
+      {
+        HorizontalSse2(row, &intermediate[y * pitch], target.GetWidth(), channels, horizontal);
+        continue;
+      }
+#endif
+
+      HorizontalScalar(row, &intermediate[y * pitch], target.GetWidth(), channels, horizontal);
+    }
+  }
+}
@@ -0,0 +1,81 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include <Core/ImageFormats/ImageAccessor.h>
+
+namespace PhotoTrack
+{
+  enum ResamplingFilter
+  {
+    ResamplingFilter_Area,       // Box filter, for fast thumbnails
+    ResamplingFilter_Lanczos3    // Sharper, but about twice slower
+  };
+
+  enum ResamplingKernel
+  {
+    ResamplingKernel_Scalar,
+    ResamplingKernel_Sse2,
+    ResamplingKernel_Avx2
+  };
+
+  /**
+   * Resampling of 8-bit images (Grayscale8, RGB24 or RGBA32). The
+   * filter is separable, and is applied with fixed-point weights:
+   * All the kernels (scalar or SIMD) produce bit-identical results.
+   * The vertical pass is applied first, as it works on whole rows
+   * and is the easiest to vectorize.
+   **/
+  class ImageResampler
+  {
+  public:
+    // The best kernel for this CPU, detected once at runtime
+    static ResamplingKernel GetBestKernel();
+
+    static bool IsKernelSupported(ResamplingKernel kernel);
+
+    static const char* EnumerationToString(ResamplingKernel kernel);
+
+    // Computes the size of the largest image that fits within
+    // "maxWidth" x "maxHeight" while preserving the aspect ratio of
+    // the source. A zero maximum leaves the dimension unconstrained.
+    // The images are never enlarged.
+    static void ComputeFittingSize(unsigned int& width,
+                                   unsigned int& height,
+                                   unsigned int sourceWidth,
+                                   unsigned int sourceHeight,
+                                   unsigned int maxWidth,
+                                   unsigned int maxHeight);
+
+    // Resamples "source" to the size of "target". Both images must
+    // have the same format.
+    static void Resample(Orthanc::ImageAccessor& target,
+                         const Orthanc::ImageAccessor& source,
+                         ResamplingFilter filter,
+                         ResamplingKernel kernel);
+
+    static void Resample(Orthanc::ImageAccessor& target,
+                         const Orthanc::ImageAccessor& source,
+                         ResamplingFilter filter = ResamplingFilter_Area)
+    {
+      Resample(target, source, filter, GetBestKernel());
+    }
+  };
+}
@@ -0,0 +1,118 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include "IBlobReader.h"
+#include "ZlibInflater.h"
+
+#include <Core/OrthancException.h>
+#include <memory>
+#include <string.h>
+
+namespace PhotoTrack
+{
+  /**
+   * Gives access to the uncompressed content of a blob that was
+   * stored compressed, without holding it entirely in memory. The
+   * reads are expected to be sequential: Reading backward restarts
+   * the decompression from the beginning.
+   **/
+  class InflatingBlobReader : public IBlobReader
+  {
+  private:
+    static const size_t CHUNK_SIZE = 64 * 1024;
+
+    std::string                 compressed_;
+    std::auto_ptr<ZlibInflater> inflater_;
+    uint64_t                    position_;   // Offset of the next uncompressed byte
+    std::string                 chunk_;
+    size_t                      chunkPosition_;
+
+    void Rewind()
+    {
+      inflater_.reset(new ZlibInflater(compressed_.c_str(), compressed_.size()));
+      position_ = 0;
+      chunk_.clear();
+      chunkPosition_ = 0;
+    }
+
+  public:
+    // The content of "compressed" is taken over by the reader
+    InflatingBlobReader(std::string& compressed)
+    {
+      compressed_.swap(compressed);
+      Rewind();
+    }
+
+    virtual uint64_t GetSize()
+    {
+      return inflater_->GetUncompressedSize();
+    }
+
+    virtual void Read(void* target,
+                      size_t size,
+                      uint64_t offset)
+    {
+      if (offset > GetSize() ||
+          size > GetSize() - offset)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+
+      if (offset < position_)
+      {
+        Rewind();
+      }
+
+      uint8_t* p = reinterpret_cast<uint8_t*>(target);
+
+      while (size > 0)
+      {
+        if (chunkPosition_ == chunk_.size())
+        {
+          chunkPosition_ = 0;
+          if (!inflater_->ReadChunk(chunk_, CHUNK_SIZE))
+          {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+          }
+        }
+
+        size_t available = chunk_.size() - chunkPosition_;
+
+        if (position_ < offset)
+        {
+          // Skip the bytes before the requested offset
+          size_t n = static_cast<size_t>(std::min<uint64_t>(offset - position_, available));
+          chunkPosition_ += n;
+          position_ += n;
+        }
+        else
+        {
+          size_t n = std::min(size, available);
+          memcpy(p, chunk_.c_str() + chunkPosition_, n);
+          chunkPosition_ += n;
+          position_ += n;
+          p += n;
+          size -= n;
+        }
+      }
+    }
+  };
+}
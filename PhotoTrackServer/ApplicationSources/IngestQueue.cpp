@@ -0,0 +1,586 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "IngestQueue.h"
+
+#include <Core/OrthancException.h>
+#include <Core/Toolbox.h>
+#include <Core/Uuid.h>
+
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#if !defined(O_BINARY)
+#define O_BINARY 0
+#endif
+
+namespace PhotoTrack
+{
+  static const char* const STAGING_EXTENSION = ".ingest";
+  static const char* const FAILED_EXTENSION = ".failed";
+
+
+  static bool WriteAll(int fd,
+                       const void* data,
+                       size_t size)
+  {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    while (size > 0)
+    {
+#if defined(_WIN32)
+      int n = _write(fd, p, static_cast<unsigned int>(size));
+#else
+      ssize_t n = write(fd, p, size);
+#endif
+
+      if (n <= 0)
+      {
+        if (n < 0 && errno == EINTR)
+        {
+          continue;
+        }
+
+        return false;
+      }
+
+      p += n;
+      size -= n;
+    }
+
+    return true;
+  }
+
+
+  IngestQueue::IngestQueue(DatabaseWrapper& db,
+                           const std::string& root,
+                           DurabilityPolicy durability) :
+    db_(db),
+    root_(root),
+    synchronizer_(durability),
+    maxAttempts_(5),
+    retryDelay_(1000),
+    done_(true)
+  {
+    using namespace boost::filesystem;
+
+    create_directories(root_);
+
+    // Queue again the photos that were staged before the restart,
+    // and keep reporting the photos that have failed
+    std::vector<path> files, failed;
+    for (directory_iterator it(root_); it != directory_iterator(); ++it)
+    {
+      if (is_regular_file(it->status()))
+      {
+        if (it->path().extension() == STAGING_EXTENSION)
+        {
+          files.push_back(it->path());
+        }
+        else if (it->path().extension() == FAILED_EXTENSION)
+        {
+          failed.push_back(it->path());
+        }
+      }
+    }
+
+    for (size_t i = 0; i < failed.size(); i++)
+    {
+      Item item;
+      std::string image;
+      if (Load(item.header_, image, failed[i].string()))
+      {
+        item.attempts_ = 0;
+        item.failed_ = true;
+        pending_[failed[i].stem().string()] = item;
+      }
+    }
+
+    for (size_t i = 0; i < files.size(); i++)
+    {
+      std::string photoUuid = files[i].stem().string();
+
+      Item item;
+      std::string image;
+      if (Load(item.header_, image, files[i].string()))
+      {
+        item.attempts_ = 0;
+        item.failed_ = false;
+        pending_[photoUuid] = item;
+        queue_.push_back(photoUuid);
+      }
+      else
+      {
+        // The server stopped while writing this file, before its
+        // client was answered
+        LOG(WARNING) << "Removing the incomplete staged photo " << photoUuid;
+        boost::system::error_code error;
+        remove(files[i], error);
+      }
+    }
+
+    if (!queue_.empty())
+    {
+      LOG(WARNING) << "Resuming the ingestion of " << queue_.size() << " staged photos";
+    }
+  }
+
+
+  IngestQueue::~IngestQueue()
+  {
+    Stop();
+  }
+
+
+  std::string IngestQueue::GetPath(const std::string& photoUuid) const
+  {
+    return (boost::filesystem::path(root_) / (photoUuid + STAGING_EXTENSION)).string();
+  }
+
+
+  std::string IngestQueue::GetFailedPath(const std::string& photoUuid) const
+  {
+    return (boost::filesystem::path(root_) / (photoUuid + FAILED_EXTENSION)).string();
+  }
+
+
+  // A staging file is made of a header, written as a single line of
+  // JSON, followed by the raw bytes of the image
+  bool IngestQueue::Load(Json::Value& header,
+                         std::string& image,
+                         const std::string& path)
+  {
+    std::string content;
+
+    try
+    {
+      Orthanc::Toolbox::ReadFile(content, path);
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      return false;
+    }
+
+    size_t eol = content.find('\n');
+
+    Json::Reader reader;
+    if (eol == std::string::npos ||
+        !reader.parse(content.substr(0, eol), header) ||
+        header.type() != Json::objectValue ||
+        !header.isMember("Metadata") ||
+        header["Metadata"].type() != Json::objectValue)
+    {
+      return false;
+    }
+
+    try
+    {
+      // The 64-bit integers are stored as strings, as jsoncpp might
+      // not support them
+      uint64_t size = boost::lexical_cast<uint64_t>(header["ImageSize"].asString());
+      if (size != content.size() - eol - 1)
+      {
+        return false;
+      }
+    }
+    catch (boost::bad_lexical_cast&)
+    {
+      return false;
+    }
+    catch (std::exception&)   // Bad type in jsoncpp
+    {
+      return false;
+    }
+
+    image = content.substr(eol + 1);
+    return true;
+  }
+
+
+  void IngestQueue::SetRetryPolicy(unsigned int maxAttempts,
+                                   unsigned int retryDelay)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    maxAttempts_ = (maxAttempts == 0 ? 1 : maxAttempts);
+    retryDelay_ = retryDelay;
+  }
+
+
+  std::string IngestQueue::Enqueue(const Json::Value& metadata,
+                                   const void* image,
+                                   size_t size,
+                                   const std::string& mimeType,
+                                   const std::string& imageHash)
+  {
+    // Same check as "DatabaseWrapper::CreateOrUpdatePhoto()", so that
+    // the client is not acknowledged a photo that cannot be stored
+    if (Photo::FromJson(metadata).GetSiteUuid().empty())
+    {
+      LOG(ERROR) << "Creating a photo without a parent site";
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentItem);
+    }
+
+    std::string photoUuid = Orthanc::Toolbox::GenerateUuid();
+
+    Json::Value header = Json::objectValue;
+    header["Metadata"] = metadata;
+    header["ImageMime"] = mimeType;
+    header["ImageSize"] = boost::lexical_cast<std::string>(size);
+    header["ImageHash"] = imageHash;
+
+    // "Json::FastWriter" ends the header with a newline
+    Json::FastWriter writer;
+    std::string line = writer.write(header);
+
+    std::string path = GetPath(photoUuid);
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0644);
+    if (fd < 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+    }
+
+    if (!WriteAll(fd, line.c_str(), line.size()) ||
+        !WriteAll(fd, image, size))
+    {
+      close(fd);
+      boost::filesystem::remove(path);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+    }
+
+    try
+    {
+      // The staging files of the concurrent uploads are flushed
+      // together if the durability policy is "Grouped"
+      synchronizer_.Commit(fd, root_);
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      boost::filesystem::remove(path);
+      throw;
+    }
+
+    Item item;
+    item.header_ = header;
+    item.attempts_ = 0;
+    item.failed_ = false;
+
+    boost::mutex::scoped_lock lock(mutex_);
+    pending_[photoUuid] = item;
+    queue_.push_back(photoUuid);
+    wakeup_.notify_one();
+
+    return photoUuid;
+  }
+
+
+  bool IngestQueue::GetPendingPhoto(Json::Value& target,
+                                    const std::string& photoUuid)
+  {
+    Photo photo;
+    bool failed;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Pending::const_iterator found = pending_.find(photoUuid);
+      if (found == pending_.end())
+      {
+        return false;
+      }
+
+      const Json::Value& header = found->second.header_;
+      photo = Photo::FromJson(header["Metadata"]);
+      photo.SetImageMime(header["ImageMime"].asString());
+      photo.SetImageHash(header["ImageHash"].asString());
+      failed = found->second.failed_;
+    }
+
+    photo.SetUuid(photoUuid);
+    photo.ToJson(target);
+    target["Status"] = (failed ? "Failed" : "Pending");
+
+    return true;
+  }
+
+
+  bool IngestQueue::IsPending(const std::string& photoUuid)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Pending::const_iterator found = pending_.find(photoUuid);
+    return (found != pending_.end() &&
+            !found->second.failed_);
+  }
+
+
+  size_t IngestQueue::GetPendingCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    size_t count = 0;
+    for (Pending::const_iterator it = pending_.begin(); it != pending_.end(); ++it)
+    {
+      if (!it->second.failed_)
+      {
+        count++;
+      }
+    }
+
+    return count;
+  }
+
+
+  bool IngestQueue::DiscardFailed(const std::string& photoUuid)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Pending::iterator found = pending_.find(photoUuid);
+    if (found == pending_.end() ||
+        !found->second.failed_)
+    {
+      return false;
+    }
+
+    boost::system::error_code error;
+    boost::filesystem::remove(GetFailedPath(photoUuid), error);
+
+    pending_.erase(found);
+    return true;
+  }
+
+
+  bool IngestQueue::Ingest(const std::string& photoUuid)
+  {
+    Photo existing;
+    if (db_.GetPhoto(existing, photoUuid))
+    {
+      // The server stopped after the commit, but before the staging
+      // file was removed: Ingesting the photo again would drop its
+      // image
+      LOG(WARNING) << "The staged photo " << photoUuid << " was already ingested";
+      return true;
+    }
+
+    Json::Value header;
+    std::string image;
+    if (!Load(header, image, GetPath(photoUuid)))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+    }
+
+    Photo photo = Photo::FromJson(header["Metadata"]);
+    photo.SetUuid(photoUuid);
+
+    std::string hash = header["ImageHash"].asString();
+    std::string mimeType = header["ImageMime"].asString();
+
+    // The photo is created together with its image, so that a failed
+    // attempt leaves nothing behind in the database
+    if (!mimeType.empty())
+    {
+      db_.CreatePhotoWithImage(photo, image.empty() ? NULL : image.c_str(), image.size(), mimeType);
+    }
+    else if (!hash.empty())
+    {
+      // The photos sharing this image may have been deleted in the
+      // meantime
+      return db_.CreatePhotoWithImage(photo, hash);
+    }
+    else
+    {
+      db_.CreateOrUpdatePhoto(photo);
+    }
+
+    return true;
+  }
+
+
+  bool IngestQueue::HasNext() const
+  {
+    return (!queue_.empty() ||
+            (!delayed_.empty() &&
+             delayed_.begin()->first <= boost::get_system_time()));
+  }
+
+
+  bool IngestQueue::ProcessNext()
+  {
+    std::string photoUuid;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (!queue_.empty())
+      {
+        photoUuid = queue_.front();
+        queue_.pop_front();
+      }
+      else if (HasNext())
+      {
+        photoUuid = delayed_.begin()->second;
+        delayed_.erase(delayed_.begin());
+      }
+      else
+      {
+        return false;
+      }
+    }
+
+    std::string error;
+    bool retry = true;
+
+    try
+    {
+      if (!Ingest(photoUuid))
+      {
+        error = "Its image is not stored anymore";
+        retry = false;
+      }
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      error = e.What();
+    }
+    catch (std::exception& e)
+    {
+      error = e.what();
+    }
+
+    if (error.empty())
+    {
+      boost::system::error_code code;
+      boost::filesystem::remove(GetPath(photoUuid), code);
+
+      // The photo only leaves the pending state once it is in the
+      // database, so that it is always visible to the clients
+      boost::mutex::scoped_lock lock(mutex_);
+      pending_.erase(photoUuid);
+      return true;
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Item& item = pending_[photoUuid];
+    item.attempts_++;
+
+    if (retry &&
+        item.attempts_ < maxAttempts_)
+    {
+      LOG(WARNING) << "Cannot ingest the staged photo " << photoUuid << " (attempt "
+                   << item.attempts_ << "/" << maxAttempts_ << "), will retry: " << error;
+
+      uint64_t delay = static_cast<uint64_t>(retryDelay_) << std::min(item.attempts_ - 1, 16u);
+      delayed_.insert(std::make_pair(boost::get_system_time() + boost::posix_time::milliseconds(delay), photoUuid));
+      wakeup_.notify_one();
+    }
+    else
+    {
+      LOG(ERROR) << "Giving up the ingestion of the staged photo " << photoUuid << ": " << error;
+
+      // The staging file is kept aside for the administrator
+      boost::system::error_code code;
+      boost::filesystem::rename(GetPath(photoUuid), GetFailedPath(photoUuid), code);
+      item.failed_ = true;
+    }
+
+    return true;
+  }
+
+
+  void IngestQueue::Worker(IngestQueue* that)
+  {
+    for (;;)
+    {
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+
+        while (!that->done_ && !that->HasNext())
+        {
+          if (that->delayed_.empty())
+          {
+            that->wakeup_.wait(lock);
+          }
+          else
+          {
+            that->wakeup_.timed_wait(lock, that->delayed_.begin()->first);
+          }
+        }
+
+        // The photos that are still queued are ingested at the next
+        // startup
+        if (that->done_)
+        {
+          return;
+        }
+      }
+
+      that->ProcessNext();
+    }
+  }
+
+
+  void IngestQueue::Start(unsigned int workers)
+  {
+    Stop();
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      done_ = false;
+    }
+
+    for (unsigned int i = 0; i < (workers == 0 ? 1 : workers); i++)
+    {
+      threads_.push_back(new boost::thread(Worker, this));
+    }
+  }
+
+
+  void IngestQueue::Stop()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      done_ = true;
+      wakeup_.notify_all();
+    }
+
+    for (size_t i = 0; i < threads_.size(); i++)
+    {
+      if (threads_[i]->joinable())
+      {
+        threads_[i]->join();
+      }
+
+      delete threads_[i];
+    }
+
+    threads_.clear();
+  }
+}
@@ -0,0 +1,138 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include "Database.h"
+#include "FileSynchronizer.h"
+
+#include <boost/thread.hpp>
+#include <list>
+#include <map>
+#include <vector>
+
+namespace PhotoTrack
+{
+  /**
+   * Fast acknowledgement of the uploads of the photos. The metadata
+   * and the image of each upload are appended to a staging file that
+   * is made durable, then the client is answered at once with the
+   * UUID of the photo. A pool of workers moves the staged photos into
+   * the database and the storage area, each photo being created
+   * together with its image in one transaction. The failed photos are
+   * retried with an exponential backoff, and stay pending meanwhile:
+   * Only once all the attempts have failed is the photo reported as
+   * "Failed", and its staging file kept aside for the administrator.
+   * The photos whose image is not stored anymore fail at once.
+   * The staging files that were not processed when the server
+   * stopped are queued again at startup.
+   **/
+  class IngestQueue : public boost::noncopyable
+  {
+  private:
+    struct Item
+    {
+      Json::Value   header_;
+      unsigned int  attempts_;
+      bool          failed_;
+    };
+
+    typedef std::map<std::string, Item>                     Pending;   // Photo UUID => item
+    typedef std::multimap<boost::system_time, std::string>  Delayed;   // Next attempt => photo UUID
+
+    DatabaseWrapper&             db_;
+    std::string                  root_;
+    FileSynchronizer             synchronizer_;
+    unsigned int                 maxAttempts_;
+    unsigned int                 retryDelay_;   // In milliseconds, doubled after each attempt
+
+    boost::mutex                 mutex_;
+    Pending                      pending_;
+    std::list<std::string>       queue_;
+    Delayed                      delayed_;
+
+    bool                         done_;
+    boost::condition_variable    wakeup_;
+    std::vector<boost::thread*>  threads_;
+
+    std::string GetPath(const std::string& photoUuid) const;
+
+    std::string GetFailedPath(const std::string& photoUuid) const;
+
+    bool Load(Json::Value& header,
+              std::string& image,
+              const std::string& path);
+
+    // Returns "false" if the photo can never be ingested, as its image
+    // is not stored anymore
+    bool Ingest(const std::string& photoUuid);
+
+    // The mutex must be locked
+    bool HasNext() const;
+
+    static void Worker(IngestQueue* that);
+
+  public:
+    IngestQueue(DatabaseWrapper& db,
+                const std::string& root,
+                DurabilityPolicy durability);
+
+    ~IngestQueue();
+
+    // 5 attempts by default, the first retry after 1 second
+    void SetRetryPolicy(unsigned int maxAttempts,
+                        unsigned int retryDelay);   // In milliseconds
+
+    // Stages a new photo, whose metadata is formatted as for
+    // "Photo::FromJson()". The image is optional: If "imageHash" is
+    // not empty, the already stored image with this SHA-1 is attached
+    // instead. Returns the UUID of the photo once the staging file is
+    // durable.
+    std::string Enqueue(const Json::Value& metadata,
+                        const void* image,
+                        size_t size,
+                        const std::string& mimeType,
+                        const std::string& imageHash);
+
+    // Gives the photo as it will be stored, if it is not committed
+    // to the database yet. Its "Status" is "Pending" while it is
+    // being ingested, or "Failed" once all the attempts have failed.
+    bool GetPendingPhoto(Json::Value& target,
+                         const std::string& photoUuid);
+
+    // Only the photos that are being ingested are pending, not the
+    // failed ones
+    bool IsPending(const std::string& photoUuid);
+
+    size_t GetPendingCount();
+
+    // Forgets about a failed photo, and removes its staging file.
+    // Returns "false" if the photo has not failed.
+    bool DiscardFailed(const std::string& photoUuid);
+
+    // Makes one attempt at ingesting the next staged photo whose
+    // retry is due, in the calling thread. Returns "false" if there
+    // is no such photo.
+    bool ProcessNext();
+
+    void Start(unsigned int workers);
+
+    void Stop();
+  };
+}
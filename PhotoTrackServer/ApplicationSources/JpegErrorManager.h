@@ -0,0 +1,60 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <jpeglib.h>
+
+namespace PhotoTrack
+{
+  /**
+   * Replaces the default error handler of libjpeg, which calls
+   * "exit()", by a "longjmp()" back to the caller. This is shared by
+   * JpegReader and JpegWriter.
+   **/
+  struct JpegErrorManager
+  {
+    struct jpeg_error_mgr  pub_;   // Must be the first member
+    jmp_buf                jump_;
+    char                   message_[JMSG_LENGTH_MAX];
+
+    static void OnError(j_common_ptr cinfo)
+    {
+      JpegErrorManager* that = reinterpret_cast<JpegErrorManager*>(cinfo->err);
+      (*cinfo->err->format_message) (cinfo, that->message_);
+      longjmp(that->jump_, 1);
+    }
+
+    static void OnOutputMessage(j_common_ptr cinfo)
+    {
+      // Drop the warnings about corrupt data, that libjpeg writes to stderr
+    }
+
+    struct jpeg_error_mgr* Install()
+    {
+      message_[0] = '\0';
+      jpeg_std_error(&pub_);
+      pub_.error_exit = OnError;
+      pub_.output_message = OnOutputMessage;
+      return &pub_;
+    }
+  };
+}
@@ -0,0 +1,200 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "JpegReader.h"
+
+#include "JpegErrorManager.h"
+
+#include <Core/OrthancException.h>
+#include <glog/logging.h>
+
+namespace PhotoTrack
+{
+  // Protection against the decompression bombs
+  static const uint64_t MAX_PIXELS = 128 * 1024 * 1024;
+
+
+  void JpegReader::ReadFromMemory(const void* buffer,
+                                  size_t size,
+                                  unsigned int minWidth,
+                                  unsigned int minHeight)
+  {
+    struct jpeg_decompress_struct cinfo;
+    JpegErrorManager error;
+
+    cinfo.err = error.Install();
+
+    if (setjmp(error.jump_))
+    {
+      jpeg_destroy_decompress(&cinfo);
+      LOG(ERROR) << "Cannot decode a JPEG image: " << error.message_;
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, const_cast<unsigned char*>(reinterpret_cast<const unsigned char*>(buffer)),
+                 static_cast<unsigned long>(size));
+    Decompress(cinfo, minWidth, minHeight);
+  }
+
+
+  void JpegReader::ReadSize(unsigned int& width,
+                            unsigned int& height,
+                            const std::string& buffer)
+  {
+    struct jpeg_decompress_struct cinfo;
+    JpegErrorManager error;
+
+    cinfo.err = error.Install();
+
+    if (setjmp(error.jump_))
+    {
+      jpeg_destroy_decompress(&cinfo);
+      LOG(ERROR) << "Cannot decode a JPEG image: " << error.message_;
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, const_cast<unsigned char*>(reinterpret_cast<const unsigned char*>(buffer.c_str())),
+                 static_cast<unsigned long>(buffer.size()));
+    jpeg_read_header(&cinfo, TRUE);
+
+    width = cinfo.image_width;
+    height = cinfo.image_height;
+
+    jpeg_destroy_decompress(&cinfo);
+  }
+
+
+  void JpegReader::ReadFromFile(const std::string& path,
+                                unsigned int minWidth,
+                                unsigned int minHeight)
+  {
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (fp == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile);
+    }
+
+    struct jpeg_decompress_struct cinfo;
+    JpegErrorManager error;
+
+    cinfo.err = error.Install();
+
+    if (setjmp(error.jump_))
+    {
+      jpeg_destroy_decompress(&cinfo);
+      fclose(fp);
+      LOG(ERROR) << "Cannot decode a JPEG image: " << error.message_;
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, fp);
+
+    try
+    {
+      Decompress(cinfo, minWidth, minHeight);
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      fclose(fp);
+      throw;
+    }
+
+    fclose(fp);
+  }
+
+
+  // The errors of libjpeg jump back to the caller, which has set up
+  // the error manager and the source of "cinfo"
+  void JpegReader::Decompress(struct jpeg_decompress_struct& cinfo,
+                              unsigned int minWidth,
+                              unsigned int minHeight)
+  {
+    jpeg_read_header(&cinfo, TRUE);
+
+    originalWidth_ = cinfo.image_width;
+    originalHeight_ = cinfo.image_height;
+
+    Orthanc::PixelFormat format;
+
+    switch (cinfo.jpeg_color_space)
+    {
+      case JCS_GRAYSCALE:
+        cinfo.out_color_space = JCS_GRAYSCALE;
+        format = Orthanc::PixelFormat_Grayscale8;
+        break;
+
+      case JCS_RGB:
+      case JCS_YCbCr:
+        cinfo.out_color_space = JCS_RGB;
+        format = Orthanc::PixelFormat_RGB24;
+        break;
+
+      default:
+        // CMYK images, as written by some desktop publishing tools
+        jpeg_destroy_decompress(&cinfo);
+        LOG(ERROR) << "Unsupported color space in a JPEG image";
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_IncompatibleImageFormat);
+    }
+
+    if (minWidth > 0 || 
+        minHeight > 0)
+    {
+      unsigned int denominator = 1;
+      while (denominator < 8 &&
+             cinfo.image_width / (2 * denominator) >= minWidth &&
+             cinfo.image_height / (2 * denominator) >= minHeight)
+      {
+        denominator *= 2;
+      }
+
+      cinfo.scale_num = 1;
+      cinfo.scale_denom = denominator;
+    }
+
+    jpeg_calc_output_dimensions(&cinfo);
+
+    if (static_cast<uint64_t>(cinfo.output_width) * static_cast<uint64_t>(cinfo.output_height) > MAX_PIXELS)
+    {
+      jpeg_destroy_decompress(&cinfo);
+      LOG(ERROR) << "JPEG image is too large: " << cinfo.image_width << "x" << cinfo.image_height;
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_IncompatibleImageSize);
+    }
+
+    jpeg_start_decompress(&cinfo);
+
+    unsigned int pitch = cinfo.output_width * cinfo.output_components;
+    data_.resize(pitch * cinfo.output_height);
+
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+      JSAMPROW row = &data_[0] + cinfo.output_scanline * pitch;
+      jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    AssignWritable(format, cinfo.output_width, cinfo.output_height, pitch, 
+                   data_.empty() ? NULL : &data_[0]);
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+  }
+}
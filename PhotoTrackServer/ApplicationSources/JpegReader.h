@@ -0,0 +1,91 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include <Core/ImageFormats/ImageAccessor.h>
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct jpeg_decompress_struct;
+
+namespace PhotoTrack
+{
+  /**
+   * Decoder of JPEG images, based on libjpeg. The interface mimics
+   * that of Orthanc::PngReader. Grayscale images are decoded as
+   * Grayscale8, and color images as RGB24.
+   **/
+  class JpegReader : public Orthanc::ImageAccessor
+  {
+  private:
+    std::vector<uint8_t>  data_;
+    unsigned int          originalWidth_;
+    unsigned int          originalHeight_;
+
+    void Decompress(struct jpeg_decompress_struct& cinfo,
+                    unsigned int minWidth,
+                    unsigned int minHeight);
+
+  public:
+    JpegReader() : originalWidth_(0), originalHeight_(0)
+    {
+    }
+
+    // If "minWidth" and "minHeight" are not zero, libjpeg downscales
+    // the image by the largest power of 2 (up to 8) that keeps it at
+    // least as large as these dimensions. This scaling happens in the
+    // DCT domain, which is much cheaper than decoding the full image
+    // and resampling it afterward.
+    void ReadFromMemory(const void* buffer,
+                        size_t size,
+                        unsigned int minWidth = 0,
+                        unsigned int minHeight = 0);
+
+    void ReadFromMemory(const std::string& buffer,
+                        unsigned int minWidth = 0,
+                        unsigned int minHeight = 0)
+    {
+      ReadFromMemory(buffer.empty() ? NULL : buffer.c_str(), buffer.size(), minWidth, minHeight);
+    }
+
+    // Reads the file with libjpeg, without loading it in memory
+    void ReadFromFile(const std::string& path,
+                      unsigned int minWidth = 0,
+                      unsigned int minHeight = 0);
+
+    // Gives the size of the image by only reading its header
+    static void ReadSize(unsigned int& width,
+                         unsigned int& height,
+                         const std::string& buffer);
+
+    // Size of the image before the DCT scaling
+    unsigned int GetOriginalWidth() const
+    {
+      return originalWidth_;
+    }
+
+    unsigned int GetOriginalHeight() const
+    {
+      return originalHeight_;
+    }
+  };
+}
@@ -0,0 +1,333 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "JpegRecompressor.h"
+
+#include "ImageResampler.h"
+#include "JpegReader.h"
+#include "JpegWriter.h"
+#include "Toolbox.h"
+
+#include <Core/ImageFormats/ImageBuffer.h>
+#include <Core/OrthancException.h>
+#include <Core/Toolbox.h>
+
+#include <boost/filesystem.hpp>
+#include <glog/logging.h>
+#include <string.h>
+
+namespace PhotoTrack
+{
+  JpegRecompressor::JpegRecompressor(DatabaseWrapper& db,
+                                     unsigned int maxDimension,
+                                     size_t minSize) :
+    db_(db),
+    maxDimension_(maxDimension),
+    minSize_(minSize),
+    quality_(80),
+    done_(true)
+  {
+  }
+
+
+  JpegRecompressor::~JpegRecompressor()
+  {
+    Stop();
+  }
+
+
+  void JpegRecompressor::SetQuality(uint8_t quality)
+  {
+    if (quality == 0 ||
+        quality > 100)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    quality_ = quality;
+  }
+
+
+  void JpegRecompressor::SetOriginalsDirectory(const std::string& path)
+  {
+    boost::filesystem::create_directories(path);
+    originals_ = path;
+  }
+
+
+  bool JpegRecompressor::ExtractExif(std::string& exif,
+                                     const std::string& jpeg)
+  {
+    exif.clear();
+
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(jpeg.c_str());
+    size_t size = jpeg.size();
+
+    // Start Of Image
+    if (size < 4 ||
+        p[0] != 0xff ||
+        p[1] != 0xd8)
+    {
+      return false;
+    }
+
+    // The metadata segments come before the Start Of Scan
+    size_t pos = 2;
+    while (pos + 4 <= size &&
+           p[pos] == 0xff &&
+           p[pos + 1] != 0xda &&
+           p[pos + 1] != 0xd9)
+    {
+      // The length includes its own 2 bytes
+      size_t length = (static_cast<size_t>(p[pos + 2]) << 8) | p[pos + 3];
+      if (length < 2 ||
+          pos + 2 + length > size)
+      {
+        return false;
+      }
+
+      if (p[pos + 1] == 0xe1 &&
+          length >= 8 &&
+          memcmp(p + pos + 4, "Exif\0\0", 6) == 0)
+      {
+        exif.assign(jpeg, pos + 4, length - 2);
+        return true;
+      }
+
+      pos += 2 + length;
+    }
+
+    return false;
+  }
+
+
+  bool JpegRecompressor::Recompress(const std::string& imageUuid)
+  {
+    Photo photo;
+    if (!db_.GetPhotoFromImage(photo, imageUuid) ||
+        photo.GetImageMime() != "image/jpeg")
+    {
+      return false;
+    }
+
+    std::string original;
+    db_.ReadImage(original, photo);
+
+    // The header is enough to skip the images that are small enough
+    unsigned int originalWidth, originalHeight;
+    JpegReader::ReadSize(originalWidth, originalHeight, original);
+
+    if (original.size() <= minSize_ &&
+        originalWidth <= maxDimension_ &&
+        originalHeight <= maxDimension_)
+    {
+      return false;
+    }
+
+    // The DCT scaling of libjpeg does most of the downscaling
+    JpegReader reader;
+    reader.ReadFromMemory(original, maxDimension_, maxDimension_);
+
+    unsigned int width, height;
+    ImageResampler::ComputeFittingSize(width, height, reader.GetWidth(), reader.GetHeight(),
+                                       maxDimension_, maxDimension_);
+
+    JpegWriter writer;
+    writer.SetQuality(quality_);
+
+    std::string exif;
+    if (ExtractExif(exif, original))
+    {
+      writer.SetExif(exif);
+    }
+
+    std::string recompressed;
+
+    if (width == reader.GetWidth() &&
+        height == reader.GetHeight())
+    {
+      writer.WriteToMemory(recompressed, reader);
+    }
+    else
+    {
+      Orthanc::ImageBuffer buffer;
+      buffer.SetFormat(reader.GetFormat());
+      buffer.SetWidth(width);
+      buffer.SetHeight(height);
+
+      Orthanc::ImageAccessor resized = buffer.GetAccessor();
+      ImageResampler::Resample(resized, reader, ResamplingFilter_Lanczos3);
+      writer.WriteToMemory(recompressed, resized);
+    }
+
+    if (recompressed.size() >= original.size())
+    {
+      LOG(INFO) << "Recompressing image " << imageUuid << " would not make it smaller";
+      return false;
+    }
+
+    std::string originalPath;
+    if (!originals_.empty())
+    {
+      // The original can be shared by several photos
+      std::string hash = photo.GetImageHash();
+      if (hash.empty())
+      {
+        hash = PhotoTrack::Toolbox::ComputeSHA1(original.c_str(), original.size());
+      }
+
+      // The same original may already be kept, in which case it must
+      // not be removed below if the swap fails
+      std::string path = (boost::filesystem::path(originals_) / (hash + ".jpg")).string();
+      if (!boost::filesystem::exists(path))
+      {
+        Orthanc::Toolbox::WriteFile(original, path);
+        originalPath = path;
+      }
+    }
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      swapping_.insert(boost::this_thread::get_id());
+    }
+
+    bool swapped = false;
+
+    try
+    {
+      swapped = db_.SwapImage(imageUuid, recompressed, "image/jpeg");
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(WARNING) << "Cannot swap image " << imageUuid << ": " << e.What();
+    }
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      swapping_.erase(boost::this_thread::get_id());
+    }
+
+    if (!swapped)
+    {
+      if (!originalPath.empty())
+      {
+        boost::system::error_code error;
+        boost::filesystem::remove(originalPath, error);
+      }
+
+      return false;
+    }
+
+    LOG(INFO) << "Recompressed image " << imageUuid << " from "
+              << original.size() << " to " << recompressed.size() << " bytes";
+    return true;
+  }
+
+
+  void JpegRecompressor::SignalNewImage(const std::string& imageUuid)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (!done_ &&
+        swapping_.find(boost::this_thread::get_id()) == swapping_.end())
+    {
+      queue_.push_back(imageUuid);
+      wakeup_.notify_one();
+    }
+  }
+
+
+  void JpegRecompressor::Worker(JpegRecompressor* that)
+  {
+    for (;;)
+    {
+      std::string imageUuid;
+
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+
+        while (!that->done_ && that->queue_.empty())
+        {
+          that->wakeup_.wait(lock);
+        }
+
+        if (that->done_)
+        {
+          return;
+        }
+
+        imageUuid = that->queue_.front();
+        that->queue_.pop_front();
+      }
+
+      try
+      {
+        that->Recompress(imageUuid);
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(ERROR) << "Cannot recompress image " << imageUuid << ": " << e.What();
+      }
+      catch (std::exception& e)
+      {
+        LOG(ERROR) << "Cannot recompress image " << imageUuid << ": " << e.what();
+      }
+    }
+  }
+
+
+  void JpegRecompressor::Start(unsigned int workers)
+  {
+    Stop();
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      done_ = false;
+    }
+
+    for (unsigned int i = 0; i < (workers == 0 ? 1 : workers); i++)
+    {
+      threads_.push_back(new boost::thread(Worker, this));
+    }
+  }
+
+
+  void JpegRecompressor::Stop()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      done_ = true;
+      queue_.clear();
+      wakeup_.notify_all();
+    }
+
+    for (size_t i = 0; i < threads_.size(); i++)
+    {
+      if (threads_[i]->joinable())
+      {
+        threads_[i]->join();
+      }
+
+      delete threads_[i];
+    }
+
+    threads_.clear();
+  }
+}
@@ -0,0 +1,95 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include "Database.h"
+#include "IImageListener.h"
+
+#include <boost/thread.hpp>
+#include <list>
+#include <set>
+#include <vector>
+
+namespace PhotoTrack
+{
+  /**
+   * Recompression of the oversized JPEG images that are uploaded by
+   * the cameras, in the background. Once a new image is attached to
+   * a photo, it is recompressed at the configured quality if it is
+   * larger than "minSize" bytes, and downscaled to fit a square of
+   * "maxDimension" pixels. The EXIF metadata (notably the orientation)
+   * is kept. The image is swapped in all the photos that still share
+   * it, if the recompressed image is smaller. Its original SHA-1
+   * remains known to "/images/lookup". The originals can be kept in a
+   * directory, e.g. on a cold storage volume.
+   **/
+  class JpegRecompressor : public IImageListener
+  {
+  private:
+    DatabaseWrapper&             db_;
+    unsigned int                 maxDimension_;
+    size_t                       minSize_;
+    uint8_t                      quality_;
+    std::string                  originals_;
+
+    boost::mutex                 mutex_;
+    bool                         done_;
+    std::list<std::string>       queue_;
+    boost::condition_variable    wakeup_;
+    std::vector<boost::thread*>  threads_;
+
+    // The threads that are swapping an image, whose new image must
+    // not be recompressed again
+    std::set<boost::thread::id>  swapping_;
+
+    static void Worker(JpegRecompressor* that);
+
+  public:
+    JpegRecompressor(DatabaseWrapper& db,
+                     unsigned int maxDimension,
+                     size_t minSize);
+
+    ~JpegRecompressor();
+
+    void SetQuality(uint8_t quality);
+
+    // The original images are written as "<SHA-1 of the image>.jpg"
+    void SetOriginalsDirectory(const std::string& path);
+
+    // Gives the payload of the APP1 marker that contains the EXIF
+    // metadata of a JPEG image
+    static bool ExtractExif(std::string& exif,
+                            const std::string& jpeg);
+
+    // Recompresses the given image in the calling thread. Returns
+    // "false" if the image was left unchanged.
+    bool Recompress(const std::string& imageUuid);
+
+    virtual void SignalNewImage(const std::string& imageUuid);
+
+    virtual void SignalImageDeleted(const std::string& imageUuid)
+    {
+    }
+
+    void Start(unsigned int workers);
+
+    void Stop();
+  };
+}
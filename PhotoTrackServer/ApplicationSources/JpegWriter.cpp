@@ -0,0 +1,123 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "JpegWriter.h"
+
+#include "JpegErrorManager.h"
+
+#include <Core/OrthancException.h>
+#include <glog/logging.h>
+#include <stdlib.h>
+
+namespace PhotoTrack
+{
+  void JpegWriter::SetQuality(uint8_t quality)
+  {
+    if (quality == 0 || 
+        quality > 100)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    quality_ = quality;
+  }
+
+
+  void JpegWriter::SetExif(const std::string& exif)
+  {
+    // The length of a JPEG segment is stored on 16 bits, and includes
+    // the 2 bytes of the length itself
+    if (exif.size() > 65533)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    exif_ = exif;
+  }
+
+
+  void JpegWriter::WriteToMemory(std::string& jpeg,
+                                 const Orthanc::ImageAccessor& accessor)
+  {
+    int components;
+    J_COLOR_SPACE colorSpace;
+
+    switch (accessor.GetFormat())
+    {
+      case Orthanc::PixelFormat_Grayscale8:
+        components = 1;
+        colorSpace = JCS_GRAYSCALE;
+        break;
+
+      case Orthanc::PixelFormat_RGB24:
+        components = 3;
+        colorSpace = JCS_RGB;
+        break;
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented);
+    }
+
+    struct jpeg_compress_struct cinfo;
+    JpegErrorManager error;
+    unsigned char* buffer = NULL;
+    unsigned long size = 0;
+
+    cinfo.err = error.Install();
+
+    if (setjmp(error.jump_))
+    {
+      jpeg_destroy_compress(&cinfo);
+      free(buffer);
+      LOG(ERROR) << "Cannot encode a JPEG image: " << error.message_;
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &buffer, &size);
+
+    cinfo.image_width = accessor.GetWidth();
+    cinfo.image_height = accessor.GetHeight();
+    cinfo.input_components = components;
+    cinfo.in_color_space = colorSpace;
+
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality_, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    if (!exif_.empty())
+    {
+      jpeg_write_marker(&cinfo, JPEG_APP0 + 1, reinterpret_cast<const JOCTET*>(exif_.c_str()),
+                        static_cast<unsigned int>(exif_.size()));
+    }
+
+    while (cinfo.next_scanline < cinfo.image_height)
+    {
+      JSAMPROW row = const_cast<JSAMPROW>(reinterpret_cast<const JSAMPLE*>(accessor.GetConstRow(cinfo.next_scanline)));
+      jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg.assign(reinterpret_cast<const char*>(buffer), size);
+
+    jpeg_destroy_compress(&cinfo);
+    free(buffer);
+  }
+}
@@ -0,0 +1,61 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include <Core/ImageFormats/ImageAccessor.h>
+
+#include <boost/noncopyable.hpp>
+#include <stdint.h>
+#include <string>
+
+namespace PhotoTrack
+{
+  /**
+   * Encoder of JPEG images, based on libjpeg. The interface mimics
+   * that of Orthanc::PngWriter. Only the Grayscale8 and RGB24 pixel
+   * formats are supported.
+   **/
+  class JpegWriter : public boost::noncopyable
+  {
+  private:
+    uint8_t      quality_;
+    std::string  exif_;
+
+  public:
+    JpegWriter() : quality_(85)
+    {
+    }
+
+    void SetQuality(uint8_t quality);
+
+    uint8_t GetQuality() const
+    {
+      return quality_;
+    }
+
+    // Payload of the APP1 marker to be written (starting with
+    // "Exif\0\0"), so as to keep the metadata of the original photo
+    // (notably its orientation). An empty string writes no marker.
+    void SetExif(const std::string& exif);
+
+    void WriteToMemory(std::string& jpeg,
+                       const Orthanc::ImageAccessor& accessor);
+  };
+}
@@ -0,0 +1,83 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include "IBlobReader.h"
+
+#include <Core/OrthancException.h>
+#include <boost/shared_ptr.hpp>
+#include <string.h>
+
+namespace PhotoTrack
+{
+  /**
+   * Reader over a blob that is held in memory, either because the
+   * storage area cannot give random access to its blobs (e.g. the
+   * compressed archives), or because the blob is cached. The content
+   * can be shared with other readers.
+   **/
+  class MemoryBlobReader : public IBlobReader
+  {
+  public:
+    typedef boost::shared_ptr<const std::string>  Content;
+
+  private:
+    Content  content_;
+
+  public:
+    // The content of "content" is taken over by the reader
+    MemoryBlobReader(std::string& content)
+    {
+      std::string* s = new std::string;
+      content_.reset(s);
+      s->swap(content);
+    }
+
+    MemoryBlobReader(const Content& content) :
+      content_(content)
+    {
+      if (content.get() == NULL)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+    }
+
+    virtual uint64_t GetSize()
+    {
+      return content_->size();
+    }
+
+    virtual void Read(void* target,
+                      size_t size,
+                      uint64_t offset)
+    {
+      if (offset > content_->size() ||
+          size > content_->size() - offset)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+
+      if (size > 0)
+      {
+        memcpy(target, content_->c_str() + offset, size);
+      }
+    }
+  };
+}
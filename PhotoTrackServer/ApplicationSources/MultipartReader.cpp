@@ -0,0 +1,288 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "MultipartReader.h"
+
+#include <Core/OrthancException.h>
+#include <Core/Toolbox.h>
+
+#include <string.h>
+
+namespace PhotoTrack
+{
+  // Searches "pattern" in [start, end). The first character of the
+  // patterns is a carriage return, that is rare in the binary
+  // content: "memchr()" skips most of the data.
+  static const char* Find(const char* start,
+                          const char* end,
+                          const std::string& pattern)
+  {
+    while (static_cast<size_t>(end - start) >= pattern.size())
+    {
+      const char* p = reinterpret_cast<const char*>
+        (memchr(start, pattern[0], end - start - pattern.size() + 1));
+
+      if (p == NULL)
+      {
+        return NULL;
+      }
+
+      if (memcmp(p, pattern.c_str(), pattern.size()) == 0)
+      {
+        return p;
+      }
+
+      start = p + 1;
+    }
+
+    return NULL;
+  }
+
+
+  static bool StartsWith(const char* start,
+                         const char* end,
+                         const char* prefix)
+  {
+    size_t length = strlen(prefix);
+    return (static_cast<size_t>(end - start) >= length &&
+            memcmp(start, prefix, length) == 0);
+  }
+
+
+  // Parses the parameters of a header value, such as:
+  // form-data; name="image"; filename="photo.jpg"
+  static void ParseParameters(std::string& value,
+                              std::vector< std::pair<std::string, std::string> >& parameters,
+                              const std::string& header)
+  {
+    parameters.clear();
+
+    std::vector<std::string> tokens;
+    Orthanc::Toolbox::TokenizeString(tokens, header, ';');
+
+    value = Orthanc::Toolbox::StripSpaces(tokens[0]);
+    Orthanc::Toolbox::ToLowerCase(value);
+
+    for (size_t i = 1; i < tokens.size(); i++)
+    {
+      size_t separator = tokens[i].find('=');
+      if (separator != std::string::npos)
+      {
+        std::string key = Orthanc::Toolbox::StripSpaces(tokens[i].substr(0, separator));
+        std::string s = Orthanc::Toolbox::StripSpaces(tokens[i].substr(separator + 1));
+        Orthanc::Toolbox::ToLowerCase(key);
+
+        if (s.size() >= 2 &&
+            s[0] == '"' &&
+            s[s.size() - 1] == '"')
+        {
+          s = s.substr(1, s.size() - 2);
+        }
+
+        parameters.push_back(std::make_pair(key, s));
+      }
+    }
+  }
+
+
+  bool MultipartReader::ParseBoundary(std::string& boundary,
+                                      const std::string& contentType)
+  {
+    std::string value;
+    std::vector< std::pair<std::string, std::string> > parameters;
+    ParseParameters(value, parameters, contentType);
+
+    if (value != "multipart/form-data")
+    {
+      return false;
+    }
+
+    for (size_t i = 0; i < parameters.size(); i++)
+    {
+      // The boundary is at most 70 characters long (RFC 2046)
+      if (parameters[i].first == "boundary" &&
+          !parameters[i].second.empty() &&
+          parameters[i].second.size() <= 70)
+      {
+        boundary = parameters[i].second;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+
+  void MultipartReader::ParseHeaders(Part& part,
+                                     const char* start,
+                                     const char* end)
+  {
+    std::vector<std::string> lines;
+    Orthanc::Toolbox::TokenizeString(lines, std::string(start, end), '\n');
+
+    for (size_t i = 0; i < lines.size(); i++)
+    {
+      size_t colon = lines[i].find(':');
+      if (colon == std::string::npos)
+      {
+        continue;
+      }
+
+      std::string name = Orthanc::Toolbox::StripSpaces(lines[i].substr(0, colon));
+      Orthanc::Toolbox::ToLowerCase(name);
+
+      std::string value = Orthanc::Toolbox::StripSpaces(lines[i].substr(colon + 1));
+
+      if (name == "content-type")
+      {
+        part.contentType_ = value;
+      }
+      else if (name == "content-disposition")
+      {
+        std::string disposition;
+        std::vector< std::pair<std::string, std::string> > parameters;
+        ParseParameters(disposition, parameters, value);
+
+        for (size_t j = 0; j < parameters.size(); j++)
+        {
+          if (parameters[j].first == "name")
+          {
+            part.name_ = parameters[j].second;
+          }
+          else if (parameters[j].first == "filename")
+          {
+            part.fileName_ = parameters[j].second;
+          }
+        }
+      }
+    }
+  }
+
+
+  bool MultipartReader::Parse(const void* body,
+                              size_t size,
+                              const std::string& boundary)
+  {
+    parts_.clear();
+
+    if (boundary.empty())
+    {
+      return false;
+    }
+
+    const char* start = reinterpret_cast<const char*>(body);
+    const char* end = start + size;
+    const std::string delimiter = "\r\n--" + boundary;
+
+    // The first delimiter may come without the leading line break
+    const char* p;
+    if (StartsWith(start, end, delimiter.c_str() + 2))
+    {
+      p = start + delimiter.size() - 2;
+    }
+    else
+    {
+      p = Find(start, end, delimiter);
+      if (p == NULL)
+      {
+        return false;
+      }
+
+      p += delimiter.size();
+    }
+
+    for (;;)
+    {
+      if (StartsWith(p, end, "--"))
+      {
+        return true;   // Close delimiter, the epilogue is ignored
+      }
+
+      // Skip the transport padding after the delimiter
+      while (p < end && (*p == ' ' || *p == '\t'))
+      {
+        p++;
+      }
+
+      if (!StartsWith(p, end, "\r\n"))
+      {
+        return false;
+      }
+
+      p += 2;
+
+      Part part;
+      const char* content;
+
+      if (StartsWith(p, end, "\r\n"))
+      {
+        content = p + 2;   // No header
+      }
+      else
+      {
+        const char* headers = Find(p, end, "\r\n\r\n");
+        if (headers == NULL)
+        {
+          return false;
+        }
+
+        ParseHeaders(part, p, headers);
+        content = headers + 4;
+      }
+
+      const char* next = Find(content, end, delimiter);
+      if (next == NULL)
+      {
+        return false;
+      }
+
+      part.data_ = content;
+      part.size_ = next - content;
+      parts_.push_back(part);
+
+      p = next + delimiter.size();
+    }
+  }
+
+
+  const MultipartReader::Part& MultipartReader::GetPart(size_t index) const
+  {
+    if (index >= parts_.size())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    return parts_[index];
+  }
+
+
+  const MultipartReader::Part* MultipartReader::LookupPart(const std::string& name) const
+  {
+    for (size_t i = 0; i < parts_.size(); i++)
+    {
+      if (parts_[i].name_ == name)
+      {
+        return &parts_[i];
+      }
+    }
+
+    return NULL;
+  }
+}
@@ -0,0 +1,108 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <string>
+#include <vector>
+
+namespace PhotoTrack
+{
+  /**
+   * Parser of the "multipart/form-data" request bodies (RFC 7578).
+   * The content of the parts is not copied: It points into the
+   * buffer of the body, that must outlive the reader. This way, a
+   * binary part can be handed to the image storage in place.
+   **/
+  class MultipartReader : public boost::noncopyable
+  {
+  public:
+    class Part
+    {
+      friend class MultipartReader;
+
+    private:
+      std::string  name_;
+      std::string  fileName_;
+      std::string  contentType_;
+      const char*  data_;
+      size_t       size_;
+
+    public:
+      Part() : data_(NULL), size_(0)
+      {
+      }
+
+      const std::string& GetName() const
+      {
+        return name_;
+      }
+
+      const std::string& GetFileName() const
+      {
+        return fileName_;
+      }
+
+      // Empty if the part has no "Content-Type" header
+      const std::string& GetContentType() const
+      {
+        return contentType_;
+      }
+
+      const char* GetData() const
+      {
+        return data_;
+      }
+
+      size_t GetSize() const
+      {
+        return size_;
+      }
+    };
+
+  private:
+    std::vector<Part>  parts_;
+
+    static void ParseHeaders(Part& part,
+                             const char* start,
+                             const char* end);
+
+  public:
+    // Extracts the boundary from the value of a "Content-Type" HTTP
+    // header. Returns "false" if the body is not "multipart/form-data".
+    static bool ParseBoundary(std::string& boundary,
+                              const std::string& contentType);
+
+    // Returns "false" if the body is malformed
+    bool Parse(const void* body,
+               size_t size,
+               const std::string& boundary);
+
+    size_t GetPartsCount() const
+    {
+      return parts_.size();
+    }
+
+    const Part& GetPart(size_t index) const;
+
+    // Returns NULL if there is no part with this name
+    const Part* LookupPart(const std::string& name) const;
+  };
+}
@@ -0,0 +1,859 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "PackfileStorage.h"
+
+#include "FileSynchronizer.h"
+
+#include <Core/OrthancException.h>
+#include <Core/SQLite/Statement.h>
+#include <Core/SQLite/Transaction.h>
+#include <Core/Uuid.h>
+
+#include <glog/logging.h>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <list>
+
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#if !defined(O_BINARY)
+#define O_BINARY 0
+#endif
+
+
+namespace
+{
+  struct Blob
+  {
+    std::string  uuid_;
+    uint64_t     offset_;
+    uint64_t     size_;
+  };
+}
+
+
+namespace PhotoTrack
+{
+  class PackfileStorage::Segment : public boost::noncopyable
+  {
+  private:
+    std::string  path_;
+    int          fd_;
+    bool         obsolete_;
+
+#if defined(_WIN32)
+    // There is no "pread()/pwrite()" on Windows: Seeking and accessing
+    // the file must be done atomically
+    boost::mutex mutex_;
+#endif
+
+  public:
+    Segment(const std::string& path) :
+      path_(path),
+      obsolete_(false)
+    {
+      fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_BINARY, 0644);
+      if (fd_ < 0)
+      {
+        LOG(ERROR) << "Cannot open the segment file: " << path;
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+      }
+    }
+
+    ~Segment()
+    {
+      close(fd_);
+
+      if (obsolete_)
+      {
+        // The segment was compacted. This is done only after the
+        // last reader has released the segment.
+        boost::system::error_code error;
+        boost::filesystem::remove(path_, error);
+      }
+    }
+
+    void MarkObsolete()
+    {
+      obsolete_ = true;
+    }
+
+    uint64_t GetSize()
+    {
+      struct stat s;
+      if (fstat(fd_, &s) != 0)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile);
+      }
+
+      return static_cast<uint64_t>(s.st_size);
+    }
+
+    void Write(uint64_t offset,
+               const void* content,
+               size_t size)
+    {
+      const char* p = reinterpret_cast<const char*>(content);
+
+#if defined(_WIN32)
+      boost::mutex::scoped_lock lock(mutex_);
+      if (_lseeki64(fd_, offset, SEEK_SET) < 0)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+      }
+#endif
+
+      while (size > 0)
+      {
+#if defined(_WIN32)
+        int n = _write(fd_, p, static_cast<unsigned int>(size));
+#else
+        ssize_t n = pwrite(fd_, p, size, offset);
+#endif
+
+        if (n <= 0)
+        {
+          if (n < 0 && errno == EINTR)
+          {
+            continue;
+          }
+
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+        }
+
+        p += n;
+        offset += n;
+        size -= n;
+      }
+    }
+
+    void Flush(FileSynchronizer& synchronizer,
+               const std::string& directory)
+    {
+      switch (synchronizer.GetPolicy())
+      {
+        case DurabilityPolicy_OsBuffered:
+          return;
+
+        case DurabilityPolicy_PerWrite:
+          if (!FileSynchronizer::SyncFile(fd_))
+          {
+            LOG(ERROR) << "Cannot flush the segment file: " << path_;
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+          }
+          return;
+
+        default:
+        {
+          // The synchronizer closes the descriptor it is given
+#if defined(_WIN32)
+          int fd = _dup(fd_);
+#else
+          int fd = dup(fd_);
+#endif
+
+          if (fd < 0)
+          {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+          }
+
+          synchronizer.Commit(fd, directory);
+          return;
+        }
+      }
+    }
+
+    void Read(void* content,
+              uint64_t offset,
+              size_t size)
+    {
+      char* p = reinterpret_cast<char*>(content);
+
+#if defined(_WIN32)
+      boost::mutex::scoped_lock lock(mutex_);
+      if (_lseeki64(fd_, offset, SEEK_SET) < 0)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+      }
+#endif
+
+      while (size > 0)
+      {
+#if defined(_WIN32)
+        int n = _read(fd_, p, static_cast<unsigned int>(size));
+#else
+        ssize_t n = pread(fd_, p, size, offset);
+#endif
+
+        if (n <= 0)
+        {
+          if (n < 0 && errno == EINTR)
+          {
+            continue;
+          }
+
+          // Reading past the end of the segment
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+        }
+
+        p += n;
+        offset += n;
+        size -= n;
+      }
+    }
+  };
+
+
+  class PackfileStorage::BlobReader : public IBlobReader
+  {
+  private:
+    SegmentPointer  segment_;   // Keeps the segment alive while streaming
+    uint64_t        offset_;
+    uint64_t        size_;
+
+  public:
+    BlobReader(SegmentPointer segment,
+               uint64_t offset,
+               uint64_t size) :
+      segment_(segment),
+      offset_(offset),
+      size_(size)
+    {
+    }
+
+    virtual uint64_t GetSize()
+    {
+      return size_;
+    }
+
+    virtual void Read(void* target,
+                      size_t size,
+                      uint64_t offset)
+    {
+      if (offset > size_ ||
+          size > size_ - offset)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+
+      if (size > 0)
+      {
+        segment_->Read(target, offset_ + offset, size);
+      }
+    }
+  };
+
+
+  std::string PackfileStorage::GetSegmentPath(int64_t segment) const
+  {
+    char name[32];
+    sprintf(name, "segment-%08d.pack", static_cast<int>(segment));
+    return (boost::filesystem::path(root_) / name).string();
+  }
+
+
+  PackfileStorage::SegmentPointer PackfileStorage::GetSegment(int64_t segment)
+  {
+    // The mutex must be locked at this point
+
+    Segments::iterator found = segments_.find(segment);
+    if (found != segments_.end())
+    {
+      return found->second;
+    }
+
+    SegmentPointer s(new Segment(GetSegmentPath(segment)));
+    segments_[segment] = s;
+    return s;
+  }
+
+
+  void PackfileStorage::OpenNewSegment()
+  {
+    // The mutex must be locked at this point
+    using namespace Orthanc;
+
+    SQLite::Statement s(index_, SQLITE_FROM_HERE, "INSERT INTO Segments VALUES(NULL, 0, 0)");
+    s.Run();
+
+    activeSegment_ = index_.GetLastInsertRowId();
+    activeSize_ = 0;
+    GetSegment(activeSegment_);
+
+    if (!FileSynchronizer::SyncDirectory(root_))
+    {
+      throw OrthancException(ErrorCode_CannotWriteFile);
+    }
+
+    LOG(INFO) << "New packfile segment: " << GetSegmentPath(activeSegment_);
+  }
+
+
+  PackfileStorage::SegmentPointer PackfileStorage::Reserve(int64_t& segment,
+                                                           uint64_t& offset,
+                                                           uint64_t size)
+  {
+    // The mutex must be locked at this point
+
+    if (activeSize_ > 0 &&
+        activeSize_ + size > maxSegmentSize_)
+    {
+      // The active segment is full, seal it
+      OpenNewSegment();
+    }
+
+    segment = activeSegment_;
+    offset = activeSize_;
+    activeSize_ += size;
+
+    // The segment cannot be compacted until the reservation is
+    // released
+    pendingWrites_[segment]++;
+
+    return GetSegment(segment);
+  }
+
+
+  void PackfileStorage::ReleaseReservation(int64_t segment)
+  {
+    // The mutex must be locked at this point
+
+    PendingWrites::iterator found = pendingWrites_.find(segment);
+    if (found != pendingWrites_.end() &&
+        --found->second == 0)
+    {
+      pendingWrites_.erase(found);
+    }
+  }
+
+
+  void PackfileStorage::UpdateSegmentSize(int64_t segment,
+                                          uint64_t end)
+  {
+    // The mutex must be locked at this point. The blobs that were
+    // reserved concurrently can be indexed in any order.
+    using namespace Orthanc;
+
+    SQLite::Statement s(index_, SQLITE_FROM_HERE, "UPDATE Segments SET size=MAX(size, ?) WHERE id=?");
+    s.BindInt64(0, end);
+    s.BindInt64(1, segment);
+    s.Run();
+  }
+
+
+  void PackfileStorage::MarkDead(int64_t segment,
+                                 uint64_t size)
+  {
+    // The mutex must be locked at this point
+    using namespace Orthanc;
+
+    SQLite::Statement s(index_, SQLITE_FROM_HERE, "UPDATE Segments SET deadBytes=deadBytes+? WHERE id=?");
+    s.BindInt64(0, size);
+    s.BindInt64(1, segment);
+    s.Run();
+  }
+
+
+  bool PackfileStorage::Lookup(SegmentPointer& segment,
+                               uint64_t& offset,
+                               uint64_t& size,
+                               const std::string& uuid)
+  {
+    using namespace Orthanc;
+    boost::mutex::scoped_lock lock(mutex_);
+
+    SQLite::Statement s(index_, SQLITE_FROM_HERE, "SELECT segment, offset, size FROM Blobs WHERE uuid=?");
+    s.BindString(0, uuid);
+
+    if (!s.Step())
+    {
+      return false;
+    }
+
+    segment = GetSegment(s.ColumnInt64(0));
+    offset = s.ColumnInt64(1);
+    size = s.ColumnInt64(2);
+    return true;
+  }
+
+
+  PackfileStorage::PackfileStorage(const std::string& root,
+                                   DurabilityPolicy policy) :
+    synchronizer_(policy),
+    root_(root),
+    maxSegmentSize_(256 * 1024 * 1024),  // 256MB
+    compactionRatio_(0.5f),
+    done_(true)
+  {
+    using namespace Orthanc;
+
+    boost::filesystem::create_directories(root);
+
+    std::string path = (boost::filesystem::path(root) / "index.db").string();
+    LOG(WARNING) << "Using the following packfile index: " << path;
+
+    index_.Open(path);
+
+    // The index is as durable as the segments
+    if (policy == DurabilityPolicy_OsBuffered)
+    {
+      index_.Execute("PRAGMA SYNCHRONOUS=NORMAL;");
+    }
+    else
+    {
+      index_.Execute("PRAGMA SYNCHRONOUS=FULL;");
+    }
+
+    index_.Execute("PRAGMA JOURNAL_MODE=WAL;");
+
+    if (!index_.DoesTableExist("Blobs"))
+    {
+      index_.Execute("CREATE TABLE Segments("
+                     "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+                     "size INTEGER, "
+                     "deadBytes INTEGER);");
+      index_.Execute("CREATE TABLE Blobs("
+                     "uuid TEXT PRIMARY KEY, "
+                     "segment INTEGER, "
+                     "offset INTEGER, "
+                     "size INTEGER);");
+      index_.Execute("CREATE INDEX BlobsSegment ON Blobs(segment);");
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    SQLite::Statement s(index_, SQLITE_FROM_HERE, "SELECT id, size FROM Segments ORDER BY id DESC LIMIT 1");
+    if (s.Step())
+    {
+      activeSegment_ = s.ColumnInt64(0);
+      activeSize_ = GetSegment(activeSegment_)->GetSize();
+
+      uint64_t recorded = s.ColumnInt64(1);
+      if (activeSize_ > recorded)
+      {
+        // The server was stopped while appending a blob: The
+        // trailing bytes are not indexed, mark them as dead
+        LOG(WARNING) << "Ignoring " << (activeSize_ - recorded) 
+                     << " trailing bytes in " << GetSegmentPath(activeSegment_);
+
+        SQLite::Statement u(index_, SQLITE_FROM_HERE, "UPDATE Segments SET size=? WHERE id=?");
+        u.BindInt64(0, activeSize_);
+        u.BindInt64(1, activeSegment_);
+        u.Run();
+
+        MarkDead(activeSegment_, activeSize_ - recorded);
+      }
+    }
+    else
+    {
+      OpenNewSegment();
+    }
+  }
+
+
+  PackfileStorage::~PackfileStorage()
+  {
+    StopCompaction();
+  }
+
+
+  std::string PackfileStorage::Create(const void* content,
+                                      size_t size)
+  {
+    using namespace Orthanc;
+
+    std::string uuid = Toolbox::GenerateUuid();
+
+    int64_t segment;
+    uint64_t offset;
+    SegmentPointer target;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      target = Reserve(segment, offset, size);
+    }
+
+    try
+    {
+      // The bytes must be durable before the index refers to them
+      target->Write(offset, content, size);
+      target->Flush(synchronizer_, root_);
+    }
+    catch (OrthancException&)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      ReleaseReservation(segment);
+
+      SQLite::Transaction transaction(index_);
+      transaction.Begin();
+      UpdateSegmentSize(segment, offset + size);
+      MarkDead(segment, size);
+      transaction.Commit();
+
+      throw;
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    ReleaseReservation(segment);
+
+    // The size of the segment and the blob are indexed at once
+    SQLite::Transaction transaction(index_);
+    transaction.Begin();
+
+    UpdateSegmentSize(segment, offset + size);
+
+    SQLite::Statement s(index_, SQLITE_FROM_HERE, "INSERT INTO Blobs VALUES(?, ?, ?, ?)");
+    s.BindString(0, uuid);
+    s.BindInt64(1, segment);
+    s.BindInt64(2, offset);
+    s.BindInt64(3, size);
+    s.Run();
+
+    transaction.Commit();
+
+    return uuid;
+  }
+
+
+  void PackfileStorage::Read(std::string& content,
+                             const std::string& uuid)
+  {
+    SegmentPointer segment;
+    uint64_t offset, size;
+
+    if (!Lookup(segment, offset, size, uuid))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile);
+    }
+
+    // The segment is read without locking the mutex: The bytes of a
+    // blob are never modified once written, and the segment cannot
+    // be deleted as long as "segment" references it
+    content.resize(static_cast<size_t>(size));
+    if (size > 0)
+    {
+      segment->Read(&content[0], offset, static_cast<size_t>(size));
+    }
+  }
+
+
+  void PackfileStorage::Remove(const std::string& uuid)
+  {
+    using namespace Orthanc;
+    boost::mutex::scoped_lock lock(mutex_);
+
+    SQLite::Statement s(index_, SQLITE_FROM_HERE, "SELECT segment, size FROM Blobs WHERE uuid=?");
+    s.BindString(0, uuid);
+
+    if (s.Step())
+    {
+      int64_t segment = s.ColumnInt64(0);
+      uint64_t size = s.ColumnInt64(1);
+
+      SQLite::Statement d(index_, SQLITE_FROM_HERE, "DELETE FROM Blobs WHERE uuid=?");
+      d.BindString(0, uuid);
+      d.Run();
+
+      MarkDead(segment, size);
+    }
+  }
+
+
+  IBlobReader* PackfileStorage::OpenBlob(const std::string& uuid)
+  {
+    SegmentPointer segment;
+    uint64_t offset, size;
+
+    if (!Lookup(segment, offset, size, uuid))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile);
+    }
+
+    return new BlobReader(segment, offset, size);
+  }
+
+
+  bool PackfileStorage::Exists(const std::string& uuid)
+  {
+    using namespace Orthanc;
+    boost::mutex::scoped_lock lock(mutex_);
+
+    SQLite::Statement s(index_, SQLITE_FROM_HERE, "SELECT 1 FROM Blobs WHERE uuid=?");
+    s.BindString(0, uuid);
+    return s.Step();
+  }
+
+
+  void PackfileStorage::SetMaxSegmentSize(uint64_t size)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    maxSegmentSize_ = size;
+  }
+
+
+  void PackfileStorage::SetCompactionRatio(float ratio)
+  {
+    if (ratio <= 0.0f || ratio > 1.0f)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    compactionRatio_ = ratio;
+  }
+
+
+  void PackfileStorage::CompactSegment(int64_t segment)
+  {
+    using namespace Orthanc;
+
+    std::list<Blob> blobs;
+    SegmentPointer source;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      SQLite::Statement s(index_, SQLITE_FROM_HERE, "SELECT uuid, offset, size FROM Blobs WHERE segment=?");
+      s.BindInt64(0, segment);
+
+      while (s.Step())
+      {
+        Blob blob;
+        blob.uuid_ = s.ColumnString(0);
+        blob.offset_ = s.ColumnInt64(1);
+        blob.size_ = s.ColumnInt64(2);
+        blobs.push_back(blob);
+      }
+
+      source = GetSegment(segment);
+    }
+
+    LOG(INFO) << "Compacting packfile segment " << GetSegmentPath(segment) 
+              << " (" << blobs.size() << " live blobs)";
+
+    uint64_t total = 0;
+    for (std::list<Blob>::const_iterator it = blobs.begin(); it != blobs.end(); ++it)
+    {
+      total += it->size_;
+    }
+
+    // All the live blobs are moved into one reserved region, that is
+    // flushed once and indexed in a single transaction
+    int64_t target = 0;
+    uint64_t start = 0;
+    SegmentPointer destination;
+
+    if (!blobs.empty())
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      destination = Reserve(target, start, total);
+    }
+
+    if (destination.get() != NULL)
+    {
+      try
+      {
+        // Copy the blobs outside of the lock, as a sealed segment is
+        // never modified
+        std::string buffer;
+        uint64_t offset = start;
+
+        for (std::list<Blob>::const_iterator it = blobs.begin(); it != blobs.end(); ++it)
+        {
+          buffer.resize(static_cast<size_t>(it->size_));
+          if (!buffer.empty())
+          {
+            source->Read(&buffer[0], it->offset_, buffer.size());
+            destination->Write(offset, buffer.c_str(), buffer.size());
+          }
+
+          offset += it->size_;
+        }
+
+        destination->Flush(synchronizer_, root_);
+      }
+      catch (OrthancException&)
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        ReleaseReservation(target);
+
+        SQLite::Transaction transaction(index_);
+        transaction.Begin();
+        UpdateSegmentSize(target, start + total);
+        MarkDead(target, total);
+        transaction.Commit();
+
+        throw;
+      }
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    SQLite::Transaction transaction(index_);
+    transaction.Begin();
+
+    if (destination.get() != NULL)
+    {
+      ReleaseReservation(target);
+      UpdateSegmentSize(target, start + total);
+
+      uint64_t offset = start;
+      for (std::list<Blob>::const_iterator it = blobs.begin(); it != blobs.end(); ++it)
+      {
+        SQLite::Statement u(index_, SQLITE_FROM_HERE, "UPDATE Blobs SET segment=?, offset=? WHERE uuid=? AND segment=?");
+        u.BindInt64(0, target);
+        u.BindInt64(1, offset);
+        u.BindString(2, it->uuid_);
+        u.BindInt64(3, segment);
+        u.Run();
+
+        if (index_.GetLastChangeCount() == 0)
+        {
+          // This blob was removed in the meantime
+          MarkDead(target, it->size_);
+        }
+
+        offset += it->size_;
+      }
+    }
+
+    SQLite::Statement s(index_, SQLITE_FROM_HERE, "DELETE FROM Segments WHERE id=?");
+    s.BindInt64(0, segment);
+    s.Run();
+
+    transaction.Commit();
+
+    // The file is removed once the last pending reader is done
+    GetSegment(segment)->MarkObsolete();
+    segments_.erase(segment);
+  }
+
+
+  void PackfileStorage::Compact()
+  {
+    using namespace Orthanc;
+
+    std::list<int64_t> candidates;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      SQLite::Statement s(index_, SQLITE_FROM_HERE, 
+                          "SELECT id FROM Segments WHERE id<>? AND deadBytes>=?*size");
+      s.BindInt64(0, activeSegment_);
+      s.BindDouble(1, compactionRatio_);
+
+      while (s.Step())
+      {
+        // Skip the segments that still have blobs being written
+        if (pendingWrites_.find(s.ColumnInt64(0)) == pendingWrites_.end())
+        {
+          candidates.push_back(s.ColumnInt64(0));
+        }
+      }
+    }
+
+    for (std::list<int64_t>::const_iterator 
+           it = candidates.begin(); it != candidates.end(); ++it)
+    {
+      CompactSegment(*it);
+    }
+  }
+
+
+  unsigned int PackfileStorage::GetSegmentsCount()
+  {
+    using namespace Orthanc;
+    boost::mutex::scoped_lock lock(mutex_);
+
+    SQLite::Statement s(index_, SQLITE_FROM_HERE, "SELECT COUNT(*) FROM Segments");
+    s.Step();
+    return static_cast<unsigned int>(s.ColumnInt(0));
+  }
+
+
+  void PackfileStorage::CompactionThread(PackfileStorage* that,
+                                         unsigned int interval)
+  {
+    for (;;)
+    {
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+
+        if (!that->done_)
+        {
+          that->wakeup_.timed_wait(lock, boost::posix_time::seconds(interval));
+        }
+
+        if (that->done_)
+        {
+          return;
+        }
+      }
+
+      try
+      {
+        that->Compact();
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(ERROR) << "Error while compacting the packfiles: " << e.What();
+      }
+    }
+  }
+
+
+  void PackfileStorage::StartCompaction(unsigned int interval)
+  {
+    StopCompaction();
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      done_ = false;
+    }
+
+    compactionThread_ = boost::thread(CompactionThread, this, interval);
+  }
+
+
+  void PackfileStorage::StopCompaction()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      done_ = true;
+      wakeup_.notify_all();
+    }
+
+    if (compactionThread_.joinable())
+    {
+      compactionThread_.join();
+    }
+  }
+}
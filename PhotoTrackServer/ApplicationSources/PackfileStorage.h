@@ -0,0 +1,134 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include "FileSynchronizer.h"
+#include "IImageStorage.h"
+
+#include <Core/SQLite/Connection.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <map>
+
+namespace PhotoTrack
+{
+  /**
+   * Storage area for small blobs. Instead of creating one file per
+   * blob, the blobs are appended to large segment files, and a SQLite
+   * index maps each blob to its (segment, offset, size). Removing a
+   * blob only marks its bytes as dead: The segments that contain too
+   * many dead bytes are rewritten by a background compaction thread.
+   * The space of each blob is reserved in the active segment under
+   * the lock, but the blob is written and flushed to the disk outside
+   * of it (depending on the durability policy), so that the
+   * concurrent uploads are not serialized. Each blob is only indexed
+   * once it is flushed.
+   **/
+  class PackfileStorage : public IImageStorage
+  {
+  private:
+    class Segment;
+    class BlobReader;
+
+    typedef boost::shared_ptr<Segment>     SegmentPointer;
+    typedef std::map<int64_t, SegmentPointer>  Segments;
+    typedef std::map<int64_t, unsigned int>    PendingWrites;
+
+    FileSynchronizer             synchronizer_;
+
+    boost::mutex                 mutex_;   // Protects all the members below
+    std::string                  root_;
+    Orthanc::SQLite::Connection  index_;
+    Segments                     segments_;
+    PendingWrites                pendingWrites_;   // Segment => number of blobs being written
+    int64_t                      activeSegment_;
+    uint64_t                     activeSize_;
+    uint64_t                     maxSegmentSize_;
+    float                        compactionRatio_;
+
+    bool                         done_;
+    boost::condition_variable    wakeup_;
+    boost::thread                compactionThread_;
+
+    static void CompactionThread(PackfileStorage* that,
+                                 unsigned int interval);
+
+    std::string GetSegmentPath(int64_t segment) const;
+
+    SegmentPointer GetSegment(int64_t segment);
+
+    void OpenNewSegment();
+
+    SegmentPointer Reserve(int64_t& segment,
+                           uint64_t& offset,
+                           uint64_t size);
+
+    void ReleaseReservation(int64_t segment);
+
+    void UpdateSegmentSize(int64_t segment,
+                           uint64_t end);
+
+    void MarkDead(int64_t segment,
+                  uint64_t size);
+
+    bool Lookup(SegmentPointer& segment,
+                uint64_t& offset,
+                uint64_t& size,
+                const std::string& uuid);
+
+    void CompactSegment(int64_t segment);
+
+  public:
+    PackfileStorage(const std::string& root,
+                    DurabilityPolicy policy = DurabilityPolicy_OsBuffered);
+
+    ~PackfileStorage();
+
+    using IImageStorage::Create;
+
+    virtual std::string Create(const void* content,
+                               size_t size);
+
+    virtual void Read(std::string& content,
+                      const std::string& uuid);
+
+    virtual void Remove(const std::string& uuid);
+
+    virtual bool Exists(const std::string& uuid);
+
+    virtual IBlobReader* OpenBlob(const std::string& uuid);
+
+    void SetMaxSegmentSize(uint64_t size);
+
+    // A sealed segment is compacted as soon as the fraction of its
+    // bytes that are dead exceeds this ratio
+    void SetCompactionRatio(float ratio);
+
+    void StartCompaction(unsigned int interval);  // In seconds
+
+    void StopCompaction();
+
+    // Runs one compaction pass over all the sealed segments
+    void Compact();
+
+    unsigned int GetSegmentsCount();
+  };
+}
@@ -0,0 +1,420 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "PerceptualHash.h"
+
+#include "CpuFeatures.h"
+#include "ImageResampler.h"
+
+#include <Core/ImageFormats/ImageBuffer.h>
+#include <Core/OrthancException.h>
+
+#include <map>
+
+namespace PhotoTrack
+{
+  static const unsigned int HASH_WIDTH = 9;
+  static const unsigned int HASH_HEIGHT = 8;
+
+  namespace
+  {
+    inline unsigned int CountBits(uint64_t x)
+    {
+      x -= (x >> 1) & 0x5555555555555555ULL;
+      x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+      x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+      return static_cast<unsigned int>((x * 0x0101010101010101ULL) >> 56);
+    }
+
+
+    void DistancesScalar(uint8_t* distances,
+                         uint64_t hash,
+                         const uint64_t* hashes,
+                         size_t count)
+    {
+      for (size_t i = 0; i < count; i++)
+      {
+        distances[i] = static_cast<uint8_t>(CountBits(hash ^ hashes[i]));
+      }
+    }
+
+
+#if PHOTO_TRACK_X86_SIMD == 1
+    /**
+     * The bits of each nibble are counted with a "pshufb" lookup, then
+     * "psadbw" sums the 8 bytes of each 64-bit lane (Wojciech Mula,
+     * "Faster Population Counts Using AVX2 Instructions", 2016).
+     **/
+
+    PHOTO_TRACK_TARGET("ssse3")
+    size_t DistancesSsse3(uint8_t* distances,
+                          uint64_t hash,
+                          const uint64_t* hashes,
+                          size_t count)
+    {
+      const __m128i lookup = _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+      const __m128i nibbles = _mm_set1_epi8(0x0f);
+      const __m128i h = _mm_set1_epi64x(static_cast<int64_t>(hash));
+
+      size_t i = 0;
+      for (; i + 2 <= count; i += 2)
+      {
+        const __m128i x = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(hashes + i)), h);
+        const __m128i bits = _mm_add_epi8(_mm_shuffle_epi8(lookup, _mm_and_si128(x, nibbles)),
+                                          _mm_shuffle_epi8(lookup, _mm_and_si128(_mm_srli_epi16(x, 4), nibbles)));
+        const __m128i sums = _mm_sad_epu8(bits, _mm_setzero_si128());
+
+        distances[i] = static_cast<uint8_t>(_mm_cvtsi128_si32(sums));
+        distances[i + 1] = static_cast<uint8_t>(_mm_extract_epi16(sums, 4));
+      }
+
+      return i;
+    }
+
+
+    PHOTO_TRACK_TARGET("avx2")
+    size_t DistancesAvx2(uint8_t* distances,
+                         uint64_t hash,
+                         const uint64_t* hashes,
+                         size_t count)
+    {
+      const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                              0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+      const __m256i nibbles = _mm256_set1_epi8(0x0f);
+      const __m256i h = _mm256_set1_epi64x(static_cast<int64_t>(hash));
+
+      size_t i = 0;
+      for (; i + 4 <= count; i += 4)
+      {
+        const __m256i x = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(hashes + i)), h);
+        const __m256i bits = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, _mm256_and_si256(x, nibbles)),
+                                             _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(x, 4), nibbles)));
+        const __m256i sums = _mm256_sad_epu8(bits, _mm256_setzero_si256());
+
+        const __m128i low = _mm256_castsi256_si128(sums);
+        const __m128i high = _mm256_extracti128_si256(sums, 1);
+        distances[i] = static_cast<uint8_t>(_mm_cvtsi128_si32(low));
+        distances[i + 1] = static_cast<uint8_t>(_mm_extract_epi16(low, 4));
+        distances[i + 2] = static_cast<uint8_t>(_mm_cvtsi128_si32(high));
+        distances[i + 3] = static_cast<uint8_t>(_mm_extract_epi16(high, 4));
+      }
+
+      return i;
+    }
+#endif
+
+
+    HammingKernel DetectBestKernel()
+    {
+      if (CpuFeatures::IsSupported(CpuFeature_Avx2))
+      {
+        return HammingKernel_Avx2;
+      }
+      else if (CpuFeatures::IsSupported(CpuFeature_Ssse3))
+      {
+        return HammingKernel_Ssse3;
+      }
+      else
+      {
+        return HammingKernel_Scalar;
+      }
+    }
+
+
+    size_t FindRoot(std::vector<size_t>& parents,
+                    size_t i)
+    {
+      while (parents[i] != i)
+      {
+        parents[i] = parents[parents[i]];   // Path halving
+        i = parents[i];
+      }
+
+      return i;
+    }
+  }
+
+
+  HammingKernel PerceptualHash::GetBestKernel()
+  {
+    static const HammingKernel kernel = DetectBestKernel();
+    return kernel;
+  }
+
+
+  bool PerceptualHash::IsKernelSupported(HammingKernel kernel)
+  {
+    return (kernel == HammingKernel_Scalar ||
+            (kernel == HammingKernel_Ssse3 && GetBestKernel() != HammingKernel_Scalar) ||
+            (kernel == HammingKernel_Avx2 && GetBestKernel() == HammingKernel_Avx2));
+  }
+
+
+  const char* PerceptualHash::EnumerationToString(HammingKernel kernel)
+  {
+    switch (kernel)
+    {
+      case HammingKernel_Scalar:
+        return "Scalar";
+
+      case HammingKernel_Ssse3:
+        return "SSSE3";
+
+      case HammingKernel_Avx2:
+        return "AVX2";
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  bool PerceptualHash::Compute(uint64_t& hash,
+                               const Orthanc::ImageAccessor& image)
+  {
+    unsigned int channels;
+
+    switch (image.GetFormat())
+    {
+      case Orthanc::PixelFormat_Grayscale8:
+        channels = 1;
+        break;
+
+      case Orthanc::PixelFormat_RGB24:
+        channels = 3;
+        break;
+
+      case Orthanc::PixelFormat_RGBA32:
+        channels = 4;
+        break;
+
+      default:
+        return false;
+    }
+
+    if (image.GetWidth() == 0 ||
+        image.GetHeight() == 0)
+    {
+      return false;
+    }
+
+    // The box filter averages the whole image, whatever its aspect ratio
+    Orthanc::ImageBuffer buffer;
+    buffer.SetFormat(image.GetFormat());
+    buffer.SetWidth(HASH_WIDTH);
+    buffer.SetHeight(HASH_HEIGHT);
+
+    Orthanc::ImageAccessor thumbnail = buffer.GetAccessor();
+    ImageResampler::Resample(thumbnail, image, ResamplingFilter_Area);
+
+    hash = 0;
+
+    for (unsigned int y = 0; y < HASH_HEIGHT; y++)
+    {
+      const uint8_t* p = reinterpret_cast<const uint8_t*>(thumbnail.GetConstRow(y));
+
+      unsigned int luma[HASH_WIDTH];
+      for (unsigned int x = 0; x < HASH_WIDTH; x++, p += channels)
+      {
+        if (channels == 1)
+        {
+          luma[x] = p[0];
+        }
+        else
+        {
+          // ITU-R BT.601, in 8-bit fixed point (the alpha is ignored)
+          luma[x] = (77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8;
+        }
+      }
+
+      for (unsigned int x = 0; x + 1 < HASH_WIDTH; x++)
+      {
+        hash = (hash << 1) | (luma[x] > luma[x + 1] ? 1 : 0);
+      }
+    }
+
+    return true;
+  }
+
+
+  std::string PerceptualHash::Format(uint64_t hash)
+  {
+    static const char DIGITS[] = "0123456789abcdef";
+
+    std::string s(16, '0');
+    for (unsigned int i = 0; i < 16; i++)
+    {
+      s[15 - i] = DIGITS[(hash >> (4 * i)) & 0x0f];
+    }
+
+    return s;
+  }
+
+
+  bool PerceptualHash::Parse(uint64_t& hash,
+                             const std::string& value)
+  {
+    if (value.size() != 16)
+    {
+      return false;
+    }
+
+    uint64_t result = 0;
+
+    for (size_t i = 0; i < value.size(); i++)
+    {
+      const char c = value[i];
+      unsigned int digit;
+
+      if (c >= '0' && c <= '9')
+      {
+        digit = c - '0';
+      }
+      else if (c >= 'a' && c <= 'f')
+      {
+        digit = c - 'a' + 10;
+      }
+      else if (c >= 'A' && c <= 'F')
+      {
+        digit = c - 'A' + 10;
+      }
+      else
+      {
+        return false;
+      }
+
+      result = (result << 4) | digit;
+    }
+
+    hash = result;
+    return true;
+  }
+
+
+  unsigned int PerceptualHash::GetDistance(uint64_t a,
+                                           uint64_t b)
+  {
+    return CountBits(a ^ b);
+  }
+
+
+  void PerceptualHash::ComputeDistances(uint8_t* distances,
+                                        uint64_t hash,
+                                        const uint64_t* hashes,
+                                        size_t count,
+                                        HammingKernel kernel)
+  {
+    if (!IsKernelSupported(kernel))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    size_t done = 0;
+
+    switch (kernel)
+    {
+#if PHOTO_TRACK_X86_SIMD == 1
+      case HammingKernel_Avx2:
+        done = DistancesAvx2(distances, hash, hashes, count);
+        done += DistancesSsse3(distances + done, hash, hashes + done, count - done);
+        break;
+
+      case HammingKernel_Ssse3:
+        done = DistancesSsse3(distances, hash, hashes, count);
+        break;
+#endif
+
+      default:
+        break;
+    }
+
+    DistancesScalar(distances + done, hash, hashes + done, count - done);
+  }
+
+
+  void PerceptualHash::Cluster(std::list< std::vector<size_t> >& groups,
+                               const std::vector<uint64_t>& hashes,
+                               unsigned int maxDistance)
+  {
+    groups.clear();
+
+    const size_t count = hashes.size();
+    if (count < 2)
+    {
+      return;
+    }
+
+    std::vector<size_t> parents(count);
+    for (size_t i = 0; i < count; i++)
+    {
+      parents[i] = i;
+    }
+
+    // Compare each hash with all the following ones (union-find)
+    std::vector<uint8_t> distances(count);
+
+    for (size_t i = 0; i + 1 < count; i++)
+    {
+      const size_t remaining = count - i - 1;
+      ComputeDistances(&distances[0], hashes[i], &hashes[i + 1], remaining);
+
+      for (size_t j = 0; j < remaining; j++)
+      {
+        if (distances[j] <= maxDistance)
+        {
+          size_t a = FindRoot(parents, i);
+          size_t b = FindRoot(parents, i + 1 + j);
+          if (a != b)
+          {
+            parents[b] = a;
+          }
+        }
+      }
+    }
+
+    // The groups are ordered by their first element
+    std::vector< std::vector<size_t> > members;
+    std::map<size_t, size_t> index;   // Root -> Group
+
+    for (size_t i = 0; i < count; i++)
+    {
+      const size_t root = FindRoot(parents, i);
+
+      std::map<size_t, size_t>::const_iterator found = index.find(root);
+      if (found == index.end())
+      {
+        index[root] = members.size();
+        members.push_back(std::vector<size_t>(1, i));
+      }
+      else
+      {
+        members[found->second].push_back(i);
+      }
+    }
+
+    for (size_t i = 0; i < members.size(); i++)
+    {
+      if (members[i].size() >= 2)
+      {
+        groups.push_back(members[i]);
+      }
+    }
+  }
+}
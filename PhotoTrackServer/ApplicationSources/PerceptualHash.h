@@ -0,0 +1,98 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include <Core/ImageFormats/ImageAccessor.h>
+
+#include <list>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace PhotoTrack
+{
+  enum HammingKernel
+  {
+    HammingKernel_Scalar,
+    HammingKernel_Ssse3,
+    HammingKernel_Avx2
+  };
+
+  /**
+   * Perceptual hash of the images ("dHash"), to detect the photos
+   * that are near-duplicates of each other (e.g. a burst of shots of
+   * the same pit). The image is reduced to a 9x8 grayscale thumbnail,
+   * and each of the 64 bits tells whether a pixel is brighter than
+   * its right neighbour. The hash survives the recompression and the
+   * resizing of the image: Two images are similar if the Hamming
+   * distance between their hashes is small (typically up to 10). The
+   * SIMD kernels count the bits with "pshufb" lookups of the nibbles,
+   * and give the same results as the scalar kernel.
+   **/
+  class PerceptualHash
+  {
+  public:
+    // The best kernel for this CPU, detected once at runtime
+    static HammingKernel GetBestKernel();
+
+    static bool IsKernelSupported(HammingKernel kernel);
+
+    static const char* EnumerationToString(HammingKernel kernel);
+
+    // Returns "false" if the format of the image is not supported
+    // (only Grayscale8, RGB24 and RGBA32 are)
+    static bool Compute(uint64_t& hash,
+                        const Orthanc::ImageAccessor& image);
+
+    // As 16 lowercase hexadecimal digits
+    static std::string Format(uint64_t hash);
+
+    static bool Parse(uint64_t& hash,
+                      const std::string& value);
+
+    static unsigned int GetDistance(uint64_t a,
+                                    uint64_t b);
+
+    // Computes the Hamming distances between "hash" and each of the
+    // "count" hashes
+    static void ComputeDistances(uint8_t* distances,
+                                 uint64_t hash,
+                                 const uint64_t* hashes,
+                                 size_t count,
+                                 HammingKernel kernel);
+
+    static void ComputeDistances(uint8_t* distances,
+                                 uint64_t hash,
+                                 const uint64_t* hashes,
+                                 size_t count)
+    {
+      ComputeDistances(distances, hash, hashes, count, GetBestKernel());
+    }
+
+    // Groups the hashes that are within "maxDistance" of each other
+    // (single linkage, so that a burst forms one group even if its
+    // first and last shots differ more). Only the groups with at
+    // least 2 hashes are reported, as indices into "hashes" in
+    // increasing order.
+    static void Cluster(std::list< std::vector<size_t> >& groups,
+                        const std::vector<uint64_t>& hashes,
+                        unsigned int maxDistance);
+  };
+}
@@ -28,6 +28,9 @@ void Photo::ToJson(Json::Value& value) const
   value["SecondsSinceEpoch"] = boost::lexical_cast<std::string>(secondsSinceEpoch_);
   value["Time"] = GetTime();
   value["ImageMime"] = imageMime_;
+  value["ImageUuid"] = imageUuid_;
+  value["ImageHash"] = imageHash_;
+  value["PerceptualHash"] = perceptualHash_;
   value["SiteUuid"] = siteUuid_;
 
   if (hasGps_)
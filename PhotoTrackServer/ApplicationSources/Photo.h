@@ -22,6 +22,7 @@
 
 #include "Site.h"
 
+#include <Core/Enumerations.h>
 #include <Core/Uuid.h>
 
 class Photo
@@ -29,15 +30,20 @@ class Photo
   std::string   uuid_;
   std::string   imageUuid_;
   std::string   imageMime_;
+  Orthanc::CompressionType  imageCompression_;
   bool          hasGps_;
   float         longitude_;
   float         latitude_;
   int64_t       secondsSinceEpoch_;
   std::string   tag_;
   std::string   siteUuid_;
+  std::string   preview_;
+  std::string   imageHash_;
+  std::string   perceptualHash_;
 public:
   Photo() :
     uuid_(Orthanc::Toolbox::GenerateUuid()), imageMime_("image/jpeg"),
+    imageCompression_(Orthanc::CompressionType_None),
     hasGps_(false),
     longitude_(0.0f),
     latitude_(0.0f),
@@ -75,6 +81,16 @@ public:
     imageMime_ = val;
   }
 
+  Orthanc::CompressionType GetImageCompression() const
+  {
+    return imageCompression_;
+  }
+
+  void SetImageCompression(Orthanc::CompressionType val)
+  {
+    imageCompression_ = val;
+  }
+
   int64_t GetSecondsSinceEpoch() const 
   { 
     return secondsSinceEpoch_; 
@@ -139,6 +155,41 @@ public:
     siteUuid_ = site.GetUuid();
   }
 
+  // Tiny PNG version of the image, encoded in base64 (empty if none)
+  const std::string& GetPreview() const
+  {
+    return preview_;
+  }
+
+  void SetPreview(const std::string& val)
+  {
+    preview_ = val;
+  }
+
+  // SHA-1 of the uncompressed image, as 40 lowercase hexadecimal
+  // digits (empty if none)
+  const std::string& GetImageHash() const
+  {
+    return imageHash_;
+  }
+
+  void SetImageHash(const std::string& val)
+  {
+    imageHash_ = val;
+  }
+
+  // Perceptual hash of the image, as 16 hexadecimal digits (empty if
+  // none), to detect the near-duplicate photos
+  const std::string& GetPerceptualHash() const
+  {
+    return perceptualHash_;
+  }
+
+  void SetPerceptualHash(const std::string& val)
+  {
+    perceptualHash_ = val;
+  }
+
   std::string GetTime() const;
 
   void ToJson(Json::Value& value) const;
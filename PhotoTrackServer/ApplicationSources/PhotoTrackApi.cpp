@@ -20,12 +20,18 @@
 #include "ServerPrecompiledHeaders.h"
 #include "PhotoTrackApi.h"
 
+#include "BlobHttpAnswer.h"
+#include "InflatingBlobReader.h"
+#include "MemoryBlobReader.h"
+#include "MultipartReader.h"
+#include "PhotoUploadParser.h"
 #include "PropertyMap.h"
 
 #include <Core/Uuid.h>
 #include <Core/Compression/HierarchicalZipWriter.h>
 #include <Core/HttpServer/FilesystemHttpSender.h>
 
+#include <boost/filesystem.hpp>
 #include <glog/logging.h>
 #include <iostream>
 
@@ -139,6 +145,23 @@ namespace PhotoTrack
 
     return *db;
   }
+
+
+  bool PhotoTrackApi::CheckImageSize(Orthanc::RestApiCall& call,
+                                     uint64_t size)
+  {
+    uint64_t maxSize = GetApi(call).maxImageSize_;
+
+    if (maxSize != 0 &&
+        size > maxSize)
+    {
+      LOG(WARNING) << "Rejecting an upload of " << size << " bytes";
+      call.GetOutput().SignalError(Orthanc::HttpStatus_413_RequestEntityTooLarge);
+      return false;
+    }
+
+    return true;
+  }
   
   //Register("/users", ListUsers);
   static void ListUsers(Orthanc::RestApiGetCall& call)
@@ -252,7 +275,7 @@ namespace PhotoTrack
   static void ListPhotos(Orthanc::RestApiGetCall& call)
   {
     Json::Value lst;
-    PhotoTrackApi::GetDatabaseWrapper(call).GetPhotos(lst);
+    PhotoTrackApi::GetDatabaseWrapper(call).GetPhotos(lst, call.HasArgument("previews"));
     call.GetOutput().AnswerJson(lst);
   }
 
@@ -261,10 +284,69 @@ namespace PhotoTrack
     std::string siteUuid = call.GetUriComponent("uuid", "");
     
     Json::Value lst;
-    PhotoTrackApi::GetDatabaseWrapper(call).GetPhotos(lst, siteUuid);
+    PhotoTrackApi::GetDatabaseWrapper(call).GetPhotos(lst, siteUuid, call.HasArgument("previews"));
     call.GetOutput().AnswerJson(lst);
   }
 
+  // Groups of near-duplicate photos of the site (e.g. bursts of shots
+  // of the same pit), each listed in chronological order. The
+  // "distance" argument is the maximum number of differing bits
+  // between the perceptual hashes of the images (out of 64).
+  static void ListDuplicatesOfSite(Orthanc::RestApiGetCall& call)
+  {
+    static const unsigned int DEFAULT_DISTANCE = 10;
+    static const unsigned int MAX_DISTANCE = 32;
+
+    unsigned int distance = DEFAULT_DISTANCE;
+
+    if (call.HasArgument("distance"))
+    {
+      try
+      {
+        distance = boost::lexical_cast<unsigned int>(call.GetArgument("distance", ""));
+      }
+      catch (boost::bad_lexical_cast&)
+      {
+        distance = MAX_DISTANCE + 1;
+      }
+
+      if (distance > MAX_DISTANCE)
+      {
+        call.GetOutput().SignalError(Orthanc::HttpStatus_400_BadRequest);
+        return;
+      }
+    }
+
+    std::string siteUuid = call.GetUriComponent("uuid", "");
+
+    Site site;
+    if (!PhotoTrackApi::GetDatabaseWrapper(call).GetSite(site, siteUuid))
+    {
+      return;
+    }
+
+    std::list< std::list<std::string> > groups;
+    PhotoTrackApi::GetDatabaseWrapper(call).GetSiteNearDuplicates(groups, siteUuid, distance);
+
+    Json::Value result = Json::arrayValue;
+
+    for (std::list< std::list<std::string> >::const_iterator
+           group = groups.begin(); group != groups.end(); ++group)
+    {
+      Json::Value photos = Json::arrayValue;
+
+      for (std::list<std::string>::const_iterator
+             it = group->begin(); it != group->end(); ++it)
+      {
+        photos.append(*it);
+      }
+
+      result.append(photos);
+    }
+
+    call.GetOutput().AnswerJson(result);
+  }
+
   static void GetSite(Orthanc::RestApiGetCall& call)
   {
     std::string uuid = call.GetUriComponent("uuid", "");
@@ -278,10 +360,45 @@ namespace PhotoTrack
     }
   }
 
+  // "Orthanc::RestApiOutput" can only answer "200 OK" with a body
+  static void AnswerAccepted(Orthanc::RestApiOutput& output,
+                             const Json::Value& answer)
+  {
+    std::string body = answer.toStyledString();
+
+    std::string header = ("HTTP/1.1 202 Accepted\r\n"
+                          "Content-Type: application/json\r\n"
+                          "Content-Length: " + boost::lexical_cast<std::string>(body.size()) + "\r\n\r\n");
+
+    output.GetLowLevelOutput().SendString(header);
+    output.GetLowLevelOutput().SendString(body);
+    output.MarkLowLevelOutputDone();
+  }
+
   static void GetPhoto(Orthanc::RestApiGetCall& call)
   {
     std::string uuid = call.GetUriComponent("uuid", "");
 
+    // The ingest queue is checked first, as the photo leaves it only
+    // once it is committed to the database
+    IngestQueue* ingest = PhotoTrackApi::GetIngestQueue(call);
+
+    Json::Value pending;
+    if (ingest != NULL &&
+        ingest->GetPendingPhoto(pending, uuid))
+    {
+      if (pending["Status"].asString() == "Failed")
+      {
+        call.GetOutput().AnswerJson(pending);
+      }
+      else
+      {
+        AnswerAccepted(call.GetOutput(), pending);
+      }
+
+      return;
+    }
+
     Photo photo;
     if (PhotoTrackApi::GetDatabaseWrapper(call).GetPhoto(photo, uuid))
     {
@@ -429,10 +546,137 @@ namespace PhotoTrack
     }
   }
 
+  namespace
+  {
+    /**
+     * Creation requests that can be retried safely by the clients
+     * that time out, thanks to the "Idempotency-Key" header: The
+     * answer of the first request is saved in the database, and is
+     * sent back to the retries instead of creating the item again.
+     * If the request fails, its key is released by the destructor.
+     **/
+    class IdempotentRequest : public boost::noncopyable
+    {
+    private:
+      Orthanc::RestApiPostCall&  call_;
+      DatabaseWrapper&           db_;
+      std::string                key_;
+      bool                       pending_;
+
+      void Complete(const Json::Value& answer)
+      {
+        if (pending_)
+        {
+          Json::FastWriter writer;
+          db_.CompleteIdempotencyKey(key_, writer.write(answer));
+          pending_ = false;
+        }
+      }
+
+    public:
+      IdempotentRequest(Orthanc::RestApiPostCall& call) :
+        call_(call),
+        db_(PhotoTrackApi::GetDatabaseWrapper(call)),
+        pending_(false)
+      {
+      }
+
+      ~IdempotentRequest()
+      {
+        if (pending_)
+        {
+          try
+          {
+            db_.ReleaseIdempotencyKey(key_);
+          }
+          catch (Orthanc::OrthancException& e)
+          {
+            LOG(ERROR) << "Cannot release the idempotency key " << key_ << ": " << e.What();
+          }
+        }
+      }
+
+      // Returns "false" if the request must not be processed, in
+      // which case the answer has already been sent. The fingerprint
+      // identifies the content of the request, whatever its encoding
+      // (cf. "GetFingerprint()").
+      bool Start(const std::string& scope,
+                 const std::string& fingerprint)
+      {
+        static const size_t MAX_KEY_SIZE = 256;
+
+        key_ = call_.GetHttpHeader("idempotency-key", "");
+        if (key_.empty())
+        {
+          return true;
+        }
+
+        if (key_.size() > MAX_KEY_SIZE)
+        {
+          call_.GetOutput().SignalError(Orthanc::HttpStatus_400_BadRequest);
+          return false;
+        }
+
+        // Reusing a key for another request is an error of the client
+        std::string answer;
+        switch (db_.ReserveIdempotencyKey(answer, key_, scope + " " + fingerprint))
+        {
+          case IdempotencyKeyStatus_New:
+            pending_ = true;
+            return true;
+
+          case IdempotencyKeyStatus_Completed:
+            call_.GetOutput().AnswerBuffer(answer, "application/json");
+            return false;
+
+          default:
+            call_.GetOutput().SignalError(Orthanc::HttpStatus_409_Conflict);
+            return false;
+        }
+      }
+
+      void Answer(const Json::Value& answer)
+      {
+        Complete(answer);
+        call_.GetOutput().AnswerJson(answer);
+      }
+
+      // The retries get the answer with "200 OK"
+      void AnswerAccepted(const Json::Value& answer)
+      {
+        Complete(answer);
+        PhotoTrack::AnswerAccepted(call_.GetOutput(), answer);
+      }
+    };
+
+
+    // Fingerprint of the parsed request, that does not depend on the
+    // bytes on the wire: A client that rebuilds a multipart request to
+    // retry it sends another random boundary. The image is optional.
+    std::string GetFingerprint(const Json::Value& request,
+                               const void* image,
+                               size_t size)
+    {
+      Json::FastWriter writer;
+      std::string s = writer.write(request);
+
+      if (image != NULL)
+      {
+        s += Toolbox::ComputeSHA1(image, size);
+      }
+
+      return Toolbox::ComputeSHA1(s.c_str(), s.size());
+    }
+  }
+
+
   static void PostSite(Orthanc::RestApiPostCall& call)
   {
+    IdempotentRequest idempotent(call);
+
     Json::Value request;
-    if (call.ParseJsonRequest(request))
+    if (call.ParseJsonRequest(request) &&
+        idempotent.Start("POST /sites", GetFingerprint(request, NULL, 0)))
     {
       Site site = Site::FromJson(request);
       site.SetUuid(Orthanc::Toolbox::GenerateUuid());
@@ -440,30 +684,217 @@ namespace PhotoTrack
 
       Json::Value answer = Json::objectValue;
       answer["SiteId"] = site.GetUuid();
-      call.GetOutput().AnswerJson(answer);
+      idempotent.Answer(answer);
     }
   }
 
-  static void PostPhoto(Orthanc::RestApiPostCall& call)
+  // Checks the "ImageHash" field of a photo that is posted without
+  // its image, as done by the clients when they re-synchronize.
+  // Answers with an error and returns "false" if the hash is
+  // malformed or if no such image is stored.
+  static bool CheckImageHash(std::string& hash,
+                             Orthanc::RestApiPostCall& call,
+                             const Json::Value& request)
   {
-    Json::Value request;
-    if (call.ParseJsonRequest(request))
+    hash.clear();
+
+    if (!request.isMember("ImageHash"))
     {
-      Photo photo = Photo::FromJson(request);
-      photo.SetUuid(Orthanc::Toolbox::GenerateUuid());
-      PhotoTrackApi::GetDatabaseWrapper(call).CreateOrUpdatePhoto(photo);
+      return true;
+    }
+
+    if (request["ImageHash"].type() != Json::stringValue ||
+        !Toolbox::ParseSHA1(hash, request["ImageHash"].asString()))
+    {
+      call.GetOutput().SignalError(Orthanc::HttpStatus_400_BadRequest);
+      return false;
+    }
+
+    std::list<std::string> hashes;
+    hashes.push_back(hash);
+
+    std::set<std::string> found;
+    PhotoTrackApi::GetDatabaseWrapper(call).LookupImageHashes(found, hashes);
+
+    if (found.empty())
+    {
+      // The client must upload the image
+      call.GetOutput().SignalError(Orthanc::HttpStatus_404_NotFound);
+      return false;
+    }
+
+    return true;
+  }
+
+
+  // Creates the photo, and attaches either its image (if "mimeType"
+  // is not empty) or the stored image with the SHA-1 "hash" (if not
+  // empty). If the ingest queue is enabled, the photo is only staged,
+  // and the client is answered with "202 Accepted".
+  static void StorePhoto(Orthanc::RestApiPostCall& call,
+                         IdempotentRequest& idempotent,
+                         const Json::Value& request,
+                         const std::string& hash,
+                         const void* image,
+                         size_t size,
+                         const std::string& mimeType)
+  {
+    Json::Value answer = Json::objectValue;
+
+    IngestQueue* ingest = PhotoTrackApi::GetIngestQueue(call);
+    if (ingest != NULL)
+    {
+      answer["PhotoId"] = ingest->Enqueue(request, image, size, mimeType, hash);
+      answer["Status"] = "Pending";
+      idempotent.AnswerAccepted(answer);
+      return;
+    }
+
+    DatabaseWrapper& db = PhotoTrackApi::GetDatabaseWrapper(call);
+
+    Photo photo = Photo::FromJson(request);
+    photo.SetUuid(Orthanc::Toolbox::GenerateUuid());
 
-      if (request.isMember("ImageData") && request.isMember("ImageMime"))
+    // The photo is created together with its image, so that it is
+    // never visible without it
+    if (!mimeType.empty())
+    {
+      db.CreatePhotoWithImage(photo, image, size, mimeType);
+    }
+    else if (!hash.empty())
+    {
+      if (!db.CreatePhotoWithImage(photo, hash))
       {
-        std::string result;
-        Orthanc::Toolbox::DecodeBase64(result, request["ImageData"].asString());
-        PhotoTrackApi::GetDatabaseWrapper(call).ReplaceImage
-          (photo.GetUuid(), result, request["ImageMime"].asString());
+        // The image was removed since "CheckImageHash()": The client
+        // must upload it
+        call.GetOutput().SignalError(Orthanc::HttpStatus_404_NotFound);
+        return;
       }
+    }
+    else
+    {
+      db.CreateOrUpdatePhoto(photo);
+    }
 
-      Json::Value answer = Json::objectValue;
-      answer["PhotoId"] = photo.GetUuid();
-      call.GetOutput().AnswerJson(answer);
+    answer["PhotoId"] = photo.GetUuid();
+    idempotent.Answer(answer);
+  }
+
+
+  // The metadata of the photo comes as a JSON part named "metadata",
+  // and the image as a binary part named "image"
+  static void PostPhotoMultipart(Orthanc::RestApiPostCall& call,
+                                 IdempotentRequest& idempotent,
+                                 const std::string& boundary)
+  {
+    const std::string& body = call.GetPostBody();
+
+    MultipartReader reader;
+    if (!reader.Parse(body.empty() ? NULL : body.c_str(), body.size(), boundary))
+    {
+      call.GetOutput().SignalError(Orthanc::HttpStatus_400_BadRequest);
+      return;
+    }
+
+    const MultipartReader::Part* metadata = reader.LookupPart("metadata");
+
+    Json::Value request;
+    Json::Reader parser;
+    if (metadata == NULL ||
+        !parser.parse(metadata->GetData(), metadata->GetData() + metadata->GetSize(), request) ||
+        request.type() != Json::objectValue)
+    {
+      call.GetOutput().SignalError(Orthanc::HttpStatus_400_BadRequest);
+      return;
+    }
+
+    const MultipartReader::Part* image = reader.LookupPart("image");
+
+    std::string fingerprint = (image == NULL ?
+                               GetFingerprint(request, NULL, 0) :
+                               GetFingerprint(request, image->GetData(), image->GetSize()));
+    if (!idempotent.Start("POST /photos", fingerprint))
+    {
+      return;
+    }
+
+    std::string hash;
+    if (image == NULL &&
+        !CheckImageHash(hash, call, request))
+    {
+      return;
+    }
+
+    if (image == NULL)
+    {
+      StorePhoto(call, idempotent, request, hash, NULL, 0, "");
+      return;
+    }
+
+    // The MIME type in the metadata has precedence, as the clients
+    // often send the files as "application/octet-stream"
+    std::string mime = request.get("ImageMime", "").asString();
+    if (mime.empty())
+    {
+      mime = image->GetContentType().empty() ? "image/jpeg" : image->GetContentType();
+    }
+
+    // The image is written to the storage from the request body,
+    // without any intermediate copy
+    StorePhoto(call, idempotent, request, hash, image->GetData(), image->GetSize(), mime);
+  }
+
+
+  static void PostPhoto(Orthanc::RestApiPostCall& call)
+  {
+    if (!PhotoTrackApi::CheckImageSize(call, call.GetPostBody().size()))
+    {
+      return;
+    }
+
+    // The idempotency key is checked once the request is parsed
+    IdempotentRequest idempotent(call);
+
+    std::string boundary;
+    if (MultipartReader::ParseBoundary(boundary, call.GetHttpHeader("content-type", "")))
+    {
+      PostPhotoMultipart(call, idempotent, boundary);
+      return;
+    }
+
+    // Legacy upload, with the image in base64 inside the JSON: The
+    // image is decoded without parsing the whole body with jsoncpp
+    const std::string& body = call.GetPostBody();
+
+    Json::Value request;
+    std::string image;
+    bool hasImage;
+    if (!PhotoUploadParser::Parse(request, image, hasImage, body.empty() ? NULL : body.c_str(), body.size()))
+    {
+      call.GetOutput().SignalError(Orthanc::HttpStatus_400_BadRequest);
+      return;
+    }
+
+    if (!idempotent.Start("POST /photos", GetFingerprint(request, hasImage ? image.c_str() : NULL, image.size())))
+    {
+      return;
+    }
+
+    std::string hash;
+    if (!hasImage &&
+        !CheckImageHash(hash, call, request))
+    {
+      return;
+    }
+
+    if (hasImage && request.isMember("ImageMime"))
+    {
+      StorePhoto(call, idempotent, request, hash, image.empty() ? NULL : image.c_str(),
+                 image.size(), request["ImageMime"].asString());
+    }
+    else
+    {
+      StorePhoto(call, idempotent, request, hash, NULL, 0, "");
     }
   }
 
@@ -531,60 +962,619 @@ namespace PhotoTrack
   {
     std::string uuid = call.GetUriComponent("uuid", "");
     PhotoTrackApi::GetDatabaseWrapper(call).DeleteSite(uuid);
+
+    ContactSheetCache* sheets = PhotoTrackApi::GetContactSheetCache(call);
+    if (sheets != NULL &&
+        Orthanc::Toolbox::IsUuid(uuid))
+    {
+      sheets->Invalidate(uuid);
+    }
+
     call.GetOutput().AnswerBuffer("{}", "application/json");
   }
 
-  static void GetImage(Orthanc::RestApiGetCall& call)
+  static bool ParseImageSize(unsigned int& value,
+                             const Orthanc::RestApiGetCall& call,
+                             const std::string& name)
   {
-    std::string uuid = call.GetUriComponent("uuid", "");
+    static const unsigned int MAX_SIZE = 4096;
 
-    Photo photo;
-    if (PhotoTrackApi::GetDatabaseWrapper(call).GetPhoto(photo, uuid))
+    try
     {
-      std::string image;
-      PhotoTrackApi::GetFileStorage(call).ReadFile(image, photo.GetImageUuid());
-      call.GetOutput().AnswerBuffer(image, photo.GetImageMime());
+      value = boost::lexical_cast<unsigned int>(call.GetArgument(name, "0"));
+      return value <= MAX_SIZE;
+    }
+    catch (boost::bad_lexical_cast&)
+    {
+      return false;
     }
-  }
-    
-  static void DeletePhoto(Orthanc::RestApiDeleteCall& call)
-  {
-    std::string uuid = call.GetUriComponent("uuid", "");
-    PhotoTrackApi::GetDatabaseWrapper(call).DeletePhoto(uuid);
-    call.GetOutput().AnswerBuffer("{}", "application/json");
   }
 
 
-  static void SetImage(Orthanc::RestApiPutCall& call)
+  // Returns "false" if the original image must be sent
+  static bool AnswerResizedImage(Orthanc::RestApiGetCall& call,
+                                 const Photo& photo,
+                                 const std::string& cacheControl)
   {
-    std::string contentType = call.GetHttpHeader("content-type", "image/jpeg");
+    unsigned int width, height;
+    if (!ParseImageSize(width, call, "width") ||
+        !ParseImageSize(height, call, "height") ||
+        (width == 0 && height == 0))
+    {
+      call.GetOutput().SignalError(Orthanc::HttpStatus_400_BadRequest);
+      return true;
+    }
 
-    std::string uuid = call.GetUriComponent("uuid", "");
-    PhotoTrackApi::GetDatabaseWrapper(call).ReplaceImage
-      (uuid, call.GetPutBody(), contentType);
+    DerivedImageCache* cache = PhotoTrackApi::GetDerivedImageCache(call);
+    if (cache == NULL ||
+        !DerivedImageCache::IsSupportedImage(photo.GetImageMime()))
+    {
+      return false;
+    }
 
-    call.GetOutput().AnswerBuffer("{}", "application/json");
-  }
-  
-  static void DeleteUser(Orthanc::RestApiDeleteCall& call)
-  {
-    std::string uuid = call.GetUriComponent("uuid", "");
-    PhotoTrackApi::GetDatabaseWrapper(call).DeleteUser(uuid);
-    call.GetOutput().AnswerBuffer("{}", "application/json");
+    // Only a fixed set of bounding boxes is generated and cached
+    width = DerivedImageCache::SnapSize(width);
+    height = DerivedImageCache::SnapSize(height);
+
+    BlobHttpAnswer answer;
+    answer.SetContentType(photo.GetImageMime());
+    answer.SetETag("\"" + photo.GetImageUuid() + "-" + boost::lexical_cast<std::string>(width) + 
+                   "x" + boost::lexical_cast<std::string>(height) + "\"");
+    answer.SetCacheControl(cacheControl);
+
+    if (answer.AnswerNotModified(call.GetOutput(), call.GetHttpHeaders()))
+    {
+      return true;
+    }
+
+    std::string resized;
+    if (!cache->GetResizedImage(resized, PhotoTrackApi::GetDatabaseWrapper(call), photo, width, height))
+    {
+      return false;
+    }
+
+    MemoryBlobReader reader(resized);
+    answer.Answer(call.GetOutput(), reader, call.GetHttpHeaders());
+    return true;
   }
 
 
-  static void GetSiteArchive(Orthanc::RestApiGetCall& call)
+  static void AnswerImage(Orthanc::RestApiGetCall& call,
+                          const Photo& photo,
+                          const std::string& cacheControl)
   {
-    std::string uuid = call.GetUriComponent("uuid", "");
+    if ((call.HasArgument("width") || call.HasArgument("height")) &&
+        AnswerResizedImage(call, photo, cacheControl))
+    {
+      return;
+    }
 
-    // Create a RAII for the temporary file to manage the ZIP file
-    Orthanc::Toolbox::TemporaryFile tmp;
+    // The content of a blob never changes once written: Its UUID is
+    // a strong entity tag
+    BlobHttpAnswer answer;
+    answer.SetContentType(photo.GetImageMime());
+    answer.SetETag("\"" + photo.GetImageUuid() + "\"");
+    answer.SetCacheControl(cacheControl);
+
+    if (answer.AnswerNotModified(call.GetOutput(), call.GetHttpHeaders()))
+    {
+      return;
+    }
+
+    // If possible, let the front proxy send the file of the image
+    ProxyOffload* offload = PhotoTrackApi::GetProxyOffload(call);
+    std::string relativePath;
+
+    if (offload != NULL &&
+        photo.GetImageCompression() == Orthanc::CompressionType_None &&
+        PhotoTrackApi::GetImageStorage(call).LookupFile(relativePath, photo.GetImageUuid()))
+    {
+      answer.AnswerOffloaded(call.GetOutput(), offload->FormatStorageRedirection(relativePath));
+      return;
+    }
+
+    // Stream the image from the storage area, without loading it
+    IImageStorage& storage = PhotoTrackApi::GetImageStorage(call);
+    std::auto_ptr<IBlobReader> reader;
+
+    if (photo.GetImageCompression() == Orthanc::CompressionType_Zlib)
+    {
+      std::string compressed;
+      storage.Read(compressed, photo.GetImageUuid());
+      reader.reset(new InflatingBlobReader(compressed));
+    }
+    else
+    {
+      reader.reset(storage.OpenBlob(photo.GetImageUuid()));
+    }
+
+    answer.Answer(call.GetOutput(), *reader, call.GetHttpHeaders());
+  }
+
+  static void GetImage(Orthanc::RestApiGetCall& call)
+  {
+    std::string uuid = call.GetUriComponent("uuid", "");
+
+    Photo photo;
+    if (PhotoTrackApi::GetDatabaseWrapper(call).GetPhoto(photo, uuid))
+    {
+      // The image of a photo can be replaced: Always revalidate
+      AnswerImage(call, photo, "no-cache");
+    }
+  }
+
+  static void GetImageFromUuid(Orthanc::RestApiGetCall& call)
+  {
+    std::string imageUuid = call.GetUriComponent("imageUuid", "");
+
+    Photo photo;
+    if (PhotoTrackApi::GetDatabaseWrapper(call).GetPhotoFromImage(photo, imageUuid))
+    {
+      // Content-addressed URL: The browsers can cache it forever
+      AnswerImage(call, photo, "public, max-age=31536000, immutable");
+    }
+  }
+    
+  static TilePyramid* OpenTilePyramid(Orthanc::RestApiGetCall& call,
+                                      Photo& photo)
+  {
+    TileCache* cache = PhotoTrackApi::GetTileCache(call);
+    if (cache == NULL ||
+        !PhotoTrackApi::GetDatabaseWrapper(call).GetPhoto(photo, call.GetUriComponent("uuid", "")))
+    {
+      return NULL;
+    }
+
+    return cache->Open(photo);
+  }
+
+
+  static void GetTilesDescriptor(Orthanc::RestApiGetCall& call)
+  {
+    Photo photo;
+    std::auto_ptr<TilePyramid> pyramid(OpenTilePyramid(call, photo));
+    if (pyramid.get() == NULL)
+    {
+      return;
+    }
+
+    // JSON flavor of the Deep Zoom descriptor, as read by OpenSeadragon
+    Json::Value image = Json::objectValue;
+    image["xmlns"] = "http://schemas.microsoft.com/deepzoom/2008";
+    image["Format"] = (pyramid->GetFormat() == TileFormat_Jpeg ? "jpg" : "png");
+    image["Overlap"] = "0";
+    image["TileSize"] = boost::lexical_cast<std::string>(TilePyramid::TILE_SIZE);
+    image["Size"] = Json::objectValue;
+    image["Size"]["Width"] = boost::lexical_cast<std::string>(pyramid->GetWidth());
+    image["Size"]["Height"] = boost::lexical_cast<std::string>(pyramid->GetHeight());
+
+    Json::Value result = Json::objectValue;
+    result["Image"] = image;
+    result["ImageUuid"] = photo.GetImageUuid();
+    result["Levels"] = pyramid->GetLevelCount();
+
+    call.GetOutput().AnswerJson(result);
+  }
+
+
+  static void GetTile(Orthanc::RestApiGetCall& call)
+  {
+    // The tiles are named "{x}_{y}", possibly with an extension
+    std::string tile = call.GetUriComponent("tile", "");
+    tile = tile.substr(0, tile.find('.'));
+
+    unsigned int level, x, y;
+    size_t separator = tile.find('_');
+
+    try
+    {
+      if (separator == std::string::npos)
+      {
+        throw boost::bad_lexical_cast();
+      }
+
+      level = boost::lexical_cast<unsigned int>(call.GetUriComponent("level", ""));
+      x = boost::lexical_cast<unsigned int>(tile.substr(0, separator));
+      y = boost::lexical_cast<unsigned int>(tile.substr(separator + 1));
+    }
+    catch (boost::bad_lexical_cast&)
+    {
+      call.GetOutput().SignalError(Orthanc::HttpStatus_400_BadRequest);
+      return;
+    }
+
+    Photo photo;
+    std::auto_ptr<TilePyramid> pyramid(OpenTilePyramid(call, photo));
+    if (pyramid.get() == NULL)
+    {
+      return;
+    }
+
+    BlobHttpAnswer answer;
+    answer.SetContentType(pyramid->GetFormat() == TileFormat_Jpeg ? "image/jpeg" : "image/png");
+    answer.SetETag("\"" + photo.GetImageUuid() + "-" + boost::lexical_cast<std::string>(level) + "-" +
+                   boost::lexical_cast<std::string>(x) + "-" + boost::lexical_cast<std::string>(y) + "\"");
+    answer.SetCacheControl("no-cache");
+
+    if (answer.AnswerNotModified(call.GetOutput(), call.GetHttpHeaders()))
+    {
+      return;
+    }
+
+    std::string content;
+    if (pyramid->ReadTile(content, level, x, y))
+    {
+      MemoryBlobReader reader(content);
+      answer.Answer(call.GetOutput(), reader, call.GetHttpHeaders());
+    }
+  }
+
+
+  static bool GetContactSheet(std::string& image,
+                              Json::Value& map,
+                              Orthanc::RestApiGetCall& call)
+  {
+    ContactSheetCache* cache = PhotoTrackApi::GetContactSheetCache(call);
+    std::string uuid = call.GetUriComponent("uuid", "");
+
+    return (cache != NULL &&
+            Orthanc::Toolbox::IsUuid(uuid) &&
+            cache->GetContactSheet(image, map, uuid));
+  }
+
+
+  static void GetContactSheetImage(Orthanc::RestApiGetCall& call)
+  {
+    std::string image;
+    Json::Value map;
+    if (!GetContactSheet(image, map, call))
+    {
+      return;
+    }
+
+    // The version is also reported in the map, so that the clients
+    // can check that the image matches the coordinates they hold
+    BlobHttpAnswer answer;
+    answer.SetContentType("image/jpeg");
+    answer.SetETag("\"" + map["Version"].asString() + "\"");
+    answer.SetCacheControl("no-cache");
+
+    if (!answer.AnswerNotModified(call.GetOutput(), call.GetHttpHeaders()))
+    {
+      MemoryBlobReader reader(image);
+      answer.Answer(call.GetOutput(), reader, call.GetHttpHeaders());
+    }
+  }
+
+
+  static void GetContactSheetMap(Orthanc::RestApiGetCall& call)
+  {
+    std::string image;
+    Json::Value map;
+    if (GetContactSheet(image, map, call))
+    {
+      call.GetOutput().AnswerJson(map);
+    }
+  }
+
+
+  static void DeletePhoto(Orthanc::RestApiDeleteCall& call)
+  {
+    std::string uuid = call.GetUriComponent("uuid", "");
+
+    // The photo would be created again by the ingest workers
+    IngestQueue* ingest = PhotoTrackApi::GetIngestQueue(call);
+    if (ingest != NULL)
+    {
+      if (ingest->IsPending(uuid))
+      {
+        call.GetOutput().SignalError(Orthanc::HttpStatus_409_Conflict);
+        return;
+      }
+
+      // A photo whose ingestion has failed is never in the database
+      if (ingest->DiscardFailed(uuid))
+      {
+        call.GetOutput().AnswerBuffer("{}", "application/json");
+        return;
+      }
+    }
+
+    PhotoTrackApi::GetDatabaseWrapper(call).DeletePhoto(uuid);
+    call.GetOutput().AnswerBuffer("{}", "application/json");
+  }
+
+
+  static void SetImage(Orthanc::RestApiPutCall& call)
+  {
+    std::string contentType = call.GetHttpHeader("content-type", "image/jpeg");
+
+    std::string uuid = call.GetUriComponent("uuid", "");
+
+    // The front proxy may have written the body to a file, in which
+    // case the image is moved to the storage area without being read
+    // in memory
+    std::string file = call.GetHttpHeader("x-upload-file", "");
+
+    if (file.empty())
+    {
+      if (!PhotoTrackApi::CheckImageSize(call, call.GetPutBody().size()))
+      {
+        return;
+      }
+
+      PhotoTrackApi::GetDatabaseWrapper(call).ReplaceImage
+        (uuid, call.GetPutBody(), contentType);
+    }
+    else
+    {
+      ProxyOffload* offload = PhotoTrackApi::GetProxyOffload(call);
+      if (offload == NULL)
+      {
+        call.GetOutput().SignalError(Orthanc::HttpStatus_403_Forbidden);
+        return;
+      }
+
+      if (!offload->IsUploadFile(file))
+      {
+        LOG(ERROR) << "Not a recent file of the upload directory of the proxy: " << file;
+        call.GetOutput().SignalError(Orthanc::HttpStatus_400_BadRequest);
+        return;
+      }
+
+      bool accepted = false;
+
+      if (!offload->IsUploadSecret(call.GetHttpHeader("x-upload-secret", "")))
+      {
+        LOG(ERROR) << "Rejecting an upload file that does not come from the proxy: " << file;
+        call.GetOutput().SignalError(Orthanc::HttpStatus_403_Forbidden);
+      }
+      else
+      {
+        accepted = PhotoTrackApi::CheckImageSize(call, boost::filesystem::file_size(file));
+      }
+
+      if (!accepted)
+      {
+        // The proxy leaves its files behind (e.g. with
+        // "client_body_in_file_only on" in nginx)
+        boost::system::error_code error;
+        boost::filesystem::remove(file, error);
+        return;
+      }
+
+      PhotoTrackApi::GetDatabaseWrapper(call).ReplaceImageFromFile(uuid, file, contentType);
+    }
+
+    call.GetOutput().AnswerBuffer("{}", "application/json");
+  }
+
+
+  // The body is the SHA-1 of an image that is already stored
+  static void SetImageHash(Orthanc::RestApiPutCall& call)
+  {
+    std::string hash;
+    if (!Toolbox::ParseSHA1(hash, Orthanc::Toolbox::StripSpaces(call.GetPutBody())))
+    {
+      call.GetOutput().SignalError(Orthanc::HttpStatus_400_BadRequest);
+      return;
+    }
+
+    std::string uuid = call.GetUriComponent("uuid", "");
+    if (PhotoTrackApi::GetDatabaseWrapper(call).AttachImage(uuid, hash))
+    {
+      call.GetOutput().AnswerBuffer("{}", "application/json");
+    }
+    else
+    {
+      call.GetOutput().SignalError(Orthanc::HttpStatus_404_NotFound);
+    }
+  }
+
+
+  // The body is an array of SHA-1 hashes. The answer tells which of
+  // them are already stored, in the format of the request.
+  static void LookupImageHashes(Orthanc::RestApiPostCall& call)
+  {
+    static const Json::ArrayIndex MAX_HASHES = 1000;
+
+    Json::Value request;
+    if (!call.ParseJsonRequest(request) ||
+        request.type() != Json::arrayValue ||
+        request.size() > MAX_HASHES)
+    {
+      call.GetOutput().SignalError(Orthanc::HttpStatus_400_BadRequest);
+      return;
+    }
+
+    std::list<std::string> hashes;
+    for (Json::Value::ArrayIndex i = 0; i < request.size(); i++)
+    {
+      std::string hash;
+      if (request[i].type() != Json::stringValue ||
+          !Toolbox::ParseSHA1(hash, request[i].asString()))
+      {
+        call.GetOutput().SignalError(Orthanc::HttpStatus_400_BadRequest);
+        return;
+      }
+
+      hashes.push_back(hash);
+    }
+
+    std::set<std::string> found;
+    PhotoTrackApi::GetDatabaseWrapper(call).LookupImageHashes(found, hashes);
+
+    Json::Value answer = Json::objectValue;
+    answer["Found"] = Json::arrayValue;
+    answer["Missing"] = Json::arrayValue;
+
+    std::list<std::string>::const_iterator hash = hashes.begin();
+    for (Json::Value::ArrayIndex i = 0; i < request.size(); i++, ++hash)
+    {
+      answer[found.find(*hash) != found.end() ? "Found" : "Missing"].append(request[i]);
+    }
+
+    call.GetOutput().AnswerJson(answer);
+  }
+
+
+  static void AnswerUploadStatus(Orthanc::RestApiOutput& output,
+                                 UploadStatus status)
+  {
+    switch (status)
+    {
+      case UploadStatus_Success:
+        output.AnswerBuffer("{}", "application/json");
+        break;
+
+      case UploadStatus_UnknownSession:
+        output.SignalError(Orthanc::HttpStatus_404_NotFound);
+        break;
+
+      case UploadStatus_Incomplete:
+        output.SignalError(Orthanc::HttpStatus_409_Conflict);
+        break;
+
+      default:
+        output.SignalError(Orthanc::HttpStatus_400_BadRequest);
+        break;
+    }
+  }
+
+
+  // The body gives the "Size" of the image, its "MD5" and its "ImageMime"
+  static void PostUploadSession(Orthanc::RestApiPostCall& call)
+  {
+    UploadSessions* uploads = PhotoTrackApi::GetUploadSessions(call);
+
+    Json::Value request;
+    if (uploads == NULL ||
+        !call.ParseJsonRequest(request) ||
+        request.type() != Json::objectValue)
+    {
+      call.GetOutput().SignalError(Orthanc::HttpStatus_400_BadRequest);
+      return;
+    }
+
+    // Read as a double, as jsoncpp stores the small numbers as signed
+    const Json::Value size = request.get("Size", Json::nullValue);
+    if (!size.isIntegral() ||
+        size.asDouble() <= 0)
+    {
+      call.GetOutput().SignalError(Orthanc::HttpStatus_400_BadRequest);
+      return;
+    }
+
+    if (size.asDouble() > static_cast<double>(uploads->GetMaxSize()))
+    {
+      call.GetOutput().SignalError(Orthanc::HttpStatus_413_RequestEntityTooLarge);
+      return;
+    }
+
+    std::string id = uploads->Create(call.GetUriComponent("uuid", ""),
+                                     request.get("ImageMime", "image/jpeg").asString(),
+                                     static_cast<uint64_t>(size.asDouble()),
+                                     request.get("MD5", "").asString());
+    if (id.empty())
+    {
+      call.GetOutput().SignalError(Orthanc::HttpStatus_400_BadRequest);
+      return;
+    }
+
+    Json::Value answer = Json::objectValue;
+    answer["ID"] = id;
+    answer["Path"] = "/uploads/" + id;
+    call.GetOutput().AnswerJson(answer);
+  }
+
+
+  static void GetUploadSession(Orthanc::RestApiGetCall& call)
+  {
+    UploadSessions* uploads = PhotoTrackApi::GetUploadSessions(call);
+
+    Json::Value status;
+    if (uploads != NULL &&
+        uploads->GetStatus(status, call.GetUriComponent("id", "")))
+    {
+      call.GetOutput().AnswerJson(status);
+    }
+  }
+
+
+  static void DeleteUploadSession(Orthanc::RestApiDeleteCall& call)
+  {
+    UploadSessions* uploads = PhotoTrackApi::GetUploadSessions(call);
+
+    if (uploads != NULL &&
+        uploads->Remove(call.GetUriComponent("id", "")))
+    {
+      call.GetOutput().AnswerBuffer("{}", "application/json");
+    }
+  }
+
+
+  static void PutUploadChunk(Orthanc::RestApiPutCall& call)
+  {
+    UploadSessions* uploads = PhotoTrackApi::GetUploadSessions(call);
+
+    uint64_t offset;
+    try
+    {
+      offset = boost::lexical_cast<uint64_t>(call.GetUriComponent("offset", ""));
+    }
+    catch (boost::bad_lexical_cast&)
+    {
+      call.GetOutput().SignalError(Orthanc::HttpStatus_400_BadRequest);
+      return;
+    }
+
+    if (uploads != NULL)
+    {
+      AnswerUploadStatus(call.GetOutput(), uploads->WriteChunk
+                         (call.GetUriComponent("id", ""), offset, call.GetPutBody()));
+    }
+  }
+
+
+  static void FinalizeUploadSession(Orthanc::RestApiPostCall& call)
+  {
+    UploadSessions* uploads = PhotoTrackApi::GetUploadSessions(call);
+
+    if (uploads != NULL)
+    {
+      AnswerUploadStatus(call.GetOutput(), uploads->Finalize(call.GetUriComponent("id", "")));
+    }
+  }
+  
+  static void DeleteUser(Orthanc::RestApiDeleteCall& call)
+  {
+    std::string uuid = call.GetUriComponent("uuid", "");
+    PhotoTrackApi::GetDatabaseWrapper(call).DeleteUser(uuid);
+    call.GetOutput().AnswerBuffer("{}", "application/json");
+  }
+
+
+  static std::string GetSiteArchiveFilename(const Site& site)
+  {
+    std::string s = site.GetPitNumber();
+    if (s.empty())
+    {
+      s = "SiteArchive";
+    }
+
+    return s + ".zip";
+  }
+
+
+  static void WriteSiteArchive(Site& site,
+                               Orthanc::RestApiGetCall& call,
+                               const std::string& path)
+  {
+    std::string uuid = call.GetUriComponent("uuid", "");
 
-    Site site;
     {    
       // Create a ZIP writer
-      Orthanc::HierarchicalZipWriter writer(tmp.GetPath().c_str());
+      Orthanc::HierarchicalZipWriter writer(path.c_str());
       writer.SetZip64(false);
 
       if (PhotoTrackApi::GetDatabaseWrapper(call).GetSite(site, uuid))
@@ -598,7 +1588,7 @@ namespace PhotoTrack
           PhotoTrackApi::GetDatabaseWrapper(call).GetPhoto(photo, lst[i]["Uuid"].asString());
         
           std::string image;
-          PhotoTrackApi::GetFileStorage(call).ReadFile(image, photo.GetImageUuid());
+          PhotoTrackApi::GetImageStorage(call).Read(image, photo.GetImageUuid());
 
           std::string extension = ".jpg";
           if (photo.GetImageMime() == "image/png")
@@ -614,22 +1604,55 @@ namespace PhotoTrack
           std::cout << filename << std::endl;
 
           writer.OpenFile(filename.c_str());
-          writer.Write(image);
+
+          if (photo.GetImageCompression() == Orthanc::CompressionType_Zlib)
+          {
+            ZlibInflater inflater(image.c_str(), image.size());
+
+            std::string chunk;
+            while (inflater.ReadChunk(chunk, 64 * 1024))
+            {
+              writer.Write(chunk);
+            }
+          }
+          else
+          {
+            writer.Write(image);
+          }
         }
       }
     }
+  }
 
-    // Prepare the sending of the ZIP file
-    Orthanc::FilesystemHttpSender sender(tmp.GetPath().c_str());
-    sender.SetContentType("application/zip");
 
-    std::string s = site.GetPitNumber();
-    if (s.empty())
+  static void GetSiteArchive(Orthanc::RestApiGetCall& call)
+  {
+    Site site;
+    ProxyOffload* offload = PhotoTrackApi::GetProxyOffload(call);
+
+    if (offload != NULL &&
+        offload->HasSpool())
     {
-      s = "SiteArchive";
+      // The ZIP file is written to the spool directory, where the
+      // front proxy will read it
+      std::string name = offload->CreateSpoolFile(".zip");
+      WriteSiteArchive(site, call, offload->GetSpoolPath(name));
+
+      BlobHttpAnswer answer;
+      answer.SetContentType("application/zip");
+      answer.SetDownloadFilename(GetSiteArchiveFilename(site));
+      answer.AnswerOffloaded(call.GetOutput(), offload->FormatSpoolRedirection(name));
+      return;
     }
 
-    sender.SetDownloadFilename(s + ".zip");
+    // Create a RAII for the temporary file to manage the ZIP file
+    Orthanc::Toolbox::TemporaryFile tmp;
+    WriteSiteArchive(site, call, tmp.GetPath());
+
+    // Prepare the sending of the ZIP file
+    Orthanc::FilesystemHttpSender sender(tmp.GetPath().c_str());
+    sender.SetContentType("application/zip");
+    sender.SetDownloadFilename(GetSiteArchiveFilename(site));
 
     // Send the ZIP
     call.GetOutput().AnswerFile(sender);
@@ -691,7 +1714,30 @@ namespace PhotoTrack
   }
 
 
-  PhotoTrackApi::PhotoTrackApi(bool isTest) : db_(NULL)
+  static void GetStatistics(Orthanc::RestApiGetCall& call)
+  {
+    Json::Value result = Json::objectValue;
+
+    ImageCache* cache = PhotoTrackApi::GetImageCache(call);
+    if (cache != NULL)
+    {
+      cache->GetStatistics(result["ImageCache"]);
+    }
+
+    call.GetOutput().AnswerJson(result);
+  }
+
+
+  PhotoTrackApi::PhotoTrackApi(bool isTest) : 
+    db_(NULL),
+    imageCache_(NULL),
+    proxyOffload_(NULL),
+    derivedImages_(NULL),
+    tileCache_(NULL),
+    contactSheets_(NULL),
+    uploads_(NULL),
+    ingest_(NULL),
+    maxImageSize_(0)
   {
     if (isTest)
     {
@@ -717,8 +1763,11 @@ namespace PhotoTrack
     Register("/sites/{uuid}/name", GetSiteName);
     Register("/sites/{uuid}/status", GetSiteStatus);    
     Register("/sites/{uuid}/archive", GetSiteArchive);    
+    Register("/sites/{uuid}/contact-sheet", GetContactSheetImage);
+    Register("/sites/{uuid}/contact-sheet/map", GetContactSheetMap);
     
     Register("/sites/{uuid}/photos", ListPhotosOfSite);
+    Register("/sites/{uuid}/duplicates", ListDuplicatesOfSite);
 
     Register("/photos", ListPhotos);
     Register("/photos", PostPhoto);
@@ -730,6 +1779,8 @@ namespace PhotoTrack
     Register("/photos/{uuid}/longitude", GetPhotoLongitude);
     Register("/photos/{uuid}/tag", GetPhotoTag);
     Register("/photos/{uuid}/seconds-since-epoch", GetPhotoSecondsSinceEpoch);
+    Register("/photos/{uuid}/tiles", GetTilesDescriptor);
+    Register("/photos/{uuid}/tiles/{level}/{tile}", GetTile);
 
     Register("/users", ListUsers);
 
@@ -753,7 +1804,17 @@ namespace PhotoTrack
 
     Register("/photos/{uuid}/image", GetImage);
     Register("/photos/{uuid}/image", SetImage);
+    Register("/photos/{uuid}/image-hash", SetImageHash);
+    Register("/images/{imageUuid}", GetImageFromUuid);
+    Register("/images/lookup", LookupImageHashes);
+
+    Register("/photos/{uuid}/uploads", PostUploadSession);
+    Register("/uploads/{id}", GetUploadSession);
+    Register("/uploads/{id}", DeleteUploadSession);
+    Register("/uploads/{id}/finalize", FinalizeUploadSession);
+    Register("/uploads/{id}/{offset}", PutUploadChunk);
 
     Register("/changes", ListChanges);
+    Register("/statistics", GetStatistics);
   }
 }
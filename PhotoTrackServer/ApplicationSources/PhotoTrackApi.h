@@ -20,9 +20,15 @@
 #pragma once
 
 #include "ActiveSessions.h"
+#include "ContactSheetCache.h"
 #include "Database.h"
+#include "DerivedImageCache.h"
+#include "ImageCache.h"
+#include "IngestQueue.h"
+#include "ProxyOffload.h"
+#include "TileCache.h"
+#include "UploadSessions.h"
 
-#include <Core/FileStorage/FileStorage.h>
 #include <Core/RestApi/RestApi.h>
 #include <set>
 
@@ -33,6 +39,14 @@ namespace PhotoTrack
   private:
     ActiveSessions  sessions_;
     DatabaseWrapper* db_;
+    ImageCache* imageCache_;
+    ProxyOffload* proxyOffload_;
+    DerivedImageCache* derivedImages_;
+    TileCache* tileCache_;
+    ContactSheetCache* contactSheets_;
+    UploadSessions* uploads_;
+    IngestQueue* ingest_;
+    uint64_t maxImageSize_;
 
   public:
     PhotoTrackApi(bool isTest);
@@ -42,6 +56,49 @@ namespace PhotoTrack
       db_ = &db;
     }
 
+    void SetImageCache(ImageCache& cache)
+    {
+      imageCache_ = &cache;
+    }
+
+    void SetProxyOffload(ProxyOffload& offload)
+    {
+      proxyOffload_ = &offload;
+    }
+
+    void SetDerivedImageCache(DerivedImageCache& cache)
+    {
+      derivedImages_ = &cache;
+    }
+
+    void SetTileCache(TileCache& cache)
+    {
+      tileCache_ = &cache;
+    }
+
+    void SetContactSheetCache(ContactSheetCache& cache)
+    {
+      contactSheets_ = &cache;
+    }
+
+    void SetUploadSessions(UploadSessions& uploads)
+    {
+      uploads_ = &uploads;
+    }
+
+    void SetIngestQueue(IngestQueue& ingest)
+    {
+      ingest_ = &ingest;
+    }
+
+    // Maximum size of the uploads of the images (0 means no limit).
+    // This is checked once the body is received: The front proxy must
+    // enforce the same limit to protect the memory of the server.
+    void SetMaxImageSize(uint64_t size)
+    {
+      maxImageSize_ = size;
+    }
+
     void SetAuthenticator(IAuthenticator& authenticator)
     {
       sessions_.SetAuthenticator(authenticator);
@@ -59,9 +116,56 @@ namespace PhotoTrack
 
     static DatabaseWrapper& GetDatabaseWrapper(Orthanc::RestApiCall& call);
 
-    static Orthanc::FileStorage& GetFileStorage(Orthanc::RestApiCall& call)
+    // Returns NULL if the images are not cached
+    static ImageCache* GetImageCache(Orthanc::RestApiCall& call)
+    {
+      return GetApi(call).imageCache_;
+    }
+
+    // Returns NULL if the transfers are not offloaded to a proxy
+    static ProxyOffload* GetProxyOffload(Orthanc::RestApiCall& call)
+    {
+      return GetApi(call).proxyOffload_;
+    }
+
+    // Returns NULL if the images cannot be resized
+    static DerivedImageCache* GetDerivedImageCache(Orthanc::RestApiCall& call)
+    {
+      return GetApi(call).derivedImages_;
+    }
+
+    // Returns NULL if the tiles are not available
+    static TileCache* GetTileCache(Orthanc::RestApiCall& call)
+    {
+      return GetApi(call).tileCache_;
+    }
+
+    // Returns NULL if the contact sheets are not available
+    static ContactSheetCache* GetContactSheetCache(Orthanc::RestApiCall& call)
+    {
+      return GetApi(call).contactSheets_;
+    }
+
+    // Returns NULL if the resumable uploads are disabled
+    static UploadSessions* GetUploadSessions(Orthanc::RestApiCall& call)
+    {
+      return GetApi(call).uploads_;
+    }
+
+    // Returns NULL if the uploads are committed before answering
+    static IngestQueue* GetIngestQueue(Orthanc::RestApiCall& call)
+    {
+      return GetApi(call).ingest_;
+    }
+
+    // Answers with "413 Request Entity Too Large" if the upload
+    // exceeds the maximum size
+    static bool CheckImageSize(Orthanc::RestApiCall& call,
+                               uint64_t size);
+
+    static IImageStorage& GetImageStorage(Orthanc::RestApiCall& call)
     {
-      return GetDatabaseWrapper(call).GetFileStorage();
+      return GetDatabaseWrapper(call).GetImageStorage();
     }
   };
 }
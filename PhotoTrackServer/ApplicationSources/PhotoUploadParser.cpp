@@ -0,0 +1,405 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "PhotoUploadParser.h"
+
+#include "Base64Decoder.h"
+
+#include <json/reader.h>
+#include <string.h>
+
+namespace PhotoTrack
+{
+  static const char IMAGE_DATA[] = "ImageData";
+
+
+  static void SkipWhitespaces(const char*& p,
+                              const char* end)
+  {
+    while (p < end && 
+           (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+    {
+      p++;
+    }
+  }
+
+
+  // On entry, "p" points to the opening quote. On exit, it points
+  // after the closing quote.
+  static bool SkipString(const char*& p,
+                         const char* end)
+  {
+    p++;
+
+    while (p < end)
+    {
+      if (*p == '"')
+      {
+        p++;
+        return true;
+      }
+      else if (*p == '\\')
+      {
+        p += 2;
+      }
+      else
+      {
+        p++;
+      }
+    }
+
+    return false;
+  }
+
+
+  // Skips any JSON value. The nested values are only checked for the
+  // balance of the brackets: jsoncpp validates them afterward.
+  static bool SkipValue(const char*& p,
+                        const char* end)
+  {
+    if (p == end)
+    {
+      return false;
+    }
+
+    if (*p == '"')
+    {
+      return SkipString(p, end);
+    }
+
+    if (*p == '{' || *p == '[')
+    {
+      unsigned int depth = 0;
+
+      while (p < end)
+      {
+        switch (*p)
+        {
+          case '"':
+            if (!SkipString(p, end))
+            {
+              return false;
+            }
+            continue;
+
+          case '{':
+          case '[':
+            depth++;
+            break;
+
+          case '}':
+          case ']':
+            depth--;
+            if (depth == 0)
+            {
+              p++;
+              return true;
+            }
+            break;
+
+          default:
+            break;
+        }
+
+        p++;
+      }
+
+      return false;
+    }
+
+    // Number or literal
+    const char* start = p;
+    while (p < end &&
+           *p != ',' && *p != '}' && *p != ']' &&
+           *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+    {
+      p++;
+    }
+
+    return p > start;
+  }
+
+
+  static int GetHexValue(char c)
+  {
+    if (c >= '0' && c <= '9')
+    {
+      return c - '0';
+    }
+    else if (c >= 'a' && c <= 'f')
+    {
+      return c - 'a' + 10;
+    }
+    else if (c >= 'A' && c <= 'F')
+    {
+      return c - 'A' + 10;
+    }
+    else
+    {
+      return -1;
+    }
+  }
+
+
+  // Decodes the content of a JSON string that holds base64. The
+  // escape sequences are rare (Android escapes the slashes, and the
+  // line breaks of the MIME flavor of base64): The runs of plain
+  // characters between them are fed to the decoder without copy.
+  static bool DecodeString(std::string& image,
+                           const char* p,
+                           const char* end)
+  {
+    Base64Decoder decoder;
+
+    // Upper bound of the decoded size, to avoid reallocations
+    image.clear();
+    image.reserve((end - p) / 4 * 3 + 3);
+
+    while (p < end)
+    {
+      const char* escape = reinterpret_cast<const char*>(memchr(p, '\\', end - p));
+      if (escape == NULL)
+      {
+        escape = end;
+      }
+
+      if (!decoder.Decode(image, p, escape - p))
+      {
+        return false;
+      }
+
+      if (escape == end)
+      {
+        break;
+      }
+
+      if (end - escape < 2)
+      {
+        return false;
+      }
+
+      char c;
+      switch (escape[1])
+      {
+        case '/':
+          c = '/';
+          p = escape + 2;
+          break;
+
+        case 'n':
+        case 'r':
+        case 't':
+          c = 0;   // Line breaks are ignored
+          p = escape + 2;
+          break;
+
+        case 'u':
+        {
+          // Only the ASCII characters may occur in base64
+          if (end - escape < 6 ||
+              memcmp(escape + 2, "00", 2) != 0 ||
+              GetHexValue(escape[4]) < 0 ||
+              GetHexValue(escape[5]) < 0)
+          {
+            return false;
+          }
+
+          c = static_cast<char>(GetHexValue(escape[4]) * 16 + GetHexValue(escape[5]));
+          p = escape + 6;
+
+          if (c == '\n' || c == '\r' || c == '\t')
+          {
+            c = 0;
+          }
+          break;
+        }
+
+        default:
+          return false;
+      }
+
+      if (c != 0 &&
+          !decoder.Decode(image, &c, 1))
+      {
+        return false;
+      }
+    }
+
+    return decoder.Finish(image);
+  }
+
+
+  bool PhotoUploadParser::Parse(Json::Value& metadata,
+                                std::string& image,
+                                bool& hasImage,
+                                const void* body,
+                                size_t size)
+  {
+    hasImage = false;
+    image.clear();
+
+    const char* start = reinterpret_cast<const char*>(body);
+    const char* end = start + size;
+    const char* p = start;
+
+    // Location of the string value of "ImageData", including quotes
+    const char* dataStart = NULL;
+    const char* dataEnd = NULL;
+
+    SkipWhitespaces(p, end);
+    if (p == end || 
+        *p != '{')
+    {
+      return false;
+    }
+
+    p++;
+    SkipWhitespaces(p, end);
+
+    if (p < end && *p == '}')
+    {
+      p++;
+    }
+    else
+    {
+      for (;;)
+      {
+        // Key
+        const char* key = p;
+        if (p == end ||
+            *p != '"' ||
+            !SkipString(p, end))
+        {
+          return false;
+        }
+
+        bool isImageData = (static_cast<size_t>(p - key) == sizeof(IMAGE_DATA) + 1 &&
+                            memcmp(key + 1, IMAGE_DATA, sizeof(IMAGE_DATA) - 1) == 0);
+
+        SkipWhitespaces(p, end);
+        if (p == end ||
+            *p != ':')
+        {
+          return false;
+        }
+
+        p++;
+        SkipWhitespaces(p, end);
+
+        // Value
+        const char* value = p;
+        if (!SkipValue(p, end))
+        {
+          return false;
+        }
+
+        if (isImageData &&
+            *value == '"')
+        {
+          if (dataStart != NULL)
+          {
+            return false;   // Duplicated image
+          }
+
+          dataStart = value;
+          dataEnd = p;
+        }
+
+        SkipWhitespaces(p, end);
+        if (p == end)
+        {
+          return false;
+        }
+        else if (*p == '}')
+        {
+          p++;
+          break;
+        }
+        else if (*p == ',')
+        {
+          p++;
+          SkipWhitespaces(p, end);
+        }
+        else
+        {
+          return false;
+        }
+      }
+    }
+
+    SkipWhitespaces(p, end);
+    if (p != end)
+    {
+      return false;
+    }
+
+    // Parse the metadata with jsoncpp, after replacing the image by "null"
+    Json::Reader reader;
+
+    if (dataStart == NULL)
+    {
+      if (!reader.parse(start, end, metadata))
+      {
+        return false;
+      }
+    }
+    else
+    {
+      std::string s;
+      s.reserve((dataStart - start) + 4 + (end - dataEnd));
+      s.append(start, dataStart);
+      s.append("null");
+      s.append(dataEnd, end);
+
+      if (!reader.parse(s, metadata) ||
+          !DecodeString(image, dataStart + 1, dataEnd - 1))
+      {
+        return false;
+      }
+
+      hasImage = true;
+    }
+
+    if (metadata.type() != Json::objectValue)
+    {
+      return false;
+    }
+
+    if (!hasImage &&
+        metadata.isMember(IMAGE_DATA) &&
+        metadata[IMAGE_DATA].type() == Json::stringValue)
+    {
+      // The key was written with escape sequences, and was not
+      // recognized by the scanner
+      const std::string& data = metadata[IMAGE_DATA].asString();
+      Base64Decoder decoder;
+      if (!decoder.Decode(image, data.c_str(), data.size()) ||
+          !decoder.Finish(image))
+      {
+        return false;
+      }
+
+      hasImage = true;
+    }
+
+    metadata.removeMember(IMAGE_DATA);
+    return true;
+  }
+}
@@ -0,0 +1,48 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include <json/value.h>
+#include <string>
+
+namespace PhotoTrack
+{
+  /**
+   * Parser of the JSON bodies of the legacy uploads of photos, in
+   * which the image is embedded as a base64 string in the
+   * "ImageData" field. The body is scanned once: The value of
+   * "ImageData" is decoded in place, chunk by chunk, and is never
+   * copied into a Json::Value. Only the other (small) fields are
+   * parsed by jsoncpp.
+   **/
+  class PhotoUploadParser
+  {
+  public:
+    // Returns "false" if the body is not a valid JSON object, or if
+    // "ImageData" is not valid base64. The "ImageData" field is
+    // removed from "metadata". If there is no image, "hasImage" is
+    // set to "false".
+    static bool Parse(Json::Value& metadata,
+                      std::string& image,
+                      bool& hasImage,
+                      const void* body,
+                      size_t size);
+  };
+}
@@ -1,3 +1,12 @@
+-- Version of the schema, to upgrade the existing databases at
+-- startup. The databases without this table are at version 1.
+CREATE TABLE GlobalProperties(
+       property TEXT PRIMARY KEY,
+       value TEXT
+       );
+
+INSERT INTO GlobalProperties VALUES('SchemaVersion', '3');
+
 CREATE TABLE Sites(
        uuid TEXT PRIMARY KEY,
        pitNumber TEXT,
@@ -17,7 +26,11 @@ CREATE TABLE Photos(
        longitude REAL,
        secondsSinceEpoch INTEGER,
        tag TEXT,
-       siteUuid TEXT REFERENCES Sites(uuid) ON DELETE CASCADE
+       siteUuid TEXT REFERENCES Sites(uuid) ON DELETE CASCADE,
+       imageCompression INTEGER,  -- Orthanc::CompressionType
+       preview TEXT,              -- Base64-encoded PNG
+       imageHash TEXT,            -- SHA-1 of the uncompressed image
+       perceptualHash TEXT        -- dHash, as 16 hexadecimal digits
        );
 
 CREATE TABLE Users(
@@ -43,12 +56,38 @@ CREATE TABLE Changes(
        date TEXT
        );
 
--- Trigger to remove image after a photo is deleted
+-- Answers of the POST requests with an "Idempotency-Key" header,
+-- replayed to the clients that retry them
+CREATE TABLE IdempotencyKeys(
+       idempotencyKey TEXT PRIMARY KEY,
+       fingerprint TEXT,          -- SHA-1 of the request
+       answer TEXT,               -- NULL while the request is processed
+       secondsSinceEpoch INTEGER
+       );
+
+-- Trigger to remove image after a photo is deleted, unless it is
+-- shared with another photo
 CREATE TRIGGER PhotoDeleted
 AFTER DELETE ON Photos
 BEGIN
-  SELECT SignalImageDeleted(old.imageUuid);
+  SELECT SignalImageDeleted(old.imageUuid)
+  WHERE NOT EXISTS (SELECT 1 FROM Photos WHERE imageUuid=old.imageUuid);
 END;
 
 
--- TODO Indexes
+-- The SHA-1 of the images that were replaced by a recompressed
+-- version, so that the clients still find them (cf. "/images/lookup")
+CREATE TABLE ImageHashAliases(
+       alias TEXT PRIMARY KEY,
+       imageHash TEXT
+       );
+
+-- Content-addressed access to the images
+CREATE INDEX PhotosImage ON Photos(imageUuid);
+CREATE INDEX PhotosImageHash ON Photos(imageHash);
+
+-- Per-site listings in chronological order (e.g. to group the
+-- near-duplicate photos)
+CREATE INDEX PhotosSite ON Photos(siteUuid, secondsSinceEpoch);
+
+CREATE INDEX IdempotencyKeysAge ON IdempotencyKeys(secondsSinceEpoch);
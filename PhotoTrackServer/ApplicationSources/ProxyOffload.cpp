@@ -0,0 +1,237 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "ProxyOffload.h"
+
+#include <Core/OrthancException.h>
+#include <Core/Uuid.h>
+
+#include <glog/logging.h>
+#include <boost/filesystem.hpp>
+#include <time.h>
+
+namespace PhotoTrack
+{
+  ProxyOffloadMode StringToProxyOffloadMode(const std::string& mode)
+  {
+    if (mode == "X-Accel-Redirect")
+    {
+      return ProxyOffloadMode_AccelRedirect;
+    }
+    else if (mode == "X-Sendfile")
+    {
+      return ProxyOffloadMode_Sendfile;
+    }
+    else
+    {
+      LOG(ERROR) << "Unknown mode for the proxy offload: " << mode;
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  ProxyOffload::ProxyOffload(ProxyOffloadMode mode,
+                             const std::string& storageRoot,
+                             const std::string& storagePrefix) :
+    mode_(mode),
+    storageRoot_(boost::filesystem::absolute(storageRoot).string()),
+    storagePrefix_(storagePrefix),
+    spoolRetention_(0)
+  {
+  }
+
+
+  std::string ProxyOffload::FormatRedirection(const std::string& root,
+                                              const std::string& prefix,
+                                              const std::string& relativePath) const
+  {
+    switch (mode_)
+    {
+      case ProxyOffloadMode_AccelRedirect:
+      {
+        std::string uri = prefix;
+        if (uri.empty() || uri[uri.size() - 1] != '/')
+        {
+          uri += '/';
+        }
+
+        return "X-Accel-Redirect: " + uri + relativePath;
+      }
+
+      case ProxyOffloadMode_Sendfile:
+        return "X-Sendfile: " + (boost::filesystem::path(root) / relativePath).string();
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+  }
+
+
+  void ProxyOffload::SetSpool(const std::string& root,
+                              const std::string& prefix,
+                              unsigned int retention)
+  {
+    boost::filesystem::create_directories(root);
+
+    spoolRoot_ = boost::filesystem::absolute(root).string();
+    spoolPrefix_ = prefix;
+    spoolRetention_ = retention;
+  }
+
+
+  std::string ProxyOffload::FormatStorageRedirection(const std::string& relativePath) const
+  {
+    return FormatRedirection(storageRoot_, storagePrefix_, relativePath);
+  }
+
+
+  std::string ProxyOffload::CreateSpoolFile(const std::string& extension)
+  {
+    if (!HasSpool())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    RemoveExpiredSpoolFiles();
+
+    return Orthanc::Toolbox::GenerateUuid() + extension;
+  }
+
+
+  std::string ProxyOffload::GetSpoolPath(const std::string& name) const
+  {
+    return (boost::filesystem::path(spoolRoot_) / name).string();
+  }
+
+
+  std::string ProxyOffload::FormatSpoolRedirection(const std::string& name) const
+  {
+    return FormatRedirection(spoolRoot_, spoolPrefix_, name);
+  }
+
+
+  void ProxyOffload::RemoveExpiredSpoolFiles()
+  {
+    using namespace boost::filesystem;
+
+    boost::mutex::scoped_lock lock(spoolMutex_);
+
+    if (!HasSpool())
+    {
+      return;
+    }
+
+    time_t limit = time(NULL) - static_cast<time_t>(spoolRetention_);
+
+    std::vector<path> expired;
+
+    for (directory_iterator it(spoolRoot_); it != directory_iterator(); ++it)
+    {
+      if (is_regular_file(it->status()) &&
+          last_write_time(it->path()) < limit)
+      {
+        expired.push_back(it->path());
+      }
+    }
+
+    for (size_t i = 0; i < expired.size(); i++)
+    {
+      boost::system::error_code error;
+      remove(expired[i], error);
+    }
+  }
+
+
+  void ProxyOffload::SetUploadRoot(const std::string& root,
+                                   const std::string& secret)
+  {
+    if (secret.empty())
+    {
+      LOG(ERROR) << "The uploads through the proxy need a shared secret";
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    boost::filesystem::create_directories(root);
+    uploadRoot_ = boost::filesystem::canonical(root).string();
+    uploadSecret_ = secret;
+  }
+
+
+  bool ProxyOffload::IsUploadSecret(const std::string& secret) const
+  {
+    if (!HasUploadRoot() ||
+        secret.size() != uploadSecret_.size())
+    {
+      return false;
+    }
+
+    // Constant-time comparison, so that the secret cannot be guessed
+    // from the response times
+    unsigned char diff = 0;
+    for (size_t i = 0; i < secret.size(); i++)
+    {
+      diff |= static_cast<unsigned char>(secret[i] ^ uploadSecret_[i]);
+    }
+
+    return diff == 0;
+  }
+
+
+  bool ProxyOffload::IsUploadFile(const std::string& path) const
+  {
+    if (!HasUploadRoot())
+    {
+      return false;
+    }
+
+    // Resolves the symbolic links and the ".." components
+    boost::system::error_code error;
+    boost::filesystem::path file = boost::filesystem::canonical(path, error);
+
+    if (error ||
+        !boost::filesystem::is_regular_file(file))
+    {
+      return false;
+    }
+
+    // The proxy forwards the request as soon as the body is written:
+    // An older file was not uploaded by this request
+    static const time_t MAX_AGE = 60;   // In seconds
+
+    time_t modified = boost::filesystem::last_write_time(file, error);
+    if (error ||
+        modified + MAX_AGE < time(NULL))
+    {
+      return false;
+    }
+
+    // The proxy may use subdirectories (cf. "client_body_temp_path")
+    for (boost::filesystem::path parent = file.parent_path();
+         !parent.empty(); parent = parent.parent_path())
+    {
+      if (parent.string() == uploadRoot_)
+      {
+        return true;
+      }
+    }
+
+    return false;
+  }
+}
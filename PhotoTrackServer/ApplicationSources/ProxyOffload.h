@@ -0,0 +1,125 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <string>
+
+namespace PhotoTrack
+{
+  enum ProxyOffloadMode
+  {
+    ProxyOffloadMode_AccelRedirect,   // nginx
+    ProxyOffloadMode_Sendfile         // Apache (mod_xsendfile), lighttpd
+  };
+
+  ProxyOffloadMode StringToProxyOffloadMode(const std::string& mode);
+
+
+  /**
+   * Configuration of the front proxy that streams the bodies of the
+   * images and of the site archives, once PhotoTrack has checked the
+   * request. With "X-Accel-Redirect", the files are designated by
+   * internal URIs of nginx (which maps them to the storage area),
+   * whereas "X-Sendfile" uses absolute paths.
+   *
+   * The site archives are written to a spool directory, as they
+   * must outlive the request. The files of this directory are
+   * removed once they are older than the retention delay.
+   *
+   * In the other direction, the proxy can write the large request
+   * bodies to an upload directory, and only pass the path of the
+   * file in the "X-Upload-File" header (e.g. "client_body_in_file_only"
+   * and "$request_body_file" in nginx). As the clients could forge
+   * this header, the proxy must also send a shared secret in the
+   * "X-Upload-Secret" header, and the file must have been written
+   * during the last minute (i.e. by the current request, not left
+   * over by a previous one). The rejected files are removed, as the
+   * accepted ones are moved to the storage area.
+   **/
+  class ProxyOffload : public boost::noncopyable
+  {
+  private:
+    ProxyOffloadMode  mode_;
+    std::string       storageRoot_;
+    std::string       storagePrefix_;
+    std::string       spoolRoot_;
+    std::string       spoolPrefix_;
+    unsigned int      spoolRetention_;
+    std::string       uploadRoot_;
+    std::string       uploadSecret_;
+    boost::mutex      spoolMutex_;
+
+    std::string FormatRedirection(const std::string& root,
+                                  const std::string& prefix,
+                                  const std::string& relativePath) const;
+
+  public:
+    ProxyOffload(ProxyOffloadMode mode,
+                 const std::string& storageRoot,
+                 const std::string& storagePrefix);
+
+    ProxyOffloadMode GetMode() const
+    {
+      return mode_;
+    }
+
+    void SetSpool(const std::string& root,
+                  const std::string& prefix,
+                  unsigned int retention);   // In seconds
+
+    bool HasSpool() const
+    {
+      return !spoolRoot_.empty();
+    }
+
+    // Formats the HTTP header that designates a blob of the storage
+    // area, given its relative path
+    std::string FormatStorageRedirection(const std::string& relativePath) const;
+
+    // Creates a new file in the spool directory, and returns its name
+    // (relative to the spool directory). This also removes the
+    // expired files.
+    std::string CreateSpoolFile(const std::string& extension);
+
+    std::string GetSpoolPath(const std::string& name) const;
+
+    std::string FormatSpoolRedirection(const std::string& name) const;
+
+    void RemoveExpiredSpoolFiles();
+
+    // The secret must be set by the proxy in the "X-Upload-Secret"
+    // header, and cannot be empty
+    void SetUploadRoot(const std::string& root,
+                       const std::string& secret);
+
+    bool HasUploadRoot() const
+    {
+      return !uploadRoot_.empty();
+    }
+
+    bool IsUploadSecret(const std::string& secret) const;
+
+    // Checks that a file given by the proxy lies in the upload
+    // directory, and that it was recently written
+    bool IsUploadFile(const std::string& path) const;
+  };
+}
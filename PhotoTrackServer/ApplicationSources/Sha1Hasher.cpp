@@ -0,0 +1,194 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "Sha1Hasher.h"
+
+#include <Core/OrthancException.h>
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+namespace PhotoTrack
+{
+  static inline uint32_t RotateLeft(uint32_t value,
+                                    unsigned int bits)
+  {
+    return (value << bits) | (value >> (32 - bits));
+  }
+
+
+  Sha1Hasher::Sha1Hasher() :
+    blockSize_(0),
+    length_(0),
+    done_(false)
+  {
+    state_[0] = 0x67452301;
+    state_[1] = 0xefcdab89;
+    state_[2] = 0x98badcfe;
+    state_[3] = 0x10325476;
+    state_[4] = 0xc3d2e1f0;
+  }
+
+
+  void Sha1Hasher::ProcessBlock(const uint8_t* block)
+  {
+    uint32_t w[80];
+
+    for (unsigned int i = 0; i < 16; i++)
+    {
+      w[i] = ((static_cast<uint32_t>(block[4 * i]) << 24) |
+              (static_cast<uint32_t>(block[4 * i + 1]) << 16) |
+              (static_cast<uint32_t>(block[4 * i + 2]) << 8) |
+              static_cast<uint32_t>(block[4 * i + 3]));
+    }
+
+    for (unsigned int i = 16; i < 80; i++)
+    {
+      w[i] = RotateLeft(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = state_[0];
+    uint32_t b = state_[1];
+    uint32_t c = state_[2];
+    uint32_t d = state_[3];
+    uint32_t e = state_[4];
+
+    for (unsigned int i = 0; i < 80; i++)
+    {
+      uint32_t f, k;
+
+      if (i < 20)
+      {
+        f = (b & c) | (~b & d);
+        k = 0x5a827999;
+      }
+      else if (i < 40)
+      {
+        f = b ^ c ^ d;
+        k = 0x6ed9eba1;
+      }
+      else if (i < 60)
+      {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8f1bbcdc;
+      }
+      else
+      {
+        f = b ^ c ^ d;
+        k = 0xca62c1d6;
+      }
+
+      uint32_t tmp = RotateLeft(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = RotateLeft(b, 30);
+      b = a;
+      a = tmp;
+    }
+
+    state_[0] += a;
+    state_[1] += b;
+    state_[2] += c;
+    state_[3] += d;
+    state_[4] += e;
+  }
+
+
+  void Sha1Hasher::Update(const void* data,
+                          size_t size)
+  {
+    if (done_)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    length_ += size;
+
+    // Complete the pending block, if any
+    if (blockSize_ > 0)
+    {
+      size_t n = std::min(size, sizeof(block_) - blockSize_);
+      memcpy(block_ + blockSize_, p, n);
+      blockSize_ += n;
+      p += n;
+      size -= n;
+
+      if (blockSize_ < sizeof(block_))
+      {
+        return;
+      }
+
+      ProcessBlock(block_);
+      blockSize_ = 0;
+    }
+
+    // Process the full blocks directly from the input
+    while (size >= sizeof(block_))
+    {
+      ProcessBlock(p);
+      p += sizeof(block_);
+      size -= sizeof(block_);
+    }
+
+    if (size > 0)
+    {
+      memcpy(block_, p, size);
+      blockSize_ = size;
+    }
+  }
+
+
+  std::string Sha1Hasher::Finish()
+  {
+    if (done_)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    uint64_t bits = length_ * 8;
+
+    // Padding: One bit set, then zeros up to 56 bytes modulo 64,
+    // then the big-endian length in bits
+    uint8_t padding[72];
+    size_t paddingSize = (blockSize_ < 56 ? 56 - blockSize_ : 120 - blockSize_);
+    memset(padding, 0, sizeof(padding));
+    padding[0] = 0x80;
+
+    for (unsigned int i = 0; i < 8; i++)
+    {
+      padding[paddingSize + i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+    }
+
+    Update(padding, paddingSize + 8);
+    done_ = true;
+
+    char buffer[41];
+    sprintf(buffer, "%08x%08x%08x%08x%08x",
+            static_cast<unsigned int>(state_[0]),
+            static_cast<unsigned int>(state_[1]),
+            static_cast<unsigned int>(state_[2]),
+            static_cast<unsigned int>(state_[3]),
+            static_cast<unsigned int>(state_[4]));
+
+    return std::string(buffer, 40);
+  }
+}
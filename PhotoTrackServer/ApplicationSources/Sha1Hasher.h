@@ -0,0 +1,57 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <stdint.h>
+#include <string>
+
+namespace PhotoTrack
+{
+  /**
+   * Incremental SHA-1 (FIPS 180-4), so that the content of the large
+   * blobs can be hashed by chunks. This avoids depending on the
+   * private "boost::uuids::detail::sha1" class, whose interface
+   * changed across the Boost versions, and on
+   * Orthanc::Toolbox::ComputeSHA1() that needs a contiguous copy of
+   * the whole content.
+   **/
+  class Sha1Hasher : public boost::noncopyable
+  {
+  private:
+    uint32_t  state_[5];
+    uint8_t   block_[64];
+    size_t    blockSize_;
+    uint64_t  length_;    // In bytes
+    bool      done_;
+
+    void ProcessBlock(const uint8_t* block);
+
+  public:
+    Sha1Hasher();
+
+    void Update(const void* data,
+                size_t size);
+
+    // Gives the digest as 40 lowercase hexadecimal digits. No more
+    // data can be added afterwards.
+    std::string Finish();
+  };
+}
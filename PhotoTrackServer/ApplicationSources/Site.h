@@ -22,6 +22,12 @@
 
 #include <Core/Uuid.h>
 
+enum SiteStatus
+{
+  SiteStatus_Closed = 0,
+  SiteStatus_Open = 1
+};
+
 class Site
 {
 private:
@@ -0,0 +1,130 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "SiteArchiver.h"
+
+#include "Toolbox.h"
+
+#include <Core/OrthancException.h>
+#include <glog/logging.h>
+
+namespace PhotoTrack
+{
+  SiteArchiver::SiteArchiver(DatabaseWrapper& db,
+                             TieredImageStorage& storage,
+                             int64_t age) :
+    db_(db),
+    storage_(storage),
+    age_(age),
+    done_(true)
+  {
+  }
+
+
+  SiteArchiver::~SiteArchiver()
+  {
+    Stop();
+  }
+
+
+  unsigned int SiteArchiver::ArchiveClosedSites()
+  {
+    std::list<std::string> sites;
+    db_.GetInactiveClosedSites(sites, Toolbox::GetSecondsSinceEpoch() - age_);
+
+    unsigned int count = 0;
+
+    for (std::list<std::string>::const_iterator
+           it = sites.begin(); it != sites.end(); ++it)
+    {
+      std::list<std::string> images;
+      db_.GetSiteImages(images, *it);
+
+      // One archive per site
+      unsigned int archived = storage_.Archive(*it, images);
+      if (archived > 0)
+      {
+        LOG(WARNING) << "Moved " << archived << " images of closed site " << *it << " to the cold storage";
+        count += archived;
+      }
+    }
+
+    return count;
+  }
+
+
+  void SiteArchiver::Worker(SiteArchiver* that,
+                            unsigned int interval)
+  {
+    for (;;)
+    {
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+
+        if (!that->done_)
+        {
+          that->wakeup_.timed_wait(lock, boost::posix_time::seconds(interval));
+        }
+
+        if (that->done_)
+        {
+          return;
+        }
+      }
+
+      try
+      {
+        that->ArchiveClosedSites();
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(ERROR) << "Error while archiving the closed sites: " << e.What();
+      }
+    }
+  }
+
+
+  void SiteArchiver::Start(unsigned int interval)
+  {
+    Stop();
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      done_ = false;
+    }
+
+    thread_ = boost::thread(Worker, this, interval);
+  }
+
+
+  void SiteArchiver::Stop()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      done_ = true;
+      wakeup_.notify_all();
+    }
+
+    if (thread_.joinable())
+    {
+      thread_.join();
+    }
+  }
+}
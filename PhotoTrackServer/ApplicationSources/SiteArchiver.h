@@ -0,0 +1,61 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include "Database.h"
+#include "TieredImageStorage.h"
+
+namespace PhotoTrack
+{
+  /**
+   * Background engine that moves the images of the closed sites to
+   * the cold tier, once no photo has been added to them for a given
+   * amount of time.
+   **/
+  class SiteArchiver : public boost::noncopyable
+  {
+  private:
+    DatabaseWrapper&           db_;
+    TieredImageStorage&        storage_;
+    int64_t                    age_;   // In seconds
+
+    boost::mutex               mutex_;
+    bool                       done_;
+    boost::condition_variable  wakeup_;
+    boost::thread              thread_;
+
+    static void Worker(SiteArchiver* that,
+                       unsigned int interval);
+
+  public:
+    SiteArchiver(DatabaseWrapper& db,
+                 TieredImageStorage& storage,
+                 int64_t age);
+
+    ~SiteArchiver();
+
+    // Runs one archiving pass, returns the number of archived images
+    unsigned int ArchiveClosedSites();
+
+    void Start(unsigned int interval);  // In seconds
+
+    void Stop();
+  };
+}
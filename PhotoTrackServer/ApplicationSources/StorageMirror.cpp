@@ -0,0 +1,422 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "StorageMirror.h"
+
+#include "FileSynchronizer.h"
+#include "IBlobReader.h"
+
+#include <Core/OrthancException.h>
+#include <Core/SQLite/Statement.h>
+#include <Core/Uuid.h>
+
+#include <glog/logging.h>
+#include <boost/filesystem.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include <memory>
+#include <stdio.h>
+#include <vector>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#if !defined(O_BINARY)
+#define O_BINARY 0
+#endif
+
+namespace PhotoTrack
+{
+  static bool WriteAll(int fd,
+                       const void* data,
+                       size_t size)
+  {
+    const char* p = reinterpret_cast<const char*>(data);
+
+    while (size > 0)
+    {
+#if defined(_WIN32)
+      int n = _write(fd, p, static_cast<unsigned int>(size));
+#else
+      ssize_t n = write(fd, p, size);
+#endif
+
+      if (n <= 0)
+      {
+        if (n < 0 && errno == EINTR)
+        {
+          continue;
+        }
+
+        return false;
+      }
+
+      p += n;
+      size -= n;
+    }
+
+    return true;
+  }
+
+
+  StorageMirror::StorageMirror(IImageStorage& source,
+                               const std::string& target,
+                               const std::string& queuePath) :
+    source_(source),
+    target_(target),
+    maxBandwidth_(0),
+    done_(true),
+    pending_(true)
+  {
+    boost::filesystem::create_directories(target);
+
+    LOG(WARNING) << "Mirroring the image storage to " << target << " (queue: " << queuePath << ")";
+
+    queue_.Open(queuePath);
+    queue_.Execute("PRAGMA SYNCHRONOUS=NORMAL;");
+    queue_.Execute("PRAGMA JOURNAL_MODE=WAL;");
+
+    if (!queue_.DoesTableExist("MirrorQueue"))
+    {
+      queue_.Execute("CREATE TABLE MirrorQueue("
+                     "seq INTEGER PRIMARY KEY AUTOINCREMENT, "
+                     "uuid TEXT, "
+                     "operation INTEGER);");
+    }
+  }
+
+
+  StorageMirror::~StorageMirror()
+  {
+    Stop();
+  }
+
+
+  std::string StorageMirror::GetPath(const std::string& uuid) const
+  {
+    if (!Orthanc::Toolbox::IsUuid(uuid))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    boost::filesystem::path path(target_);
+    path /= uuid.substr(0, 2);
+    path /= uuid.substr(2, 2);
+    path /= uuid;
+
+    return path.string();
+  }
+
+
+  void StorageMirror::Enqueue(const std::string& uuid,
+                              Operation operation)
+  {
+    {
+      boost::mutex::scoped_lock lock(queueMutex_);
+
+      Orthanc::SQLite::Statement s(queue_, SQLITE_FROM_HERE, "INSERT INTO MirrorQueue VALUES(NULL, ?, ?)");
+      s.BindString(0, uuid);
+      s.BindInt(1, operation);
+      s.Run();
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    pending_ = true;
+    wakeup_.notify_all();
+  }
+
+
+  bool StorageMirror::GetFirst(int64_t& seq,
+                               std::string& uuid,
+                               Operation& operation)
+  {
+    boost::mutex::scoped_lock lock(queueMutex_);
+
+    Orthanc::SQLite::Statement s(queue_, SQLITE_FROM_HERE, "SELECT * FROM MirrorQueue ORDER BY seq LIMIT 1");
+    if (s.Step())
+    {
+      seq = s.ColumnInt64(0);
+      uuid = s.ColumnString(1);
+      operation = static_cast<Operation>(s.ColumnInt(2));
+      return true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+
+  void StorageMirror::Acknowledge(int64_t seq)
+  {
+    boost::mutex::scoped_lock lock(queueMutex_);
+
+    Orthanc::SQLite::Statement s(queue_, SQLITE_FROM_HERE, "DELETE FROM MirrorQueue WHERE seq=?");
+    s.BindInt64(0, seq);
+    s.Run();
+  }
+
+
+  uint64_t StorageMirror::GetQueueSize()
+  {
+    boost::mutex::scoped_lock lock(queueMutex_);
+
+    Orthanc::SQLite::Statement s(queue_, SQLITE_FROM_HERE, "SELECT COUNT(*) FROM MirrorQueue");
+    s.Step();
+    return static_cast<uint64_t>(s.ColumnInt64(0));
+  }
+
+
+  void StorageMirror::Copy(const std::string& uuid)
+  {
+    if (!source_.Exists(uuid))
+    {
+      // The blob was deleted in the meantime: Its removal is queued
+      return;
+    }
+
+    // Stream the blob, so that large images are never entirely loaded in memory
+    std::auto_ptr<IBlobReader> reader(source_.OpenBlob(uuid));
+    uint64_t size = reader->GetSize();
+
+    std::string path = GetPath(uuid);
+    std::string tmp = path + ".tmp";
+    std::string directory = boost::filesystem::path(path).parent_path().string();
+    boost::filesystem::create_directories(directory);
+
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+    }
+
+    // Copy by chunks of 1MB, sleeping as needed to respect the bandwidth
+    static const size_t CHUNK_SIZE = 1024 * 1024;
+    std::vector<char> buffer(static_cast<size_t>(std::min(static_cast<uint64_t>(CHUNK_SIZE), size)));
+    boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+    bool success = true;
+
+    try
+    {
+      for (uint64_t pos = 0; pos < size && success; pos += CHUNK_SIZE)
+      {
+        size_t n = static_cast<size_t>(std::min(static_cast<uint64_t>(CHUNK_SIZE), size - pos));
+        reader->Read(&buffer[0], n, pos);
+        success = WriteAll(fd, &buffer[0], n);
+
+        if (maxBandwidth_ > 0)
+        {
+          int64_t expected = static_cast<int64_t>((pos + n) * 1000000 / maxBandwidth_);   // In microseconds
+          int64_t elapsed = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds();
+
+          if (expected > elapsed)
+          {
+            boost::this_thread::sleep(boost::posix_time::microseconds(expected - elapsed));
+          }
+        }
+      }
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      close(fd);
+      boost::filesystem::remove(tmp);
+      throw;
+    }
+
+    // The queue entry is acknowledged right after this method
+    // returns: The copy must have reached the disk before
+    if (!FileSynchronizer::SyncFile(fd))
+    {
+      success = false;
+    }
+
+    if (close(fd) != 0)
+    {
+      success = false;
+    }
+
+    if (!success)
+    {
+      boost::filesystem::remove(tmp);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+    }
+
+    boost::filesystem::rename(tmp, path);
+
+    if (!FileSynchronizer::SyncDirectory(directory))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+    }
+  }
+
+
+  void StorageMirror::Remove(const std::string& uuid)
+  {
+    boost::filesystem::remove(GetPath(uuid));
+  }
+
+
+  void StorageMirror::SignalNewImage(const std::string& imageUuid)
+  {
+    Enqueue(imageUuid, Operation_Copy);
+  }
+
+
+  void StorageMirror::SignalImageDeleted(const std::string& imageUuid)
+  {
+    Enqueue(imageUuid, Operation_Remove);
+  }
+
+
+  bool StorageMirror::ProcessFirst()
+  {
+    boost::mutex::scoped_lock lock(processMutex_);
+
+    int64_t seq;
+    std::string uuid;
+    Operation operation;
+
+    if (!GetFirst(seq, uuid, operation))
+    {
+      return false;
+    }
+
+    try
+    {
+      switch (operation)
+      {
+        case Operation_Copy:
+          Copy(uuid);
+          break;
+
+        case Operation_Remove:
+          Remove(uuid);
+          break;
+
+        default:
+          LOG(ERROR) << "Ignoring a bad entry in the mirror queue: " << seq;
+          break;
+      }
+    }
+    catch (boost::filesystem::filesystem_error& e)
+    {
+      LOG(ERROR) << "Cannot write to the mirror: " << e.what();
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+    }
+
+    // The entry is only removed from the queue once it is replicated
+    Acknowledge(seq);
+    return true;
+  }
+
+
+  unsigned int StorageMirror::ProcessQueue()
+  {
+    unsigned int count = 0;
+
+    while (ProcessFirst())
+    {
+      count++;
+    }
+
+    return count;
+  }
+
+
+  void StorageMirror::Worker(StorageMirror* that,
+                             unsigned int retryInterval)
+  {
+    for (;;)
+    {
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+
+        if (!that->done_ && !that->pending_)
+        {
+          that->wakeup_.timed_wait(lock, boost::posix_time::seconds(retryInterval));
+        }
+
+        if (that->done_)
+        {
+          return;
+        }
+
+        that->pending_ = false;
+      }
+
+      try
+      {
+        for (;;)
+        {
+          {
+            boost::mutex::scoped_lock lock(that->mutex_);
+            if (that->done_)
+            {
+              return;
+            }
+          }
+
+          if (!that->ProcessFirst())
+          {
+            break;
+          }
+        }
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        // The mirror is unavailable: Retry later
+        LOG(ERROR) << "Error while mirroring the image storage: " << e.What();
+      }
+    }
+  }
+
+
+  void StorageMirror::Start(unsigned int retryInterval)
+  {
+    Stop();
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      done_ = false;
+      pending_ = true;   // Resume the replication after a restart
+    }
+
+    thread_ = boost::thread(Worker, this, retryInterval);
+  }
+
+
+  void StorageMirror::Stop()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      done_ = true;
+      wakeup_.notify_all();
+    }
+
+    if (thread_.joinable())
+    {
+      thread_.join();
+    }
+  }
+}
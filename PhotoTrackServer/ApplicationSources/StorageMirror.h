@@ -0,0 +1,116 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include "IImageListener.h"
+#include "IImageStorage.h"
+
+#include <Core/SQLite/Connection.h>
+
+#include <boost/thread.hpp>
+
+namespace PhotoTrack
+{
+  /**
+   * Continuously replicates the blobs of the image storage to a
+   * secondary directory (typically on another mount), using the
+   * same hashed directory layout as "Orthanc::FileStorage". The new
+   * and deleted blobs are recorded in a persistent queue, which is
+   * processed by a background thread with a bounded bandwidth, and
+   * which survives the restarts. The blobs are streamed from the
+   * source, and an entry only leaves the queue once its copy has
+   * been flushed to the disk of the mirror.
+   **/
+  class StorageMirror : public IImageListener
+  {
+  private:
+    enum Operation
+    {
+      Operation_Copy = 1,
+      Operation_Remove = 2
+    };
+
+    IImageStorage&               source_;
+    std::string                  target_;
+    uint64_t                     maxBandwidth_;   // In bytes per second, 0 = unlimited
+
+    boost::mutex                 queueMutex_;
+    Orthanc::SQLite::Connection  queue_;
+    boost::mutex                 processMutex_;
+
+    boost::mutex                 mutex_;
+    bool                         done_;
+    bool                         pending_;
+    boost::condition_variable    wakeup_;
+    boost::thread                thread_;
+
+    void Enqueue(const std::string& uuid,
+                 Operation operation);
+
+    bool GetFirst(int64_t& seq,
+                  std::string& uuid,
+                  Operation& operation);
+
+    void Acknowledge(int64_t seq);
+
+    void Copy(const std::string& uuid);
+
+    void Remove(const std::string& uuid);
+
+    bool ProcessFirst();
+
+    static void Worker(StorageMirror* that,
+                       unsigned int retryInterval);
+
+  public:
+    StorageMirror(IImageStorage& source,
+                  const std::string& target,
+                  const std::string& queuePath);
+
+    ~StorageMirror();
+
+    void SetMaxBandwidth(uint64_t bytesPerSecond)
+    {
+      maxBandwidth_ = bytesPerSecond;
+    }
+
+    const std::string& GetTarget() const
+    {
+      return target_;
+    }
+
+    std::string GetPath(const std::string& uuid) const;
+
+    uint64_t GetQueueSize();
+
+    virtual void SignalNewImage(const std::string& imageUuid);
+
+    virtual void SignalImageDeleted(const std::string& imageUuid);
+
+    // Replicates all the queued blobs, returns the number of
+    // processed entries. Throws an exception (and keeps the failing
+    // entry in the queue) if the mirror cannot be written.
+    unsigned int ProcessQueue();
+
+    void Start(unsigned int retryInterval);  // In seconds
+
+    void Stop();
+  };
+}
@@ -0,0 +1,434 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "TieredImageStorage.h"
+
+#include "FileSynchronizer.h"
+
+#include <Core/Compression/ZlibCompressor.h>
+#include <Core/OrthancException.h>
+#include <Core/SQLite/Statement.h>
+#include <Core/Uuid.h>
+
+#include <glog/logging.h>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#if !defined(O_BINARY)
+#define O_BINARY 0
+#endif
+
+namespace PhotoTrack
+{
+  static const size_t UUID_LENGTH = 36;
+  static const size_t HEADER_SIZE = UUID_LENGTH + 8;
+
+
+  static bool WriteAll(int fd,
+                       const void* data,
+                       size_t size)
+  {
+    const char* p = reinterpret_cast<const char*>(data);
+
+    while (size > 0)
+    {
+#if defined(_WIN32)
+      int n = _write(fd, p, static_cast<unsigned int>(size));
+#else
+      ssize_t n = write(fd, p, size);
+#endif
+
+      if (n <= 0)
+      {
+        if (n < 0 && errno == EINTR)
+        {
+          continue;
+        }
+
+        return false;
+      }
+
+      p += n;
+      size -= n;
+    }
+
+    return true;
+  }
+
+
+  std::string TieredImageStorage::GetArchivePath(int64_t archive) const
+  {
+    char name[32];
+    sprintf(name, "archive-%08d.cold", static_cast<int>(archive));
+    return (boost::filesystem::path(coldRoot_) / name).string();
+  }
+
+
+  int64_t TieredImageStorage::GetArchive(const std::string& name)
+  {
+    // The mutex must be locked at this point
+    using namespace Orthanc;
+
+    {
+      SQLite::Statement s(index_, SQLITE_FROM_HERE, "SELECT id FROM Archives WHERE name=?");
+      s.BindString(0, name);
+      if (s.Step())
+      {
+        return s.ColumnInt64(0);
+      }
+    }
+
+    SQLite::Statement s(index_, SQLITE_FROM_HERE, "INSERT INTO Archives VALUES(NULL, ?)");
+    s.BindString(0, name);
+    s.Run();
+    return index_.GetLastInsertRowId();
+  }
+
+
+  void TieredImageStorage::RemoveArchived(const std::string& uuid)
+  {
+    // The mutex must be locked at this point
+    using namespace Orthanc;
+
+    int64_t archive;
+
+    {
+      SQLite::Statement s(index_, SQLITE_FROM_HERE, "SELECT archive FROM ArchivedBlobs WHERE uuid=?");
+      s.BindString(0, uuid);
+      if (!s.Step())
+      {
+        return;
+      }
+
+      archive = s.ColumnInt64(0);
+    }
+
+    {
+      SQLite::Statement s(index_, SQLITE_FROM_HERE, "DELETE FROM ArchivedBlobs WHERE uuid=?");
+      s.BindString(0, uuid);
+      s.Run();
+    }
+
+    SQLite::Statement s(index_, SQLITE_FROM_HERE, "SELECT 1 FROM ArchivedBlobs WHERE archive=? LIMIT 1");
+    s.BindInt64(0, archive);
+
+    if (!s.Step())
+    {
+      // No more blob in this archive, drop it
+      SQLite::Statement d(index_, SQLITE_FROM_HERE, "DELETE FROM Archives WHERE id=?");
+      d.BindInt64(0, archive);
+      d.Run();
+
+      boost::system::error_code error;
+      boost::filesystem::remove(GetArchivePath(archive), error);
+    }
+  }
+
+
+  TieredImageStorage::TieredImageStorage(IImageStorage& hot,
+                                         const std::string& coldRoot) :
+    hot_(hot),
+    coldRoot_(coldRoot)
+  {
+    boost::filesystem::create_directories(coldRoot);
+
+    std::string path = (boost::filesystem::path(coldRoot) / "index.db").string();
+    LOG(WARNING) << "Using the following cold storage index: " << path;
+
+    index_.Open(path);
+    index_.Execute("PRAGMA SYNCHRONOUS=FULL;");
+    index_.Execute("PRAGMA JOURNAL_MODE=WAL;");
+
+    if (!index_.DoesTableExist("ArchivedBlobs"))
+    {
+      index_.Execute("CREATE TABLE Archives("
+                     "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+                     "name TEXT UNIQUE);");
+      index_.Execute("CREATE TABLE ArchivedBlobs("
+                     "uuid TEXT PRIMARY KEY, "
+                     "archive INTEGER, "
+                     "offset INTEGER, "
+                     "size INTEGER);");
+      index_.Execute("CREATE INDEX ArchivedBlobsArchive ON ArchivedBlobs(archive);");
+    }
+  }
+
+
+  std::string TieredImageStorage::Create(const void* content,
+                                         size_t size)
+  {
+    return hot_.Create(content, size);
+  }
+
+
+  std::string TieredImageStorage::CreateFromFile(const std::string& path)
+  {
+    return hot_.CreateFromFile(path);
+  }
+
+
+  bool TieredImageStorage::LookupArchived(std::string& path,
+                                          uint64_t& offset,
+                                          uint64_t& size,
+                                          const std::string& uuid)
+  {
+    using namespace Orthanc;
+    boost::mutex::scoped_lock lock(mutex_);
+
+    SQLite::Statement s(index_, SQLITE_FROM_HERE, "SELECT archive, offset, size FROM ArchivedBlobs WHERE uuid=?");
+    s.BindString(0, uuid);
+
+    if (!s.Step())
+    {
+      return false;
+    }
+
+    path = GetArchivePath(s.ColumnInt64(0));
+    offset = s.ColumnInt64(1);
+    size = s.ColumnInt64(2);
+    return true;
+  }
+
+
+  void TieredImageStorage::Read(std::string& content,
+                                const std::string& uuid)
+  {
+    using namespace Orthanc;
+
+    std::string path;
+    uint64_t offset, size;
+
+    if (!LookupArchived(path, offset, size, uuid))
+    {
+      try
+      {
+        hot_.Read(content, uuid);
+        return;
+      }
+      catch (OrthancException&)
+      {
+        // The blob may have been archived in the meantime
+        if (!LookupArchived(path, offset, size, uuid))
+        {
+          throw;
+        }
+      }
+    }
+
+    std::string compressed;
+    compressed.resize(static_cast<size_t>(size));
+
+    boost::filesystem::ifstream f(path, std::ios::in | std::ios::binary);
+    f.seekg(static_cast<std::streamoff>(offset + HEADER_SIZE));
+    if (size > 0)
+    {
+      f.read(&compressed[0], compressed.size());
+    }
+
+    if (!f.good())
+    {
+      LOG(ERROR) << "Cannot read blob " << uuid << " from the archive " << path;
+      throw OrthancException(ErrorCode_CorruptedFile);
+    }
+
+    ZlibCompressor compressor;
+    compressor.Uncompress(content, compressed);
+  }
+
+
+  void TieredImageStorage::Remove(const std::string& uuid)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (hot_.Exists(uuid))
+    {
+      hot_.Remove(uuid);
+    }
+    else
+    {
+      RemoveArchived(uuid);
+    }
+  }
+
+
+  bool TieredImageStorage::IsArchived(const std::string& uuid)
+  {
+    using namespace Orthanc;
+    boost::mutex::scoped_lock lock(mutex_);
+
+    SQLite::Statement s(index_, SQLITE_FROM_HERE, "SELECT 1 FROM ArchivedBlobs WHERE uuid=?");
+    s.BindString(0, uuid);
+    return s.Step();
+  }
+
+
+  bool TieredImageStorage::Exists(const std::string& uuid)
+  {
+    return hot_.Exists(uuid) || IsArchived(uuid);
+  }
+
+
+  IBlobReader* TieredImageStorage::OpenBlob(const std::string& uuid)
+  {
+    if (!IsArchived(uuid))
+    {
+      try
+      {
+        return hot_.OpenBlob(uuid);
+      }
+      catch (Orthanc::OrthancException&)
+      {
+        // The blob was archived in the meantime
+      }
+    }
+
+    // The archived blobs are compressed: Uncompress them in memory
+    return IImageStorage::OpenBlob(uuid);
+  }
+
+
+  bool TieredImageStorage::LookupFile(std::string& relativePath,
+                                      const std::string& uuid)
+  {
+    // The archived blobs are not plain files
+    return (!IsArchived(uuid) &&
+            hot_.LookupFile(relativePath, uuid));
+  }
+
+
+  unsigned int TieredImageStorage::Archive(const std::string& archiveName,
+                                           const std::list<std::string>& uuids)
+  {
+    using namespace Orthanc;
+
+    unsigned int count = 0;
+
+    for (std::list<std::string>::const_iterator
+           it = uuids.begin(); it != uuids.end(); ++it)
+    {
+      if (it->size() != UUID_LENGTH)
+      {
+        throw OrthancException(ErrorCode_ParameterOutOfRange);
+      }
+
+      // The blobs are never modified once written: They are read and
+      // compressed outside of the lock
+      std::string compressed;
+
+      try
+      {
+        if (!hot_.Exists(*it))
+        {
+          continue;
+        }
+
+        std::string content;
+        hot_.Read(content, *it);
+
+        ZlibCompressor compressor;
+        compressor.Compress(compressed, content);
+      }
+      catch (OrthancException&)
+      {
+        if (hot_.Exists(*it))
+        {
+          throw;
+        }
+
+        continue;  // The blob was removed in the meantime
+      }
+
+      // Hold the lock while moving the blob, so that it cannot be
+      // removed from the hot storage in the meantime
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (!hot_.Exists(*it))
+      {
+        continue;
+      }
+
+      int64_t archive = GetArchive(archiveName);
+      std::string path = GetArchivePath(archive);
+
+      uint64_t offset = 0;
+      bool isNew = true;
+      if (boost::filesystem::exists(path))
+      {
+        offset = boost::filesystem::file_size(path);
+        isNew = false;
+      }
+
+      uint8_t header[HEADER_SIZE];
+      memcpy(header, it->c_str(), UUID_LENGTH);
+
+      uint64_t size = compressed.size();
+      for (size_t i = 0; i < 8; i++)
+      {
+        header[UUID_LENGTH + i] = static_cast<uint8_t>((size >> (8 * i)) & 0xff);
+      }
+
+      {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_BINARY, 0644);
+        if (fd < 0)
+        {
+          throw OrthancException(ErrorCode_CannotWriteFile);
+        }
+
+        // The record must be on the disk before the index refers to
+        // it, and the index before the hot copy is removed
+        bool success = (WriteAll(fd, header, HEADER_SIZE) &&
+                        WriteAll(fd, compressed.c_str(), compressed.size()) &&
+                        FileSynchronizer::SyncFile(fd));
+        close(fd);
+
+        if (!success ||
+            (isNew && !FileSynchronizer::SyncDirectory(coldRoot_)))
+        {
+          LOG(ERROR) << "Cannot write blob " << *it << " to the archive " << path;
+          throw OrthancException(ErrorCode_CannotWriteFile);
+        }
+      }
+
+      SQLite::Statement s(index_, SQLITE_FROM_HERE, "INSERT INTO ArchivedBlobs VALUES(?, ?, ?, ?)");
+      s.BindString(0, *it);
+      s.BindInt64(1, archive);
+      s.BindInt64(2, offset);
+      s.BindInt64(3, size);
+      s.Run();
+
+      // The blob is now durably indexed in the cold tier (the index
+      // is synchronous), it can be freed
+      hot_.Remove(*it);
+      count++;
+    }
+
+    return count;
+  }
+}
@@ -0,0 +1,93 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include "IImageStorage.h"
+
+#include <Core/SQLite/Connection.h>
+
+#include <boost/thread.hpp>
+#include <list>
+
+namespace PhotoTrack
+{
+  /**
+   * Two-tier storage area. New blobs are written to the "hot"
+   * storage. The blobs can later be moved to the "cold" tier, where
+   * all the blobs of one archive (typically, all the images of one
+   * closed site) are compressed and appended to a single, sequentially
+   * readable file. Reading an archived blob is slower, but is
+   * transparent to the callers. A blob is only removed from the hot
+   * tier once its record and its index entry are on the disk.
+   *
+   * Each record of an archive file is made of the 36 characters of
+   * the blob UUID, of the size of the compressed blob (64 bits,
+   * little endian), then of the compressed blob itself.
+   **/
+  class TieredImageStorage : public IImageStorage
+  {
+  private:
+    boost::mutex                 mutex_;
+    IImageStorage&               hot_;
+    std::string                  coldRoot_;
+    Orthanc::SQLite::Connection  index_;
+
+    std::string GetArchivePath(int64_t archive) const;
+
+    int64_t GetArchive(const std::string& name);
+
+    void RemoveArchived(const std::string& uuid);
+
+    bool LookupArchived(std::string& path,
+                        uint64_t& offset,
+                        uint64_t& size,
+                        const std::string& uuid);
+
+  public:
+    TieredImageStorage(IImageStorage& hot,
+                       const std::string& coldRoot);
+
+    using IImageStorage::Create;
+
+    virtual std::string Create(const void* content,
+                               size_t size);
+
+    virtual std::string CreateFromFile(const std::string& path);
+
+    virtual void Read(std::string& content,
+                      const std::string& uuid);
+
+    virtual void Remove(const std::string& uuid);
+
+    virtual bool Exists(const std::string& uuid);
+
+    virtual IBlobReader* OpenBlob(const std::string& uuid);
+
+    virtual bool LookupFile(std::string& relativePath,
+                            const std::string& uuid);
+
+    bool IsArchived(const std::string& uuid);
+
+    // Moves the given blobs from the hot storage to the archive with
+    // the given name. Returns the number of blobs that were moved.
+    unsigned int Archive(const std::string& archiveName,
+                         const std::list<std::string>& uuids);
+  };
+}
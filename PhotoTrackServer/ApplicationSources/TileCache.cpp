@@ -0,0 +1,324 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "TileCache.h"
+
+#include "JpegReader.h"
+
+#include <Core/ImageFormats/PngReader.h>
+#include <Core/OrthancException.h>
+#include <Core/Toolbox.h>
+#include <Core/Uuid.h>
+
+#include <glog/logging.h>
+#include <boost/filesystem.hpp>
+
+namespace PhotoTrack
+{
+  namespace
+  {
+    class WorkerSlot : public boost::noncopyable
+    {
+    private:
+      Orthanc::Semaphore& workers_;
+
+    public:
+      WorkerSlot(Orthanc::Semaphore& workers) : workers_(workers)
+      {
+        workers_.Acquire();
+      }
+
+      ~WorkerSlot()
+      {
+        workers_.Release();
+      }
+    };
+  }
+
+
+  TileCache::TileCache(DatabaseWrapper& db,
+                       const std::string& root,
+                       unsigned int maxWorkers) :
+    db_(db),
+    root_(root),
+    quality_(85),
+    workers_(maxWorkers == 0 ? 1 : maxWorkers),
+    started_(false),
+    done_(true)
+  {
+    boost::filesystem::create_directories(root_);
+  }
+
+
+  TileCache::~TileCache()
+  {
+    Stop();
+  }
+
+
+  void TileCache::SetJpegQuality(uint8_t quality)
+  {
+    if (quality == 0 || 
+        quality > 100)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    quality_ = quality;
+  }
+
+
+  std::string TileCache::GetPath(const std::string& imageUuid) const
+  {
+    if (!Orthanc::Toolbox::IsUuid(imageUuid))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    boost::filesystem::path path(root_);
+    path /= imageUuid.substr(0, 2);
+    path /= imageUuid.substr(2, 2);
+    path /= imageUuid + ".tiles";
+
+    return path.string();
+  }
+
+
+  void TileCache::Build(const std::string& path,
+                        const Photo& photo)
+  {
+    std::string image;
+    db_.ReadImage(image, photo);
+
+    JpegReader jpeg;
+    Orthanc::PngReader png;
+    const Orthanc::ImageAccessor* source = NULL;
+    TileFormat format = TileFormat_Jpeg;
+
+    try
+    {
+      if (photo.GetImageMime() == "image/jpeg")
+      {
+        jpeg.ReadFromMemory(image);
+        source = &jpeg;
+      }
+      else if (photo.GetImageMime() == "image/png")
+      {
+        png.ReadFromMemory(image);
+        source = &png;
+        format = TileFormat_Png;
+      }
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(WARNING) << "Cannot decode image " << photo.GetImageUuid() << ": " << e.What();
+    }
+
+    image.clear();
+
+    if (source != NULL &&
+        source->GetFormat() != Orthanc::PixelFormat_Grayscale8 &&
+        source->GetFormat() != Orthanc::PixelFormat_RGB24 &&
+        source->GetFormat() != Orthanc::PixelFormat_RGBA32)
+    {
+      source = NULL;   // E.g. 16-bit PNG images
+    }
+
+    boost::filesystem::create_directories(boost::filesystem::path(path).parent_path());
+
+    // Write to a temporary file, then atomically move it into place.
+    // An empty file means that the image has no pyramid.
+    std::string tmp = path + "." + Orthanc::Toolbox::GenerateUuid() + ".tmp";
+
+    if (source == NULL)
+    {
+      Orthanc::Toolbox::WriteFile("", tmp);
+    }
+    else
+    {
+      TilePyramid::Create(tmp, *source, format, quality_);
+    }
+
+    boost::system::error_code error;
+    boost::filesystem::rename(tmp, path, error);
+    if (error)
+    {
+      boost::filesystem::remove(tmp, error);
+    }
+  }
+
+
+  TilePyramid* TileCache::Open(const Photo& photo)
+  {
+    if (photo.GetImageMime() != "image/jpeg" &&
+        photo.GetImageMime() != "image/png")
+    {
+      return NULL;
+    }
+
+    const std::string path = GetPath(photo.GetImageUuid());
+
+    bool build;
+
+    {
+      // Wait for the concurrent building of the same pyramid, if any
+      boost::mutex::scoped_lock lock(mutex_);
+
+      while (pending_.find(path) != pending_.end())
+      {
+        generated_.wait(lock);
+      }
+
+      build = !boost::filesystem::exists(path);
+      if (build)
+      {
+        pending_.insert(path);
+      }
+    }
+
+    if (build)
+    {
+      try
+      {
+        WorkerSlot slot(workers_);
+        Build(path, photo);
+      }
+      catch (...)
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        pending_.erase(path);
+        generated_.notify_all();
+        throw;
+      }
+
+      boost::mutex::scoped_lock lock(mutex_);
+      pending_.erase(path);
+      generated_.notify_all();
+    }
+
+    boost::system::error_code error;
+    if (boost::filesystem::file_size(path, error) == 0 ||
+        error)
+    {
+      return NULL;
+    }
+
+    return new TilePyramid(path);
+  }
+
+
+  void TileCache::Invalidate(const std::string& imageUuid)
+  {
+    boost::system::error_code error;
+    boost::filesystem::remove(GetPath(imageUuid), error);
+
+    if (error)
+    {
+      LOG(ERROR) << "Cannot remove the tiles of " << imageUuid << ": " << error.message();
+    }
+  }
+
+
+  void TileCache::SignalNewImage(const std::string& imageUuid)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (started_)
+    {
+      queue_.push_back(imageUuid);
+      wakeup_.notify_one();
+    }
+  }
+
+
+  void TileCache::Worker(TileCache* that)
+  {
+    for (;;)
+    {
+      std::string imageUuid;
+
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+
+        while (!that->done_ && that->queue_.empty())
+        {
+          that->wakeup_.wait(lock);
+        }
+
+        if (that->done_)
+        {
+          return;
+        }
+
+        imageUuid = that->queue_.front();
+        that->queue_.pop_front();
+      }
+
+      try
+      {
+        // The image may have been replaced in the meantime
+        Photo photo;
+        if (that->db_.GetPhotoFromImage(photo, imageUuid))
+        {
+          std::auto_ptr<TilePyramid> pyramid(that->Open(photo));
+        }
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(ERROR) << "Cannot build the tiles of image " << imageUuid << ": " << e.What();
+      }
+      catch (std::exception& e)
+      {
+        LOG(ERROR) << "Cannot build the tiles of image " << imageUuid << ": " << e.what();
+      }
+    }
+  }
+
+
+  void TileCache::Start()
+  {
+    Stop();
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      started_ = true;
+      done_ = false;
+    }
+
+    thread_ = boost::thread(Worker, this);
+  }
+
+
+  void TileCache::Stop()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      started_ = false;
+      done_ = true;
+      queue_.clear();
+      wakeup_.notify_all();
+    }
+
+    if (thread_.joinable())
+    {
+      thread_.join();
+    }
+  }
+}
@@ -0,0 +1,94 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include "Database.h"
+#include "IImageListener.h"
+#include "TilePyramid.h"
+
+#include <Core/MultiThreading/Semaphore.h>
+
+#include <boost/thread.hpp>
+#include <list>
+#include <set>
+
+namespace PhotoTrack
+{
+  /**
+   * Persistent cache of the tile pyramids of the images, stored as one
+   * packed file per blob. The pyramids are built lazily on the first
+   * request, or in the background as soon as a new image is attached
+   * to a photo if "Start()" has been called. As for the
+   * DerivedImageCache, the entries are removed when the blob is
+   * detached, and at most "maxWorkers" pyramids are built at once.
+   **/
+  class TileCache : public IImageListener
+  {
+  private:
+    DatabaseWrapper&           db_;
+    std::string                root_;
+    uint8_t                    quality_;
+    Orthanc::Semaphore         workers_;
+
+    boost::mutex               mutex_;
+    boost::condition_variable  generated_;
+    std::set<std::string>      pending_;
+
+    // Background building of the pyramids of the new images
+    bool                       started_;
+    bool                       done_;
+    std::list<std::string>     queue_;
+    boost::condition_variable  wakeup_;
+    boost::thread              thread_;
+
+    void Build(const std::string& path,
+               const Photo& photo);
+
+    static void Worker(TileCache* that);
+
+  public:
+    TileCache(DatabaseWrapper& db,
+              const std::string& root,
+              unsigned int maxWorkers);
+
+    ~TileCache();
+
+    void SetJpegQuality(uint8_t quality);
+
+    std::string GetPath(const std::string& imageUuid) const;
+
+    // Returns NULL if the image cannot be decoded, or is neither a
+    // JPEG nor a PNG image. The caller takes the ownership.
+    TilePyramid* Open(const Photo& photo);
+
+    void Invalidate(const std::string& imageUuid);
+
+    virtual void SignalNewImage(const std::string& imageUuid);
+
+    virtual void SignalImageDeleted(const std::string& imageUuid)
+    {
+      Invalidate(imageUuid);
+    }
+
+    void Start();
+
+    void Stop();
+  };
+}
@@ -0,0 +1,326 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "TilePyramid.h"
+
+#include "ImageResampler.h"
+#include "JpegWriter.h"
+
+#include <Core/ImageFormats/ImageBuffer.h>
+#include <Core/ImageFormats/PngWriter.h>
+#include <Core/OrthancException.h>
+
+#include <algorithm>
+#include <memory>
+#include <string.h>
+
+namespace PhotoTrack
+{
+  const unsigned int TilePyramid::TILE_SIZE;
+
+  static const char MAGIC[8] = { 'P', 'T', 'T', 'I', 'L', 'E', 'S', '1' };
+
+  // Magic, width, height, format, tiles count
+  static const size_t HEADER_SIZE = sizeof(MAGIC) + 4 * sizeof(uint32_t);
+
+  // Offset and size of one tile
+  static const size_t ENTRY_SIZE = sizeof(uint64_t) + sizeof(uint32_t);
+
+
+  // The integers are stored in the byte order of the host
+  template <typename T>
+  static void WriteInteger(std::string& target,
+                           T value)
+  {
+    target.append(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+
+  template <typename T>
+  static T ReadInteger(const char*& source)
+  {
+    T value;
+    memcpy(&value, source, sizeof(T));
+    source += sizeof(T);
+    return value;
+  }
+
+
+  unsigned int TilePyramid::ComputeLevelCount(unsigned int width,
+                                              unsigned int height)
+  {
+    unsigned int size = std::max(width, height);
+
+    // Smallest "n" such that 2^n >= size
+    unsigned int levels = 1;
+    while (size > 1)
+    {
+      size = (size + 1) / 2;
+      levels++;
+    }
+
+    return levels;
+  }
+
+
+  static unsigned int GetLevelSize(unsigned int size,
+                                   unsigned int level,
+                                   unsigned int levelCount)
+  {
+    for (unsigned int i = level + 1; i < levelCount; i++)
+    {
+      size = (size + 1) / 2;
+    }
+
+    return size;
+  }
+
+
+  void TilePyramid::ComputeLayout(std::vector<unsigned int>& firstTile,
+                                  unsigned int width,
+                                  unsigned int height)
+  {
+    const unsigned int levelCount = ComputeLevelCount(width, height);
+
+    firstTile.resize(levelCount + 1);
+    firstTile[0] = 0;
+
+    for (unsigned int level = 0; level < levelCount; level++)
+    {
+      unsigned int w = GetLevelSize(width, level, levelCount);
+      unsigned int h = GetLevelSize(height, level, levelCount);
+      firstTile[level + 1] = (firstTile[level] + 
+                              ((w + TILE_SIZE - 1) / TILE_SIZE) * ((h + TILE_SIZE - 1) / TILE_SIZE));
+    }
+  }
+
+
+  unsigned int TilePyramid::GetLevelWidth(unsigned int level) const
+  {
+    if (level >= GetLevelCount())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    return GetLevelSize(width_, level, GetLevelCount());
+  }
+
+
+  unsigned int TilePyramid::GetLevelHeight(unsigned int level) const
+  {
+    if (level >= GetLevelCount())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    return GetLevelSize(height_, level, GetLevelCount());
+  }
+
+
+  void TilePyramid::Create(const std::string& path,
+                           const Orthanc::ImageAccessor& image,
+                           TileFormat format,
+                           uint8_t jpegQuality)
+  {
+    if (image.GetWidth() == 0 ||
+        image.GetHeight() == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_IncompatibleImageSize);
+    }
+
+    std::vector<unsigned int> firstTile;
+    ComputeLayout(firstTile, image.GetWidth(), image.GetHeight());
+
+    const unsigned int levelCount = static_cast<unsigned int>(firstTile.size()) - 1;
+    const unsigned int tilesCount = firstTile[levelCount];
+
+    std::string header;
+    header.append(MAGIC, sizeof(MAGIC));
+    WriteInteger<uint32_t>(header, image.GetWidth());
+    WriteInteger<uint32_t>(header, image.GetHeight());
+    WriteInteger<uint32_t>(header, format);
+    WriteInteger<uint32_t>(header, tilesCount);
+
+    std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+    if (!file.good())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+    }
+
+    // Reserve the room for the index, that is only known at the end
+    file.write(header.c_str(), header.size());
+    file.write(std::string(tilesCount * ENTRY_SIZE, '\0').c_str(), tilesCount * ENTRY_SIZE);
+
+    std::vector<uint64_t> offsets(tilesCount);
+    std::vector<uint32_t> sizes(tilesCount);
+    uint64_t offset = HEADER_SIZE + tilesCount * ENTRY_SIZE;
+
+    JpegWriter jpeg;
+    jpeg.SetQuality(jpegQuality);
+    Orthanc::PngWriter png;
+
+    // Each level is downscaled from the level above it
+    std::auto_ptr<Orthanc::ImageBuffer> previous, current;
+    Orthanc::ImageAccessor accessor = image;
+
+    for (int level = static_cast<int>(levelCount) - 1; level >= 0; level--)
+    {
+      if (level != static_cast<int>(levelCount) - 1)
+      {
+        current.reset(new Orthanc::ImageBuffer);
+        current->SetFormat(image.GetFormat());
+        current->SetWidth(GetLevelSize(image.GetWidth(), level, levelCount));
+        current->SetHeight(GetLevelSize(image.GetHeight(), level, levelCount));
+
+        Orthanc::ImageAccessor next = current->GetAccessor();
+        ImageResampler::Resample(next, accessor, ResamplingFilter_Area);
+
+        accessor = next;
+        previous = current;   // Keeps the buffer alive
+      }
+
+      const unsigned int countX = (accessor.GetWidth() + TILE_SIZE - 1) / TILE_SIZE;
+      const unsigned int countY = (accessor.GetHeight() + TILE_SIZE - 1) / TILE_SIZE;
+      const unsigned int bytesPerPixel = accessor.GetBytesPerPixel();
+
+      for (unsigned int y = 0; y < countY; y++)
+      {
+        for (unsigned int x = 0; x < countX; x++)
+        {
+          // The tiles are views over the level, without copy
+          Orthanc::ImageAccessor tile;
+          tile.AssignReadOnly(accessor.GetFormat(),
+                              std::min(TILE_SIZE, accessor.GetWidth() - x * TILE_SIZE),
+                              std::min(TILE_SIZE, accessor.GetHeight() - y * TILE_SIZE),
+                              accessor.GetPitch(),
+                              reinterpret_cast<const uint8_t*>(accessor.GetConstRow(y * TILE_SIZE)) + 
+                              x * TILE_SIZE * bytesPerPixel);
+
+          std::string encoded;
+          if (format == TileFormat_Jpeg)
+          {
+            jpeg.WriteToMemory(encoded, tile);
+          }
+          else
+          {
+            png.WriteToMemory(encoded, tile);
+          }
+
+          unsigned int index = firstTile[level] + y * countX + x;
+          offsets[index] = offset;
+          sizes[index] = static_cast<uint32_t>(encoded.size());
+          offset += encoded.size();
+
+          file.write(encoded.c_str(), encoded.size());
+        }
+      }
+    }
+
+    std::string index;
+    index.reserve(tilesCount * ENTRY_SIZE);
+    for (unsigned int i = 0; i < tilesCount; i++)
+    {
+      WriteInteger<uint64_t>(index, offsets[i]);
+      WriteInteger<uint32_t>(index, sizes[i]);
+    }
+
+    file.seekp(HEADER_SIZE);
+    file.write(index.c_str(), index.size());
+    file.close();
+
+    if (!file.good())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+    }
+  }
+
+
+  TilePyramid::TilePyramid(const std::string& path) :
+    file_(path.c_str(), std::ios::binary)
+  {
+    std::string header(HEADER_SIZE, '\0');
+    if (!file_.good() ||
+        !file_.read(&header[0], HEADER_SIZE) ||
+        memcmp(header.c_str(), MAGIC, sizeof(MAGIC)) != 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    const char* p = header.c_str() + sizeof(MAGIC);
+    width_ = ReadInteger<uint32_t>(p);
+    height_ = ReadInteger<uint32_t>(p);
+    format_ = static_cast<TileFormat>(ReadInteger<uint32_t>(p));
+    uint32_t tilesCount = ReadInteger<uint32_t>(p);
+
+    if (width_ == 0 || height_ == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    ComputeLayout(firstTile_, width_, height_);
+
+    if (tilesCount != firstTile_.back())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    std::string index(tilesCount * ENTRY_SIZE, '\0');
+    if (!file_.read(&index[0], index.size()))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    index_.resize(tilesCount);
+    p = index.c_str();
+    for (uint32_t i = 0; i < tilesCount; i++)
+    {
+      index_[i].offset_ = ReadInteger<uint64_t>(p);
+      index_[i].size_ = ReadInteger<uint32_t>(p);
+    }
+  }
+
+
+  bool TilePyramid::ReadTile(std::string& tile,
+                             unsigned int level,
+                             unsigned int x,
+                             unsigned int y)
+  {
+    if (level >= GetLevelCount() ||
+        x >= GetTilesCountX(level) ||
+        y >= GetTilesCountY(level))
+    {
+      return false;
+    }
+
+    const Entry& entry = index_[firstTile_[level] + y * GetTilesCountX(level) + x];
+
+    tile.resize(entry.size_);
+    file_.clear();
+    file_.seekg(entry.offset_);
+
+    if (entry.size_ > 0 &&
+        !file_.read(&tile[0], entry.size_))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+    }
+
+    return true;
+  }
+}
@@ -0,0 +1,123 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include <Core/ImageFormats/ImageAccessor.h>
+
+#include <boost/noncopyable.hpp>
+#include <fstream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace PhotoTrack
+{
+  enum TileFormat
+  {
+    TileFormat_Jpeg = 1,
+    TileFormat_Png = 2
+  };
+
+  /**
+   * Multi-resolution pyramid of 256x256 tiles, following the layout
+   * of Deep Zoom (DZI): Level "GetLevelCount() - 1" is the full
+   * resolution, and each level below halves the size of the image,
+   * down to a single pixel at level 0. All the tiles of an image are
+   * packed in a single file, made of a header, of an index giving the
+   * offset and size of each tile, then of the encoded tiles.
+   **/
+  class TilePyramid : public boost::noncopyable
+  {
+  public:
+    static const unsigned int TILE_SIZE = 256;
+
+  private:
+    struct Entry
+    {
+      uint64_t  offset_;
+      uint32_t  size_;
+    };
+
+    std::ifstream       file_;
+    unsigned int        width_;
+    unsigned int        height_;
+    TileFormat          format_;
+    std::vector<Entry>  index_;
+    std::vector<unsigned int>  firstTile_;   // Index of the first tile of each level
+
+    static void ComputeLayout(std::vector<unsigned int>& firstTile,
+                              unsigned int width,
+                              unsigned int height);
+
+  public:
+    explicit TilePyramid(const std::string& path);
+
+    // Builds the pyramid of "image" (Grayscale8, RGB24 or RGBA32),
+    // and writes it to "path"
+    static void Create(const std::string& path,
+                       const Orthanc::ImageAccessor& image,
+                       TileFormat format,
+                       uint8_t jpegQuality);
+
+    static unsigned int ComputeLevelCount(unsigned int width,
+                                          unsigned int height);
+
+    unsigned int GetWidth() const
+    {
+      return width_;
+    }
+
+    unsigned int GetHeight() const
+    {
+      return height_;
+    }
+
+    TileFormat GetFormat() const
+    {
+      return format_;
+    }
+
+    unsigned int GetLevelCount() const
+    {
+      return static_cast<unsigned int>(firstTile_.size()) - 1;
+    }
+
+    unsigned int GetLevelWidth(unsigned int level) const;
+
+    unsigned int GetLevelHeight(unsigned int level) const;
+
+    unsigned int GetTilesCountX(unsigned int level) const
+    {
+      return (GetLevelWidth(level) + TILE_SIZE - 1) / TILE_SIZE;
+    }
+
+    unsigned int GetTilesCountY(unsigned int level) const
+    {
+      return (GetLevelHeight(level) + TILE_SIZE - 1) / TILE_SIZE;
+    }
+
+    // Returns "false" if the tile does not exist. This method is not
+    // thread-safe, as the file is shared.
+    bool ReadTile(std::string& tile,
+                  unsigned int level,
+                  unsigned int x,
+                  unsigned int y);
+  };
+}
@@ -20,8 +20,16 @@
 #include "ServerPrecompiledHeaders.h"
 #include "Toolbox.h"
 
+#include "Sha1Hasher.h"
+
 #include <boost/date_time/c_local_time_adjustor.hpp>
 #include <Core/OrthancException.h>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/trim.hpp>
+#include <boost/lexical_cast.hpp>
+#include <math.h>
+#include <stdio.h>
+#include <vector>
 
 namespace PhotoTrack
 {
@@ -137,4 +145,231 @@ namespace PhotoTrack
     }
   }
 
+
+  double Toolbox::ComputeEntropy(const void* data,
+                                 size_t size)
+  {
+    // Shannon entropy of the bytes, in bits per byte
+    if (size == 0)
+    {
+      return 0;
+    }
+
+    size_t histogram[256];
+    memset(histogram, 0, sizeof(histogram));
+
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++)
+    {
+      histogram[p[i]]++;
+    }
+
+    double entropy = 0;
+    for (unsigned int i = 0; i < 256; i++)
+    {
+      if (histogram[i] > 0)
+      {
+        double f = static_cast<double>(histogram[i]) / static_cast<double>(size);
+        entropy -= f * log(f);
+      }
+    }
+
+    return entropy / log(2.0);
+  }
+
+
+  bool Toolbox::IsCompressibleImage(const std::string& mimeType,
+                                    const void* image,
+                                    size_t size)
+  {
+    static const size_t MIN_SIZE = 256;
+    static const size_t SAMPLE_SIZE = 64 * 1024;
+    static const double MAX_ENTROPY = 7.0;   // In bits per byte
+
+    if (size < MIN_SIZE ||
+        mimeType == "image/jpeg")
+    {
+      // JPEG images are already compressed: Don't waste CPU on them
+      return false;
+    }
+
+    if (mimeType == "plain/text" ||
+        mimeType == "application/json" ||
+        boost::starts_with(mimeType, "text/"))
+    {
+      return true;
+    }
+
+    // For the other types (e.g. PNG screenshots), only compress if a
+    // sample of the payload has a low entropy
+    return ComputeEntropy(image, std::min(size, SAMPLE_SIZE)) < MAX_ENTROPY;
+  }
+
+
+  std::string Toolbox::ComputeSHA1(const void* data,
+                                   size_t size)
+  {
+    Sha1Hasher sha1;
+    if (size > 0)
+    {
+      sha1.Update(data, size);
+    }
+
+    return sha1.Finish();
+  }
+
+
+  std::string Toolbox::ComputeFileSHA1(const std::string& path)
+  {
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (fp == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile);
+    }
+
+    Sha1Hasher sha1;
+    std::vector<char> buffer(64 * 1024);
+
+    for (;;)
+    {
+      size_t n = fread(&buffer[0], 1, buffer.size(), fp);
+      if (n > 0)
+      {
+        sha1.Update(&buffer[0], n);
+      }
+
+      if (n < buffer.size())
+      {
+        break;
+      }
+    }
+
+    bool success = !ferror(fp);
+    fclose(fp);
+
+    if (!success)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    return sha1.Finish();
+  }
+
+
+  bool Toolbox::ParseSHA1(std::string& target,
+                          const std::string& source)
+  {
+    target.clear();
+    target.reserve(40);
+
+    for (size_t i = 0; i < source.size(); i++)
+    {
+      char c = source[i];
+      if (c >= '0' && c <= '9')
+      {
+        target.push_back(c);
+      }
+      else if (c >= 'a' && c <= 'f')
+      {
+        target.push_back(c);
+      }
+      else if (c >= 'A' && c <= 'F')
+      {
+        target.push_back(c - 'A' + 'a');
+      }
+      else if (c != '-' ||
+               source.size() != 44 ||
+               i % 9 != 8)
+      {
+        return false;
+      }
+    }
+
+    return target.size() == 40;
+  }
+
+
+  static bool ParseRangeBound(uint64_t& target,
+                              const std::string& s)
+  {
+    if (s.empty() ||
+        s.size() > 18 ||   // Avoid overflows
+        s.find_first_not_of("0123456789") != std::string::npos)
+    {
+      return false;
+    }
+
+    target = boost::lexical_cast<uint64_t>(s);
+    return true;
+  }
+
+
+  ByteRange Toolbox::ParseByteRange(uint64_t& start,
+                                    uint64_t& length,
+                                    const std::string& header,
+                                    uint64_t size)
+  {
+    std::string s = boost::trim_copy(header);
+    if (!boost::starts_with(s, "bytes="))
+    {
+      return ByteRange_None;
+    }
+
+    s = boost::trim_copy(s.substr(6));
+
+    size_t dash = s.find('-');
+    if (dash == std::string::npos ||
+        s.find(',') != std::string::npos)
+    {
+      return ByteRange_None;
+    }
+
+    std::string first = boost::trim_copy(s.substr(0, dash));
+    std::string last = boost::trim_copy(s.substr(dash + 1));
+
+    uint64_t a, b;
+
+    if (first.empty())
+    {
+      // Suffix range: "bytes=-500" are the last 500 bytes
+      if (!ParseRangeBound(b, last))
+      {
+        return ByteRange_None;
+      }
+
+      if (b == 0 || size == 0)
+      {
+        return ByteRange_Unsatisfiable;
+      }
+
+      length = std::min(b, size);
+      start = size - length;
+      return ByteRange_Valid;
+    }
+
+    if (!ParseRangeBound(a, first))
+    {
+      return ByteRange_None;
+    }
+
+    if (last.empty())
+    {
+      b = size - 1;
+    }
+    else if (!ParseRangeBound(b, last) ||
+             b < a)
+    {
+      return ByteRange_None;
+    }
+
+    if (a >= size)
+    {
+      return ByteRange_Unsatisfiable;
+    }
+
+    start = a;
+    length = std::min(b, size - 1) - a + 1;
+    return ByteRange_Valid;
+  }
+
 }
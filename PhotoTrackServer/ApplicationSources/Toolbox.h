@@ -24,6 +24,13 @@
 
 namespace PhotoTrack
 {
+  enum ByteRange
+  {
+    ByteRange_None,           // No range, or unsupported range: Send the full content
+    ByteRange_Valid,
+    ByteRange_Unsatisfiable
+  };
+
   class Toolbox
   {
   public:
@@ -48,5 +55,37 @@ namespace PhotoTrack
 
     static bool GetSessionCookie(std::string& session,
                                  const Orthanc::RestApiCall& call);
+
+    static double ComputeEntropy(const void* data,
+                                 size_t size);
+
+    static bool IsCompressibleImage(const std::string& mimeType,
+                                    const void* image,
+                                    size_t size);
+
+    static bool IsCompressibleImage(const std::string& mimeType,
+                                    const std::string& image)
+    {
+      return IsCompressibleImage(mimeType, image.empty() ? NULL : image.c_str(), image.size());
+    }
+
+    // Gives the SHA-1 of the data as 40 lowercase hexadecimal digits
+    static std::string ComputeSHA1(const void* data,
+                                   size_t size);
+
+    // Same as above, reading the file by chunks
+    static std::string ComputeFileSHA1(const std::string& path);
+
+    // Accepts both the format above and the dashed format of
+    // Orthanc::Toolbox::ComputeSHA1(), and converts to the former
+    static bool ParseSHA1(std::string& target,
+                          const std::string& source);
+
+    // Parses a "Range" HTTP header made of one byte range, given the
+    // size of the resource. Multiple ranges are not supported.
+    static ByteRange ParseByteRange(uint64_t& start,
+                                    uint64_t& length,
+                                    const std::string& header,
+                                    uint64_t size);
   };
 }
@@ -0,0 +1,34 @@
+-- Upgrade of the databases of version 1, that were created before
+-- the schema was versioned. The new columns of the "Photos" table
+-- (imageCompression, preview, imageHash and perceptualHash) are added
+-- beforehand by DatabaseWrapper, as SQLite cannot add a column only if
+-- it is missing.
+
+CREATE TABLE IF NOT EXISTS IdempotencyKeys(
+       idempotencyKey TEXT PRIMARY KEY,
+       fingerprint TEXT,
+       answer TEXT,
+       secondsSinceEpoch INTEGER
+       );
+
+-- The blobs can now be shared between several photos
+DROP TRIGGER IF EXISTS PhotoDeleted;
+
+CREATE TRIGGER PhotoDeleted
+AFTER DELETE ON Photos
+BEGIN
+  SELECT SignalImageDeleted(old.imageUuid)
+  WHERE NOT EXISTS (SELECT 1 FROM Photos WHERE imageUuid=old.imageUuid);
+END;
+
+CREATE INDEX IF NOT EXISTS PhotosImage ON Photos(imageUuid);
+CREATE INDEX IF NOT EXISTS PhotosImageHash ON Photos(imageHash);
+CREATE INDEX IF NOT EXISTS PhotosSite ON Photos(siteUuid, secondsSinceEpoch);
+CREATE INDEX IF NOT EXISTS IdempotencyKeysAge ON IdempotencyKeys(secondsSinceEpoch);
+
+CREATE TABLE IF NOT EXISTS GlobalProperties(
+       property TEXT PRIMARY KEY,
+       value TEXT
+       );
+
+INSERT OR REPLACE INTO GlobalProperties VALUES('SchemaVersion', '2');
@@ -0,0 +1,9 @@
+-- Upgrade of the databases of version 2. The SHA-1 of the images that
+-- are replaced by a recompressed version are kept as aliases.
+
+CREATE TABLE IF NOT EXISTS ImageHashAliases(
+       alias TEXT PRIMARY KEY,
+       imageHash TEXT
+       );
+
+INSERT OR REPLACE INTO GlobalProperties VALUES('SchemaVersion', '3');
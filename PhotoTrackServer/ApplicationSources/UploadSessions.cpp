@@ -0,0 +1,617 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "UploadSessions.h"
+
+#include "FileSynchronizer.h"
+#include "Toolbox.h"
+
+#include <Core/OrthancException.h>
+#include <Core/Toolbox.h>
+#include <Core/Uuid.h>
+
+#include <algorithm>
+#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <glog/logging.h>
+#include <list>
+#include <stdio.h>
+
+namespace PhotoTrack
+{
+  class UploadSessions::Session : public boost::noncopyable
+  {
+  private:
+    typedef std::map<uint64_t, uint64_t>  Ranges;   // Start => end (excluded)
+
+    std::string  root_;
+    std::string  dataPath_;
+    std::string  statePath_;
+    Ranges       ranges_;
+
+  public:
+    boost::mutex  mutex_;
+    bool          removed_;
+    std::string   photoUuid_;
+    std::string   mimeType_;
+    std::string   md5_;
+    uint64_t      size_;
+    int64_t       lastActivity_;
+
+    Session(const std::string& root,
+            const std::string& id) :
+      root_(root),
+      removed_(false),
+      size_(0),
+      lastActivity_(0)
+    {
+      dataPath_ = (boost::filesystem::path(root) / (id + ".data")).string();
+      statePath_ = (boost::filesystem::path(root) / (id + ".json")).string();
+    }
+
+    const std::string& GetDataPath() const
+    {
+      return dataPath_;
+    }
+
+    void AddRange(uint64_t start,
+                  uint64_t end)
+    {
+      // Merge with the overlapping or adjacent ranges
+      Ranges::iterator it = ranges_.upper_bound(start);
+      if (it != ranges_.begin())
+      {
+        Ranges::iterator previous = it;
+        --previous;
+
+        if (previous->second >= start)
+        {
+          start = previous->first;
+          end = std::max(end, previous->second);
+          ranges_.erase(previous);
+        }
+      }
+
+      while (it != ranges_.end() &&
+             it->first <= end)
+      {
+        end = std::max(end, it->second);
+        ranges_.erase(it++);
+      }
+
+      ranges_[start] = end;
+    }
+
+    uint64_t GetReceivedSize() const
+    {
+      uint64_t size = 0;
+      for (Ranges::const_iterator it = ranges_.begin(); it != ranges_.end(); ++it)
+      {
+        size += it->second - it->first;
+      }
+
+      return size;
+    }
+
+    void GetRanges(std::list< std::pair<uint64_t, uint64_t> >& target) const
+    {
+      target.assign(ranges_.begin(), ranges_.end());
+    }
+
+    bool IsComplete() const
+    {
+      return (ranges_.size() == 1 &&
+              ranges_.begin()->first == 0 &&
+              ranges_.begin()->second == size_);
+    }
+
+    void Serialize(Json::Value& target) const
+    {
+      target = Json::objectValue;
+      target["Photo"] = photoUuid_;
+      target["ImageMime"] = mimeType_;
+      target["MD5"] = md5_;
+      target["Size"] = boost::lexical_cast<std::string>(size_);
+      target["LastActivity"] = boost::lexical_cast<std::string>(lastActivity_);
+
+      Json::Value received = Json::arrayValue;
+      for (Ranges::const_iterator it = ranges_.begin(); it != ranges_.end(); ++it)
+      {
+        Json::Value range = Json::arrayValue;
+        range.append(boost::lexical_cast<std::string>(it->first));
+        range.append(boost::lexical_cast<std::string>(it->second));
+        received.append(range);
+      }
+
+      target["Received"] = received;
+    }
+
+    // The 64-bit integers are stored as strings, as jsoncpp might
+    // not support them
+    bool Unserialize(const Json::Value& source)
+    {
+      try
+      {
+        photoUuid_ = source["Photo"].asString();
+        mimeType_ = source["ImageMime"].asString();
+        md5_ = source["MD5"].asString();
+        size_ = boost::lexical_cast<uint64_t>(source["Size"].asString());
+        lastActivity_ = boost::lexical_cast<int64_t>(source["LastActivity"].asString());
+
+        const Json::Value& received = source["Received"];
+        for (Json::Value::ArrayIndex i = 0; i < received.size(); i++)
+        {
+          uint64_t start = boost::lexical_cast<uint64_t>(received[i][0].asString());
+          uint64_t end = boost::lexical_cast<uint64_t>(received[i][1].asString());
+          if (start >= end || end > size_)
+          {
+            return false;
+          }
+
+          AddRange(start, end);
+        }
+
+        return true;
+      }
+      catch (boost::bad_lexical_cast&)
+      {
+        return false;
+      }
+      catch (std::exception&)   // Bad type in jsoncpp
+      {
+        return false;
+      }
+    }
+
+    bool Load()
+    {
+      std::string content;
+      Json::Value state;
+      Json::Reader reader;
+
+      try
+      {
+        Orthanc::Toolbox::ReadFile(content, statePath_);
+      }
+      catch (Orthanc::OrthancException&)
+      {
+        return false;
+      }
+
+      return (reader.parse(content, state) &&
+              state.type() == Json::objectValue &&
+              Unserialize(state) &&
+              boost::filesystem::is_regular_file(dataPath_));
+    }
+
+    void Save() const
+    {
+      Json::Value state;
+      Serialize(state);
+
+      std::string content = state.toStyledString();
+      std::string tmp = statePath_ + ".tmp";
+
+      FILE* fp = fopen(tmp.c_str(), "wb");
+      if (fp == NULL)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+      }
+
+      // The new state must be on the disk before it replaces the old
+      // one, and the rename must be on the disk before the chunk is
+      // acknowledged to the client
+      bool success = (fwrite(content.c_str(), 1, content.size(), fp) == content.size() &&
+                      fflush(fp) == 0 &&
+                      FileSynchronizer::SyncFile(fileno(fp)));
+
+      if (fclose(fp) != 0 || !success)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+      }
+
+      boost::filesystem::rename(tmp, statePath_);
+
+      if (!FileSynchronizer::SyncDirectory(root_))
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+      }
+    }
+
+    void RemoveFiles()
+    {
+      boost::system::error_code error;
+      boost::filesystem::remove(dataPath_, error);
+      boost::filesystem::remove(statePath_, error);
+      boost::filesystem::remove(statePath_ + ".tmp", error);
+    }
+  };
+
+
+  UploadSessions::UploadSessions(DatabaseWrapper& db,
+                                 const std::string& root,
+                                 uint64_t maxSize,
+                                 unsigned int timeout) :
+    db_(db),
+    root_(root),
+    maxSize_(std::min(maxSize, static_cast<uint64_t>(0xffffffffu))),
+    timeout_(timeout),
+    done_(true)
+  {
+    using namespace boost::filesystem;
+
+    create_directories(root_);
+
+    // Resume the sessions that were open before the restart
+    std::vector<path> states;
+    for (directory_iterator it(root_); it != directory_iterator(); ++it)
+    {
+      if (is_regular_file(it->status()) &&
+          it->path().extension() == ".json")
+      {
+        states.push_back(it->path());
+      }
+    }
+
+    for (size_t i = 0; i < states.size(); i++)
+    {
+      std::string id = states[i].stem().string();
+      boost::shared_ptr<Session> session(new Session(root_, id));
+
+      if (session->Load())
+      {
+        sessions_[id] = session;
+      }
+      else
+      {
+        LOG(WARNING) << "Removing the corrupted upload session " << id;
+        session->RemoveFiles();
+      }
+    }
+
+    if (!sessions_.empty())
+    {
+      LOG(WARNING) << "Resuming " << sessions_.size() << " upload sessions";
+    }
+  }
+
+
+  UploadSessions::~UploadSessions()
+  {
+    Stop();
+  }
+
+
+  boost::shared_ptr<UploadSessions::Session> UploadSessions::Lookup(const std::string& id)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Sessions::iterator found = sessions_.find(id);
+    if (found == sessions_.end())
+    {
+      return boost::shared_ptr<Session>();
+    }
+    else
+    {
+      return found->second;
+    }
+  }
+
+
+  void UploadSessions::Discard(const std::string& id,
+                               Session& session)
+  {
+    // The mutex of the session must be locked by the caller, which
+    // ensures that no other thread is writing to its files
+    session.removed_ = true;
+    session.RemoveFiles();
+
+    boost::mutex::scoped_lock lock(mutex_);
+    sessions_.erase(id);
+  }
+
+
+  std::string UploadSessions::Create(const std::string& photoUuid,
+                                     const std::string& mimeType,
+                                     uint64_t size,
+                                     const std::string& md5)
+  {
+    std::string hash = boost::to_lower_copy(md5);
+
+    Photo photo;
+    if (size == 0 ||
+        size > maxSize_ ||
+        hash.size() != 32 ||
+        hash.find_first_not_of("0123456789abcdef") != std::string::npos ||
+        !db_.GetPhoto(photo, photoUuid))
+    {
+      return "";
+    }
+
+    std::string id = Orthanc::Toolbox::GenerateUuid();
+
+    boost::shared_ptr<Session> session(new Session(root_, id));
+    session->photoUuid_ = photoUuid;
+    session->mimeType_ = mimeType;
+    session->md5_ = hash;
+    session->size_ = size;
+    session->lastActivity_ = Toolbox::GetSecondsSinceEpoch();
+
+    Orthanc::Toolbox::WriteFile("", session->GetDataPath());
+    session->Save();
+
+    boost::mutex::scoped_lock lock(mutex_);
+    sessions_[id] = session;
+
+    return id;
+  }
+
+
+  bool UploadSessions::GetStatus(Json::Value& target,
+                                 const std::string& id)
+  {
+    boost::shared_ptr<Session> session = Lookup(id);
+    if (session.get() == NULL)
+    {
+      return false;
+    }
+
+    boost::mutex::scoped_lock lock(session->mutex_);
+    if (session->removed_)
+    {
+      return false;
+    }
+
+    // The sizes are bounded by "maxSize_", which fits 32 bits
+    target = Json::objectValue;
+    target["ID"] = id;
+    target["Photo"] = session->photoUuid_;
+    target["ImageMime"] = session->mimeType_;
+    target["MD5"] = session->md5_;
+    target["Size"] = static_cast<Json::UInt>(session->size_);
+    target["ReceivedSize"] = static_cast<Json::UInt>(session->GetReceivedSize());
+    target["Complete"] = session->IsComplete();
+
+    std::list< std::pair<uint64_t, uint64_t> > ranges;
+    session->GetRanges(ranges);
+
+    target["Received"] = Json::arrayValue;
+    for (std::list< std::pair<uint64_t, uint64_t> >::const_iterator
+           it = ranges.begin(); it != ranges.end(); ++it)
+    {
+      Json::Value range = Json::arrayValue;
+      range.append(static_cast<Json::UInt>(it->first));
+      range.append(static_cast<Json::UInt>(it->second));
+      target["Received"].append(range);
+    }
+
+    return true;
+  }
+
+
+  UploadStatus UploadSessions::WriteChunk(const std::string& id,
+                                          uint64_t offset,
+                                          const void* data,
+                                          size_t size)
+  {
+    boost::shared_ptr<Session> session = Lookup(id);
+    if (session.get() == NULL)
+    {
+      return UploadStatus_UnknownSession;
+    }
+
+    boost::mutex::scoped_lock lock(session->mutex_);
+    if (session->removed_)
+    {
+      return UploadStatus_UnknownSession;
+    }
+
+    if (size == 0 ||
+        offset >= session->size_ ||
+        static_cast<uint64_t>(size) > session->size_ - offset)
+    {
+      return UploadStatus_BadRange;
+    }
+
+    FILE* fp = fopen(session->GetDataPath().c_str(), "r+b");
+    if (fp == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+    }
+
+    // Writing after the end of the file fills the gap with zeros
+    bool success = (fseek(fp, static_cast<long>(offset), SEEK_SET) == 0 &&
+                    fwrite(data, 1, size, fp) == size &&
+                    fflush(fp) == 0 &&
+                    FileSynchronizer::SyncFile(fileno(fp)));
+
+    if (fclose(fp) != 0 || !success)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+    }
+
+    // The range is only recorded once its bytes are on the disk
+    session->AddRange(offset, offset + size);
+    session->lastActivity_ = Toolbox::GetSecondsSinceEpoch();
+    session->Save();
+
+    return UploadStatus_Success;
+  }
+
+
+  UploadStatus UploadSessions::Finalize(const std::string& id)
+  {
+    boost::shared_ptr<Session> session = Lookup(id);
+    if (session.get() == NULL)
+    {
+      return UploadStatus_UnknownSession;
+    }
+
+    boost::mutex::scoped_lock lock(session->mutex_);
+    if (session->removed_)
+    {
+      return UploadStatus_UnknownSession;
+    }
+
+    if (!session->IsComplete())
+    {
+      return UploadStatus_Incomplete;
+    }
+
+    std::string image;
+    Orthanc::Toolbox::ReadFile(image, session->GetDataPath());
+
+    std::string md5;
+    Orthanc::Toolbox::ComputeMD5(md5, image);
+
+    if (image.size() != session->size_ ||
+        md5 != session->md5_)
+    {
+      LOG(WARNING) << "Bad checksum in the upload session " << id << " of photo " << session->photoUuid_;
+      Discard(id, *session);
+      return UploadStatus_BadChecksum;
+    }
+
+    // If the photo was deleted in the meantime, this throws an
+    // exception, and the session will expire
+    db_.ReplaceImage(session->photoUuid_, image, session->mimeType_);
+
+    Discard(id, *session);
+    return UploadStatus_Success;
+  }
+
+
+  bool UploadSessions::Remove(const std::string& id)
+  {
+    boost::shared_ptr<Session> session = Lookup(id);
+    if (session.get() == NULL)
+    {
+      return false;
+    }
+
+    boost::mutex::scoped_lock lock(session->mutex_);
+    if (session->removed_)
+    {
+      return false;
+    }
+
+    Discard(id, *session);
+    return true;
+  }
+
+
+  size_t UploadSessions::GetSessionsCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return sessions_.size();
+  }
+
+
+  unsigned int UploadSessions::RemoveExpiredSessions(int64_t now)
+  {
+    Sessions sessions;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      sessions = sessions_;
+    }
+
+    unsigned int count = 0;
+
+    for (Sessions::iterator it = sessions.begin(); it != sessions.end(); ++it)
+    {
+      boost::mutex::scoped_lock lock(it->second->mutex_);
+
+      if (!it->second->removed_ &&
+          it->second->lastActivity_ + timeout_ < now)
+      {
+        LOG(INFO) << "Removing the expired upload session " << it->first;
+        Discard(it->first, *it->second);
+        count++;
+      }
+    }
+
+    return count;
+  }
+
+
+  void UploadSessions::Worker(UploadSessions* that,
+                              unsigned int interval)
+  {
+    for (;;)
+    {
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+
+        if (!that->done_)
+        {
+          that->wakeup_.timed_wait(lock, boost::posix_time::seconds(interval));
+        }
+
+        if (that->done_)
+        {
+          return;
+        }
+      }
+
+      try
+      {
+        unsigned int count = that->RemoveExpiredSessions(Toolbox::GetSecondsSinceEpoch());
+        if (count > 0)
+        {
+          LOG(WARNING) << "Removed " << count << " expired upload sessions";
+        }
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(ERROR) << "Error while removing the expired upload sessions: " << e.What();
+      }
+    }
+  }
+
+
+  void UploadSessions::Start(unsigned int interval)
+  {
+    Stop();
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      done_ = false;
+    }
+
+    thread_ = boost::thread(Worker, this, interval);
+  }
+
+
+  void UploadSessions::Stop()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      done_ = true;
+      wakeup_.notify_all();
+    }
+
+    if (thread_.joinable())
+    {
+      thread_.join();
+    }
+  }
+}
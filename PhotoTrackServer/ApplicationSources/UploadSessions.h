@@ -0,0 +1,133 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include "Database.h"
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <map>
+
+namespace PhotoTrack
+{
+  enum UploadStatus
+  {
+    UploadStatus_Success,
+    UploadStatus_UnknownSession,
+    UploadStatus_BadRange,       // The chunk does not fit in the image
+    UploadStatus_Incomplete,     // Some chunks are missing
+    UploadStatus_BadChecksum     // The session is discarded
+  };
+
+
+  /**
+   * Resumable uploads of the images, for the clients on unreliable
+   * networks. A session is created for a photo with the size and the
+   * MD5 of the image, then the chunks are written at their offset in
+   * a staging file, in any order and possibly several times. Once
+   * all the bytes are received, finalizing the session checks the
+   * MD5 and attaches the image to the photo, as
+   * "DatabaseWrapper::ReplaceImage()".
+   *
+   * The state of each session is saved next to its staging file, so
+   * that the uploads can be resumed after a restart of the server.
+   * A chunk is only acknowledged once its bytes and the updated state
+   * are flushed to the disk. The sessions that receive no chunk during
+   * the timeout are removed by a background thread.
+   **/
+  class UploadSessions : public boost::noncopyable
+  {
+  private:
+    class Session;
+
+    typedef std::map<std::string, boost::shared_ptr<Session> >  Sessions;
+
+    DatabaseWrapper&           db_;
+    std::string                root_;
+    uint64_t                   maxSize_;
+    int64_t                    timeout_;   // In seconds
+
+    boost::mutex               mutex_;
+    Sessions                   sessions_;
+
+    bool                       done_;
+    boost::condition_variable  wakeup_;
+    boost::thread              thread_;
+
+    boost::shared_ptr<Session> Lookup(const std::string& id);
+
+    void Discard(const std::string& id,
+                 Session& session);
+
+    static void Worker(UploadSessions* that,
+                       unsigned int interval);
+
+  public:
+    UploadSessions(DatabaseWrapper& db,
+                   const std::string& root,
+                   uint64_t maxSize,
+                   unsigned int timeout);   // In seconds
+
+    ~UploadSessions();
+
+    uint64_t GetMaxSize() const
+    {
+      return maxSize_;
+    }
+
+    // Returns an empty string if the photo does not exist, or if the
+    // image is too large
+    std::string Create(const std::string& photoUuid,
+                       const std::string& mimeType,
+                       uint64_t size,
+                       const std::string& md5);
+
+    // Gives the ranges of bytes that have been received, as a list
+    // of [start, end) pairs
+    bool GetStatus(Json::Value& target,
+                   const std::string& id);
+
+    UploadStatus WriteChunk(const std::string& id,
+                            uint64_t offset,
+                            const void* data,
+                            size_t size);
+
+    UploadStatus WriteChunk(const std::string& id,
+                            uint64_t offset,
+                            const std::string& data)
+    {
+      return WriteChunk(id, offset, data.empty() ? NULL : data.c_str(), data.size());
+    }
+
+    UploadStatus Finalize(const std::string& id);
+
+    bool Remove(const std::string& id);
+
+    size_t GetSessionsCount();
+
+    // Returns the number of sessions that were inactive since "now -
+    // timeout", and that have been removed
+    unsigned int RemoveExpiredSessions(int64_t now);
+
+    void Start(unsigned int interval);  // In seconds
+
+    void Stop();
+  };
+}
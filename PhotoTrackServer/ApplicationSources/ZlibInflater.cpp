@@ -0,0 +1,102 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerPrecompiledHeaders.h"
+#include "ZlibInflater.h"
+
+#include <Core/OrthancException.h>
+#include <string.h>
+
+namespace PhotoTrack
+{
+  ZlibInflater::ZlibInflater(const void* compressed,
+                             size_t size) :
+    uncompressedSize_(0),
+    done_(false)
+  {
+    if (size < sizeof(uint64_t))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    memcpy(&uncompressedSize_, compressed, sizeof(uint64_t));
+
+    memset(&stream_, 0, sizeof(stream_));
+    stream_.next_in = reinterpret_cast<Bytef*>(const_cast<void*>(compressed)) + sizeof(uint64_t);
+    stream_.avail_in = static_cast<uInt>(size - sizeof(uint64_t));
+
+    if (inflateInit(&stream_) != Z_OK)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    if (uncompressedSize_ == 0)
+    {
+      done_ = true;
+    }
+  }
+
+
+  ZlibInflater::~ZlibInflater()
+  {
+    inflateEnd(&stream_);
+  }
+
+
+  bool ZlibInflater::ReadChunk(std::string& chunk,
+                               size_t maxSize)
+  {
+    chunk.clear();
+
+    if (done_)
+    {
+      return false;
+    }
+
+    if (maxSize == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    chunk.resize(maxSize);
+    stream_.next_out = reinterpret_cast<Bytef*>(&chunk[0]);
+    stream_.avail_out = static_cast<uInt>(maxSize);
+
+    int error = inflate(&stream_, Z_NO_FLUSH);
+
+    if (error == Z_STREAM_END)
+    {
+      done_ = true;
+    }
+    else if (error != Z_OK)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    chunk.resize(maxSize - stream_.avail_out);
+
+    if (!done_ && chunk.empty())
+    {
+      // Truncated stream
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    return !chunk.empty() || !done_;
+  }
+}
@@ -0,0 +1,58 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <stdint.h>
+#include <string>
+#include <zlib.h>
+
+namespace PhotoTrack
+{
+  /**
+   * Incremental decompression of a buffer that was produced by
+   * Orthanc::ZlibCompressor (i.e. an 8-byte prefix with the
+   * uncompressed size, followed by a zlib stream). This avoids
+   * holding the full uncompressed image in memory. The compressed
+   * buffer must remain alive as long as the inflater is used.
+   **/
+  class ZlibInflater : public boost::noncopyable
+  {
+  private:
+    z_stream  stream_;
+    uint64_t  uncompressedSize_;
+    bool      done_;
+
+  public:
+    ZlibInflater(const void* compressed,
+                 size_t size);
+
+    ~ZlibInflater();
+
+    uint64_t GetUncompressedSize() const
+    {
+      return uncompressedSize_;
+    }
+
+    // Returns "false" once the whole content has been produced
+    bool ReadChunk(std::string& chunk,
+                   size_t maxSize);
+  };
+}
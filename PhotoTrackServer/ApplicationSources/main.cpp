@@ -25,8 +25,21 @@
 #include "Configuration.h"
 #include "Toolbox.h"
 #include "Database.h"
+#include "ContactSheetCache.h"
+#include "DerivedImageCache.h"
+#include "CachedImageStorage.h"
+#include "FilesystemImageStorage.h"
+#include "HybridImageStorage.h"
+#include "IngestQueue.h"
+#include "JpegRecompressor.h"
+#include "PackfileStorage.h"
+#include "ProxyOffload.h"
+#include "SiteArchiver.h"
+#include "StorageMirror.h"
+#include "TileCache.h"
+#include "TieredImageStorage.h"
+#include "UploadSessions.h"
 
-#include <Core/FileStorage/FileStorage.h>
 #include <Core/HttpServer/MongooseServer.h>
 #include <Core/HttpServer/FilesystemHttpHandler.h>
 #include <Core/Toolbox.h>
@@ -145,8 +158,177 @@ int main(int argc, char* argv[])
 
   LOG(WARNING) << PhotoTrack::Configuration::GetPath("Assets", "test.cpp");
 
-  Orthanc::FileStorage storage(PhotoTrack::Configuration::GetPath("FileStorage", "FileStorage"));
-  DatabaseWrapper database(PhotoTrack::Configuration::GetPath("Database", "index.db"), storage);
+  PhotoTrack::DurabilityPolicy storageDurability = 
+    PhotoTrack::StringToDurabilityPolicy(PhotoTrack::Configuration::GetString("StorageDurability", "OsBuffered"));
+
+  PhotoTrack::FilesystemImageStorage fileStorage
+    (PhotoTrack::Configuration::GetPath("FileStorage", "FileStorage"), storageDurability);
+  PhotoTrack::IImageStorage* storage = &fileStorage;
+
+  // Small blobs can be appended to packfiles, to avoid creating
+  // millions of tiny files in the storage area
+  std::auto_ptr<PhotoTrack::PackfileStorage> packfiles;
+  std::auto_ptr<PhotoTrack::HybridImageStorage> hybrid;
+
+  int packfileThreshold = PhotoTrack::Configuration::GetInteger("PackfileThreshold", 0);
+  if (packfileThreshold > 0)
+  {
+    packfiles.reset(new PhotoTrack::PackfileStorage(PhotoTrack::Configuration::GetPath("PackfileStorage", "Packfiles"),
+                                                 storageDurability));
+    packfiles->SetMaxSegmentSize(static_cast<uint64_t>(PhotoTrack::Configuration::GetInteger("PackfileSegmentSize", 256)) * 1024 * 1024);
+    packfiles->StartCompaction(PhotoTrack::Configuration::GetInteger("PackfileCompactionInterval", 600));
+
+    LOG(WARNING) << "Blobs below " << packfileThreshold << " bytes are stored in packfiles";
+    hybrid.reset(new PhotoTrack::HybridImageStorage(*packfiles, fileStorage, packfileThreshold));
+    storage = hybrid.get();
+  }
+
+  // The images of the closed sites can be moved to a cold storage
+  std::auto_ptr<PhotoTrack::TieredImageStorage> tiered;
+  if (PhotoTrack::Configuration::HasParameter("ColdStorage"))
+  {
+    tiered.reset(new PhotoTrack::TieredImageStorage(*storage, PhotoTrack::Configuration::GetPath("ColdStorage", "ColdStorage")));
+    storage = tiered.get();
+  }
+
+  // Memory cache of the hot images. The mirror below reads from the
+  // uncached storage, so as not to pollute the cache.
+  std::auto_ptr<PhotoTrack::CachedImageStorage> cache;
+  int cacheSize = PhotoTrack::Configuration::GetInteger("ImageCacheSize", 0);  // In MB
+  if (cacheSize > 0)
+  {
+    int maxEntrySize = PhotoTrack::Configuration::GetInteger("ImageCacheMaxEntrySize", 4);  // In MB
+    LOG(WARNING) << "Caching the images of at most " << maxEntrySize << "MB in " << cacheSize << "MB of memory";
+    cache.reset(new PhotoTrack::CachedImageStorage(*storage, 
+                                                   static_cast<size_t>(cacheSize) * 1024 * 1024,
+                                                   static_cast<size_t>(maxEntrySize) * 1024 * 1024));
+  }
+
+  DatabaseWrapper database(PhotoTrack::Configuration::GetPath("Database", "index.db"),
+                           cache.get() != NULL ? static_cast<PhotoTrack::IImageStorage&>(*cache) : *storage);
+  database.SetIdempotencyKeyTtl(PhotoTrack::Configuration::GetInteger("IdempotencyKeyTtl", 24 * 3600));  // In seconds
+
+  // Continuous replication of the new images to a secondary path
+  std::auto_ptr<PhotoTrack::StorageMirror> mirror;
+  if (PhotoTrack::Configuration::HasParameter("Mirror"))
+  {
+    mirror.reset(new PhotoTrack::StorageMirror(*storage, 
+                                               PhotoTrack::Configuration::GetPath("Mirror", "Mirror"),
+                                               PhotoTrack::Configuration::GetPath("MirrorQueue", "mirror.db")));
+    mirror->SetMaxBandwidth(static_cast<uint64_t>(PhotoTrack::Configuration::GetInteger("MirrorBandwidth", 0)) * 1024);  // In KB/s
+    database.Register(*mirror);
+    mirror->Start(PhotoTrack::Configuration::GetInteger("MirrorRetryInterval", 60));
+  }
+
+  // Downscaled images, generated on demand for the thumbnails
+  PhotoTrack::DerivedImageCache derivedImages(PhotoTrack::Configuration::GetPath("DerivedImages", "DerivedImages"),
+                                              PhotoTrack::Configuration::GetInteger("DerivedImageWorkers", 2));
+  derivedImages.SetJpegQuality(PhotoTrack::Configuration::GetInteger("DerivedImageQuality", 85));
+  database.Register(derivedImages);
+
+  // Deep-zoom tile pyramids, built lazily or as soon as the images
+  // are uploaded if "TilePrebuild" is set
+  PhotoTrack::TileCache tiles(database, PhotoTrack::Configuration::GetPath("Tiles", "Tiles"),
+                              PhotoTrack::Configuration::GetInteger("TileWorkers", 1));
+  tiles.SetJpegQuality(PhotoTrack::Configuration::GetInteger("DerivedImageQuality", 85));
+  database.Register(tiles);
+
+  if (PhotoTrack::Configuration::GetBoolean("TilePrebuild", false))
+  {
+    tiles.Start();
+  }
+
+  // Composite images of the thumbnails of all the photos of a site
+  PhotoTrack::ContactSheetCache contactSheets(database, PhotoTrack::Configuration::GetPath("ContactSheets", "ContactSheets"),
+                                              PhotoTrack::Configuration::GetInteger("ContactSheetWorkers", 1));
+  contactSheets.SetJpegQuality(PhotoTrack::Configuration::GetInteger("DerivedImageQuality", 85));
+  contactSheets.SetThumbnailSize(PhotoTrack::Configuration::GetInteger("ContactSheetThumbnailSize", 128));
+  contactSheets.SetColumns(PhotoTrack::Configuration::GetInteger("ContactSheetColumns", 16));
+
+  // Recompression of the oversized JPEG images of the cameras, once
+  // they are attached to their photo
+  std::auto_ptr<PhotoTrack::JpegRecompressor> recompressor;
+  if (PhotoTrack::Configuration::GetBoolean("Recompression", false))
+  {
+    int maxDimension = PhotoTrack::Configuration::GetInteger("RecompressionMaxDimension", 2560);
+    int quality = PhotoTrack::Configuration::GetInteger("RecompressionQuality", 80);
+    LOG(WARNING) << "Recompressing the JPEG images to " << maxDimension << " pixels at quality " << quality;
+
+    recompressor.reset(new PhotoTrack::JpegRecompressor
+                       (database, maxDimension,
+                        static_cast<size_t>(PhotoTrack::Configuration::GetInteger("RecompressionMinSize", 2048)) * 1024));  // In KB
+    recompressor->SetQuality(quality);
+
+    if (PhotoTrack::Configuration::HasParameter("RecompressionOriginals"))
+    {
+      recompressor->SetOriginalsDirectory(PhotoTrack::Configuration::GetPath("RecompressionOriginals", "Originals"));
+    }
+
+    database.Register(*recompressor);
+    recompressor->Start(PhotoTrack::Configuration::GetInteger("RecompressionWorkers", 1));
+  }
+
+  // Staging area of the resumable uploads, whose abandoned sessions
+  // are removed in the background
+  PhotoTrack::UploadSessions uploads(database, PhotoTrack::Configuration::GetPath("Uploads", "Uploads"),
+                                     static_cast<uint64_t>(PhotoTrack::Configuration::GetInteger("UploadMaxSize", 64)) * 1024 * 1024,  // In MB
+                                     PhotoTrack::Configuration::GetInteger("UploadTimeout", 24 * 3600));
+  uploads.Start(PhotoTrack::Configuration::GetInteger("UploadReaperInterval", 600));
+
+  // Fast acknowledgement of the uploads: The new photos are staged in
+  // durable files, then committed to the database in the background.
+  // The staging files are always flushed before the acknowledgement,
+  // whatever the durability of the storage area.
+  std::auto_ptr<PhotoTrack::IngestQueue> ingest;
+  if (PhotoTrack::Configuration::GetBoolean("IngestQueue", false))
+  {
+    int workers = PhotoTrack::Configuration::GetInteger("IngestWorkers", 2);
+    LOG(WARNING) << "The uploads are ingested in the background by " << workers << " workers";
+
+    ingest.reset(new PhotoTrack::IngestQueue
+                 (database, PhotoTrack::Configuration::GetPath("IngestStaging", "Ingest"),
+                  PhotoTrack::StringToDurabilityPolicy(PhotoTrack::Configuration::GetString("IngestDurability", "Grouped"))));
+    ingest->SetRetryPolicy(PhotoTrack::Configuration::GetInteger("IngestAttempts", 5),
+                           PhotoTrack::Configuration::GetInteger("IngestRetryDelay", 1000));  // In milliseconds
+    ingest->Start(workers);
+  }
+
+  std::auto_ptr<PhotoTrack::SiteArchiver> archiver;
+  if (tiered.get() != NULL)
+  {
+    int days = PhotoTrack::Configuration::GetInteger("ColdStorageAge", 30);
+    LOG(WARNING) << "The images of the sites that are closed since " << days << " days are moved to the cold storage";
+
+    archiver.reset(new PhotoTrack::SiteArchiver(database, *tiered, static_cast<int64_t>(days) * 24 * 3600));
+    archiver->Start(PhotoTrack::Configuration::GetInteger("ColdStorageInterval", 3600));
+  }
+
+  // The bodies of the images can be sent by a front proxy (nginx,
+  // Apache...) that has access to the storage area
+  std::auto_ptr<PhotoTrack::ProxyOffload> offload;
+  if (PhotoTrack::Configuration::HasParameter("ProxyOffload"))
+  {
+    std::string mode = PhotoTrack::Configuration::GetString("ProxyOffload", "");
+    LOG(WARNING) << "Offloading the transfers of the images to the front proxy with " << mode;
+
+    offload.reset(new PhotoTrack::ProxyOffload(PhotoTrack::StringToProxyOffloadMode(mode), fileStorage.GetRoot(),
+                                               PhotoTrack::Configuration::GetString("ProxyStoragePrefix", "/internal/storage/")));
+
+    if (PhotoTrack::Configuration::HasParameter("ProxySpool"))
+    {
+      offload->SetSpool(PhotoTrack::Configuration::GetPath("ProxySpool", "Spool"),
+                        PhotoTrack::Configuration::GetString("ProxySpoolPrefix", "/internal/spool/"),
+                        PhotoTrack::Configuration::GetInteger("ProxySpoolRetention", 3600));
+    }
+
+    // The proxy must send "ProxyUploadSecret" in the "X-Upload-Secret"
+    // header of the requests that carry "X-Upload-File"
+    if (PhotoTrack::Configuration::HasParameter("ProxyUploads"))
+    {
+      offload->SetUploadRoot(PhotoTrack::Configuration::GetPath("ProxyUploads", "ProxyUploads"),
+                             PhotoTrack::Configuration::GetString("ProxyUploadSecret", ""));
+    }
+  }
 
   {
     DummyAuthenticator authenticator;
@@ -155,6 +337,35 @@ int main(int argc, char* argv[])
     api.SetAuthenticator(authenticator);
     api.SetDatabaseWrapper(database);
 
+    // The embedded HTTP server of Orthanc 0.8.1 reads the whole body
+    // before calling the REST API, and gives no access to the
+    // "Content-Length" header beforehand: This limit only avoids
+    // storing the large images, not receiving them. The front proxy
+    // must reject the oversized requests before they reach the
+    // server, e.g. with "client_max_body_size" in nginx (or
+    // "LimitRequestBody" in Apache), set to the same value.
+    api.SetMaxImageSize(static_cast<uint64_t>(PhotoTrack::Configuration::GetInteger("MaxImageSize", 64)) * 1024 * 1024);  // In MB
+
+    if (cache.get() != NULL)
+    {
+      api.SetImageCache(cache->GetCache());
+    }
+
+    if (offload.get() != NULL)
+    {
+      api.SetProxyOffload(*offload);
+    }
+
+    api.SetDerivedImageCache(derivedImages);
+    api.SetTileCache(tiles);
+    api.SetContactSheetCache(contactSheets);
+    api.SetUploadSessions(uploads);
+
+    if (ingest.get() != NULL)
+    {
+      api.SetIngestQueue(*ingest);
+    }
+
     Orthanc::MongooseServer httpServer;
     httpServer.SetRemoteAccessAllowed(true);   // TODO : For security
     httpServer.RegisterHandler(api);
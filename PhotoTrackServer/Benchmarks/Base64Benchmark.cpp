@@ -0,0 +1,149 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Microbenchmark of the base64 codec, on a payload of the size of a
+ * typical JPEG upload (4MB). Prints the throughput of each kernel in
+ * MB per second of decoded data, next to the codec of the Orthanc
+ * framework. Build in Release mode:
+ *
+ *   ./Base64Benchmark [iterations]
+ **/
+
+#include "../ApplicationSources/Base64.h"
+
+#include <Core/Toolbox.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/lexical_cast.hpp>
+#include <stdio.h>
+#include <stdint.h>
+
+using namespace PhotoTrack;
+
+
+static const size_t PAYLOAD_SIZE = 4 * 1024 * 1024;
+
+
+static double GetElapsedSeconds(const boost::posix_time::ptime& start)
+{
+  return static_cast<double>((boost::posix_time::microsec_clock::universal_time() - start).total_microseconds()) / 1000000.0;
+}
+
+
+static void Print(const char* name,
+                  const char* operation,
+                  double seconds,
+                  unsigned int iterations)
+{
+  double megabytes = static_cast<double>(PAYLOAD_SIZE) * static_cast<double>(iterations) / (1024.0 * 1024.0);
+
+  printf("%-8s %-8s %8.2f ms/payload  %8.1f MB/s\n", name, operation,
+         1000.0 * seconds / static_cast<double>(iterations), megabytes / seconds);
+}
+
+
+static void Run(const std::string& payload,
+                Base64Kernel kernel,
+                unsigned int iterations)
+{
+  std::string encoded, decoded;
+
+  // Warm up the caches and the allocator
+  Base64::Encode(encoded, payload.c_str(), payload.size(), kernel);
+  Base64::Decode(decoded, encoded.c_str(), encoded.size(), kernel);
+
+  boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+  for (unsigned int i = 0; i < iterations; i++)
+  {
+    Base64::Encode(encoded, payload.c_str(), payload.size(), kernel);
+  }
+
+  Print(Base64::EnumerationToString(kernel), "Encode", GetElapsedSeconds(start), iterations);
+
+  start = boost::posix_time::microsec_clock::universal_time();
+
+  for (unsigned int i = 0; i < iterations; i++)
+  {
+    if (!Base64::Decode(decoded, encoded.c_str(), encoded.size(), kernel))
+    {
+      fprintf(stderr, "Decoding has failed\n");
+      return;
+    }
+  }
+
+  Print(Base64::EnumerationToString(kernel), "Decode", GetElapsedSeconds(start), iterations);
+}
+
+
+static void RunOrthanc(const std::string& payload,
+                       unsigned int iterations)
+{
+  std::string encoded, decoded;
+  Orthanc::Toolbox::EncodeBase64(encoded, payload);
+
+  boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+  for (unsigned int i = 0; i < iterations; i++)
+  {
+    Orthanc::Toolbox::EncodeBase64(encoded, payload);
+  }
+
+  Print("Orthanc", "Encode", GetElapsedSeconds(start), iterations);
+
+  start = boost::posix_time::microsec_clock::universal_time();
+
+  for (unsigned int i = 0; i < iterations; i++)
+  {
+    Orthanc::Toolbox::DecodeBase64(decoded, encoded);
+  }
+
+  Print("Orthanc", "Decode", GetElapsedSeconds(start), iterations);
+}
+
+
+int main(int argc, char* argv[])
+{
+  unsigned int iterations = (argc > 1 ? boost::lexical_cast<unsigned int>(argv[1]) : 20);
+
+  // Pseudo-random content, as in compressed images
+  std::string payload(PAYLOAD_SIZE, '\0');
+
+  uint32_t seed = 42;
+  for (size_t i = 0; i < payload.size(); i++)
+  {
+    seed = seed * 1103515245u + 12345u;
+    payload[i] = static_cast<char>(seed >> 24);
+  }
+
+  printf("Best kernel on this CPU: %s\n", Base64::EnumerationToString(Base64::GetBestKernel()));
+
+  RunOrthanc(payload, iterations);
+
+  for (unsigned int kernel = Base64Kernel_Scalar; kernel <= Base64Kernel_Avx2; kernel++)
+  {
+    if (Base64::IsKernelSupported(static_cast<Base64Kernel>(kernel)))
+    {
+      Run(payload, static_cast<Base64Kernel>(kernel), iterations);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,121 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Microbenchmark of ImageResampler, on typical 12-megapixel camera
+ * frames (4000x3000 RGB24). Prints the throughput of each kernel in
+ * source megapixels per second. Build in Release mode:
+ *
+ *   ./ResamplingBenchmark [iterations]
+ **/
+
+#include "../ApplicationSources/ImageResampler.h"
+
+#include <Core/ImageFormats/ImageBuffer.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/lexical_cast.hpp>
+#include <stdio.h>
+#include <stdint.h>
+
+using namespace PhotoTrack;
+
+
+static const unsigned int SOURCE_WIDTH = 4000;
+static const unsigned int SOURCE_HEIGHT = 3000;
+
+
+static void Run(const Orthanc::ImageAccessor& source,
+                unsigned int width,
+                unsigned int height,
+                ResamplingFilter filter,
+                ResamplingKernel kernel,
+                unsigned int iterations)
+{
+  Orthanc::ImageBuffer buffer;
+  buffer.SetFormat(source.GetFormat());
+  buffer.SetWidth(width);
+  buffer.SetHeight(height);
+  Orthanc::ImageAccessor target = buffer.GetAccessor();
+
+  // Warm up the caches and the allocator
+  ImageResampler::Resample(target, source, filter, kernel);
+
+  boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+  for (unsigned int i = 0; i < iterations; i++)
+  {
+    ImageResampler::Resample(target, source, filter, kernel);
+  }
+
+  double seconds = static_cast<double>((boost::posix_time::microsec_clock::universal_time() - start).total_microseconds()) / 1000000.0;
+  double megapixels = static_cast<double>(source.GetWidth()) * static_cast<double>(source.GetHeight()) * 
+    static_cast<double>(iterations) / 1000000.0;
+
+  printf("%-8s %-8s %4ux%-4u  %8.2f ms/frame  %8.1f MP/s\n",
+         filter == ResamplingFilter_Area ? "Area" : "Lanczos3",
+         ImageResampler::EnumerationToString(kernel), width, height,
+         1000.0 * seconds / static_cast<double>(iterations), megapixels / seconds);
+}
+
+
+int main(int argc, char* argv[])
+{
+  unsigned int iterations = (argc > 1 ? boost::lexical_cast<unsigned int>(argv[1]) : 10);
+
+  Orthanc::ImageBuffer buffer;
+  buffer.SetFormat(Orthanc::PixelFormat_RGB24);
+  buffer.SetWidth(SOURCE_WIDTH);
+  buffer.SetHeight(SOURCE_HEIGHT);
+  Orthanc::ImageAccessor source = buffer.GetAccessor();
+
+  // Pseudo-random content, so that nothing is predictable
+  uint32_t seed = 42;
+  for (unsigned int y = 0; y < source.GetHeight(); y++)
+  {
+    uint8_t* p = reinterpret_cast<uint8_t*>(source.GetRow(y));
+    for (unsigned int x = 0; x < source.GetWidth() * 3; x++)
+    {
+      seed = seed * 1103515245u + 12345u;
+      p[x] = static_cast<uint8_t>(seed >> 24);
+    }
+  }
+
+  printf("Best kernel on this CPU: %s\n", ImageResampler::EnumerationToString(ImageResampler::GetBestKernel()));
+
+  // Thumbnail, web preview and half-resolution
+  const unsigned int sizes[][2] = { { 256, 192 }, { 1024, 768 }, { 2000, 1500 } };
+
+  for (unsigned int filter = ResamplingFilter_Area; filter <= ResamplingFilter_Lanczos3; filter++)
+  {
+    for (unsigned int s = 0; s < 3; s++)
+    {
+      for (unsigned int kernel = ResamplingKernel_Scalar; kernel <= ResamplingKernel_Avx2; kernel++)
+      {
+        if (ImageResampler::IsKernelSupported(static_cast<ResamplingKernel>(kernel)))
+        {
+          Run(source, sizes[s][0], sizes[s][1], static_cast<ResamplingFilter>(filter),
+              static_cast<ResamplingKernel>(kernel), iterations);
+        }
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,64 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include "../ApplicationSources/Database.h"
+#include "../ApplicationSources/FilesystemImageStorage.h"
+
+#include <gtest/gtest.h>
+#include <boost/filesystem.hpp>
+
+/**
+ * Fixture of the tests that work on a database. Each test gets an
+ * empty "UnitTestsResults/<test name>" directory, that contains the
+ * storage area and the index, and one site.
+ **/
+class DatabaseTest : public ::testing::Test
+{
+private:
+  static std::string PrepareRoot()
+  {
+    std::string root = (std::string("UnitTestsResults/") +
+                        ::testing::UnitTest::GetInstance()->current_test_info()->name());
+    boost::filesystem::remove_all(root);
+    boost::filesystem::create_directories(root);
+    return root;
+  }
+
+protected:
+  std::string                         root_;
+  PhotoTrack::FilesystemImageStorage  storage_;
+  DatabaseWrapper                     db_;
+  Site                                site_;
+
+  DatabaseTest() :
+    root_(PrepareRoot()),
+    storage_(root_ + "/Storage"),
+    db_(root_ + "/index.db", storage_)
+  {
+    db_.CreateOrUpdateSite(site_);
+  }
+
+  // Gives a path inside the directory of the test
+  std::string GetPath(const std::string& name) const
+  {
+    return root_ + "/" + name;
+  }
+};
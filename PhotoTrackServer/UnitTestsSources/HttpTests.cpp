@@ -0,0 +1,509 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerTestsPrecompiledHeaders.h"
+
+#include "../ApplicationSources/Base64.h"
+#include "../ApplicationSources/Base64Decoder.h"
+#include "../ApplicationSources/BlobHttpAnswer.h"
+#include "../ApplicationSources/FilesystemImageStorage.h"
+#include "../ApplicationSources/MemoryBlobReader.h"
+#include "../ApplicationSources/MultipartReader.h"
+#include "../ApplicationSources/PhotoUploadParser.h"
+#include "../ApplicationSources/ProxyOffload.h"
+
+#include <gtest/gtest.h>
+#include <boost/filesystem.hpp>
+
+using namespace PhotoTrack;
+
+
+namespace
+{
+  class StringHttpOutput : public Orthanc::HttpOutput
+  {
+  private:
+    std::string  content_;
+
+  public:
+    virtual void Send(const void* buffer,
+                      size_t length)
+    {
+      content_.append(reinterpret_cast<const char*>(buffer), length);
+    }
+
+    const std::string& GetContent() const
+    {
+      return content_;
+    }
+  };
+}
+
+
+static std::string AnswerBlob(const std::string& content,
+                              const BlobHttpAnswer::HttpHeaders& headers)
+{
+  std::string s = content;
+  MemoryBlobReader reader(s);
+
+  BlobHttpAnswer answer;
+  answer.SetContentType("image/png");
+  answer.SetETag("\"tag\"");
+  answer.SetCacheControl("no-cache");
+
+  StringHttpOutput http;
+  Orthanc::RestApiOutput output(http);
+  answer.Answer(output, reader, headers);
+
+  return http.GetContent();
+}
+
+
+static std::string AnswerBlob(const std::string& content,
+                              const std::string& range,
+                              const std::string& ifRange)
+{
+  BlobHttpAnswer::HttpHeaders headers;
+
+  if (!range.empty())
+  {
+    headers["range"] = range;
+  }
+
+  if (!ifRange.empty())
+  {
+    headers["if-range"] = ifRange;
+  }
+
+  return AnswerBlob(content, headers);
+}
+
+
+static bool HasLine(const std::string& answer,
+                    const std::string& line)
+{
+  return answer.find(line + "\r\n") != std::string::npos;
+}
+
+
+static std::string GetBody(const std::string& answer)
+{
+  size_t pos = answer.find("\r\n\r\n");
+  return (pos == std::string::npos ? "" : answer.substr(pos + 4));
+}
+
+
+TEST(BlobHttpAnswer, Full)
+{
+  std::string s = AnswerBlob("Hello world", "", "");
+  ASSERT_TRUE(HasLine(s, "HTTP/1.1 200 OK"));
+  ASSERT_TRUE(HasLine(s, "Content-Type: image/png"));
+  ASSERT_TRUE(HasLine(s, "Content-Length: 11"));
+  ASSERT_TRUE(HasLine(s, "Accept-Ranges: bytes"));
+  ASSERT_TRUE(HasLine(s, "ETag: \"tag\""));
+  ASSERT_TRUE(HasLine(s, "Cache-Control: no-cache"));
+  ASSERT_EQ("Hello world", GetBody(s));
+}
+
+
+TEST(BlobHttpAnswer, Range)
+{
+  std::string s = AnswerBlob("Hello world", "bytes=6-", "");
+  ASSERT_TRUE(HasLine(s, "HTTP/1.1 206 Partial Content"));
+  ASSERT_TRUE(HasLine(s, "Content-Range: bytes 6-10/11"));
+  ASSERT_TRUE(HasLine(s, "Content-Length: 5"));
+  ASSERT_EQ("world", GetBody(s));
+
+  s = AnswerBlob("Hello world", "bytes=0-4", "\"tag\"");
+  ASSERT_TRUE(HasLine(s, "HTTP/1.1 206 Partial Content"));
+  ASSERT_EQ("Hello", GetBody(s));
+
+  // The client has an outdated version of the image
+  s = AnswerBlob("Hello world", "bytes=0-4", "\"other\"");
+  ASSERT_TRUE(HasLine(s, "HTTP/1.1 200 OK"));
+  ASSERT_EQ("Hello world", GetBody(s));
+
+  s = AnswerBlob("Hello world", "bytes=20-", "");
+  ASSERT_TRUE(HasLine(s, "HTTP/1.1 416 Requested Range Not Satisfiable"));
+  ASSERT_TRUE(HasLine(s, "Content-Range: bytes */11"));
+  ASSERT_EQ("", GetBody(s));
+}
+
+
+TEST(BlobHttpAnswer, NotModified)
+{
+  BlobHttpAnswer::HttpHeaders headers;
+  headers["if-none-match"] = "\"other\", W/\"tag\"";
+
+  std::string s = AnswerBlob("Hello world", headers);
+  ASSERT_TRUE(HasLine(s, "HTTP/1.1 304 Not Modified"));
+  ASSERT_TRUE(HasLine(s, "ETag: \"tag\""));
+  ASSERT_TRUE(HasLine(s, "Cache-Control: no-cache"));
+  ASSERT_EQ("", GetBody(s));
+
+  headers["if-none-match"] = "*";
+  ASSERT_TRUE(HasLine(AnswerBlob("Hello world", headers), "HTTP/1.1 304 Not Modified"));
+
+  headers["if-none-match"] = "\"other\"";
+  headers["range"] = "bytes=0-4";
+  s = AnswerBlob("Hello world", headers);
+  ASSERT_TRUE(HasLine(s, "HTTP/1.1 206 Partial Content"));
+  ASSERT_EQ("Hello", GetBody(s));
+}
+
+
+TEST(ProxyOffload, Redirection)
+{
+  boost::filesystem::remove_all("UnitTestsResults/Offload");
+
+  FilesystemImageStorage storage("UnitTestsResults/Offload/Storage");
+  std::string uuid = storage.Create("Hello");
+
+  std::string path;
+  ASSERT_TRUE(storage.LookupFile(path, uuid));
+  ASSERT_EQ(uuid.substr(0, 2) + "/" + uuid.substr(2, 2) + "/" + uuid, path);
+  ASSERT_FALSE(storage.LookupFile(path, "00000000-0000-0000-0000-000000000000"));
+
+  ProxyOffload accel(ProxyOffloadMode_AccelRedirect, storage.GetRoot(), "/internal/storage");
+  ASSERT_EQ("X-Accel-Redirect: /internal/storage/" + path, accel.FormatStorageRedirection(path));
+
+  ProxyOffload sendfile(ProxyOffloadMode_Sendfile, storage.GetRoot(), "");
+  std::string s = sendfile.FormatStorageRedirection(path);
+  ASSERT_EQ(0u, s.find("X-Sendfile: /"));
+  ASSERT_EQ(boost::filesystem::absolute(storage.GetPath(uuid)).string(), s.substr(12));
+
+  BlobHttpAnswer answer;
+  answer.SetContentType("image/jpeg");
+  answer.SetETag("\"" + uuid + "\"");
+
+  StringHttpOutput http;
+  Orthanc::RestApiOutput output(http);
+  answer.AnswerOffloaded(output, accel.FormatStorageRedirection(path));
+
+  ASSERT_TRUE(HasLine(http.GetContent(), "HTTP/1.1 200 OK"));
+  ASSERT_TRUE(HasLine(http.GetContent(), "Content-Type: image/jpeg"));
+  ASSERT_TRUE(HasLine(http.GetContent(), "ETag: \"" + uuid + "\""));
+  ASSERT_TRUE(HasLine(http.GetContent(), "X-Accel-Redirect: /internal/storage/" + path));
+  ASSERT_TRUE(HasLine(http.GetContent(), "Content-Length: 0"));
+  ASSERT_EQ("", GetBody(http.GetContent()));
+
+  ASSERT_THROW(StringToProxyOffloadMode("nope"), Orthanc::OrthancException);
+}
+
+
+TEST(ProxyOffload, Spool)
+{
+  boost::filesystem::remove_all("UnitTestsResults/Spool");
+
+  ProxyOffload offload(ProxyOffloadMode_AccelRedirect, "UnitTestsResults/Storage", "/internal/storage/");
+  ASSERT_FALSE(offload.HasSpool());
+  ASSERT_THROW(offload.CreateSpoolFile(".zip"), Orthanc::OrthancException);
+
+  offload.SetSpool("UnitTestsResults/Spool", "/internal/spool/", 3600);
+  ASSERT_TRUE(offload.HasSpool());
+
+  std::string a = offload.CreateSpoolFile(".zip");
+  std::string b = offload.CreateSpoolFile(".zip");
+  ASSERT_NE(a, b);
+  ASSERT_EQ("X-Accel-Redirect: /internal/spool/" + a, offload.FormatSpoolRedirection(a));
+
+  Orthanc::Toolbox::WriteFile("a", offload.GetSpoolPath(a));
+  Orthanc::Toolbox::WriteFile("b", offload.GetSpoolPath(b));
+
+  // Make "a" older than the retention delay
+  boost::filesystem::last_write_time(offload.GetSpoolPath(a), time(NULL) - 7200);
+
+  offload.RemoveExpiredSpoolFiles();
+  ASSERT_FALSE(boost::filesystem::exists(offload.GetSpoolPath(a)));
+  ASSERT_TRUE(boost::filesystem::exists(offload.GetSpoolPath(b)));
+}
+
+
+TEST(MultipartReader, Boundary)
+{
+  std::string boundary;
+  ASSERT_TRUE(MultipartReader::ParseBoundary(boundary, "multipart/form-data; boundary=abc"));
+  ASSERT_EQ("abc", boundary);
+  ASSERT_TRUE(MultipartReader::ParseBoundary(boundary, "Multipart/Form-Data;charset=utf-8; Boundary=\"a b\""));
+  ASSERT_EQ("a b", boundary);
+  ASSERT_FALSE(MultipartReader::ParseBoundary(boundary, "multipart/form-data"));
+  ASSERT_FALSE(MultipartReader::ParseBoundary(boundary, "multipart/mixed; boundary=abc"));
+  ASSERT_FALSE(MultipartReader::ParseBoundary(boundary, "application/json"));
+  ASSERT_FALSE(MultipartReader::ParseBoundary(boundary, ""));
+}
+
+
+TEST(MultipartReader, Parse)
+{
+  // The binary content contains partial delimiters
+  std::string image("\xff\xd8\r\n--boun\r\n-\0\r\n\r\n\xff\xd9", 17);
+
+  std::string body = ("preamble\r\n"
+                      "--boundary\r\n"
+                      "Content-Disposition: form-data; name=\"metadata\"\r\n"
+                      "Content-Type: application/json\r\n"
+                      "\r\n"
+                      "{\"Tag\":\"hello\"}\r\n"
+                      "--boundary  \r\n"
+                      "content-disposition: form-data; name=\"image\"; filename=\"photo.jpg\"\r\n"
+                      "content-type: image/jpeg\r\n"
+                      "\r\n" + image + "\r\n"
+                      "--boundary\r\n"
+                      "\r\n"
+                      "\r\n"
+                      "--boundary--\r\n"
+                      "epilogue");
+
+  MultipartReader reader;
+  ASSERT_TRUE(reader.Parse(body.c_str(), body.size(), "boundary"));
+  ASSERT_EQ(3u, reader.GetPartsCount());
+
+  const MultipartReader::Part* metadata = reader.LookupPart("metadata");
+  ASSERT_TRUE(metadata != NULL);
+  ASSERT_EQ("application/json", metadata->GetContentType());
+  ASSERT_TRUE(metadata->GetFileName().empty());
+  ASSERT_EQ("{\"Tag\":\"hello\"}", std::string(metadata->GetData(), metadata->GetSize()));
+
+  const MultipartReader::Part* part = reader.LookupPart("image");
+  ASSERT_TRUE(part != NULL);
+  ASSERT_EQ("image/jpeg", part->GetContentType());
+  ASSERT_EQ("photo.jpg", part->GetFileName());
+  ASSERT_EQ(image, std::string(part->GetData(), part->GetSize()));
+
+  // The parts point into the body
+  ASSERT_TRUE(part->GetData() > body.c_str() &&
+              part->GetData() + part->GetSize() < body.c_str() + body.size());
+
+  ASSERT_TRUE(reader.GetPart(2).GetName().empty());
+  ASSERT_EQ(0u, reader.GetPart(2).GetSize());
+  ASSERT_TRUE(reader.LookupPart("nope") == NULL);
+  ASSERT_THROW(reader.GetPart(3), Orthanc::OrthancException);
+
+  // Without preamble
+  body = "--b\r\nContent-Disposition: form-data; name=\"a\"\r\n\r\n123\r\n--b--";
+  ASSERT_TRUE(reader.Parse(body.c_str(), body.size(), "b"));
+  ASSERT_EQ(1u, reader.GetPartsCount());
+  ASSERT_EQ("123", std::string(reader.GetPart(0).GetData(), reader.GetPart(0).GetSize()));
+
+  // Malformed bodies
+  ASSERT_FALSE(reader.Parse(body.c_str(), body.size(), "c"));
+  ASSERT_FALSE(reader.Parse(body.c_str(), body.size() - 6, "b"));
+  ASSERT_FALSE(reader.Parse(body.c_str(), 20, "b"));
+  ASSERT_FALSE(reader.Parse(NULL, 0, "b"));
+
+  body = "--b\r\nContent-Disposition: form-data; name=\"a\"\r\n123\r\n--b--";
+  ASSERT_FALSE(reader.Parse(body.c_str(), body.size(), "b"));
+
+  body = "--bX\r\n\r\n123\r\n--b--";
+  ASSERT_FALSE(reader.Parse(body.c_str(), body.size(), "b"));
+}
+
+
+TEST(Base64Decoder, Chunks)
+{
+  std::string data;
+  for (unsigned int i = 0; i < 40; i++)
+  {
+    data.push_back(static_cast<char>(i * 37 + 11));
+  }
+
+  for (size_t size = 0; size <= data.size(); size++)
+  {
+    std::string encoded;
+    Orthanc::Toolbox::EncodeBase64(encoded, data.substr(0, size));
+
+    // Split the input at every possible position
+    for (size_t split = 0; split <= encoded.size(); split++)
+    {
+      Base64Decoder decoder;
+      std::string decoded;
+      ASSERT_TRUE(decoder.Decode(decoded, encoded.c_str(), split));
+      ASSERT_TRUE(decoder.Decode(decoded, encoded.c_str() + split, encoded.size() - split));
+      ASSERT_TRUE(decoder.Finish(decoded));
+      ASSERT_EQ(data.substr(0, size), decoded);
+    }
+
+    // Without the padding
+    std::string stripped = encoded.substr(0, encoded.find('='));
+    Base64Decoder decoder;
+    std::string decoded;
+    ASSERT_TRUE(decoder.Decode(decoded, stripped.c_str(), stripped.size()));
+    ASSERT_TRUE(decoder.Finish(decoded));
+    ASSERT_EQ(data.substr(0, size), decoded);
+  }
+
+  const char* invalid[] = { "ab!d", "a===", "ab=c", "abc=abcd", "abcde", "ab==\n" };
+  for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+  {
+    Base64Decoder decoder;
+    std::string decoded;
+    ASSERT_FALSE(decoder.Decode(decoded, invalid[i], strlen(invalid[i])) &&
+                 decoder.Finish(decoded));
+  }
+}
+
+
+TEST(Base64, Equivalence)
+{
+  // Fuzzing of the SIMD kernels against the codec of Orthanc
+  uint32_t seed = 42;
+
+  for (unsigned int round = 0; round < 2000; round++)
+  {
+    seed = seed * 1103515245u + 12345u;
+    std::string data((seed >> 16) % 300, '\0');
+    for (size_t i = 0; i < data.size(); i++)
+    {
+      seed = seed * 1103515245u + 12345u;
+      data[i] = static_cast<char>(seed >> 24);
+    }
+
+    std::string expected;
+    Orthanc::Toolbox::EncodeBase64(expected, data);
+
+    // Random corruption of the encoded data
+    std::string corrupted = expected;
+    if (!corrupted.empty() && round % 2 == 1)
+    {
+      const char invalid[] = { '!', '=', '\n', '-', '\x80', '\0' };
+      seed = seed * 1103515245u + 12345u;
+      corrupted[(seed >> 8) % corrupted.size()] = invalid[(seed >> 24) % sizeof(invalid)];
+    }
+
+    std::string reference;
+    bool isReferenceValid = Base64::Decode(reference, corrupted.c_str(), corrupted.size(), Base64Kernel_Scalar);
+
+    for (unsigned int kernel = Base64Kernel_Scalar; kernel <= Base64Kernel_Avx2; kernel++)
+    {
+      Base64Kernel k = static_cast<Base64Kernel>(kernel);
+      if (!Base64::IsKernelSupported(k))
+      {
+        continue;
+      }
+
+      std::string encoded;
+      Base64::Encode(encoded, data.empty() ? NULL : data.c_str(), data.size(), k);
+      ASSERT_EQ(expected, encoded);
+
+      std::string decoded;
+      ASSERT_TRUE(Base64::Decode(decoded, encoded.c_str(), encoded.size(), k));
+      ASSERT_EQ(data, decoded);
+
+      ASSERT_EQ(isReferenceValid, Base64::Decode(decoded, corrupted.c_str(), corrupted.size(), k));
+      if (isReferenceValid)
+      {
+        ASSERT_EQ(reference, decoded);
+      }
+
+      // Random split of the input of the incremental decoder
+      seed = seed * 1103515245u + 12345u;
+      size_t split = (encoded.empty() ? 0 : (seed >> 8) % encoded.size());
+
+      Base64Decoder decoder(k);
+      decoded.clear();
+      ASSERT_TRUE(decoder.Decode(decoded, encoded.c_str(), split));
+      ASSERT_TRUE(decoder.Decode(decoded, encoded.c_str() + split, encoded.size() - split));
+      ASSERT_TRUE(decoder.Finish(decoded));
+      ASSERT_EQ(data, decoded);
+    }
+  }
+}
+
+
+TEST(PhotoUploadParser, Basic)
+{
+  std::string image;
+  for (unsigned int i = 0; i < 1000; i++)
+  {
+    image.push_back(static_cast<char>(i * 7));
+  }
+
+  std::string encoded;
+  Orthanc::Toolbox::EncodeBase64(encoded, image);
+
+  Json::Value metadata;
+  std::string decoded;
+  bool hasImage;
+
+  std::string body = ("{ \"Tag\" : \"a \\\"b\\\" }\", \"Nested\": { \"x\": [1, {\"ImageData\": 2}] },"
+                      "\"ImageData\":\"" + encoded + "\", \"ImageMime\":\"image/jpeg\", \"Flag\": true }\n");
+  ASSERT_TRUE(PhotoUploadParser::Parse(metadata, decoded, hasImage, body.c_str(), body.size()));
+  ASSERT_TRUE(hasImage);
+  ASSERT_EQ(image, decoded);
+  ASSERT_EQ("a \"b\" }", metadata["Tag"].asString());
+  ASSERT_EQ("image/jpeg", metadata["ImageMime"].asString());
+  ASSERT_EQ(2, metadata["Nested"]["x"][1]["ImageData"].asInt());
+  ASSERT_TRUE(metadata["Flag"].asBool());
+  ASSERT_FALSE(metadata.isMember("ImageData"));
+
+  // Escaped slashes and line breaks, as written by Android
+  std::string escaped;
+  for (size_t i = 0; i < encoded.size(); i++)
+  {
+    if (encoded[i] == '/')
+    {
+      escaped += "\\/";
+    }
+    else
+    {
+      escaped += encoded[i];
+    }
+
+    if (i % 76 == 75)
+    {
+      escaped += "\\n";
+    }
+  }
+
+  ASSERT_NE(std::string::npos, escaped.find("\\/"));
+
+  body = "{\"ImageData\":\"" + escaped + "\\u000a\"}";
+  ASSERT_TRUE(PhotoUploadParser::Parse(metadata, decoded, hasImage, body.c_str(), body.size()));
+  ASSERT_TRUE(hasImage);
+  ASSERT_EQ(image, decoded);
+  ASSERT_EQ(0u, metadata.size());
+
+  // Escaped key
+  body = "{\"Image\\u0044ata\":\"" + encoded + "\"}";
+  ASSERT_TRUE(PhotoUploadParser::Parse(metadata, decoded, hasImage, body.c_str(), body.size()));
+  ASSERT_TRUE(hasImage);
+  ASSERT_EQ(image, decoded);
+
+  // No image
+  body = "{\"Tag\":\"hello\", \"ImageData\": null}";
+  ASSERT_TRUE(PhotoUploadParser::Parse(metadata, decoded, hasImage, body.c_str(), body.size()));
+  ASSERT_FALSE(hasImage);
+  ASSERT_EQ("hello", metadata["Tag"].asString());
+
+  body = "{}";
+  ASSERT_TRUE(PhotoUploadParser::Parse(metadata, decoded, hasImage, body.c_str(), body.size()));
+  ASSERT_FALSE(hasImage);
+
+  // Malformed bodies
+  const char* invalid[] = {
+    "", "[]", "{", "{\"a\"}", "{\"a\":}", "{\"a\":1,}", "{\"a\":1} x", "{\"a\":[1}",
+    "{\"ImageData\":\"ab!d\"}", "{\"ImageData\":\"abcd\\x\"}", "{\"ImageData\":\"a\", \"ImageData\":\"b\"}",
+    "{\"ImageData\":\"abcd\", \"a\":tru}"
+  };
+
+  for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+  {
+    ASSERT_FALSE(PhotoUploadParser::Parse(metadata, decoded, hasImage, invalid[i], strlen(invalid[i])));
+  }
+}
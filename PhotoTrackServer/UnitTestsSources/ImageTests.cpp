@@ -0,0 +1,922 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerTestsPrecompiledHeaders.h"
+
+#include "../ApplicationSources/ContactSheetCache.h"
+#include "../ApplicationSources/DerivedImageCache.h"
+#include "../ApplicationSources/FilesystemImageStorage.h"
+#include "../ApplicationSources/ImagePreview.h"
+#include "../ApplicationSources/ImageResampler.h"
+#include "../ApplicationSources/JpegReader.h"
+#include "../ApplicationSources/JpegRecompressor.h"
+#include "../ApplicationSources/JpegWriter.h"
+#include "../ApplicationSources/PerceptualHash.h"
+#include "../ApplicationSources/TileCache.h"
+#include "../ApplicationSources/Toolbox.h"
+#include "DatabaseTest.h"
+
+#include <Core/OrthancException.h>
+#include <Core/ImageFormats/ImageBuffer.h>
+#include <Core/ImageFormats/PngReader.h>
+#include <Core/ImageFormats/PngWriter.h>
+#include <Core/Toolbox.h>
+#include <gtest/gtest.h>
+#include <boost/filesystem.hpp>
+#include <math.h>
+
+using namespace PhotoTrack;
+
+
+static void FillGradient(Orthanc::ImageAccessor& image)
+{
+  for (unsigned int y = 0; y < image.GetHeight(); y++)
+  {
+    uint8_t* p = reinterpret_cast<uint8_t*>(image.GetRow(y));
+    for (unsigned int x = 0; x < image.GetWidth() * image.GetBytesPerPixel(); x++)
+    {
+      p[x] = static_cast<uint8_t>((x + y * 3) % 256);
+    }
+  }
+}
+
+
+static std::string CreateJpeg(unsigned int width,
+                              unsigned int height)
+{
+  Orthanc::ImageBuffer buffer;
+  buffer.SetFormat(Orthanc::PixelFormat_RGB24);
+  buffer.SetWidth(width);
+  buffer.SetHeight(height);
+
+  Orthanc::ImageAccessor image = buffer.GetAccessor();
+  FillGradient(image);
+
+  std::string jpeg;
+  JpegWriter writer;
+  writer.WriteToMemory(jpeg, image);
+  return jpeg;
+}
+
+
+TEST(ImageResampler, FittingSize)
+{
+  unsigned int w, h;
+  ImageResampler::ComputeFittingSize(w, h, 4000, 3000, 256, 256);
+  ASSERT_EQ(256u, w);  ASSERT_EQ(192u, h);
+
+  ImageResampler::ComputeFittingSize(w, h, 3000, 4000, 256, 256);
+  ASSERT_EQ(192u, w);  ASSERT_EQ(256u, h);
+
+  ImageResampler::ComputeFittingSize(w, h, 4000, 3000, 0, 300);
+  ASSERT_EQ(400u, w);  ASSERT_EQ(300u, h);
+
+  ImageResampler::ComputeFittingSize(w, h, 4000, 3000, 1000, 0);
+  ASSERT_EQ(1000u, w);  ASSERT_EQ(750u, h);
+
+  ImageResampler::ComputeFittingSize(w, h, 100, 50, 256, 256);  // Never enlarge
+  ASSERT_EQ(100u, w);  ASSERT_EQ(50u, h);
+
+  ImageResampler::ComputeFittingSize(w, h, 10000, 1, 100, 100);
+  ASSERT_EQ(100u, w);  ASSERT_EQ(1u, h);
+}
+
+
+TEST(ImageResampler, Area)
+{
+  // 4x2 grayscale image, downscaled to 2x1
+  uint8_t source[] = { 0, 10, 20, 30,
+                       40, 50, 60, 70 };
+  Orthanc::ImageAccessor a;
+  a.AssignReadOnly(Orthanc::PixelFormat_Grayscale8, 4, 2, 4, source);
+
+  uint8_t target[2];
+  Orthanc::ImageAccessor b;
+  b.AssignWritable(Orthanc::PixelFormat_Grayscale8, 2, 1, 2, target);
+
+  ImageResampler::Resample(b, a);
+  ASSERT_EQ(25, target[0]);   // (0 + 10 + 40 + 50) / 4
+  ASSERT_EQ(45, target[1]);   // (20 + 30 + 60 + 70) / 4
+
+  // Uniform RGB image with a non-integer ratio
+  Orthanc::ImageBuffer buffer;
+  buffer.SetFormat(Orthanc::PixelFormat_RGB24);
+  buffer.SetWidth(7);
+  buffer.SetHeight(5);
+  Orthanc::ImageAccessor c = buffer.GetAccessor();
+  for (unsigned int y = 0; y < 5; y++)
+  {
+    uint8_t* p = reinterpret_cast<uint8_t*>(c.GetRow(y));
+    for (unsigned int x = 0; x < 7; x++)
+    {
+      p[3 * x] = 200;
+      p[3 * x + 1] = 100;
+      p[3 * x + 2] = 0;
+    }
+  }
+
+  uint8_t small[3 * 3 * 2];
+  Orthanc::ImageAccessor d;
+  d.AssignWritable(Orthanc::PixelFormat_RGB24, 3, 2, 9, small);
+  ImageResampler::Resample(d, c);
+
+  for (unsigned int i = 0; i < 6; i++)
+  {
+    ASSERT_EQ(200, small[3 * i]);
+    ASSERT_EQ(100, small[3 * i + 1]);
+    ASSERT_EQ(0, small[3 * i + 2]);
+  }
+
+  d.AssignWritable(Orthanc::PixelFormat_Grayscale8, 3, 2, 9, small);
+  ASSERT_THROW(ImageResampler::Resample(d, c), Orthanc::OrthancException);
+}
+
+
+static void FillRandom(Orthanc::ImageAccessor& image,
+                       unsigned int seed)
+{
+  for (unsigned int y = 0; y < image.GetHeight(); y++)
+  {
+    uint8_t* p = reinterpret_cast<uint8_t*>(image.GetRow(y));
+    for (unsigned int x = 0; x < image.GetWidth() * image.GetBytesPerPixel(); x++)
+    {
+      seed = seed * 1103515245u + 12345u;
+      p[x] = static_cast<uint8_t>(seed >> 24);
+    }
+  }
+}
+
+
+TEST(ImageResampler, Lanczos)
+{
+  // A uniform image remains uniform, whatever the scale
+  uint8_t source[13 * 11];
+  memset(source, 77, sizeof(source));
+
+  Orthanc::ImageAccessor a;
+  a.AssignReadOnly(Orthanc::PixelFormat_Grayscale8, 13, 11, 13, source);
+
+  uint8_t target[29 * 5];
+  Orthanc::ImageAccessor b;
+  b.AssignWritable(Orthanc::PixelFormat_Grayscale8, 29, 5, 29, target);
+  ImageResampler::Resample(b, a, ResamplingFilter_Lanczos3);
+
+  for (size_t i = 0; i < sizeof(target); i++)
+  {
+    ASSERT_EQ(77, target[i]);
+  }
+}
+
+
+TEST(ImageResampler, Kernels)
+{
+  // The SIMD kernels must give the very same result as the scalar one
+  ASSERT_TRUE(ImageResampler::IsKernelSupported(ResamplingKernel_Scalar));
+  ASSERT_TRUE(ImageResampler::IsKernelSupported(ImageResampler::GetBestKernel()));
+
+  const Orthanc::PixelFormat formats[] = { 
+    Orthanc::PixelFormat_Grayscale8, Orthanc::PixelFormat_RGB24, Orthanc::PixelFormat_RGBA32 
+  };
+
+  const unsigned int sizes[][4] = { 
+    { 257, 131, 64, 33 },     // Downscaling, with the tails of the SIMD loops
+    { 640, 480, 100, 75 },
+    { 33, 17, 71, 40 },       // Upscaling
+    { 5, 3, 1, 1 }
+  };
+
+  for (unsigned int f = 0; f < 3; f++)
+  {
+    for (unsigned int s = 0; s < 4; s++)
+    {
+      Orthanc::ImageBuffer source;
+      source.SetFormat(formats[f]);
+      source.SetWidth(sizes[s][0]);
+      source.SetHeight(sizes[s][1]);
+      Orthanc::ImageAccessor a = source.GetAccessor();
+      FillRandom(a, f * 10 + s);
+
+      for (unsigned int filter = 0; filter < 2; filter++)
+      {
+        Orthanc::ImageBuffer expected;
+        expected.SetFormat(formats[f]);
+        expected.SetWidth(sizes[s][2]);
+        expected.SetHeight(sizes[s][3]);
+        Orthanc::ImageAccessor b = expected.GetAccessor();
+        ImageResampler::Resample(b, a, static_cast<ResamplingFilter>(filter), ResamplingKernel_Scalar);
+
+        for (unsigned int kernel = ResamplingKernel_Sse2; kernel <= ResamplingKernel_Avx2; kernel++)
+        {
+          if (!ImageResampler::IsKernelSupported(static_cast<ResamplingKernel>(kernel)))
+          {
+            continue;
+          }
+
+          Orthanc::ImageBuffer actual;
+          actual.SetFormat(formats[f]);
+          actual.SetWidth(sizes[s][2]);
+          actual.SetHeight(sizes[s][3]);
+          Orthanc::ImageAccessor c = actual.GetAccessor();
+          ImageResampler::Resample(c, a, static_cast<ResamplingFilter>(filter), static_cast<ResamplingKernel>(kernel));
+
+          ASSERT_EQ(0, memcmp(b.GetConstBuffer(), c.GetConstBuffer(), b.GetSize()));
+        }
+      }
+    }
+  }
+}
+
+
+TEST(JpegCodec, Basic)
+{
+  std::string jpeg = CreateJpeg(64, 48);
+
+  JpegReader reader;
+  reader.ReadFromMemory(jpeg);
+  ASSERT_EQ(Orthanc::PixelFormat_RGB24, reader.GetFormat());
+  ASSERT_EQ(64u, reader.GetWidth());
+  ASSERT_EQ(48u, reader.GetHeight());
+
+  // Scaling in the DCT domain, by a factor 4
+  reader.ReadFromMemory(jpeg, 16, 0);
+  ASSERT_EQ(16u, reader.GetWidth());
+  ASSERT_EQ(12u, reader.GetHeight());
+  ASSERT_EQ(64u, reader.GetOriginalWidth());
+  ASSERT_EQ(48u, reader.GetOriginalHeight());
+
+  reader.ReadFromMemory(jpeg, 20, 20);
+  ASSERT_EQ(32u, reader.GetWidth());
+  ASSERT_EQ(24u, reader.GetHeight());
+
+  ASSERT_THROW(reader.ReadFromMemory(jpeg.substr(0, 10)), Orthanc::OrthancException);
+  ASSERT_THROW(reader.ReadFromMemory(""), Orthanc::OrthancException);
+
+  unsigned int width, height;
+  JpegReader::ReadSize(width, height, jpeg);
+  ASSERT_EQ(64u, width);
+  ASSERT_EQ(48u, height);
+  ASSERT_THROW(JpegReader::ReadSize(width, height, "Hello"), Orthanc::OrthancException);
+
+  JpegWriter writer;
+  ASSERT_THROW(writer.SetQuality(0), Orthanc::OrthancException);
+  ASSERT_THROW(writer.SetQuality(101), Orthanc::OrthancException);
+}
+
+
+TEST_F(DatabaseTest, DerivedImageCache)
+{
+  DerivedImageCache cache(GetPath("Cache"), 2);
+  db_.Register(cache);
+
+  Photo photo;
+  photo.SetSite(site_);
+  db_.CreateOrUpdatePhoto(photo);
+
+  db_.ReplaceImage(photo.GetUuid(), CreateJpeg(640, 480), "image/jpeg");
+  ASSERT_TRUE(db_.GetPhoto(photo, photo.GetUuid()));
+  std::string first = photo.GetImageUuid();
+
+  std::string s;
+  ASSERT_TRUE(cache.GetResizedImage(s, db_, photo, 100, 100));
+  ASSERT_TRUE(Orthanc::Toolbox::IsExistingFile(cache.GetPath(first, 100, 100)));
+
+  // The requested size is rounded up to one of the cached sizes
+  ASSERT_EQ(cache.GetPath(first, 128, 128), cache.GetPath(first, 100, 100));
+  ASSERT_EQ(0u, DerivedImageCache::SnapSize(0));
+  ASSERT_EQ(64u, DerivedImageCache::SnapSize(1));
+  ASSERT_EQ(160u, DerivedImageCache::SnapSize(160));
+  ASSERT_EQ(4096u, DerivedImageCache::SnapSize(4000));
+  ASSERT_THROW(DerivedImageCache::SnapSize(4097), Orthanc::OrthancException);
+
+  JpegReader reader;
+  reader.ReadFromMemory(s);
+  ASSERT_EQ(128u, reader.GetWidth());
+  ASSERT_EQ(96u, reader.GetHeight());
+
+  // Exact DCT scaling, then served from the cache
+  ASSERT_TRUE(cache.GetResizedImage(s, db_, photo, 160, 0));
+  ASSERT_TRUE(cache.GetResizedImage(s, db_, photo, 160, 0));
+  reader.ReadFromMemory(s);
+  ASSERT_EQ(160u, reader.GetWidth());
+  ASSERT_EQ(120u, reader.GetHeight());
+
+  // The image already fits
+  ASSERT_FALSE(cache.GetResizedImage(s, db_, photo, 1000, 1000));
+  ASSERT_FALSE(cache.GetResizedImage(s, db_, photo, 1000, 1000));
+
+  // Replacing the image invalidates the cache
+  Orthanc::ImageBuffer buffer;
+  buffer.SetFormat(Orthanc::PixelFormat_RGBA32);
+  buffer.SetWidth(300);
+  buffer.SetHeight(600);
+  Orthanc::ImageAccessor image = buffer.GetAccessor();
+  FillGradient(image);
+
+  std::string png;
+  Orthanc::PngWriter writer;
+  writer.WriteToMemory(png, image);
+
+  db_.ReplaceImage(photo.GetUuid(), png, "image/png");
+  ASSERT_FALSE(Orthanc::Toolbox::IsExistingFile(cache.GetPath(first, 100, 100)));
+
+  ASSERT_TRUE(db_.GetPhoto(photo, photo.GetUuid()));
+  ASSERT_TRUE(cache.GetResizedImage(s, db_, photo, 100, 100));
+
+  Orthanc::PngReader pngReader;
+  pngReader.ReadFromMemory(s);
+  ASSERT_EQ(Orthanc::PixelFormat_RGBA32, pngReader.GetFormat());
+  ASSERT_EQ(64u, pngReader.GetWidth());
+  ASSERT_EQ(128u, pngReader.GetHeight());
+
+  // Undecodable images are sent as such
+  db_.ReplaceImage(photo.GetUuid(), "Hello", "image/jpeg");
+  ASSERT_TRUE(db_.GetPhoto(photo, photo.GetUuid()));
+  ASSERT_FALSE(cache.GetResizedImage(s, db_, photo, 100, 100));
+
+  db_.DeletePhoto(photo.GetUuid());
+  ASSERT_FALSE(boost::filesystem::exists(boost::filesystem::path(cache.GetPath(photo.GetImageUuid(), 100, 100)).parent_path()));
+}
+
+
+TEST(TilePyramid, Layout)
+{
+  ASSERT_EQ(1u, TilePyramid::ComputeLevelCount(1, 1));
+  ASSERT_EQ(2u, TilePyramid::ComputeLevelCount(2, 1));
+  ASSERT_EQ(9u, TilePyramid::ComputeLevelCount(256, 256));
+  ASSERT_EQ(10u, TilePyramid::ComputeLevelCount(257, 100));
+  ASSERT_EQ(13u, TilePyramid::ComputeLevelCount(4000, 3000));
+
+  boost::filesystem::remove_all("UnitTestsResults/Tiles");
+  boost::filesystem::create_directories("UnitTestsResults/Tiles");
+
+  Orthanc::ImageBuffer buffer;
+  buffer.SetFormat(Orthanc::PixelFormat_RGB24);
+  buffer.SetWidth(600);
+  buffer.SetHeight(400);
+  Orthanc::ImageAccessor image = buffer.GetAccessor();
+  FillGradient(image);
+
+  TilePyramid::Create("UnitTestsResults/Tiles/pyramid", image, TileFormat_Jpeg, 90);
+
+  TilePyramid pyramid("UnitTestsResults/Tiles/pyramid");
+  ASSERT_EQ(600u, pyramid.GetWidth());
+  ASSERT_EQ(400u, pyramid.GetHeight());
+  ASSERT_EQ(TileFormat_Jpeg, pyramid.GetFormat());
+  ASSERT_EQ(11u, pyramid.GetLevelCount());
+
+  ASSERT_EQ(600u, pyramid.GetLevelWidth(10));
+  ASSERT_EQ(300u, pyramid.GetLevelWidth(9));
+  ASSERT_EQ(200u, pyramid.GetLevelHeight(9));
+  ASSERT_EQ(1u, pyramid.GetLevelWidth(0));
+  ASSERT_EQ(1u, pyramid.GetLevelHeight(0));
+  ASSERT_EQ(3u, pyramid.GetTilesCountX(10));
+  ASSERT_EQ(2u, pyramid.GetTilesCountY(10));
+  ASSERT_EQ(2u, pyramid.GetTilesCountX(9));
+  ASSERT_EQ(1u, pyramid.GetTilesCountY(9));
+
+  std::string tile;
+  JpegReader reader;
+
+  ASSERT_TRUE(pyramid.ReadTile(tile, 10, 0, 0));
+  reader.ReadFromMemory(tile);
+  ASSERT_EQ(256u, reader.GetWidth());
+  ASSERT_EQ(256u, reader.GetHeight());
+
+  ASSERT_TRUE(pyramid.ReadTile(tile, 10, 2, 1));   // Bottom-right corner
+  reader.ReadFromMemory(tile);
+  ASSERT_EQ(88u, reader.GetWidth());
+  ASSERT_EQ(144u, reader.GetHeight());
+
+  ASSERT_TRUE(pyramid.ReadTile(tile, 0, 0, 0));
+  reader.ReadFromMemory(tile);
+  ASSERT_EQ(1u, reader.GetWidth());
+  ASSERT_EQ(1u, reader.GetHeight());
+
+  ASSERT_FALSE(pyramid.ReadTile(tile, 10, 3, 0));
+  ASSERT_FALSE(pyramid.ReadTile(tile, 9, 0, 1));
+  ASSERT_FALSE(pyramid.ReadTile(tile, 11, 0, 0));
+
+  Orthanc::Toolbox::WriteFile("nope", "UnitTestsResults/Tiles/corrupted");
+  ASSERT_THROW(TilePyramid p("UnitTestsResults/Tiles/corrupted"), Orthanc::OrthancException);
+}
+
+
+TEST_F(DatabaseTest, TileCache)
+{
+  TileCache cache(db_, GetPath("Tiles"), 1);
+  db_.Register(cache);
+
+  Photo photo;
+  photo.SetSite(site_);
+  db_.CreateOrUpdatePhoto(photo);
+
+  // Lazy building
+  db_.ReplaceImage(photo.GetUuid(), CreateJpeg(300, 200), "image/jpeg");
+  ASSERT_TRUE(db_.GetPhoto(photo, photo.GetUuid()));
+  ASSERT_FALSE(Orthanc::Toolbox::IsExistingFile(cache.GetPath(photo.GetImageUuid())));
+
+  std::auto_ptr<TilePyramid> pyramid(cache.Open(photo));
+  ASSERT_TRUE(pyramid.get() != NULL);
+  ASSERT_EQ(300u, pyramid->GetWidth());
+  ASSERT_EQ(10u, pyramid->GetLevelCount());
+  ASSERT_TRUE(Orthanc::Toolbox::IsExistingFile(cache.GetPath(photo.GetImageUuid())));
+
+  // Background building
+  std::string first = photo.GetImageUuid();
+  cache.Start();
+  db_.ReplaceImage(photo.GetUuid(), CreateJpeg(100, 50), "image/jpeg");
+  ASSERT_FALSE(Orthanc::Toolbox::IsExistingFile(cache.GetPath(first)));
+  ASSERT_TRUE(db_.GetPhoto(photo, photo.GetUuid()));
+
+  for (unsigned int i = 0; i < 100 && !Orthanc::Toolbox::IsExistingFile(cache.GetPath(photo.GetImageUuid())); i++)
+  {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(20));
+  }
+
+  cache.Stop();
+  ASSERT_TRUE(Orthanc::Toolbox::IsExistingFile(cache.GetPath(photo.GetImageUuid())));
+
+  pyramid.reset(cache.Open(photo));
+  ASSERT_EQ(100u, pyramid->GetWidth());
+  ASSERT_EQ(50u, pyramid->GetHeight());
+
+  // No pyramid for the undecodable images
+  db_.ReplaceImage(photo.GetUuid(), "Hello", "image/jpeg");
+  ASSERT_TRUE(db_.GetPhoto(photo, photo.GetUuid()));
+  ASSERT_TRUE(cache.Open(photo) == NULL);
+  ASSERT_TRUE(cache.Open(photo) == NULL);
+}
+
+
+static std::string AddPhoto(DatabaseWrapper& db,
+                            const Site& site,
+                            int64_t time,
+                            const std::string& image,
+                            const std::string& mime)
+{
+  Photo photo;
+  photo.SetSite(site);
+  photo.SetSecondsSinceEpoch(time);
+  db.CreateOrUpdatePhoto(photo);
+
+  if (!image.empty())
+  {
+    db.ReplaceImage(photo.GetUuid(), image, mime);
+  }
+
+  return photo.GetUuid();
+}
+
+
+TEST_F(DatabaseTest, ContactSheetCache)
+{
+  ContactSheetCache cache(db_, GetPath("Sheets"), 1);
+  ASSERT_THROW(cache.SetThumbnailSize(100), Orthanc::OrthancException);
+  cache.SetThumbnailSize(64);
+  cache.SetColumns(4);
+
+  std::string image;
+  Json::Value map;
+  ASSERT_FALSE(cache.GetContactSheet(image, map, site_.GetUuid()));
+
+  Orthanc::ImageBuffer buffer;
+  buffer.SetFormat(Orthanc::PixelFormat_RGBA32);
+  buffer.SetWidth(32);
+  buffer.SetHeight(48);
+  Orthanc::ImageAccessor accessor = buffer.GetAccessor();
+  FillGradient(accessor);
+
+  std::string png;
+  Orthanc::PngWriter writer;
+  writer.WriteToMemory(png, accessor);
+
+  std::string a = AddPhoto(db_, site_, 1, CreateJpeg(300, 200), "image/jpeg");
+  std::string b = AddPhoto(db_, site_, 2, png, "image/png");
+  std::string c = AddPhoto(db_, site_, 3, "Hello", "image/jpeg");
+  std::string d = AddPhoto(db_, site_, 4, "", "");
+
+  ASSERT_TRUE(cache.GetContactSheet(image, map, site_.GetUuid()));
+  ASSERT_TRUE(Orthanc::Toolbox::IsExistingFile(cache.GetPath(site_.GetUuid())));
+
+  // The undecodable image takes a cell, but is not in the map
+  ASSERT_EQ(3u * 64u, map["Width"].asUInt());
+  ASSERT_EQ(64u, map["Height"].asUInt());
+  ASSERT_EQ(2u, map["Photos"].size());
+  ASSERT_FALSE(map["Photos"].isMember(c));
+  ASSERT_FALSE(map["Photos"].isMember(d));
+
+  // The thumbnails are centered in their cell
+  ASSERT_EQ(0u, map["Photos"][a]["X"].asUInt());
+  ASSERT_EQ(64u, map["Photos"][a]["Width"].asUInt());
+  ASSERT_EQ(42u, map["Photos"][a]["Height"].asUInt());
+  ASSERT_EQ(11u, map["Photos"][a]["Y"].asUInt());
+  ASSERT_EQ(64u + 16u, map["Photos"][b]["X"].asUInt());
+  ASSERT_EQ(8u, map["Photos"][b]["Y"].asUInt());
+  ASSERT_EQ(32u, map["Photos"][b]["Width"].asUInt());
+  ASSERT_EQ(48u, map["Photos"][b]["Height"].asUInt());
+
+  JpegReader reader;
+  reader.ReadFromMemory(image);
+  ASSERT_EQ(192u, reader.GetWidth());
+  ASSERT_EQ(64u, reader.GetHeight());
+
+  // Unchanged site
+  std::string version = map["Version"].asString();
+  ASSERT_TRUE(cache.GetContactSheet(image, map, site_.GetUuid()));
+  ASSERT_EQ(version, map["Version"].asString());
+
+  // Incremental rebuild: The remaining photo keeps its cell, and the
+  // new photos fill the holes
+  db_.DeletePhoto(a);
+  std::string e = AddPhoto(db_, site_, 5, CreateJpeg(50, 100), "image/jpeg");
+  std::string f = AddPhoto(db_, site_, 6, CreateJpeg(100, 100), "image/jpeg");
+
+  ASSERT_TRUE(cache.GetContactSheet(image, map, site_.GetUuid()));
+  ASSERT_NE(version, map["Version"].asString());
+  ASSERT_EQ(3u, map["Photos"].size());
+  ASSERT_EQ(64u + 16u, map["Photos"][b]["X"].asUInt());
+  ASSERT_EQ(8u, map["Photos"][b]["Y"].asUInt());
+  ASSERT_EQ(2u * 64u + 16u, map["Photos"][e]["X"].asUInt());
+  ASSERT_EQ(3u * 64u, map["Photos"][f]["X"].asUInt());
+  ASSERT_EQ(4u * 64u, map["Width"].asUInt());
+
+  reader.ReadFromMemory(image);
+  ASSERT_EQ(256u, reader.GetWidth());
+
+  // A new image for a photo invalidates its cell
+  db_.ReplaceImage(b, CreateJpeg(64, 64), "image/jpeg");
+  ASSERT_TRUE(cache.GetContactSheet(image, map, site_.GetUuid()));
+  ASSERT_EQ(0u, map["Photos"][b]["X"].asUInt());
+  ASSERT_EQ(0u, map["Photos"][b]["Y"].asUInt());
+  ASSERT_EQ(3u * 64u, map["Photos"][f]["X"].asUInt());
+  ASSERT_EQ(64u, map["Photos"][b]["Width"].asUInt());
+
+  cache.Invalidate(site_.GetUuid());
+  ASSERT_FALSE(Orthanc::Toolbox::IsExistingFile(cache.GetPath(site_.GetUuid())));
+}
+
+
+TEST_F(DatabaseTest, ImagePreview)
+{
+  std::string preview, hash, png;
+  ASSERT_TRUE(ImagePreview::Create(preview, hash, CreateJpeg(640, 480), "image/jpeg"));
+  ASSERT_LT(preview.size(), 1024u);
+  ASSERT_EQ(16u, hash.size());
+
+  Orthanc::Toolbox::DecodeBase64(png, preview);
+
+  Orthanc::PngReader reader;
+  reader.ReadFromMemory(png);
+  ASSERT_EQ(16u, reader.GetWidth());
+  ASSERT_EQ(12u, reader.GetHeight());
+  ASSERT_EQ(Orthanc::PixelFormat_RGB24, reader.GetFormat());
+
+  ASSERT_FALSE(ImagePreview::Create(preview, hash, "Hello", "image/jpeg"));
+  ASSERT_FALSE(ImagePreview::Create(preview, hash, "Hello", "plain/text"));
+
+  // Decoding from a file gives the same preview
+  std::string fromFile, hashFromFile;
+  Orthanc::Toolbox::WriteFile(CreateJpeg(640, 480), "UnitTestsResults/preview.jpg");
+  ASSERT_TRUE(ImagePreview::CreateFromFile(fromFile, hashFromFile, "UnitTestsResults/preview.jpg", "image/jpeg"));
+  ASSERT_TRUE(ImagePreview::Create(preview, hash, CreateJpeg(640, 480), "image/jpeg"));
+  ASSERT_EQ(preview, fromFile);
+  ASSERT_EQ(hash, hashFromFile);
+  ASSERT_FALSE(ImagePreview::CreateFromFile(fromFile, hashFromFile, "UnitTestsResults/nope.jpg", "image/jpeg"));
+
+  // The previews are computed at upload time, and only embedded in
+  // the listings on request
+  std::string a = AddPhoto(db_, site_, 1, CreateJpeg(100, 200), "image/jpeg");
+  std::string b = AddPhoto(db_, site_, 2, "Hello", "plain/text");
+
+  Photo photo;
+  ASSERT_TRUE(db_.GetPhoto(photo, a));
+  ASSERT_FALSE(photo.GetPreview().empty());
+  ASSERT_TRUE(db_.GetPhoto(photo, b));
+  ASSERT_TRUE(photo.GetPreview().empty());
+
+  Json::Value photos;
+  db_.GetPhotos(photos, site_.GetUuid());
+  ASSERT_EQ(2u, photos.size());
+  ASSERT_FALSE(photos[0].isMember("Preview"));
+  ASSERT_FALSE(photos[1].isMember("Preview"));
+
+  db_.GetPhotos(photos, site_.GetUuid(), true);
+  ASSERT_EQ(2u, photos.size());
+  for (Json::Value::ArrayIndex i = 0; i < photos.size(); i++)
+  {
+    if (photos[i]["Uuid"].asString() == a)
+    {
+      ASSERT_EQ(0u, photos[i]["Preview"].asString().find("data:image/png;base64,"));
+    }
+    else
+    {
+      ASSERT_FALSE(photos[i].isMember("Preview"));
+    }
+  }
+
+  // Updating the photo keeps its preview
+  ASSERT_TRUE(db_.GetPhoto(photo, a));
+  preview = photo.GetPreview();
+  photo.SetTag("Hello");
+  db_.CreateOrUpdatePhoto(photo);
+  ASSERT_TRUE(db_.GetPhoto(photo, a));
+  ASSERT_EQ(preview, photo.GetPreview());
+}
+
+
+static std::string CreateWaves(unsigned int width,
+                               unsigned int height,
+                               double frequency,
+                               uint8_t quality)
+{
+  Orthanc::ImageBuffer buffer;
+  buffer.SetFormat(Orthanc::PixelFormat_RGB24);
+  buffer.SetWidth(width);
+  buffer.SetHeight(height);
+
+  Orthanc::ImageAccessor image = buffer.GetAccessor();
+
+  for (unsigned int y = 0; y < height; y++)
+  {
+    uint8_t* p = reinterpret_cast<uint8_t*>(image.GetRow(y));
+    for (unsigned int x = 0; x < width; x++, p += 3)
+    {
+      // The pattern scales with the image
+      const double u = frequency * static_cast<double>(x) / static_cast<double>(width);
+      const double v = frequency * static_cast<double>(y) / static_cast<double>(height);
+      const double value = 128.0 + 100.0 * sin(u * 6.0 + 1.0) * cos(v * 5.0 + 0.5);
+      p[0] = static_cast<uint8_t>(value);
+      p[1] = static_cast<uint8_t>(value * 0.8);
+      p[2] = static_cast<uint8_t>(255.0 - value);
+    }
+  }
+
+  std::string jpeg;
+  JpegWriter writer;
+  writer.SetQuality(quality);
+  writer.WriteToMemory(jpeg, image);
+  return jpeg;
+}
+
+
+TEST(PerceptualHash, Basic)
+{
+  uint64_t hash;
+  ASSERT_EQ("0123456789abcdef", PerceptualHash::Format(0x0123456789abcdefULL));
+  ASSERT_EQ("0000000000000000", PerceptualHash::Format(0));
+  ASSERT_TRUE(PerceptualHash::Parse(hash, "0123456789ABCDEF"));
+  ASSERT_EQ(0x0123456789abcdefULL, hash);
+  ASSERT_TRUE(PerceptualHash::Parse(hash, "ffffffffffffffff"));
+  ASSERT_EQ(0xffffffffffffffffULL, hash);
+  ASSERT_FALSE(PerceptualHash::Parse(hash, ""));
+  ASSERT_FALSE(PerceptualHash::Parse(hash, "0123456789abcde"));
+  ASSERT_FALSE(PerceptualHash::Parse(hash, "0123456789abcdeg"));
+
+  ASSERT_EQ(0u, PerceptualHash::GetDistance(42, 42));
+  ASSERT_EQ(4u, PerceptualHash::GetDistance(0x0f, 0));
+  ASSERT_EQ(64u, PerceptualHash::GetDistance(0, 0xffffffffffffffffULL));
+
+  // The hash survives the recompression and the resizing
+  JpegReader reader;
+  uint64_t a, b, c;
+  reader.ReadFromMemory(CreateWaves(640, 480, 1.0, 95));
+  ASSERT_TRUE(PerceptualHash::Compute(a, reader));
+  reader.ReadFromMemory(CreateWaves(320, 240, 1.0, 30));
+  ASSERT_TRUE(PerceptualHash::Compute(b, reader));
+  reader.ReadFromMemory(CreateWaves(640, 480, 2.0, 95));
+  ASSERT_TRUE(PerceptualHash::Compute(c, reader));
+
+  ASSERT_LE(PerceptualHash::GetDistance(a, b), 4u);
+  ASSERT_GT(PerceptualHash::GetDistance(a, c), 16u);
+
+  Orthanc::ImageBuffer buffer;
+  buffer.SetFormat(Orthanc::PixelFormat_Grayscale16);
+  buffer.SetWidth(16);
+  buffer.SetHeight(16);
+  ASSERT_FALSE(PerceptualHash::Compute(hash, buffer.GetAccessor()));
+}
+
+
+TEST(PerceptualHash, Kernels)
+{
+  ASSERT_TRUE(PerceptualHash::IsKernelSupported(HammingKernel_Scalar));
+  ASSERT_TRUE(PerceptualHash::IsKernelSupported(PerceptualHash::GetBestKernel()));
+
+  std::vector<uint64_t> hashes(37);
+  uint64_t seed = 42;
+  for (size_t i = 0; i < hashes.size(); i++)
+  {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    hashes[i] = seed;
+  }
+
+  hashes[3] = 0;
+  hashes[4] = 0xffffffffffffffffULL;
+
+  // All the counts, to exercise the tails of the SIMD loops
+  for (size_t count = 0; count <= hashes.size(); count++)
+  {
+    for (unsigned int kernel = HammingKernel_Scalar; kernel <= HammingKernel_Avx2; kernel++)
+    {
+      if (!PerceptualHash::IsKernelSupported(static_cast<HammingKernel>(kernel)))
+      {
+        continue;
+      }
+
+      std::vector<uint8_t> distances(count + 1, 0xff);
+      PerceptualHash::ComputeDistances(&distances[0], hashes[5], &hashes[0], count,
+                                       static_cast<HammingKernel>(kernel));
+
+      for (size_t i = 0; i < count; i++)
+      {
+        ASSERT_EQ(PerceptualHash::GetDistance(hashes[5], hashes[i]), distances[i]);
+      }
+
+      ASSERT_EQ(0xff, distances[count]);
+    }
+  }
+}
+
+
+TEST_F(DatabaseTest, NearDuplicates)
+{
+  std::vector<uint64_t> hashes;
+  hashes.push_back(0x00);
+  hashes.push_back(0x01);
+  hashes.push_back(0xff00000000000000ULL);
+  hashes.push_back(0x03);   // Chained to the first hash through the second one
+  hashes.push_back(0xff00000000000001ULL);
+  hashes.push_back(0x00ff000000000000ULL);
+
+  std::list< std::vector<size_t> > groups;
+  PerceptualHash::Cluster(groups, hashes, 1);
+  ASSERT_EQ(2u, groups.size());
+  ASSERT_EQ(3u, groups.front().size());
+  ASSERT_EQ(0u, groups.front()[0]);
+  ASSERT_EQ(1u, groups.front()[1]);
+  ASSERT_EQ(3u, groups.front()[2]);
+  ASSERT_EQ(2u, groups.back().size());
+  ASSERT_EQ(2u, groups.back()[0]);
+  ASSERT_EQ(4u, groups.back()[1]);
+
+  PerceptualHash::Cluster(groups, hashes, 0);
+  ASSERT_TRUE(groups.empty());
+
+  // The hashes are computed at upload time, and the photos of each
+  // site are grouped in chronological order
+  Site other;
+  db_.CreateOrUpdateSite(other);
+  std::string a = AddPhoto(db_, site_, 3, CreateWaves(640, 480, 1.0, 95), "image/jpeg");
+  std::string b = AddPhoto(db_, site_, 1, CreateWaves(800, 600, 1.0, 60), "image/jpeg");
+  AddPhoto(db_, site_, 2, CreateWaves(640, 480, 2.0, 95), "image/jpeg");
+  AddPhoto(db_, site_, 4, "Hello", "plain/text");
+  AddPhoto(db_, other, 5, CreateWaves(640, 480, 1.0, 95), "image/jpeg");
+
+  uint64_t hash;
+  Photo photo;
+  ASSERT_TRUE(db_.GetPhoto(photo, a));
+  ASSERT_TRUE(PerceptualHash::Parse(hash, photo.GetPerceptualHash()));
+
+  Json::Value json;
+  photo.ToJson(json);
+  ASSERT_EQ(photo.GetPerceptualHash(), json["PerceptualHash"].asString());
+
+  std::list< std::list<std::string> > duplicates;
+  db_.GetSiteNearDuplicates(duplicates, site_.GetUuid(), 10);
+  ASSERT_EQ(1u, duplicates.size());
+  ASSERT_EQ(2u, duplicates.front().size());
+  ASSERT_EQ(b, duplicates.front().front());
+  ASSERT_EQ(a, duplicates.front().back());
+
+  db_.GetSiteNearDuplicates(duplicates, other.GetUuid(), 10);
+  ASSERT_TRUE(duplicates.empty());
+}
+
+
+TEST_F(DatabaseTest, JpegRecompressor)
+{
+  // A camera image at high quality, with an EXIF segment
+  Orthanc::ImageBuffer buffer;
+  buffer.SetFormat(Orthanc::PixelFormat_RGB24);
+  buffer.SetWidth(1000);
+  buffer.SetHeight(800);
+
+  Orthanc::ImageAccessor source = buffer.GetAccessor();
+  FillGradient(source);
+
+  const std::string exif("Exif\0\0MM\0\x2a\0\0\0\x08", 14);
+
+  std::string camera, exif2;
+  JpegWriter writer;
+  writer.SetQuality(100);
+  writer.SetExif(exif);
+  writer.WriteToMemory(camera, source);
+  ASSERT_TRUE(JpegRecompressor::ExtractExif(exif2, camera));
+  ASSERT_EQ(exif, exif2);
+  ASSERT_FALSE(JpegRecompressor::ExtractExif(exif2, CreateJpeg(10, 10)));
+  ASSERT_FALSE(JpegRecompressor::ExtractExif(exif2, "Hello"));
+
+  std::string a = AddPhoto(db_, site_, 1, camera, "image/jpeg");
+  std::string b = AddPhoto(db_, site_, 2, CreateJpeg(200, 100), "image/jpeg");
+  std::string c = AddPhoto(db_, site_, 3, "Hello", "plain/text");
+
+  // The blob of "a" is shared with "d"
+  const std::string cameraHash = PhotoTrack::Toolbox::ComputeSHA1(camera.c_str(), camera.size());
+  std::string d = AddPhoto(db_, site_, 4, "Hello", "plain/text");
+  ASSERT_TRUE(db_.AttachImage(d, cameraHash));
+
+  JpegRecompressor recompressor(db_, 500, 1024 * 1024);
+  recompressor.SetQuality(70);
+  recompressor.SetOriginalsDirectory(GetPath("Originals"));
+
+  Photo photo;
+  ASSERT_TRUE(db_.GetPhoto(photo, a));
+  std::string imageA = photo.GetImageUuid();
+  ASSERT_TRUE(recompressor.Recompress(imageA));
+  ASSERT_FALSE(recompressor.Recompress(imageA));  // Not attached anymore
+
+  std::string s;
+  ASSERT_TRUE(db_.GetPhoto(photo, a));
+  ASSERT_NE(imageA, photo.GetImageUuid());
+  ASSERT_EQ("image/jpeg", photo.GetImageMime());
+  db_.ReadImage(s, photo);
+  ASSERT_LT(s.size(), camera.size());
+  ASSERT_TRUE(JpegRecompressor::ExtractExif(exif2, s));
+  ASSERT_EQ(exif, exif2);
+
+  JpegReader reader;
+  reader.ReadFromMemory(s);
+  ASSERT_EQ(500u, reader.GetWidth());
+  ASSERT_EQ(400u, reader.GetHeight());
+
+  // All the photos sharing the blob are swapped, and the original is
+  // still known by its SHA-1
+  Photo photoD;
+  ASSERT_TRUE(db_.GetPhoto(photoD, d));
+  ASSERT_EQ(photo.GetImageUuid(), photoD.GetImageUuid());
+  ASSERT_EQ(photo.GetImageHash(), photoD.GetImageHash());
+  ASSERT_NE(cameraHash, photo.GetImageHash());
+  ASSERT_FALSE(storage_.Exists(imageA));
+
+  std::list<std::string> hashes;
+  hashes.push_back(cameraHash);
+  std::set<std::string> found;
+  db_.LookupImageHashes(found, hashes);
+  ASSERT_EQ(1u, found.size());
+
+  std::string e = AddPhoto(db_, site_, 5, "Hello", "plain/text");
+  ASSERT_TRUE(db_.AttachImage(e, cameraHash));
+  ASSERT_TRUE(db_.GetPhoto(photoD, e));
+  ASSERT_EQ(photo.GetImageUuid(), photoD.GetImageUuid());
+
+  // The original is kept
+  Orthanc::Toolbox::ReadFile(s, GetPath("Originals/") + cameraHash + ".jpg");
+  ASSERT_EQ(camera, s);
+
+  // Neither too large nor too heavy, or not a JPEG image
+  ASSERT_TRUE(db_.GetPhoto(photo, b));
+  ASSERT_FALSE(recompressor.Recompress(photo.GetImageUuid()));
+  ASSERT_TRUE(db_.GetPhoto(photo, c));
+  ASSERT_FALSE(recompressor.Recompress(photo.GetImageUuid()));
+
+  // The image is only swapped if a photo still has it
+  ASSERT_TRUE(db_.GetPhoto(photo, b));
+  ASSERT_FALSE(db_.SwapImage("nope", camera, "image/jpeg"));
+  ASSERT_TRUE(db_.SwapImage(photo.GetImageUuid(), camera, "image/jpeg"));
+
+  // In the background, as soon as the image is attached
+  recompressor.Start(2);
+  db_.Register(recompressor);
+  db_.ReplaceImage(c, camera, "image/jpeg");
+
+  for (unsigned int i = 0; i < 500; i++)
+  {
+    ASSERT_TRUE(db_.GetPhoto(photo, c));
+    db_.ReadImage(s, photo);
+    if (s != camera)
+    {
+      break;
+    }
+
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+
+  ASSERT_LT(s.size(), camera.size());
+  recompressor.Stop();
+}
@@ -0,0 +1,1110 @@
+/**
+ * Orthanc PhotoTrack
+ * Copyright (C) 2014 - Gregory Art, Jean-Francois Colson, Benjamin
+ * Golinvaux, Sebastien Jodogne
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "ServerTestsPrecompiledHeaders.h"
+
+#include "../ApplicationSources/CachedImageStorage.h"
+#include "../ApplicationSources/FilesystemImageStorage.h"
+#include "../ApplicationSources/HybridImageStorage.h"
+#include "../ApplicationSources/InflatingBlobReader.h"
+#include "../ApplicationSources/IngestQueue.h"
+#include "../ApplicationSources/PackfileStorage.h"
+#include "../ApplicationSources/ProxyOffload.h"
+#include "../ApplicationSources/Sha1Hasher.h"
+#include "../ApplicationSources/SiteArchiver.h"
+#include "../ApplicationSources/StorageMirror.h"
+#include "../ApplicationSources/TieredImageStorage.h"
+#include "../ApplicationSources/Toolbox.h"
+#include "../ApplicationSources/UploadSessions.h"
+#include "../ApplicationSources/ZlibInflater.h"
+#include "DatabaseTest.h"
+
+#include <Core/OrthancException.h>
+#include <Core/Compression/ZlibCompressor.h>
+#include <Core/SQLite/Connection.h>
+#include <Core/SQLite/Statement.h>
+#include <Core/Toolbox.h>
+#include <gtest/gtest.h>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+
+using namespace Orthanc;
+using namespace PhotoTrack;
+
+
+TEST(PackfileStorage, Basic)
+{
+  boost::filesystem::remove_all("UnitTestsResults/Packfiles");
+
+  std::string a, b, c;
+
+  {
+    PackfileStorage storage("UnitTestsResults/Packfiles", DurabilityPolicy_PerWrite);
+    a = storage.Create("Hello");
+    b = storage.Create("");
+    c = storage.Create("World");
+
+    ASSERT_TRUE(storage.Exists(a));
+    ASSERT_TRUE(storage.Exists(b));
+    ASSERT_FALSE(storage.Exists("nope"));
+
+    std::string s;
+    storage.Read(s, a);  ASSERT_EQ("Hello", s);
+    storage.Read(s, b);  ASSERT_EQ("", s);
+    storage.Read(s, c);  ASSERT_EQ("World", s);
+
+    storage.Remove(b);
+    ASSERT_FALSE(storage.Exists(b));
+    ASSERT_THROW(storage.Read(s, b), OrthancException);
+  }
+
+  {
+    // Reopen the index
+    PackfileStorage storage("UnitTestsResults/Packfiles");
+
+    std::string s;
+    storage.Read(s, a);  ASSERT_EQ("Hello", s);
+    storage.Read(s, c);  ASSERT_EQ("World", s);
+    ASSERT_FALSE(storage.Exists(b));
+    ASSERT_EQ(1u, storage.GetSegmentsCount());
+  }
+}
+
+
+TEST(PackfileStorage, Compaction)
+{
+  boost::filesystem::remove_all("UnitTestsResults/Packfiles");
+
+  PackfileStorage storage("UnitTestsResults/Packfiles", DurabilityPolicy_Grouped);
+  storage.SetMaxSegmentSize(100);
+
+  std::vector<std::string> uuids;
+  for (unsigned int i = 0; i < 50; i++)
+  {
+    // 10 bytes per blob, hence 10 blobs per segment
+    uuids.push_back(storage.Create("blob-" + boost::lexical_cast<std::string>(10000 + i)));
+  }
+
+  ASSERT_EQ(5u, storage.GetSegmentsCount());
+
+  // Nothing to compact yet
+  storage.Compact();
+  ASSERT_EQ(5u, storage.GetSegmentsCount());
+
+  // Remove 6 blobs out of 10 in each of the first 4 segments
+  for (unsigned int i = 0; i < 40; i++)
+  {
+    if (i % 10 < 6)
+    {
+      storage.Remove(uuids[i]);
+    }
+  }
+
+  storage.Compact();
+
+  // The 16 remaining blobs of the 4 sealed segments were moved to
+  // 2 new segments, as the last segment was already full
+  ASSERT_EQ(3u, storage.GetSegmentsCount());
+
+  for (unsigned int i = 0; i < 50; i++)
+  {
+    if (i >= 40 || i % 10 >= 6)
+    {
+      std::string s;
+      storage.Read(s, uuids[i]);
+      ASSERT_EQ("blob-" + boost::lexical_cast<std::string>(10000 + i), s);
+    }
+    else
+    {
+      ASSERT_FALSE(storage.Exists(uuids[i]));
+    }
+  }
+}
+
+
+TEST(HybridImageStorage, Dispatch)
+{
+  boost::filesystem::remove_all("UnitTestsResults/Packfiles");
+  boost::filesystem::remove_all("UnitTestsResults/Hybrid");
+
+  PackfileStorage small("UnitTestsResults/Packfiles");
+  FilesystemImageStorage large("UnitTestsResults/Hybrid");
+  HybridImageStorage storage(small, large, 4);
+
+  std::string a = storage.Create("abcd");
+  std::string b = storage.Create("abcde");
+
+  ASSERT_TRUE(small.Exists(a));
+  ASSERT_FALSE(large.Exists(a));
+  ASSERT_FALSE(small.Exists(b));
+  ASSERT_TRUE(large.Exists(b));
+
+  std::string s;
+  storage.Read(s, a);  ASSERT_EQ("abcd", s);
+  storage.Read(s, b);  ASSERT_EQ("abcde", s);
+
+  storage.Remove(a);
+  storage.Remove(b);
+  ASSERT_FALSE(storage.Exists(a));
+  ASSERT_FALSE(storage.Exists(b));
+}
+
+
+TEST(TieredImageStorage, Archive)
+{
+  boost::filesystem::remove_all("UnitTestsResults/Hot");
+  boost::filesystem::remove_all("UnitTestsResults/Cold");
+
+  FilesystemImageStorage hot("UnitTestsResults/Hot");
+  TieredImageStorage storage(hot, "UnitTestsResults/Cold");
+
+  std::string a = storage.Create("Hello");
+  std::string b = storage.Create("");
+  std::string c = storage.Create("World");
+
+  std::list<std::string> lst;
+  lst.push_back(a);
+  lst.push_back(b);
+  lst.push_back("00000000-0000-0000-0000-000000000000");  // Unknown blob
+  ASSERT_EQ(2u, storage.Archive("site", lst));
+
+  ASSERT_TRUE(storage.IsArchived(a));
+  ASSERT_TRUE(storage.IsArchived(b));
+  ASSERT_FALSE(storage.IsArchived(c));
+  ASSERT_FALSE(hot.Exists(a));
+  ASSERT_TRUE(storage.Exists(a));
+
+  std::string s;
+  storage.Read(s, a);  ASSERT_EQ("Hello", s);
+  storage.Read(s, b);  ASSERT_EQ("", s);
+  storage.Read(s, c);  ASSERT_EQ("World", s);
+
+  // Archiving twice does nothing
+  ASSERT_EQ(0u, storage.Archive("site", lst));
+
+  storage.Remove(a);
+  storage.Remove(b);
+  storage.Remove(c);
+  ASSERT_FALSE(storage.Exists(a));
+  ASSERT_FALSE(storage.Exists(b));
+  ASSERT_FALSE(storage.Exists(c));
+}
+
+
+TEST(SiteArchiver, ClosedSites)
+{
+  boost::filesystem::remove_all("UnitTestsResults/Hot");
+  boost::filesystem::remove_all("UnitTestsResults/Cold");
+  Toolbox::RemoveFile("UnitTestsResults/archiver.db");
+
+  FilesystemImageStorage hot("UnitTestsResults/Hot");
+  TieredImageStorage storage(hot, "UnitTestsResults/Cold");
+  DatabaseWrapper db("UnitTestsResults/archiver.db", storage);
+
+  Site open, closed;
+  open.SetStatus(SiteStatus_Open);
+  open.SetSecondsSinceEpoch(1000);
+  closed.SetStatus(SiteStatus_Closed);
+  closed.SetSecondsSinceEpoch(1000);
+  db.CreateOrUpdateSite(open);
+  db.CreateOrUpdateSite(closed);
+
+  Photo photo1, photo2;
+  photo1.SetSite(open);
+  photo1.SetSecondsSinceEpoch(2000);
+  photo2.SetSite(closed);
+  photo2.SetSecondsSinceEpoch(2000);
+  db.CreateOrUpdatePhoto(photo1);
+  db.CreateOrUpdatePhoto(photo2);
+  db.ReplaceImage(photo1.GetUuid(), "open", "plain/text");
+  db.ReplaceImage(photo2.GetUuid(), "closed", "plain/text");
+
+  // The photos were taken long ago
+  SiteArchiver archiver(db, storage, 3600);
+  ASSERT_EQ(1u, archiver.ArchiveClosedSites());
+  ASSERT_EQ(0u, archiver.ArchiveClosedSites());
+
+  db.GetPhoto(photo1, photo1.GetUuid());
+  db.GetPhoto(photo2, photo2.GetUuid());
+  ASSERT_FALSE(storage.IsArchived(photo1.GetImageUuid()));
+  ASSERT_TRUE(storage.IsArchived(photo2.GetImageUuid()));
+
+  std::string s;
+  storage.Read(s, photo2.GetImageUuid());
+  ASSERT_EQ("closed", s);
+
+  // Removing the photo also removes its archived image
+  db.DeletePhoto(photo2.GetUuid());
+  ASSERT_FALSE(storage.Exists(photo2.GetImageUuid()));
+}
+
+
+TEST(Compression, Policy)
+{
+  std::string text;
+  for (unsigned int i = 0; i < 1000; i++)
+  {
+    text += "Hello world ";
+  }
+
+  std::string noise;
+  for (unsigned int i = 0; i < 4096; i++)
+  {
+    noise.push_back(static_cast<char>(rand() % 256));
+  }
+
+  ASSERT_TRUE(PhotoTrack::Toolbox::IsCompressibleImage("plain/text", text));
+  ASSERT_TRUE(PhotoTrack::Toolbox::IsCompressibleImage("image/png", text));
+  ASSERT_FALSE(PhotoTrack::Toolbox::IsCompressibleImage("image/jpeg", text));
+  ASSERT_FALSE(PhotoTrack::Toolbox::IsCompressibleImage("image/png", noise));
+  ASSERT_FALSE(PhotoTrack::Toolbox::IsCompressibleImage("plain/text", "Hello"));
+}
+
+
+TEST(Compression, Inflater)
+{
+  std::string s;
+  for (unsigned int i = 0; i < 100000; i++)
+  {
+    s += boost::lexical_cast<std::string>(i);
+  }
+
+  std::string compressed;
+  ZlibCompressor compressor;
+  compressor.Compress(compressed, s);
+
+  ZlibInflater inflater(compressed.c_str(), compressed.size());
+  ASSERT_EQ(s.size(), inflater.GetUncompressedSize());
+
+  std::string chunk, result;
+  while (inflater.ReadChunk(chunk, 1000))
+  {
+    ASSERT_GE(1000u, chunk.size());
+    result += chunk;
+  }
+
+  ASSERT_EQ(s, result);
+
+  // Random access to the uncompressed content
+  InflatingBlobReader reader(compressed);
+  ASSERT_EQ(s.size(), reader.GetSize());
+
+  std::string buffer(10, '\0');
+  reader.Read(&buffer[0], 10, 200000);
+  ASSERT_EQ(s.substr(200000, 10), buffer);
+  reader.Read(&buffer[0], 10, 100);   // Backward
+  ASSERT_EQ(s.substr(100, 10), buffer);
+  reader.Read(&buffer[0], 10, s.size() - 10);
+  ASSERT_EQ(s.substr(s.size() - 10), buffer);
+  ASSERT_THROW(reader.Read(&buffer[0], 10, s.size() - 5), OrthancException);
+}
+
+
+TEST_F(DatabaseTest, Compression)
+{
+  Photo photo;
+  photo.SetSite(site_);
+  db_.CreateOrUpdatePhoto(photo);
+
+  std::string text(10000, 'a'), s;
+  db_.ReplaceImage(photo.GetUuid(), text, "plain/text");
+  ASSERT_TRUE(db_.GetPhoto(photo, photo.GetUuid()));
+  ASSERT_EQ(CompressionType_Zlib, photo.GetImageCompression());
+  storage_.Read(s, photo.GetImageUuid());
+  ASSERT_GT(text.size(), s.size());
+  db_.ReadImage(s, photo);
+  ASSERT_EQ(text, s);
+
+  Photo photo2;
+  ASSERT_TRUE(db_.GetPhotoFromImage(photo2, photo.GetImageUuid()));
+  ASSERT_EQ(photo.GetUuid(), photo2.GetUuid());
+  ASSERT_FALSE(db_.GetPhotoFromImage(photo2, ""));
+
+  db_.ReplaceImage(photo.GetUuid(), text, "image/jpeg");
+  ASSERT_TRUE(db_.GetPhoto(photo, photo.GetUuid()));
+  ASSERT_EQ(CompressionType_None, photo.GetImageCompression());
+  db_.ReadImage(s, photo);
+  ASSERT_EQ(text, s);
+}
+
+
+static void WriteBlobs(FilesystemImageStorage* storage,
+                       std::list<std::string>* uuids,
+                       boost::mutex* mutex)
+{
+  for (unsigned int i = 0; i < 10; i++)
+  {
+    std::string uuid = storage->Create("Hello " + boost::lexical_cast<std::string>(i));
+
+    boost::mutex::scoped_lock lock(*mutex);
+    uuids->push_back(uuid);
+  }
+}
+
+
+TEST(Toolbox, SHA1)
+{
+  std::string hash;
+  ASSERT_EQ("a9993e364706816aba3e25717850c26c9cd0d89d", PhotoTrack::Toolbox::ComputeSHA1("abc", 3));
+  ASSERT_EQ("da39a3ee5e6b4b0d3255bfef95601890afd80709", PhotoTrack::Toolbox::ComputeSHA1(NULL, 0));
+
+  {
+    // The padding spans two blocks, and the input is split across blocks
+    std::string s = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    PhotoTrack::Sha1Hasher sha1;
+    sha1.Update(s.c_str(), 10);
+    sha1.Update(s.c_str() + 10, s.size() - 10);
+    ASSERT_EQ("84983e441c3bd26ebaae4aa1f95129e5e54670f1", sha1.Finish());
+    ASSERT_THROW(sha1.Finish(), OrthancException);
+  }
+
+  {
+    std::string s(1000000, 'a');
+    ASSERT_EQ("34aa973cd4c4daa4f61eeb2bdbad27316534016f", PhotoTrack::Toolbox::ComputeSHA1(s.c_str(), s.size()));
+  }
+
+  ASSERT_TRUE(PhotoTrack::Toolbox::ParseSHA1(hash, "A9993E364706816ABA3E25717850C26C9CD0D89D"));
+  ASSERT_EQ("a9993e364706816aba3e25717850c26c9cd0d89d", hash);
+  ASSERT_TRUE(PhotoTrack::Toolbox::ParseSHA1(hash, "a9993e36-4706816a-ba3e2571-7850c26c-9cd0d89d"));
+  ASSERT_EQ("a9993e364706816aba3e25717850c26c9cd0d89d", hash);
+  ASSERT_FALSE(PhotoTrack::Toolbox::ParseSHA1(hash, "a9993e364706816aba3e25717850c26c9cd0d89"));
+  ASSERT_FALSE(PhotoTrack::Toolbox::ParseSHA1(hash, "a9993e364706816aba3e25717850c26c9cd0d89g"));
+  ASSERT_FALSE(PhotoTrack::Toolbox::ParseSHA1(hash, "a9993e36-706816ab-a3e25717-850c26c9-cd0d89d"));
+  ASSERT_FALSE(PhotoTrack::Toolbox::ParseSHA1(hash, ""));
+}
+
+
+TEST_F(DatabaseTest, ImageHash)
+{
+  Photo a, b, c;
+  a.SetSite(site_);
+  b.SetSite(site_);
+  c.SetSite(site_);
+  db_.CreateOrUpdatePhoto(a);
+  db_.CreateOrUpdatePhoto(b);
+  db_.CreateOrUpdatePhoto(c);
+
+  std::string text(10000, 'a');
+  std::string hash = PhotoTrack::Toolbox::ComputeSHA1(text.c_str(), text.size());
+  db_.ReplaceImage(a.GetUuid(), text, "plain/text");
+  ASSERT_TRUE(db_.GetPhoto(a, a.GetUuid()));
+  ASSERT_EQ(hash, a.GetImageHash());
+
+  std::list<std::string> hashes;
+  hashes.push_back(hash);
+  hashes.push_back(PhotoTrack::Toolbox::ComputeSHA1("nope", 4));
+
+  std::set<std::string> found;
+  db_.LookupImageHashes(found, hashes);
+  ASSERT_EQ(1u, found.size());
+  ASSERT_EQ(hash, *found.begin());
+
+  // Attach the stored image to other photos, without uploading it
+  ASSERT_FALSE(db_.AttachImage(b.GetUuid(), hashes.back()));
+  ASSERT_THROW(db_.AttachImage("nope", hash), OrthancException);
+  ASSERT_TRUE(db_.AttachImage(b.GetUuid(), hash));
+  ASSERT_TRUE(db_.AttachImage(c.GetUuid(), hash));
+  ASSERT_TRUE(db_.GetPhoto(b, b.GetUuid()));
+  ASSERT_EQ(a.GetImageUuid(), b.GetImageUuid());
+  ASSERT_EQ("plain/text", b.GetImageMime());
+  ASSERT_EQ(CompressionType_Zlib, b.GetImageCompression());
+  ASSERT_EQ(hash, b.GetImageHash());
+
+  std::string s;
+  db_.ReadImage(s, b);
+  ASSERT_EQ(text, s);
+
+  std::list<std::string> images;
+  db_.GetSiteImages(images, site_.GetUuid());
+  ASSERT_EQ(1u, images.size());
+
+  // The shared blob is only removed with its last photo
+  db_.DeletePhoto(a.GetUuid());
+  ASSERT_TRUE(storage_.Exists(b.GetImageUuid()));
+  db_.ReplaceImage(c.GetUuid(), "Hello", "plain/text");
+  ASSERT_TRUE(storage_.Exists(b.GetImageUuid()));
+  db_.DeletePhoto(b.GetUuid());
+  ASSERT_FALSE(storage_.Exists(b.GetImageUuid()));
+
+  found.clear();
+  db_.LookupImageHashes(found, hashes);
+  ASSERT_TRUE(found.empty());
+
+  // The photo is only created if its image is stored
+  Photo d;
+  d.SetSite(site_);
+  ASSERT_FALSE(db_.CreatePhotoWithImage(d, hash));
+  ASSERT_FALSE(db_.GetPhoto(d, d.GetUuid()));
+  ASSERT_TRUE(db_.CreatePhotoWithImage(d, PhotoTrack::Toolbox::ComputeSHA1("Hello", 5)));
+  ASSERT_TRUE(db_.GetPhoto(c, c.GetUuid()));
+  ASSERT_TRUE(db_.GetPhoto(d, d.GetUuid()));
+  ASSERT_EQ(c.GetImageUuid(), d.GetImageUuid());
+}
+
+
+TEST(Database, Upgrade)
+{
+  boost::filesystem::remove_all("UnitTestsResults/Upgrade");
+  boost::filesystem::create_directories("UnitTestsResults/Upgrade");
+
+  const std::string path = "UnitTestsResults/Upgrade/index.db";
+
+  {
+    // Schema of the first releases, without any version
+    SQLite::Connection legacy;
+    legacy.Open(path);
+    legacy.Execute("CREATE TABLE Sites(uuid TEXT PRIMARY KEY, pitNumber TEXT, name TEXT, "
+                   "secondsSinceEpoch INTEGER, latitude REAL, longitude REAL, address TEXT, status INTEGER);");
+    legacy.Execute("CREATE TABLE Photos(uuid TEXT PRIMARY KEY, imageUuid TEXT, imageMime TEXT, "
+                   "latitude REAL, longitude REAL, secondsSinceEpoch INTEGER, tag TEXT, "
+                   "siteUuid TEXT REFERENCES Sites(uuid) ON DELETE CASCADE);");
+    legacy.Execute("CREATE TABLE Users(uuid TEXT PRIMARY KEY, username TEXT, password TEXT, fullName TEXT, "
+                   "email TEXT, isSupervisor INT, isAdmin INT, organization TEXT);");
+    legacy.Execute("CREATE TABLE UserSiteMap(user TEXT REFERENCES Users(uuid) ON DELETE CASCADE, "
+                   "site TEXT REFERENCES Sites(uuid) ON DELETE CASCADE);");
+    legacy.Execute("CREATE TABLE Changes(seq INTEGER PRIMARY KEY AUTOINCREMENT, changeType INTEGER, "
+                   "photoUuid TEXT REFERENCES Photos(uuid) ON DELETE CASCADE, date TEXT);");
+    legacy.Execute("CREATE TRIGGER PhotoDeleted AFTER DELETE ON Photos BEGIN "
+                   "SELECT SignalImageDeleted(old.imageUuid); END;");
+    legacy.Execute("INSERT INTO Sites VALUES('site', '42', 'Site', 0, NULL, NULL, '', 0);");
+    legacy.Execute("INSERT INTO Photos VALUES('photo', '', 'image/jpeg', NULL, NULL, 10, 'Tag', 'site');");
+  }
+
+  FilesystemImageStorage storage("UnitTestsResults/Upgrade/Storage");
+
+  for (unsigned int i = 0; i < 2; i++)   // The upgrade is only done once
+  {
+    DatabaseWrapper db(path, storage);
+
+    Photo photo;
+    ASSERT_TRUE(db.GetPhoto(photo, "photo"));
+    ASSERT_EQ("Tag", photo.GetTag());
+
+    if (i == 0)
+    {
+      ASSERT_EQ(CompressionType_None, photo.GetImageCompression());
+      ASSERT_TRUE(photo.GetPreview().empty());
+      ASSERT_TRUE(photo.GetImageHash().empty());
+    }
+
+    std::string text(1000, 'a');
+    db.ReplaceImage("photo", text, "plain/text");
+    ASSERT_TRUE(db.GetPhoto(photo, "photo"));
+    ASSERT_EQ(CompressionType_Zlib, photo.GetImageCompression());
+    ASSERT_EQ(PhotoTrack::Toolbox::ComputeSHA1(text.c_str(), text.size()), photo.GetImageHash());
+
+    Photo other;
+    other.SetSiteUuid("site");
+    db.CreateOrUpdatePhoto(other);
+    ASSERT_TRUE(db.AttachImage(other.GetUuid(), photo.GetImageHash()));
+
+    // The new trigger keeps the shared blobs
+    db.DeletePhoto(other.GetUuid());
+    ASSERT_TRUE(storage.Exists(photo.GetImageUuid()));
+
+    std::string answer;
+    ASSERT_EQ(IdempotencyKeyStatus_New, db.ReserveIdempotencyKey(answer, "key", "fingerprint"));
+    db.ReleaseIdempotencyKey("key");
+  }
+
+  {
+    SQLite::Connection db;
+    db.Open(path);
+    db.Execute("UPDATE GlobalProperties SET value='4' WHERE property='SchemaVersion'");
+  }
+
+  ASSERT_THROW(DatabaseWrapper(path, storage), OrthancException);
+}
+
+
+TEST_F(DatabaseTest, ReplaceImageFromFile)
+{
+  boost::filesystem::create_directories(GetPath("Uploads"));
+
+  Photo photo;
+  photo.SetSite(site_);
+  db_.CreateOrUpdatePhoto(photo);
+
+  std::string image;
+  for (unsigned int i = 0; i < 1000; i++)
+  {
+    image.push_back(static_cast<char>(i * 13));
+  }
+
+  const std::string body = GetPath("Uploads/body");
+  Orthanc::Toolbox::WriteFile(image, body);
+  ASSERT_EQ(PhotoTrack::Toolbox::ComputeSHA1(image.c_str(), image.size()),
+            PhotoTrack::Toolbox::ComputeFileSHA1(body));
+
+  // Only the files of the upload directory can be given by the proxy
+  ProxyOffload offload(ProxyOffloadMode_AccelRedirect, GetPath("Storage"), "/storage/");
+  ASSERT_FALSE(offload.IsUploadFile(body));
+  ASSERT_FALSE(offload.IsUploadSecret(""));
+  ASSERT_THROW(offload.SetUploadRoot(GetPath("Uploads"), ""), OrthancException);
+  offload.SetUploadRoot(GetPath("Uploads"), "secret");
+  ASSERT_TRUE(offload.IsUploadFile(body));
+  ASSERT_FALSE(offload.IsUploadFile(GetPath("Uploads/../index.db")));
+  ASSERT_FALSE(offload.IsUploadFile(GetPath("Uploads/nope")));
+  ASSERT_FALSE(offload.IsUploadFile(GetPath("Uploads")));
+
+  // The header of the proxy must come with the shared secret
+  ASSERT_TRUE(offload.IsUploadSecret("secret"));
+  ASSERT_FALSE(offload.IsUploadSecret("secreT"));
+  ASSERT_FALSE(offload.IsUploadSecret("secret2"));
+  ASSERT_FALSE(offload.IsUploadSecret(""));
+
+  // The files left over by the previous requests are rejected
+  const std::string old = GetPath("Uploads/old");
+  Orthanc::Toolbox::WriteFile(image, old);
+  boost::filesystem::last_write_time(old, time(NULL) - 3600);
+  ASSERT_FALSE(offload.IsUploadFile(old));
+
+  // The file is moved to the storage area
+  db_.ReplaceImageFromFile(photo.GetUuid(), body, "application/octet-stream");
+  ASSERT_FALSE(boost::filesystem::exists(body));
+
+  std::string s;
+  ASSERT_TRUE(db_.GetPhoto(photo, photo.GetUuid()));
+  ASSERT_EQ("application/octet-stream", photo.GetImageMime());
+  ASSERT_EQ(CompressionType_None, photo.GetImageCompression());
+  ASSERT_EQ(PhotoTrack::Toolbox::ComputeSHA1(image.c_str(), image.size()), photo.GetImageHash());
+  db_.ReadImage(s, photo);
+  ASSERT_EQ(image, s);
+
+  // The compressible images go through the memory
+  Orthanc::Toolbox::WriteFile(std::string(1000, 'a'), body);
+  db_.ReplaceImageFromFile(photo.GetUuid(), body, "plain/text");
+  ASSERT_FALSE(boost::filesystem::exists(body));
+
+  ASSERT_TRUE(db_.GetPhoto(photo, photo.GetUuid()));
+  ASSERT_EQ(CompressionType_Zlib, photo.GetImageCompression());
+  db_.ReadImage(s, photo);
+  ASSERT_EQ(std::string(1000, 'a'), s);
+
+  // Unknown photo: The blob is not kept
+  Orthanc::Toolbox::WriteFile(image, body);
+  ASSERT_THROW(db_.ReplaceImageFromFile("nope", body, "application/octet-stream"), OrthancException);
+  ASSERT_FALSE(boost::filesystem::exists(body));
+}
+
+TEST(FilesystemImageStorage, Durability)
+{
+  const DurabilityPolicy policies[] = {
+    DurabilityPolicy_PerWrite, DurabilityPolicy_Grouped, DurabilityPolicy_OsBuffered
+  };
+
+  for (unsigned int i = 0; i < 3; i++)
+  {
+    boost::filesystem::remove_all("UnitTestsResults/Durability");
+    FilesystemImageStorage storage("UnitTestsResults/Durability", policies[i]);
+    ASSERT_EQ(policies[i], storage.GetDurabilityPolicy());
+
+    std::list<std::string> uuids;
+    boost::mutex mutex;
+
+    boost::thread_group threads;
+    for (unsigned int j = 0; j < 4; j++)
+    {
+      threads.create_thread(boost::bind(WriteBlobs, &storage, &uuids, &mutex));
+    }
+
+    threads.join_all();
+
+    ASSERT_EQ(40u, uuids.size());
+    for (std::list<std::string>::const_iterator
+           it = uuids.begin(); it != uuids.end(); ++it)
+    {
+      std::string s;
+      ASSERT_TRUE(storage.Exists(*it));
+      storage.Read(s, *it);
+      ASSERT_EQ(0u, s.find("Hello "));
+    }
+  }
+
+  ASSERT_EQ(DurabilityPolicy_Grouped, StringToDurabilityPolicy("Grouped"));
+  ASSERT_THROW(StringToDurabilityPolicy("Nope"), OrthancException);
+}
+
+
+TEST(StorageMirror, Replication)
+{
+  boost::filesystem::remove_all("UnitTestsResults/Mirror");
+  boost::filesystem::create_directories("UnitTestsResults/Mirror");
+
+  FilesystemImageStorage storage("UnitTestsResults/Mirror/Primary");
+  DatabaseWrapper db("UnitTestsResults/Mirror/index.db", storage);
+
+  std::string first, second;
+
+  {
+    StorageMirror mirror(storage, "UnitTestsResults/Mirror/Secondary", "UnitTestsResults/Mirror/queue.db");
+    db.Register(mirror);
+
+    Site site;
+    db.CreateOrUpdateSite(site);
+
+    Photo photo;
+    photo.SetSite(site);
+    db.CreateOrUpdatePhoto(photo);
+
+    db.ReplaceImage(photo.GetUuid(), "Hello", "image/jpeg");
+    ASSERT_TRUE(db.GetPhoto(photo, photo.GetUuid()));
+    first = photo.GetImageUuid();
+    ASSERT_EQ(1u, mirror.GetQueueSize());
+
+    db.ReplaceImage(photo.GetUuid(), "World", "image/jpeg");
+    ASSERT_TRUE(db.GetPhoto(photo, photo.GetUuid()));
+    second = photo.GetImageUuid();
+    ASSERT_EQ(3u, mirror.GetQueueSize());   // Copy, remove, copy
+  }
+
+  // The queue survives the restarts
+  StorageMirror mirror(storage, "UnitTestsResults/Mirror/Secondary", "UnitTestsResults/Mirror/queue.db");
+  ASSERT_EQ(3u, mirror.GetQueueSize());
+  mirror.SetMaxBandwidth(1024 * 1024);
+  ASSERT_EQ(3u, mirror.ProcessQueue());
+  ASSERT_EQ(0u, mirror.GetQueueSize());
+
+  ASSERT_FALSE(Toolbox::IsExistingFile(mirror.GetPath(first)));
+
+  std::string s;
+  Toolbox::ReadFile(s, mirror.GetPath(second));
+  ASSERT_EQ("World", s);
+}
+
+
+static std::string ReadByChunks(IImageStorage& storage,
+                                const std::string& uuid)
+{
+  std::auto_ptr<IBlobReader> reader(storage.OpenBlob(uuid));
+
+  std::string result;
+  char buffer[3];
+
+  for (uint64_t pos = 0; pos < reader->GetSize(); pos += sizeof(buffer))
+  {
+    size_t n = static_cast<size_t>(std::min<uint64_t>(sizeof(buffer), reader->GetSize() - pos));
+    reader->Read(buffer, n, pos);
+    result.append(buffer, n);
+  }
+
+  char c;
+  EXPECT_THROW(reader->Read(&c, 1, reader->GetSize()), OrthancException);
+
+  return result;
+}
+
+
+TEST(ImageStorage, OpenBlob)
+{
+  boost::filesystem::remove_all("UnitTestsResults/Streaming");
+
+  FilesystemImageStorage files("UnitTestsResults/Streaming/Files");
+  PackfileStorage packfiles("UnitTestsResults/Streaming/Packfiles");
+  HybridImageStorage hybrid(packfiles, files, 10);
+  TieredImageStorage storage(hybrid, "UnitTestsResults/Streaming/Cold");
+
+  std::string a = storage.Create("Hello");
+  std::string b = storage.Create("Hello world, this is a large blob");
+  std::string c = storage.Create("Archived blob");
+  ASSERT_TRUE(packfiles.Exists(a));
+  ASSERT_TRUE(files.Exists(b));
+
+  std::list<std::string> lst;
+  lst.push_back(c);
+  ASSERT_EQ(1u, storage.Archive("site", lst));
+
+  ASSERT_EQ("Hello", ReadByChunks(storage, a));
+  ASSERT_EQ("Hello world, this is a large blob", ReadByChunks(storage, b));
+  ASSERT_EQ("Archived blob", ReadByChunks(storage, c));
+
+  // A reader remains valid after the removal of its blob
+  std::auto_ptr<IBlobReader> reader(storage.OpenBlob(b));
+  storage.Remove(b);
+  ASSERT_FALSE(storage.Exists(b));
+
+  char buffer[5];
+  reader->Read(buffer, 5, 0);
+  ASSERT_EQ("Hello", std::string(buffer, 5));
+}
+
+
+TEST(ImageCache, Lru)
+{
+  ImageCache cache(30, 10, 1);
+
+  ImageCache::Content a(new std::string(10, 'a'));
+  ImageCache::Content b(new std::string(10, 'b'));
+  ImageCache::Content c(new std::string(10, 'c'));
+  ImageCache::Content d(new std::string(10, 'd'));
+  ImageCache::Content big(new std::string(11, 'x'));
+
+  cache.Store("a", a);
+  cache.Store("b", b);
+  cache.Store("c", c);
+  cache.Store("big", big);  // Not admitted
+
+  ImageCache::Content s;
+  ASSERT_TRUE(cache.Lookup(s, "a"));  // "b" becomes the least recently used
+  ASSERT_EQ(a, s);
+
+  cache.Store("d", d);
+  ASSERT_FALSE(cache.Lookup(s, "b"));
+  ASSERT_FALSE(cache.Lookup(s, "big"));
+  ASSERT_TRUE(cache.Lookup(s, "c"));
+  ASSERT_TRUE(cache.Lookup(s, "d"));
+
+  cache.Invalidate("d");
+  ASSERT_FALSE(cache.Lookup(s, "d"));
+
+  // A content read before a concurrent invalidation is not inserted
+  ImageCache::Generation generation;
+  ASSERT_FALSE(cache.Lookup(s, generation, "b"));
+  cache.Invalidate("b");
+  cache.Store("b", b, generation);
+  ASSERT_FALSE(cache.Lookup(s, "b"));
+
+  Json::Value v;
+  cache.GetStatistics(v);
+  ASSERT_EQ(3u, v["Hits"].asUInt());
+  ASSERT_EQ(5u, v["Misses"].asUInt());
+  ASSERT_EQ(20u, v["Size"].asUInt());
+  ASSERT_EQ(30u, v["MaxSize"].asUInt());
+  ASSERT_EQ(2u, v["Count"].asUInt());
+}
+
+
+TEST(CachedImageStorage, Basic)
+{
+  boost::filesystem::remove_all("UnitTestsResults/Cached");
+
+  FilesystemImageStorage files("UnitTestsResults/Cached");
+  CachedImageStorage storage(files, 1024 * 1024, 10);
+
+  std::string a = storage.Create("Hello");
+  std::string b = storage.Create("Large blob, not cached");
+
+  std::string s;
+  storage.Read(s, a);  ASSERT_EQ("Hello", s);
+  storage.Read(s, b);
+
+  // The cached blob survives the removal of its file behind the cache
+  boost::filesystem::remove(files.GetPath(a));
+  storage.Read(s, a);  ASSERT_EQ("Hello", s);
+  ASSERT_EQ("Hello", ReadByChunks(storage, a));
+  ASSERT_EQ("Large blob, not cached", ReadByChunks(storage, b));
+
+  // Removing through the cache invalidates it
+  storage.Remove(a);
+  ASSERT_THROW(storage.Read(s, a), OrthancException);
+
+  Json::Value v;
+  storage.GetCache().GetStatistics(v);
+  ASSERT_EQ(2u, v["Hits"].asUInt());
+  ASSERT_EQ(4u, v["Misses"].asUInt());
+}
+
+
+TEST_F(DatabaseTest, UploadSessions)
+{
+  Photo photo;
+  photo.SetSite(site_);
+  db_.CreateOrUpdatePhoto(photo);
+
+  std::string image;
+  for (unsigned int i = 0; i < 1000; i++)
+  {
+    image.push_back(static_cast<char>(i * 13));
+  }
+
+  std::string md5;
+  Orthanc::Toolbox::ComputeMD5(md5, image);
+
+  std::string id;
+
+  {
+    UploadSessions uploads(db_, GetPath("Staging"), 2000, 60);
+
+    // Bad sessions
+    ASSERT_TRUE(uploads.Create("nope", "image/jpeg", image.size(), md5).empty());
+    ASSERT_TRUE(uploads.Create(photo.GetUuid(), "image/jpeg", 3000, md5).empty());
+    ASSERT_TRUE(uploads.Create(photo.GetUuid(), "image/jpeg", 0, md5).empty());
+    ASSERT_TRUE(uploads.Create(photo.GetUuid(), "image/jpeg", image.size(), "1234").empty());
+
+    id = uploads.Create(photo.GetUuid(), "plain/text", image.size(), md5);
+    ASSERT_FALSE(id.empty());
+
+    // Chunks out of order, overlapping, and out of bounds
+    ASSERT_EQ(UploadStatus_Success, uploads.WriteChunk(id, 600, image.substr(600, 400)));
+    ASSERT_EQ(UploadStatus_Success, uploads.WriteChunk(id, 100, image.substr(100, 200)));
+    ASSERT_EQ(UploadStatus_Success, uploads.WriteChunk(id, 250, image.substr(250, 100)));
+    ASSERT_EQ(UploadStatus_BadRange, uploads.WriteChunk(id, 900, image.substr(0, 101)));
+    ASSERT_EQ(UploadStatus_BadRange, uploads.WriteChunk(id, 1000, "a"));
+    ASSERT_EQ(UploadStatus_BadRange, uploads.WriteChunk(id, 0, ""));
+    ASSERT_EQ(UploadStatus_UnknownSession, uploads.WriteChunk("nope", 0, "a"));
+    ASSERT_EQ(UploadStatus_Incomplete, uploads.Finalize(id));
+
+    Json::Value status;
+    ASSERT_TRUE(uploads.GetStatus(status, id));
+    ASSERT_EQ(1000u, status["Size"].asUInt());
+    ASSERT_EQ(650u, status["ReceivedSize"].asUInt());
+    ASSERT_FALSE(status["Complete"].asBool());
+    ASSERT_EQ(2u, status["Received"].size());
+    ASSERT_EQ(100u, status["Received"][0][0].asUInt());
+    ASSERT_EQ(350u, status["Received"][0][1].asUInt());
+    ASSERT_EQ(600u, status["Received"][1][0].asUInt());
+    ASSERT_EQ(1000u, status["Received"][1][1].asUInt());
+  }
+
+  {
+    // The session survives a restart
+    UploadSessions uploads(db_, GetPath("Staging"), 2000, 60);
+    ASSERT_EQ(1u, uploads.GetSessionsCount());
+
+    ASSERT_EQ(UploadStatus_Success, uploads.WriteChunk(id, 0, image.substr(0, 100)));
+    ASSERT_EQ(UploadStatus_Success, uploads.WriteChunk(id, 350, image.substr(350, 250)));
+
+    Json::Value status;
+    ASSERT_TRUE(uploads.GetStatus(status, id));
+    ASSERT_TRUE(status["Complete"].asBool());
+
+    ASSERT_EQ(UploadStatus_Success, uploads.Finalize(id));
+    ASSERT_EQ(UploadStatus_UnknownSession, uploads.Finalize(id));
+    ASSERT_EQ(0u, uploads.GetSessionsCount());
+
+    std::string s;
+    ASSERT_TRUE(db_.GetPhoto(photo, photo.GetUuid()));
+    ASSERT_EQ("plain/text", photo.GetImageMime());
+    db_.ReadImage(s, photo);
+    ASSERT_EQ(image, s);
+
+    // Corrupted upload
+    id = uploads.Create(photo.GetUuid(), "plain/text", 3, md5);
+    ASSERT_EQ(UploadStatus_Success, uploads.WriteChunk(id, 0, "abc"));
+    ASSERT_EQ(UploadStatus_BadChecksum, uploads.Finalize(id));
+    ASSERT_FALSE(uploads.GetStatus(status, id));
+
+    // Expiration of the abandoned sessions
+    id = uploads.Create(photo.GetUuid(), "plain/text", image.size(), md5);
+    ASSERT_EQ(0u, uploads.RemoveExpiredSessions(PhotoTrack::Toolbox::GetSecondsSinceEpoch()));
+    ASSERT_EQ(1u, uploads.RemoveExpiredSessions(PhotoTrack::Toolbox::GetSecondsSinceEpoch() + 61));
+    ASSERT_FALSE(uploads.Remove(id));
+    ASSERT_EQ(0u, uploads.GetSessionsCount());
+
+    id = uploads.Create(photo.GetUuid(), "plain/text", image.size(), md5);
+    ASSERT_TRUE(uploads.Remove(id));
+  }
+
+  // No file is left in the staging area
+  ASSERT_TRUE(boost::filesystem::is_empty(GetPath("Staging")));
+}
+
+
+namespace
+{
+  class FlakyImageStorage : public FilesystemImageStorage
+  {
+  public:
+    bool  fail_;
+
+    FlakyImageStorage(const std::string& root) :
+      FilesystemImageStorage(root),
+      fail_(false)
+    {
+    }
+
+    using FilesystemImageStorage::Create;
+
+    virtual std::string Create(const void* content,
+                               size_t size)
+    {
+      if (fail_)
+      {
+        throw OrthancException(ErrorCode_CannotWriteFile);
+      }
+
+      return FilesystemImageStorage::Create(content, size);
+    }
+  };
+}
+
+
+TEST(IngestQueue, Basic)
+{
+  boost::filesystem::remove_all("UnitTestsResults/Ingest");
+  boost::filesystem::create_directories("UnitTestsResults/Ingest");
+
+  FlakyImageStorage storage("UnitTestsResults/Ingest/Storage");
+  DatabaseWrapper db("UnitTestsResults/Ingest/index.db", storage);
+
+  Site site;
+  db.CreateOrUpdateSite(site);
+
+  Json::Value metadata = Json::objectValue;
+  metadata["SiteUuid"] = site.GetUuid();
+  metadata["Tag"] = "hello";
+
+  std::string first, second;
+
+  {
+    IngestQueue ingest(db, "UnitTestsResults/Ingest/Staging", DurabilityPolicy_PerWrite);
+
+    // No parent site
+    ASSERT_THROW(ingest.Enqueue(Json::objectValue, "abc", 3, "plain/text", ""), OrthancException);
+
+    first = ingest.Enqueue(metadata, "abc", 3, "plain/text", "");
+    second = ingest.Enqueue(metadata, NULL, 0, "", "");
+    ASSERT_EQ(2u, ingest.GetPendingCount());
+
+    Photo photo;
+    ASSERT_FALSE(db.GetPhoto(photo, first));
+
+    Json::Value pending;
+    ASSERT_TRUE(ingest.GetPendingPhoto(pending, first));
+    ASSERT_EQ(first, pending["Uuid"].asString());
+    ASSERT_EQ("hello", pending["Tag"].asString());
+    ASSERT_EQ("plain/text", pending["ImageMime"].asString());
+    ASSERT_EQ("Pending", pending["Status"].asString());
+    ASSERT_FALSE(ingest.GetPendingPhoto(pending, "nope"));
+  }
+
+  {
+    // The staged photos survive a restart
+    IngestQueue ingest(db, "UnitTestsResults/Ingest/Staging", DurabilityPolicy_PerWrite);
+    ASSERT_EQ(2u, ingest.GetPendingCount());
+    ASSERT_TRUE(ingest.IsPending(first));
+    ASSERT_TRUE(ingest.IsPending(second));
+
+    ASSERT_TRUE(ingest.ProcessNext());
+    ASSERT_EQ(1u, ingest.GetPendingCount());
+    ASSERT_TRUE(ingest.ProcessNext());
+    ASSERT_FALSE(ingest.ProcessNext());
+    ASSERT_EQ(0u, ingest.GetPendingCount());
+    ASSERT_FALSE(ingest.IsPending(first));
+
+    Photo photo;
+    std::string s;
+    ASSERT_TRUE(db.GetPhoto(photo, first));
+    ASSERT_EQ("hello", photo.GetTag());
+    ASSERT_EQ("plain/text", photo.GetImageMime());
+    db.ReadImage(s, photo);
+    ASSERT_EQ("abc", s);
+
+    std::string imageUuid = photo.GetImageUuid();
+
+    ASSERT_TRUE(db.GetPhoto(photo, second));
+    ASSERT_TRUE(photo.GetImageUuid().empty());
+
+    // Attaching an already stored image, through a worker
+    ingest.Start(2);
+    std::string third = ingest.Enqueue(metadata, NULL, 0, "", PhotoTrack::Toolbox::ComputeSHA1("abc", 3));
+
+    for (unsigned int i = 0; i < 100 && ingest.IsPending(third); i++)
+    {
+      boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    }
+
+    ingest.Stop();
+    ASSERT_TRUE(db.GetPhoto(photo, third));
+    ASSERT_EQ(imageUuid, photo.GetImageUuid());
+  }
+
+  {
+    // Stop between the commit and the removal of the staging file:
+    // The photo is not ingested again
+    IngestQueue ingest(db, "UnitTestsResults/Ingest/Staging", DurabilityPolicy_PerWrite);
+    std::string fourth = ingest.Enqueue(metadata, "def", 3, "plain/text", "");
+    boost::filesystem::copy_file("UnitTestsResults/Ingest/Staging/" + fourth + ".ingest",
+                                 "UnitTestsResults/Ingest/copy");
+    ASSERT_TRUE(ingest.ProcessNext());
+    boost::filesystem::rename("UnitTestsResults/Ingest/copy",
+                              "UnitTestsResults/Ingest/Staging/" + fourth + ".ingest");
+
+    Photo photo;
+    ASSERT_TRUE(db.GetPhoto(photo, fourth));
+    std::string imageUuid = photo.GetImageUuid();
+
+    IngestQueue restarted(db, "UnitTestsResults/Ingest/Staging", DurabilityPolicy_PerWrite);
+    ASSERT_TRUE(restarted.IsPending(fourth));
+    ASSERT_TRUE(restarted.ProcessNext());
+    ASSERT_FALSE(restarted.IsPending(fourth));
+    ASSERT_TRUE(db.GetPhoto(photo, fourth));
+    ASSERT_EQ(imageUuid, photo.GetImageUuid());
+    ASSERT_TRUE(storage.Exists(imageUuid));
+  }
+
+  std::string failed;
+
+  {
+    // The failed photos are retried, and stay pending meanwhile
+    IngestQueue ingest(db, "UnitTestsResults/Ingest/Staging", DurabilityPolicy_PerWrite);
+    ingest.SetRetryPolicy(2, 0);
+
+    storage.fail_ = true;
+    failed = ingest.Enqueue(metadata, "abc", 3, "plain/text", "");
+
+    Json::Value pending;
+    ASSERT_TRUE(ingest.ProcessNext());
+    ASSERT_TRUE(ingest.IsPending(failed));
+    ASSERT_TRUE(ingest.GetPendingPhoto(pending, failed));
+    ASSERT_EQ("Pending", pending["Status"].asString());
+    ASSERT_FALSE(ingest.DiscardFailed(failed));
+
+    // Only the last attempt reports the error
+    ASSERT_TRUE(ingest.ProcessNext());
+    ASSERT_FALSE(ingest.ProcessNext());
+    ASSERT_FALSE(ingest.IsPending(failed));
+    ASSERT_EQ(0u, ingest.GetPendingCount());
+    ASSERT_TRUE(ingest.GetPendingPhoto(pending, failed));
+    ASSERT_EQ("Failed", pending["Status"].asString());
+
+    // The photo is not created without its image
+    Photo photo;
+    ASSERT_FALSE(db.GetPhoto(photo, failed));
+    ASSERT_TRUE(boost::filesystem::exists("UnitTestsResults/Ingest/Staging/" + failed + ".failed"));
+    storage.fail_ = false;
+
+    // The image to attach is not stored anymore: No retry
+    std::string missing = ingest.Enqueue(metadata, NULL, 0, "", PhotoTrack::Toolbox::ComputeSHA1("nope", 4));
+    ASSERT_TRUE(ingest.ProcessNext());
+    ASSERT_FALSE(ingest.IsPending(missing));
+    ASSERT_TRUE(ingest.GetPendingPhoto(pending, missing));
+    ASSERT_EQ("Failed", pending["Status"].asString());
+    ASSERT_FALSE(db.GetPhoto(photo, missing));
+    ASSERT_TRUE(ingest.DiscardFailed(missing));
+  }
+
+  // The staging files that were not completely written are removed
+  Orthanc::Toolbox::WriteFile("{\"Metadata\":{},\"ImageSize\":\"10\"}\nabc",
+                              "UnitTestsResults/Ingest/Staging/nope.ingest");
+
+  {
+    IngestQueue ingest(db, "UnitTestsResults/Ingest/Staging", DurabilityPolicy_PerWrite);
+    ASSERT_EQ(0u, ingest.GetPendingCount());
+
+    // The failed photos are still reported after a restart
+    Json::Value pending;
+    ASSERT_TRUE(ingest.GetPendingPhoto(pending, failed));
+    ASSERT_EQ("Failed", pending["Status"].asString());
+    ASSERT_TRUE(ingest.DiscardFailed(failed));
+    ASSERT_FALSE(ingest.GetPendingPhoto(pending, failed));
+  }
+
+  ASSERT_TRUE(boost::filesystem::is_empty("UnitTestsResults/Ingest/Staging"));
+}
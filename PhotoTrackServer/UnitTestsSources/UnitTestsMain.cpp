@@ -20,6 +20,7 @@
 #include "ServerTestsPrecompiledHeaders.h"
 
 #include "../ApplicationSources/Database.h"
+#include "../ApplicationSources/FilesystemImageStorage.h"
 
 #include <Core/Toolbox.h>
 #include <Core/Uuid.h>
@@ -81,7 +82,7 @@ TEST(SQLite, Connection)
 TEST(Database, Site)
 {
   Toolbox::RemoveFile("test.db");
-  Orthanc::FileStorage storage("UnitTestsStorage");
+  PhotoTrack::FilesystemImageStorage storage("UnitTestsStorage");
   DatabaseWrapper db("test.db", storage);
 
   Site site;
@@ -99,7 +100,7 @@ TEST(Database, Site)
 TEST(Database, Mockup)
 {
   Toolbox::RemoveFile("mockup.db");
-  Orthanc::FileStorage storage("MockupStorage");
+  PhotoTrack::FilesystemImageStorage storage("MockupStorage");
   DatabaseWrapper db("mockup.db", storage);
 
   std::list<std::string>  sites;
@@ -213,7 +214,7 @@ ASSERT_EQ("image/png", photo.GetImageMime());
 TEST(Database, DeleteSites)
 {
   Toolbox::RemoveFile("test.db");
-  Orthanc::FileStorage storage("UnitTestsStorage");
+  PhotoTrack::FilesystemImageStorage storage("UnitTestsStorage");
   DatabaseWrapper db("test.db", storage);
 
   for (unsigned int i = 0; i < 3; i++)
@@ -248,6 +249,49 @@ TEST(Database, DeleteSites)
 
 
 
+TEST(Database, IdempotencyKeys)
+{
+  Toolbox::RemoveFile("test.db");
+  PhotoTrack::FilesystemImageStorage storage("UnitTestsStorage");
+
+  {
+    DatabaseWrapper db("test.db", storage);
+
+    std::string answer;
+    ASSERT_EQ(IdempotencyKeyStatus_New, db.ReserveIdempotencyKey(answer, "a", "POST /photos 1234"));
+    ASSERT_EQ(IdempotencyKeyStatus_Pending, db.ReserveIdempotencyKey(answer, "a", "POST /photos 1234"));
+    ASSERT_EQ(IdempotencyKeyStatus_Mismatch, db.ReserveIdempotencyKey(answer, "a", "POST /sites 1234"));
+
+    db.CompleteIdempotencyKey("a", "{\"PhotoId\":\"x\"}");
+    ASSERT_EQ(IdempotencyKeyStatus_Completed, db.ReserveIdempotencyKey(answer, "a", "POST /photos 1234"));
+    ASSERT_EQ("{\"PhotoId\":\"x\"}", answer);
+
+    // A completed request is not released
+    db.ReleaseIdempotencyKey("a");
+    ASSERT_EQ(IdempotencyKeyStatus_Completed, db.ReserveIdempotencyKey(answer, "a", "POST /photos 1234"));
+
+    // A failed request can be retried
+    ASSERT_EQ(IdempotencyKeyStatus_New, db.ReserveIdempotencyKey(answer, "b", "POST /photos 1234"));
+    db.ReleaseIdempotencyKey("b");
+    ASSERT_EQ(IdempotencyKeyStatus_New, db.ReserveIdempotencyKey(answer, "b", "POST /photos 1234"));
+  }
+
+  {
+    // The pending requests are forgotten after a restart
+    DatabaseWrapper db("test.db", storage);
+
+    std::string answer;
+    ASSERT_EQ(IdempotencyKeyStatus_New, db.ReserveIdempotencyKey(answer, "b", "POST /photos 1234"));
+    ASSERT_EQ(IdempotencyKeyStatus_Completed, db.ReserveIdempotencyKey(answer, "a", "POST /photos 1234"));
+
+    // Expiration
+    db.SetIdempotencyKeyTtl(0);
+    ASSERT_EQ(IdempotencyKeyStatus_New, db.ReserveIdempotencyKey(answer, "a", "POST /photos 1234"));
+  }
+}
+
+
+
 TEST(Cookie, Basic)
 {
   // https://en.wikipedia.org/wiki/HTTP_cookie#Setting_a_cookie
@@ -263,6 +307,31 @@ TEST(Cookie, Basic)
 }
 
 
+
+TEST(Toolbox, ByteRange)
+{
+  uint64_t start, length;
+
+  ASSERT_EQ(PhotoTrack::ByteRange_Valid, PhotoTrack::Toolbox::ParseByteRange(start, length, "bytes=0-499", 1000));
+  ASSERT_EQ(0u, start);  ASSERT_EQ(500u, length);
+
+  ASSERT_EQ(PhotoTrack::ByteRange_Valid, PhotoTrack::Toolbox::ParseByteRange(start, length, "bytes=500-", 1000));
+  ASSERT_EQ(500u, start);  ASSERT_EQ(500u, length);
+
+  ASSERT_EQ(PhotoTrack::ByteRange_Valid, PhotoTrack::Toolbox::ParseByteRange(start, length, "bytes=-100", 1000));
+  ASSERT_EQ(900u, start);  ASSERT_EQ(100u, length);
+
+  ASSERT_EQ(PhotoTrack::ByteRange_Valid, PhotoTrack::Toolbox::ParseByteRange(start, length, " bytes=990-2000", 1000));
+  ASSERT_EQ(990u, start);  ASSERT_EQ(10u, length);
+
+  ASSERT_EQ(PhotoTrack::ByteRange_Unsatisfiable, PhotoTrack::Toolbox::ParseByteRange(start, length, "bytes=1000-", 1000));
+  ASSERT_EQ(PhotoTrack::ByteRange_Unsatisfiable, PhotoTrack::Toolbox::ParseByteRange(start, length, "bytes=-0", 1000));
+  ASSERT_EQ(PhotoTrack::ByteRange_None, PhotoTrack::Toolbox::ParseByteRange(start, length, "", 1000));
+  ASSERT_EQ(PhotoTrack::ByteRange_None, PhotoTrack::Toolbox::ParseByteRange(start, length, "bytes=0-1,5-6", 1000));
+  ASSERT_EQ(PhotoTrack::ByteRange_None, PhotoTrack::Toolbox::ParseByteRange(start, length, "bytes=5-1", 1000));
+  ASSERT_EQ(PhotoTrack::ByteRange_None, PhotoTrack::Toolbox::ParseByteRange(start, length, "items=0-1", 1000));
+}
+
 int main(int argc, char **argv)
 {
   // Initialize Google's logging library.